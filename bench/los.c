@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "map.h"
+#include "map_opts.h"
+#include "rng.h"
+
+/* Times map_line_of_sight() and map_has_los() from random floor cells, first
+ * walking the map and then with the precomputed table */
+
+struct setup {
+  coord_t width;
+  coord_t height;
+  int32_t room_factor;
+  uint32_t calls;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(map_t *map, map_opts_t *spaces, const char *name,
+                uint32_t calls) {
+  double start;
+  double elapsed;
+  uint64_t cells = 0;
+
+  start = now();
+  for (uint32_t i = 0; i < calls; i++) {
+    map_opts_t *los;
+
+    los = map_line_of_sight(map, spaces->data[i % spaces->size],
+                            i % (DIRECTION_ANY + 1));
+    cells += los->size;
+    map_opts_free(los);
+  }
+  elapsed = now() - start;
+
+  printf("%4dx%-4d %-5s line of sight: %10.2f us/call, %8.1f cells/call\n",
+         map_width(map), map_height(map), name, elapsed * 1e6 / calls,
+         (double)cells / calls);
+
+  start = now();
+  for (uint32_t i = 0; i < calls * 100; i++) {
+    pos_t from = spaces->data[i % spaces->size];
+    pos_t to = spaces->data[(i * 7919) % spaces->size];
+
+    cells += map_has_los(map, from, to);
+  }
+  elapsed = now() - start;
+
+  printf("%4dx%-4d %-5s has los:       %10.3f us/call\n", map_width(map),
+         map_height(map), name, elapsed * 1e6 / (calls * 100));
+}
+
+int main(int argc, char **argv) {
+  struct setup setups[] = {
+      {.width = 80, .height = 40, .room_factor = 20, .calls = 20000},
+      {.width = 200, .height = 200, .room_factor = 50, .calls = 2000},
+  };
+  uint32_t seed = 1;
+
+  if (argc > 1) {
+    seed = atoi(argv[1]);
+  }
+
+  for (uint8_t i = 0; i < sizeof(setups) / sizeof(*setups); i++) {
+    map_t *map;
+    map_opts_t *spaces;
+    rng_t rng;
+    double start;
+
+    map = map_new(setups[i].width, setups[i].height, setups[i].room_factor,
+                  seed);
+    spaces = map_empty_spaces(map);
+    rng_seed(&rng, seed);
+    map_opts_shuffle(spaces, &rng);
+
+    run(map, spaces, "walk", setups[i].calls);
+
+    start = now();
+    map_precompute_los(map, 0, 64 * 1024 * 1024);
+    printf("%4dx%-4d table built in %.1f ms\n", map_width(map),
+           map_height(map), (now() - start) * 1e3);
+
+    run(map, spaces, "table", setups[i].calls);
+
+    map_opts_free(spaces);
+  }
+
+  return 0;
+}
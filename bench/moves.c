@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "map.h"
+#include "map_opts.h"
+#include "map_opts_ranked.h"
+#include "rng.h"
+
+/* Times map_reachable() / map_valid_moves() from random floor cells */
+
+struct setup {
+  coord_t width;
+  coord_t height;
+  int32_t room_factor;
+  uint32_t calls;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(map_t *map, map_opts_t *spaces, uint8_t steps,
+                uint32_t calls) {
+  double start;
+  double elapsed;
+  uint64_t cells = 0;
+
+  start = now();
+  for (uint32_t i = 0; i < calls; i++) {
+    map_opts_t *moves;
+
+    moves = map_valid_moves(map, spaces->data[i % spaces->size], steps);
+    cells += moves->size;
+    map_opts_free(moves);
+  }
+  elapsed = now() - start;
+
+  printf("%4dx%-4d steps %2u: %10.2f us/call, %8.1f cells/call\n",
+         map_width(map), map_height(map), steps, elapsed * 1e6 / calls,
+         (double)cells / calls);
+}
+
+int main(int argc, char **argv) {
+  struct setup setups[] = {
+      {.width = 80, .height = 40, .room_factor = 20, .calls = 20000},
+      {.width = 512, .height = 512, .room_factor = 50, .calls = 2000},
+  };
+  uint8_t steps[] = {15, 46};
+  uint32_t seed = 1;
+
+  if (argc > 1) {
+    seed = atoi(argv[1]);
+  }
+
+  for (uint8_t i = 0; i < sizeof(setups) / sizeof(*setups); i++) {
+    map_t *map;
+    map_opts_t *spaces;
+    rng_t rng;
+
+    map = map_new(setups[i].width, setups[i].height, setups[i].room_factor,
+                  seed);
+    spaces = map_empty_spaces(map);
+    rng_seed(&rng, seed);
+    map_opts_shuffle(spaces, &rng);
+
+    for (uint8_t j = 0; j < sizeof(steps) / sizeof(*steps); j++) {
+      run(map, spaces, steps[j], setups[i].calls);
+    }
+
+    map_opts_free(spaces);
+  }
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "player_npc.h"
+
+/* Times engine_snapshot() into a reused snapshot and engine_restore() of it,
+ * partway into NPC matches of 4, 8 and 16 players */
+
+#define ROUNDS 20000
+
+struct setup {
+  uint8_t players;
+  coord_t width;
+  coord_t height;
+  uint32_t turns;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void npc_send(void *data, message_t *msg) {
+  player_npc_server_send(data, msg);
+}
+
+static message_t *npc_get(void *data) { return player_npc_server_get(data); }
+
+static void run(struct setup *s, uint32_t seed) {
+  engine_snapshot_t *snap;
+  engine_t *engine;
+  map_t *map;
+  void **npcs;
+  double start;
+  double taken;
+  double restored;
+  size_t size;
+
+  map = map_new(s->width, s->height, 20, seed);
+  map_precompute_los(map, 1, MAP_LOS_TABLE_MAX);
+  engine = engine_new(s->players, map, NULL, false, seed);
+  npcs = calloc(s->players, sizeof(*npcs));
+  if (engine == NULL || npcs == NULL) {
+    fprintf(stderr, "Can not set up %u players\n", s->players);
+    engine_free(engine);
+    free(npcs);
+    map_free(map);
+    return;
+  }
+
+  for (uint8_t i = 0; i < s->players; i++) {
+    npcs[i] = player_npc_new(seed * UINT8_MAX + i);
+    engine_add_player(engine, npc_send, npcs[i], npc_get, npcs[i]);
+  }
+  engine_run(engine, s->turns);
+
+  snap = engine_snapshot(engine, NULL);
+  start = now();
+  for (uint32_t i = 0; i < ROUNDS; i++) {
+    engine_snapshot(engine, snap);
+  }
+  taken = now() - start;
+
+  start = now();
+  for (uint32_t i = 0; i < ROUNDS; i++) {
+    engine_restore(engine, snap);
+  }
+  restored = now() - start;
+
+  engine_snapshot_data(snap, &size);
+  printf("%3u players %4dx%-4d: %7.2f us snapshot, %7.2f us restore, "
+         "%zu bytes\n",
+         s->players, s->width, s->height, taken * 1e6 / ROUNDS,
+         restored * 1e6 / ROUNDS, size);
+
+  engine_snapshot_free(snap);
+  engine_free(engine);
+  for (uint8_t i = 0; i < s->players; i++) {
+    player_npc_free(&npcs[i]);
+  }
+  free(npcs);
+  map_free(map);
+}
+
+int main(int argc, char **argv) {
+  struct setup setups[] = {
+      {.players = 4, .width = 80, .height = 40, .turns = 30},
+      {.players = 8, .width = 80, .height = 40, .turns = 30},
+      {.players = 16, .width = 80, .height = 40, .turns = 30},
+  };
+  uint32_t seed = 1;
+
+  if (argc > 1) {
+    seed = atoi(argv[1]);
+  }
+
+  common_log_quiet(true);
+
+  for (uint8_t i = 0; i < sizeof(setups) / sizeof(*setups); i++) {
+    run(&setups[i], seed);
+  }
+
+  return 0;
+}
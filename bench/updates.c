@@ -0,0 +1,170 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "player.h"
+#include "player_npc.h"
+
+/* Times building the player updates of NPC matches with 4, 16 and 64
+ * players. The NPCs only get their messages after the engine step, so the
+ * step times are the engine's alone.
+ *
+ * "round" is from the start of a step that sends updates to the last update
+ * sent, which includes resolving the moves or the fight before them. "each"
+ * is the time between the first and the last update divided by the updates
+ * in between, so it leaves out whatever is done once per round. */
+
+struct setup {
+  uint8_t players;
+  coord_t width;
+  coord_t height;
+  int32_t room_factor;
+  uint32_t turns;
+};
+
+struct tap {
+  void *npc;
+  /* What the engine sent this tick, handed on once it is done */
+  message_t *pending[PLAYER_MAX];
+  uint8_t num_pending;
+  struct timing *timing;
+};
+
+struct timing {
+  double first;
+  double last;
+  uint32_t sent;
+
+  double round;
+  double each;
+  uint32_t rounds;
+  uint64_t updates;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void deliver(struct tap *tap);
+
+static void tap_send(void *data, message_t *msg) {
+  struct tap *tap = data;
+
+  if (msg->type == MESSAGE_PLAYER_UPDATE) {
+    struct timing *t = tap->timing;
+
+    t->last = now();
+    if (t->sent == 0) {
+      t->first = t->last;
+    }
+    t->sent++;
+  }
+  /* No tick sends this many, handing them on early keeps it in bounds */
+  if (tap->num_pending == PLAYER_MAX) {
+    deliver(tap);
+  }
+  tap->pending[tap->num_pending++] = message_ref(msg);
+}
+
+static message_t *tap_get(void *data) {
+  struct tap *tap = data;
+
+  return player_npc_server_get(tap->npc);
+}
+
+static void deliver(struct tap *tap) {
+  for (uint8_t i = 0; i < tap->num_pending; i++) {
+    player_npc_server_send(tap->npc, tap->pending[i]);
+    message_unref(tap->pending[i]);
+  }
+  tap->num_pending = 0;
+}
+
+static void run(struct setup *s, uint32_t seed) {
+  struct tap *taps;
+  struct timing timing = {0};
+  engine_t *engine;
+  map_t *map;
+
+  map = map_new(s->width, s->height, s->room_factor, seed);
+  map_precompute_los(map, 1, MAP_LOS_TABLE_MAX);
+  engine = engine_new(s->players, map, NULL, false, seed);
+  taps = calloc(s->players, sizeof(*taps));
+  if (engine == NULL || taps == NULL) {
+    fprintf(stderr, "Can not set up %u players\n", s->players);
+    engine_free(engine);
+    free(taps);
+    map_free(map);
+    return;
+  }
+
+  for (uint8_t i = 0; i < s->players; i++) {
+    taps[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    taps[i].timing = &timing;
+    engine_add_player(engine, tap_send, &taps[i], tap_get, &taps[i]);
+  }
+
+  while (engine_turns(engine) < s->turns) {
+    double start = now();
+
+    timing.sent = 0;
+    engine_tick(engine);
+
+    if (timing.sent == s->players) {
+      timing.round += timing.last - start;
+      timing.each += (timing.last - timing.first) / (timing.sent - 1);
+      timing.rounds++;
+      timing.updates += timing.sent;
+    }
+
+    for (uint8_t i = 0; i < s->players; i++) {
+      deliver(&taps[i]);
+    }
+  }
+
+  printf("%3u players %4dx%-4d: %9.2f us/round, %8.2f us/update each "
+         "(%u rounds)\n",
+         s->players, s->width, s->height, timing.round * 1e6 / timing.rounds,
+         timing.each * 1e6 / timing.rounds, timing.rounds);
+
+  engine_free(engine);
+  for (uint8_t i = 0; i < s->players; i++) {
+    player_npc_free(&taps[i].npc);
+  }
+  free(taps);
+  map_free(map);
+}
+
+int main(int argc, char **argv) {
+  struct setup setups[] = {
+      {.players = 4, .width = 80, .height = 40, .room_factor = 20,
+       .turns = 200},
+      {.players = 16, .width = 80, .height = 40, .room_factor = 20,
+       .turns = 200},
+      {.players = 64, .width = 160, .height = 80, .room_factor = 20,
+       .turns = 100},
+  };
+  uint32_t seed = 1;
+
+  if (argc > 1) {
+    seed = atoi(argv[1]);
+  }
+
+  common_log_quiet(true);
+
+  for (uint8_t i = 0; i < sizeof(setups) / sizeof(*setups); i++) {
+    run(&setups[i], seed);
+  }
+
+  return 0;
+}
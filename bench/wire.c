@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "player_npc.h"
+#include "wire.h"
+
+/* Records every message of an NPC match, then times wire_encode() and
+ * wire_decode() on them and reports the bytes each message type takes.
+ * "bench-wire <seed> delta" sends the player updates as deltas. */
+
+#define TYPES (MESSAGE_REPLY_PLAYER_UPDATE + 1)
+
+struct tap {
+  void *npc;
+  struct recording *rec;
+};
+
+struct recording {
+  message_t **msgs;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+static const char *names[TYPES] = {
+    "ask ready", "reply ready", "map",          "reply map",
+    "ask spawn", "reply spawn", "ask move",     "reply move",
+    "ask fight", "reply fight", "player update", "reply player update",
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Messages there is no memory for are left out of the timings */
+static void record(struct recording *rec, message_t *msg) {
+  if (rec->size == rec->capacity) {
+    uint32_t capacity = rec->capacity > 0 ? rec->capacity * 2 : 1024;
+    message_t **msgs = realloc(rec->msgs, sizeof(*rec->msgs) * capacity);
+
+    if (msgs == NULL) {
+      return;
+    }
+    rec->msgs = msgs;
+    rec->capacity = capacity;
+  }
+  rec->msgs[rec->size++] = message_ref(msg);
+}
+
+static void tap_send(void *data, message_t *msg) {
+  struct tap *tap = data;
+
+  record(tap->rec, msg);
+  player_npc_server_send(tap->npc, msg);
+}
+
+static message_t *tap_get(void *data) {
+  struct tap *tap = data;
+  message_t *msg;
+
+  msg = player_npc_server_get(tap->npc);
+  if (msg != NULL) {
+    record(tap->rec, msg);
+  }
+  return msg;
+}
+
+static void play(struct recording *rec, uint8_t players, uint32_t turns,
+                 uint32_t seed, bool delta) {
+  struct tap taps[UINT8_MAX];
+  engine_t *engine;
+  map_t *map;
+
+  map = map_new(80, 40, 20, seed);
+  map_precompute_los(map, 1, MAP_LOS_TABLE_MAX);
+  engine = engine_new(players, map, NULL, false, seed);
+  if (engine == NULL) {
+    fprintf(stderr, "Can not set up %u players\n", players);
+    map_free(map);
+    return;
+  }
+  engine_set_delta_updates(engine, delta);
+
+  for (uint8_t i = 0; i < players; i++) {
+    taps[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    taps[i].rec = rec;
+    engine_add_player(engine, tap_send, &taps[i], tap_get, &taps[i]);
+  }
+
+  engine_run(engine, turns);
+
+  engine_free(engine);
+  for (uint8_t i = 0; i < players; i++) {
+    player_npc_free(&taps[i].npc);
+  }
+  map_free(map);
+}
+
+int main(int argc, char **argv) {
+  struct recording rec = {0};
+  uint32_t count[TYPES] = {0};
+  uint64_t bytes[TYPES] = {0};
+  double encode[TYPES] = {0};
+  double decode[TYPES] = {0};
+  uint32_t rounds = 20;
+  uint32_t seed = 1;
+  bool delta = false;
+  uint8_t buf[1 << 16];
+
+  if (argc > 1) {
+    seed = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    delta = strcmp(argv[2], "delta") == 0;
+  }
+
+  common_log_quiet(true);
+  play(&rec, 8, 100, seed, delta);
+
+  for (uint32_t r = 0; r < rounds; r++) {
+    for (uint32_t i = 0; i < rec.size; i++) {
+      message_t *msg = rec.msgs[i];
+      message_t *copy;
+      double start;
+      size_t size;
+
+      start = now();
+      size = wire_encode(msg, buf, sizeof(buf));
+      encode[msg->type] += now() - start;
+
+      start = now();
+      copy = wire_decode(buf, size, WIRE_FRAME_MAX);
+      decode[msg->type] += now() - start;
+      message_unref(copy);
+
+      if (r == 0) {
+        count[msg->type]++;
+        bytes[msg->type] += size;
+      }
+    }
+  }
+
+  printf("%u messages from an 8 player match%s, %u rounds\n\n", rec.size,
+         delta ? " with delta updates" : "", rounds);
+  printf("%-20s %8s %10s %12s %12s\n", "type", "count", "bytes/msg",
+         "encode/s", "decode/s");
+  for (uint8_t t = 0; t < TYPES; t++) {
+    if (count[t] == 0) {
+      continue;
+    }
+    printf("%-20s %8u %10.1f %12.0f %12.0f\n", names[t], count[t],
+           (double)bytes[t] / count[t], count[t] * rounds / encode[t],
+           count[t] * rounds / decode[t]);
+  }
+
+  for (uint32_t i = 0; i < rec.size; i++) {
+    message_unref(rec.msgs[i]);
+  }
+  free(rec.msgs);
+
+  return 0;
+}
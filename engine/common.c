@@ -1,5 +1,11 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+
 #include "common.h"
 
+static _Thread_local bool quiet = false;
+
 pos_t common_position_unknown(void) {
   pos_t p = {-1, -1};
   return p;
@@ -21,3 +27,22 @@ const char *kind_string(enum portal_type type) {
   }
   return "Unknown";
 }
+
+void common_log(const char *fmt, ...) {
+  va_list args;
+
+  if (quiet) {
+    return;
+  }
+
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+}
+
+bool common_log_quiet(bool q) {
+  bool was = quiet;
+
+  quiet = q;
+  return was;
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #define POS_EQ(a, b) (a.x == b.x && a.y == b.y)
 #define POS_IS_UNKNOWN(a) (a.x == -1 || a.y == -1)
@@ -38,3 +41,61 @@ pos_t
 common_position_unknown(void);
 
 const char* kind_string(enum portal_type type);
+
+/* Engine chatter goes through here, printf() unless the calling thread has
+ * turned it off. Threads running many matches side by side keep it off. */
+void common_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/* Returns the previous setting */
+bool common_log_quiet(bool quiet);
+
+/* Saving state to one block: copies @param size bytes to offset @param at of
+ * @param buf and returns the offset after them. With @param buf NULL it only
+ * counts, so the same code sizes the block and fills it. */
+static inline size_t common_put(uint8_t *buf, size_t at, const void *src,
+                                size_t size) {
+  if (buf != NULL && size > 0) {
+    memcpy(buf + at, src, size);
+  }
+  return at + size;
+}
+
+/* Reads back what common_put() wrote */
+static inline size_t common_get(const uint8_t *buf, size_t at, void *dst,
+                                size_t size) {
+  if (size > 0) {
+    memcpy(dst, buf + at, size);
+  }
+  return at + size;
+}
+
+/* Reads a block that may be cut short or made up, like one read from a file.
+ * Reading past the end sets broken and leaves the destination alone, so the
+ * reads can go on and broken be checked once at the end. */
+struct common_reader {
+  const uint8_t *buf;
+  size_t size;
+  size_t pos;
+  bool broken;
+};
+
+/* Whether @param count items of @param each bytes are left, to check counts
+ * taken from the block before allocating for them */
+static inline bool common_has(struct common_reader *r, size_t count,
+                              size_t each) {
+  if (r->broken || (each > 0 && count > (r->size - r->pos) / each)) {
+    r->broken = true;
+    return false;
+  }
+  return true;
+}
+
+static inline void common_read(struct common_reader *r, void *dst,
+                               size_t size) {
+  if (!common_has(r, size, 1)) {
+    return;
+  }
+  if (size > 0) {
+    memcpy(dst, r->buf + r->pos, size);
+  }
+  r->pos += size;
+}
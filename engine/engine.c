@@ -9,11 +9,17 @@
 #include "engine.h"
 #include "incident.h"
 #include "map.h"
+#include "map_bits.h"
 #include "map_opts.h"
 #include "message.h"
+#include "occupancy.h"
 #include "player.h"
 #include "portals.h"
+#include "record.h"
+#include "rng.h"
 #include "spell.h"
+#include "timers.h"
+#include "visibility.h"
 
 typedef enum state {
   STATE_STARTING = 0,
@@ -34,6 +40,50 @@ struct waiting {
   uint32_t tick;
   message_t *incoming;
   message_t *sent;
+  /* Complete player update the player has not acked yet. Outlives the wait
+   * it was sent with, as with pipelined turns the next reply acks it. */
+  message_t *full;
+  /* Positions the last spawn ask offered, to check the reply against. Move
+   * replies are checked with map_can_reach(), which is far cheaper. */
+  map_bits_t *allowed;
+  /* Where a spawn goes if the reply is not one of them, the first offered */
+  pos_t fallback;
+};
+
+/* Where a player's line of sight is taken from, POSITION_UNKNOWN while it
+ * has none */
+struct sight {
+  pos_t from;
+  enum direction facing;
+  /* The player's los is not worked out yet, see view_sync() */
+  bool due;
+};
+
+/* What the player updates of a round share: the public state of every player
+ * and the portals. Built once, each update copies the parts it needs. */
+struct round {
+  typeof(((message_t *)0)->body.player_update.others) players;
+  typeof(((message_t *)0)->body.player_update.portals) portals;
+  uint8_t num_portals;
+  /* Effects of all players back to back, players[i].effects point here */
+  struct msg_spell *effects;
+  uint32_t effects_capacity;
+  /* Arena an update needs for its copy of all of it */
+  size_t arena;
+};
+
+/* Block layout version, the first thing in it */
+#define SNAPSHOT_VERSION 4
+/* Messages a snapshot holds per player: sent, incoming, full and acked */
+#define SNAPSHOT_MSGS 4
+
+struct engine_snapshot {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  uint8_t player_count;
+  /* SNAPSHOT_MSGS per player, NULL when read from a block */
+  message_t **msgs;
 };
 
 struct engine_ctx {
@@ -51,6 +101,56 @@ struct engine_ctx {
   bool timer;
 
   map_t *map;
+  occupancy_t *occupancy;
+  /* Who sees which cell, as of the last round of player updates */
+  visibility_t *visibility;
+  /* The sights of the players now and at the last round of player updates */
+  struct sight *sight;
+  struct sight *seen_from;
+  /* Headless engines leave the tags to view_sync() too: the sights and
+   * positions resolve_moves() went by and the players still to be tagged */
+  struct sight *tag_from;
+  pos_t *tag_pos;
+  uint64_t tags_due;
+  /* Portals coming back and effects running out, by turn */
+  timers_t *timers;
+  rng_t rng;
+
+  engine_ready_func_t ready;
+  void *ready_data;
+
+  /* Player updates are sent as deltas against the last acked ones */
+  bool delta;
+  message_t **acked;
+  /* Cells being compared or sorted, reused */
+  map_bits_t *scratch;
+  /* The next ask follows a player update without waiting for its ack */
+  bool pipelined;
+  /* Player updates and most asks are not built, only waited for */
+  bool headless;
+  /* Once the map is out the players run the match themselves and only get
+   * the replies, see engine_set_lockstep() */
+  bool lockstep;
+  bool lockstep_running;
+  /* The next lockstep message is the first, which carries the state */
+  bool lockstep_first;
+  /* Replies taken since the last lockstep message */
+  struct msg_input *inputs;
+  uint32_t num_inputs;
+  uint32_t inputs_capacity;
+  /* Block engine_state_hash() was taken over */
+  uint8_t *hashed;
+  size_t hashed_size;
+  size_t hashed_capacity;
+  /* The engine as it was before a restore, put back if the block is broken */
+  engine_snapshot_t *undo;
+
+  /* Taken replies and every keyframe_turns turns a keyframe go here */
+  recorder_t *recorder;
+  uint32_t keyframe_turns;
+  engine_snapshot_t *keyframe;
+
+  struct round round;
 };
 
 static void setup_portals(engine_t *ctx) {
@@ -60,14 +160,21 @@ static void setup_portals(engine_t *ctx) {
 
   for (uint32_t i = 0; i < portals->size; i++) {
     map_set_portal(ctx->map, portals->data[i]);
-    portals_add_kind(ctx->portals, i % PORTAL_NONE, portals->data[i]);
+    portals_add_kind(ctx->portals, i % PORTAL_NONE, portals->data[i],
+                     &ctx->rng);
   }
+
+  map_opts_free(portals);
 }
 
 engine_t *engine_new(uint8_t num_players, map_t *map, portals_ctx_t *portals,
-                     bool timer) {
+                     bool timer, uint32_t seed) {
   engine_t *ctx;
 
+  if (num_players > PLAYER_MAX) {
+    return NULL;
+  }
+
   ctx = malloc(sizeof(*ctx));
 
   ctx->players = player_create(num_players);
@@ -78,18 +185,144 @@ engine_t *engine_new(uint8_t num_players, map_t *map, portals_ctx_t *portals,
   ctx->incidents = incident_ctx_new(num_players);
   ctx->tick = 0;
   ctx->turns = 0;
+  ctx->ready = NULL;
+  ctx->ready_data = NULL;
+  ctx->delta = false;
+  ctx->pipelined = false;
+  ctx->headless = false;
+  ctx->lockstep = false;
+  ctx->lockstep_running = false;
+  ctx->lockstep_first = false;
+  ctx->inputs = NULL;
+  ctx->num_inputs = 0;
+  ctx->inputs_capacity = 0;
+  ctx->hashed = NULL;
+  ctx->hashed_size = 0;
+  ctx->hashed_capacity = 0;
+  ctx->undo = NULL;
+  ctx->recorder = NULL;
+  ctx->keyframe_turns = 0;
+  ctx->keyframe = NULL;
+  ctx->acked = calloc(num_players, sizeof(*ctx->acked));
+  ctx->scratch = map_bits_new(map_width(map), map_height(map));
+  rng_seed(&ctx->rng, seed);
 
   if (portals == NULL) {
     ctx->portals = portals_new(16);
     setup_portals(ctx);
   }
 
+  ctx->round.players =
+      calloc(num_players, sizeof(*ctx->round.players));
+  ctx->round.portals =
+      calloc(portals_num(ctx->portals), sizeof(*ctx->round.portals));
+  ctx->round.num_portals = 0;
+  ctx->round.effects = NULL;
+  ctx->round.effects_capacity = 0;
+  ctx->round.arena = 0;
+
+  ctx->occupancy = occupancy_new(map_width(map), map_height(map), num_players);
+  ctx->visibility = visibility_new(map_width(map), map_height(map));
+  ctx->sight = malloc(num_players * sizeof(*ctx->sight));
+  ctx->seen_from = malloc(num_players * sizeof(*ctx->seen_from));
+  ctx->tag_from = malloc(num_players * sizeof(*ctx->tag_from));
+  ctx->tag_pos = malloc(num_players * sizeof(*ctx->tag_pos));
+  ctx->tags_due = 0;
+  for (uint8_t i = 0; i < num_players; i++) {
+    ctx->sight[i].from = POSITION_UNKNOWN;
+    ctx->sight[i].facing = DIRECTION_ANY;
+    ctx->sight[i].due = false;
+  }
+  memcpy(ctx->seen_from, ctx->sight, num_players * sizeof(*ctx->sight));
+  ctx->timers = timers_new();
+  for (uint8_t i = 0; i < num_players; i++) {
+    occupancy_move_player(ctx->occupancy, i, ctx->players[i].position);
+  }
+  for (uint8_t i = 0; i < portals_num(ctx->portals); i++) {
+    portal_t *portal = portals_get(ctx->portals, i);
+
+    occupancy_set_portal(ctx->occupancy, portal->position, i);
+  }
+
   ctx->state = STATE_STARTING;
+  ctx->init_spawn_active = 0;
   ctx->waiting = calloc(sizeof(*ctx->waiting), num_players);
+  for (uint8_t i = 0; i < num_players; i++) {
+    ctx->waiting[i].allowed = map_bits_new(map_width(map), map_height(map));
+  }
 
   return ctx;
 }
 
+/* The LoS list is kept in row order, which is the cheapest to send */
+static void build_los(engine_t *ctx, player_t *p) {
+  struct sight *sight = &ctx->sight[p->id];
+  map_opts_t *los;
+
+  map_opts_free(p->los);
+  map_bits_free(p->los_set);
+
+  los = map_line_of_sight(ctx->map, sight->from, sight->facing);
+  p->los_set =
+      map_bits_from_opts(map_width(ctx->map), map_height(ctx->map), los);
+  p->los = map_bits_to_opts(p->los_set);
+  map_opts_free(los);
+  sight->due = false;
+}
+
+/* Nothing in a headless match looks at the line of sight, so it is only
+ * noted where it is from until something does */
+static void update_los(engine_t *ctx, player_t *p) {
+  ctx->sight[p->id].from = p->position;
+  ctx->sight[p->id].facing = p->facing;
+  ctx->sight[p->id].due = true;
+
+  if (!ctx->headless) {
+    build_los(ctx, p);
+  }
+}
+
+/* Works out what headless steps left for later, so the players look as if
+ * every step had done it */
+static void view_sync(engine_t *ctx) {
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    if (ctx->sight[i].due) {
+      build_los(ctx, &ctx->players[i]);
+    }
+  }
+
+  for (uint8_t i = 0; ctx->tags_due != 0 && i < ctx->player_count; i++) {
+    struct sight *from = &ctx->tag_from[i];
+
+    if (!(ctx->tags_due & (uint64_t)1 << i) ||
+        POS_EQ(from->from, POSITION_UNKNOWN)) {
+      continue;
+    }
+
+    for (uint8_t j = 0; j < ctx->player_count; j++) {
+      if (j != i &&
+          map_sees(ctx->map, from->from, from->facing, ctx->tag_pos[j])) {
+        player_tag(&ctx->players[i], j);
+      }
+    }
+  }
+  ctx->tags_due = 0;
+}
+
+/* Moves a player on the map and in the occupancy index, the cell left behind
+ * only stops being a player cell once nobody is left on it */
+static void place_player(engine_t *ctx, player_t *p, pos_t to_pos) {
+  pos_t from = p->position;
+
+  p->position = to_pos;
+  occupancy_move_player(ctx->occupancy, p->id, to_pos);
+
+  if (!occupancy_has_player(ctx->occupancy, from)) {
+    map_unset_player(ctx->map, from);
+  }
+  map_set_player(ctx->map, to_pos);
+}
+
 static void player_position_update(engine_t *ctx, uint8_t player_id,
                                    pos_t to_pos, enum direction face) {
   player_t *p = &ctx->players[player_id];
@@ -98,20 +331,19 @@ static void player_position_update(engine_t *ctx, uint8_t player_id,
     return;
   }
 
-  map_unset_player(ctx->map, p->position);
-  p->position = to_pos;
-
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
-    map_set_player(ctx->map, ctx->players[i].position);
-  }
+  place_player(ctx, p, to_pos);
 
   if (face != DIRECTION_ANY) {
     p->facing = face;
-    map_opts_free(p->los);
-    p->los = map_line_of_sight(ctx->map, p->position, p->facing);
+    update_los(ctx, p);
   }
 }
 
+/* Player updates and asks are only built where the engine needs them */
+static bool quiet(engine_t *ctx) {
+  return ctx->headless || ctx->lockstep_running;
+}
+
 static void send_all(engine_t *ctx, message_t *msg) {
 
   for (uint8_t i = 0; i < ctx->player_count; i++) {
@@ -119,25 +351,66 @@ static void send_all(engine_t *ctx, message_t *msg) {
   }
 }
 
-static bool players_ready(engine_t *ctx) {
+static void add_input(engine_t *ctx, uint8_t i, uint32_t tick,
+                      message_t *msg) {
+  if (ctx->num_inputs == ctx->inputs_capacity) {
+    uint32_t capacity =
+        ctx->inputs_capacity == 0 ? 64 : ctx->inputs_capacity * 2;
+    struct msg_input *inputs =
+        realloc(ctx->inputs, capacity * sizeof(*ctx->inputs));
+
+    /* The players notice at the next hash */
+    if (inputs == NULL) {
+      common_log("Lockstep input dropped at tick %u\n", tick);
+      return;
+    }
+    ctx->inputs = inputs;
+    ctx->inputs_capacity = capacity;
+  }
+  message_to_input(msg, i, tick, &ctx->inputs[ctx->num_inputs++]);
+}
+
+/* True once player @param i has nothing outstanding, the reply is kept.
+ * @param tick is the step it counts for, as recorded: the current one while
+ * stepping, the next one in between. */
+static bool poll_player(engine_t *ctx, uint8_t i, uint32_t tick) {
   message_t *msg;
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
-    if (ctx->waiting[i].tick == 0) {
-      continue;
+  if (ctx->waiting[i].tick == 0) {
+    return true;
+  }
+  msg = player_server_get_msg(&ctx->players[i]);
+  if (msg != NULL) {
+    common_log("GOT MESSAGE TYPE %u, TICK %u FROM %u\n", msg->type,
+               msg->tick, i);
+  }
+  if (msg != NULL && msg->type == ctx->waiting[i].type &&
+      ctx->waiting[i].tick == msg->tick) {
+    ctx->waiting[i].tick = 0;
+    ctx->waiting[i].incoming = msg;
+    if (ctx->recorder != NULL) {
+      recorder_reply(ctx->recorder, i, tick, msg);
     }
-    msg = player_server_get_msg(&ctx->players[i]);
-    if (msg != NULL) {
-      printf("GOT MESSAGE TYPE %u, TICK %u FROM %u\n", msg->type, msg->tick, i);
+    if (ctx->lockstep_running) {
+      add_input(ctx, i, tick, msg);
     }
-    if (msg != NULL && msg->type == ctx->waiting[i].type &&
-        ctx->waiting[i].tick == msg->tick) {
-      ctx->waiting[i].tick = 0;
-      ctx->waiting[i].incoming = msg;
-      continue;
+    if (ctx->waiting[i].full != NULL) {
+      message_unref(ctx->acked[i]);
+      ctx->acked[i] = ctx->waiting[i].full;
+      ctx->waiting[i].full = NULL;
+    }
+    return true;
+  }
+  /* Anything else, such as acks to pipelined updates, is dropped */
+  message_unref(msg);
+  return false;
+}
+
+static bool players_ready(engine_t *ctx) {
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    if (!poll_player(ctx, i, ctx->tick)) {
+      return false;
     }
-    message_unref(msg);
-    return false;
   }
   return true;
 }
@@ -153,7 +426,7 @@ static void resolve_deaths(engine_t *ctx) {
     }
 
     for (uint8_t j = 0; j < ctx->player_count; j++) {
-      if (p->injured_by & (1 << j)) {
+      if (p->injured_by & (uint64_t)1 << j) {
         if (j == i) {
           p->kills--;
         } else {
@@ -169,6 +442,10 @@ static void resolve_deaths(engine_t *ctx) {
 
     player_killed(p);
     player_position_update(ctx, p->id, POSITION_UNKNOWN, DIRECTION_ANY);
+    ctx->sight[i].from = POSITION_UNKNOWN;
+    ctx->sight[i].facing = DIRECTION_ANY;
+    ctx->sight[i].due = false;
+    ctx->tags_due &= ~((uint64_t)1 << i);
   }
 }
 
@@ -198,15 +475,28 @@ static void ask_spawn(engine_t *ctx, uint8_t id) {
 
   points = map_valid_spawns(ctx->map, 3, 15);
 
-  msg = message_ask_spawn(ctx->tick, id, points->size, points->data);
-  ctx->waiting[id].sent = msg;
-  player_server_send_msg(&ctx->players[id], msg);
+  /* Crowded maps can leave no safe spot, settle for any free cell */
+  if (points->size == 0) {
+    map_opts_free(points);
+    points = map_empty_spaces(ctx->map);
+    map_opts_shuffle(points, &ctx->rng);
+  }
+
+  map_bits_clear(ctx->waiting[id].allowed);
+  map_bits_add_opts(ctx->waiting[id].allowed, points);
+  ctx->waiting[id].fallback =
+      points->size > 0 ? points->data[0] : POSITION_UNKNOWN;
+
+  if (!quiet(ctx)) {
+    msg = message_ask_spawn(ctx->tick, id, points->size, points->data);
+    ctx->waiting[id].sent = msg;
+    player_server_send_msg(&ctx->players[id], msg);
+  }
 
   map_opts_free(points);
 }
 
 static bool spawn_reply(engine_t *ctx, uint8_t id) {
-  bool ok = false;
   pos_t pos;
   enum direction facing;
 
@@ -217,68 +507,76 @@ static bool spawn_reply(engine_t *ctx, uint8_t id) {
     return false;
   }
 
-  for (uint32_t i = 0; i < w->sent->body.ask_spawn.size; i++) {
-    if (POS_EQ(w->incoming->body.reply_spawn.dst,
-               w->sent->body.ask_spawn.opts[i])) {
-      ok = true;
-      break;
-    }
-  }
-
-  if (ok) {
+  if (map_bits_contains(w->allowed, w->incoming->body.reply_spawn.dst)) {
     pos = w->incoming->body.reply_spawn.dst;
   } else {
-    pos = w->sent->body.ask_spawn.opts[0];
+    pos = w->fallback;
   }
 
   facing = w->incoming->body.reply_spawn.face;
   if (!map_valid_direction(facing)) {
 
-    printf("Invalid direction %u\n", w->incoming->body.reply_spawn.face);
+    common_log("Invalid direction %u\n", w->incoming->body.reply_spawn.face);
     facing = DIRECTION_NORTH;
   }
 
-  player_spawn(&ctx->players[id], pos, facing);
+  player_spawn(&ctx->players[id], pos, facing, &ctx->rng);
+  occupancy_move_player(ctx->occupancy, id, pos);
   map_set_player(ctx->map, pos);
-  ctx->players[id].los = map_line_of_sight(ctx->map, pos, facing);
+  update_los(ctx, &ctx->players[id]);
 
-  printf("Spawned player %d\n", id);
+  common_log("Spawned player %d\n", id);
 
   return true;
 }
 
-static void resolve_moves(engine_t *ctx) {
-
+/* Tagging a player makes it visible for an extra turn after moving out of
+ * LoS. Nobody's LoS changed since the last updates, so their visibility
+ * index still holds. */
+static void tag_players(engine_t *ctx) {
   for (uint8_t i = 0; i < ctx->player_count; i++) {
-    player_t *p = &ctx->players[i];
-
-    /* Tagging a player makes it visible for an extra turn after
-     * moving out of LoS
-     */
-    player_clear_tags(p);
+    player_clear_tags(&ctx->players[i]);
+  }
 
+  /* There is no visibility index, view_sync() goes by the sights instead */
+  if (ctx->headless) {
+    memcpy(ctx->tag_from, ctx->seen_from,
+           ctx->player_count * sizeof(*ctx->tag_from));
     for (uint8_t j = 0; j < ctx->player_count; j++) {
-      if (i == j) {
-        continue;
-      }
+      ctx->tag_pos[j] = ctx->players[j].position;
+    }
+    ctx->tags_due = ctx->player_count < 64
+                        ? ((uint64_t)1 << ctx->player_count) - 1
+                        : UINT64_MAX;
+    return;
+  }
+
+  for (uint8_t j = 0; j < ctx->player_count; j++) {
+    uint64_t seen = visibility_in_sight(ctx->visibility,
+                                        ctx->players[j].position) &
+                    ~((uint64_t)1 << j);
 
-      if (map_opts_contains(p->los, ctx->players[j].position)) {
-        player_tag(p, j);
+    for (uint8_t i = 0; seen != 0; i++, seen >>= 1) {
+      if (seen & 1) {
+        player_tag(&ctx->players[i], j);
       }
     }
   }
+}
+
+static void resolve_moves(engine_t *ctx) {
+  tag_players(ctx);
 
   for (uint8_t i = 0; i < ctx->player_count; i++) {
-    bool ok = false;
     enum direction facing;
     player_t *p = &ctx->players[i];
     pos_t pos = p->position;
 
     struct waiting *w = &ctx->waiting[i];
-    printf("Resolving move for player %u\n", i);
+    common_log("Resolving move for player %u\n", i);
 
     if (spawn_reply(ctx, i)) {
-      printf("  Player spawned, skipping move (w->type)\n");
+      common_log("  Player spawned, skipping move (w->type)\n");
       continue;
     }
 
@@ -286,15 +584,8 @@ static void resolve_moves(engine_t *ctx) {
       continue;
     }
 
-    for (uint32_t j = 0; j < w->sent->body.ask_move.size; j++) {
-      if (POS_EQ(w->incoming->body.reply_move.dst,
-                 w->sent->body.ask_move.opts[j])) {
-        ok = true;
-        break;
-      }
-    }
-
-    if (ok) {
+    if (map_can_reach(ctx->map, pos, w->incoming->body.reply_move.dst,
+                      MESSAGE_MOVE_STEPS)) {
       pos = w->incoming->body.reply_move.dst;
     }
 
@@ -307,22 +598,24 @@ static void resolve_moves(engine_t *ctx) {
     inc->type = INCIDENT_PLAYER_MOVE;
     inc->player_origin = &ctx->players[i];
     inc->from = ctx->players[i].position;
-    incident_new_target(inc, pos);
+    incident_new_target(ctx->incidents, inc, pos);
 
     player_position_update(ctx, i, pos, facing);
 
     /* Update spells if positioned on a portal */
 
-    if (map_is_portal(ctx->map, p->position)) {
+    if (occupancy_portal_at(ctx->occupancy, p->position) != OCCUPANCY_NONE) {
+      uint8_t id = occupancy_portal_at(ctx->occupancy, p->position);
       portal_t *portal;
       incident_t *incident;
       const spell_t *spell;
 
-      portal = portals_get_at(ctx->portals, p->position);
-      spell = portal_get_spell(portal, ctx->turns + 3);
+      portal = portals_get(ctx->portals, id);
+      spell = portals_take(ctx->portals, id, ctx->turns + 3);
+      timers_add(ctx->timers, TIMER_PORTAL, id, ctx->turns + 3);
 
       if (spell != NULL) {
-        p->spells[portal->kind] = portal_get_spell(portal, ctx->turns + 3);
+        p->spells[portal->kind] = spell;
         p->charges[portal->kind] = p->spells[portal->kind]->charges;
         incident = incident_new(ctx->incidents);
         incident->type = INCIDENT_PORTAL;
@@ -336,7 +629,8 @@ void add_portals_to_map_msg(engine_t *ctx, message_t *msg) {
   uint8_t count = 0;
   uint8_t num = portals_num(ctx->portals);
 
-  msg->body.map.portals = malloc(num * sizeof(*msg->body.map.portals));
+  msg->body.map.portals =
+      message_alloc(msg, num, sizeof(*msg->body.map.portals));
 
   for (uint32_t i = 0; i < num; i++) {
     portal_t *p;
@@ -349,8 +643,8 @@ void add_portals_to_map_msg(engine_t *ctx, message_t *msg) {
     msg->body.map.portals[count].pos = p->position;
     msg->body.map.portals[count].kind = p->kind;
 
-    printf("Sending initial portal data (%d,%d) -> %u\n", p->position.x,
-           p->position.y, p->kind);
+    common_log("Sending initial portal data (%d,%d) -> %u\n", p->position.x,
+               p->position.y, p->kind);
     count++;
   }
   msg->body.map.num_portals = count;
@@ -358,125 +652,313 @@ void add_portals_to_map_msg(engine_t *ctx, message_t *msg) {
   msg->body.map.num_players = ctx->player_count;
 }
 
-static message_t *build_player_update(engine_t *ctx, player_t *p) {
-  map_opts_t *portals;
-  uint8_t count = 0;
-  message_t *msg;
+static void gather_round(engine_t *ctx) {
+  struct round *s = &ctx->round;
+  uint8_t num_portals = portals_num(ctx->portals);
+  uint32_t effects = 0;
+  uint32_t used = 0;
+  bool room = true;
+
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    effects += player_num_effects(&ctx->players[i]);
+  }
+  if (effects > s->effects_capacity) {
+    struct msg_spell *grown =
+        realloc(s->effects, sizeof(*s->effects) * effects);
+
+    /* The others are sent without their effects this round */
+    if (grown == NULL) {
+      common_log("No memory for the effects at turn %u\n", ctx->turns);
+      room = false;
+    } else {
+      s->effects = grown;
+      s->effects_capacity = effects;
+    }
+  }
 
-  msg = message_player_update(ctx->tick);
+  s->arena = message_arena_size(ctx->player_count, sizeof(*s->players));
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    player_t *p = &ctx->players[i];
+    typeof(s->players) o = &s->players[i];
 
-  msg->body.player_update.player_id = p->id;
-  msg->body.player_update.pos = p->position;
-  msg->body.player_update.face = p->facing;
-  msg->body.player_update.health = p->health;
-  msg->body.player_update.kills = p->kills;
-  msg->body.player_update.deaths = p->deaths;
+    o->player_id = p->id;
+    o->pos = p->position;
+    o->face = p->facing;
+    o->health = p->health;
+    o->kills = p->kills;
+    o->deaths = p->deaths;
 
-  player_add_effects_to_msg(p, &msg->body.player_update.effects,
-                            &msg->body.player_update.num_effects);
+    for (uint8_t j = 0; j < PORTAL_NONE; j++) {
+      o->spells[j].id = p->spells[j] != NULL ? p->spells[j]->id : 0;
+      o->spells[j].charges = p->spells[j] != NULL ? p->charges[j] : 0;
+    }
 
-  for (uint8_t i = 0; i < PORTAL_NONE; i++) {
-    if (p->spells[i] != NULL) {
-      msg->body.player_update.spells[i].id = p->spells[i]->id;
-      msg->body.player_update.spells[i].charges = p->charges[i];
+    o->effects = room ? s->effects + used : NULL;
+    o->num_effects = room ? player_effects_to_msg(p, o->effects) : 0;
+    used += o->num_effects;
+    s->arena += message_arena_size(o->num_effects, sizeof(*o->effects));
+  }
 
-      printf("Updating playrt %u with spell id %u (%p)\n", p->id,
-             p->spells[i]->id, p->spells[i]);
-    } else {
-      msg->body.player_update.spells[i].id = 0;
-      msg->body.player_update.spells[i].charges = 0;
+  s->num_portals = 0;
+  for (uint8_t i = 0; i < num_portals; i++) {
+    portal_t *p = portals_get(ctx->portals, i);
+
+    if (p == NULL) {
+      continue;
     }
+    s->portals[s->num_portals].pos = p->position;
+    s->portals[s->num_portals].kind = p->kind;
+    s->portals[s->num_portals].spell = p->spell != NULL ? p->spell->id : 0;
+    s->num_portals++;
   }
+  s->arena += message_arena_size(s->num_portals, sizeof(*s->portals));
+}
 
-  if (p->los != NULL) {
-    map_opts_export(p->los, &msg->body.player_update.los.opts,
-                    &msg->body.player_update.los.size);
-  } else {
-    msg->body.player_update.los.opts = NULL;
-    msg->body.player_update.los.size = 0;
+static struct msg_spell *copy_effects(message_t *msg, struct msg_spell *from,
+                                      uint8_t num) {
+  struct msg_spell *effects = message_alloc(msg, num, sizeof(*effects));
+
+  if (num > 0) {
+    memcpy(effects, from, num * sizeof(*effects));
   }
+  return effects;
+}
 
-  msg->body.player_update.others =
-      malloc(ctx->player_count * sizeof(*msg->body.player_update.others));
-  count = 0;
+/* The update for @param p out of the round data, with @param extra more bytes
+ * of arena */
+static message_t *build_player_update(engine_t *ctx, player_t *p,
+                                      size_t extra) {
+  struct round *s = &ctx->round;
+  typeof(s->players) me = &s->players[p->id];
+  typeof(((message_t *)0)->body.player_update) *u;
+  size_t los = p->los != NULL ? p->los->size : 0;
+  uint64_t bit = (uint64_t)1 << p->id;
+  message_t *msg;
+
+  msg = message_player_update(
+      ctx->tick, s->arena + extra + message_arena_size(los, sizeof(pos_t)) +
+                     message_arena_size(me->num_effects, sizeof(*me->effects)));
+  u = &msg->body.player_update;
+
+  u->player_id = me->player_id;
+  u->pos = me->pos;
+  u->face = me->face;
+  u->health = me->health;
+  u->kills = me->kills;
+  u->deaths = me->deaths;
+  memcpy(u->spells, me->spells, sizeof(u->spells));
+  u->num_effects = me->num_effects;
+  u->effects = copy_effects(msg, me->effects, me->num_effects);
+
+  u->los.size = los;
+  u->los.opts = message_alloc(msg, los, sizeof(pos_t));
+  if (los > 0) {
+    memcpy(u->los.opts, p->los->data, los * sizeof(pos_t));
+  }
+
+  u->others = message_alloc(msg, ctx->player_count, sizeof(*u->others));
+  u->num_others = 0;
 
   for (uint8_t i = 0; i < ctx->player_count; i++) {
-    player_t *other;
-    other = &ctx->players[i];
+    typeof(u->others) o;
+
     if (p->health > 0 &&
-        (other->id == p->id || !(player_is_tagged(p, i) ||
-                                 map_opts_contains(p->los, other->position)))) {
+        (i == p->id ||
+         !(player_is_tagged(p, i) ||
+           visibility_in_sight(ctx->visibility, s->players[i].pos) & bit))) {
       continue;
     }
 
-    msg->body.player_update.others[count].player_id = other->id;
-    msg->body.player_update.others[count].face = other->facing;
-    msg->body.player_update.others[count].pos = other->position;
-    msg->body.player_update.others[count].kills = other->kills;
-    msg->body.player_update.others[count].deaths = other->deaths;
-    msg->body.player_update.others[count].health = other->health;
+    o = &u->others[u->num_others++];
+    *o = s->players[i];
+    o->effects = copy_effects(msg, o->effects, o->num_effects);
+  }
 
-    for (uint8_t j = 0; j < PORTAL_NONE; j++) {
-      if (other->spells[j] != NULL) {
-        msg->body.player_update.others[count].spells[j].id =
-            other->spells[j]->id;
-        msg->body.player_update.others[count].spells[j].charges =
-            other->charges[j];
-      } else {
-        msg->body.player_update.others[count].spells[j].id = 0;
-        msg->body.player_update.others[count].spells[j].charges = 0;
-      }
-    }
+  u->num_portals = s->num_portals;
+  u->portals = message_alloc(msg, s->num_portals, sizeof(*u->portals));
+  if (s->num_portals > 0) {
+    memcpy(u->portals, s->portals, s->num_portals * sizeof(*u->portals));
+  }
 
-    player_add_effects_to_msg(
-        other, &msg->body.player_update.others[count].effects,
-        &msg->body.player_update.others[count].num_effects);
+  return msg;
+}
 
-    count++;
+static bool same_other(typeof(((message_t *)0)->body.player_update.others) a,
+                       typeof(a) b) {
+  return a->player_id == b->player_id && POS_EQ(a->pos, b->pos) &&
+         a->face == b->face && a->health == b->health &&
+         a->kills == b->kills && a->deaths == b->deaths &&
+         memcmp(a->spells, b->spells, sizeof(a->spells)) == 0 &&
+         a->num_effects == b->num_effects &&
+         (a->num_effects == 0 ||
+          memcmp(a->effects, b->effects,
+                 a->num_effects * sizeof(*a->effects)) == 0);
+}
+
+/* What changed in @param full since @param base, the last update the player
+ * acked. The arena has room for @param events on top. */
+static message_t *build_delta(engine_t *ctx, message_t *full, message_t *base,
+                              size_t events) {
+  typeof(full->body.player_update) *f = &full->body.player_update;
+  typeof(base->body.player_update) *b = &base->body.player_update;
+  typeof(full->body.player_update) *d;
+  uint8_t in_base[UINT8_MAX + 1] = {0};
+  size_t arena = events;
+  message_t *msg;
+
+  arena += message_arena_size(f->los.size, sizeof(pos_t));
+  arena += message_arena_size(b->los.size, sizeof(pos_t));
+  arena += message_arena_size(f->num_effects, sizeof(*f->effects));
+  arena += message_arena_size(f->num_others, sizeof(*f->others));
+  for (uint8_t i = 0; i < f->num_others; i++) {
+    arena += message_arena_size(f->others[i].num_effects,
+                                sizeof(*f->others[i].effects));
+  }
+  arena += message_arena_size(b->num_others, sizeof(*b->others_gone));
+  arena += message_arena_size(f->num_portals, sizeof(*f->portals));
+
+  msg = message_player_update(full->tick, arena);
+  d = &msg->body.player_update;
+
+  d->base = base->tick;
+  d->player_id = f->player_id;
+  d->pos = f->pos;
+  d->face = f->face;
+  d->health = f->health;
+  d->kills = f->kills;
+  d->deaths = f->deaths;
+  memcpy(d->spells, f->spells, sizeof(d->spells));
+
+  d->num_effects = f->num_effects;
+  d->effects = message_alloc(msg, f->num_effects, sizeof(*d->effects));
+  if (f->num_effects > 0) {
+    memcpy(d->effects, f->effects, f->num_effects * sizeof(*d->effects));
+  }
+
+  d->los.opts = message_alloc(msg, f->los.size, sizeof(pos_t));
+  map_bits_clear(ctx->scratch);
+  for (uint32_t i = 0; i < b->los.size; i++) {
+    map_bits_add(ctx->scratch, b->los.opts[i]);
+  }
+  for (uint32_t i = 0; i < f->los.size; i++) {
+    if (!map_bits_contains(ctx->scratch, f->los.opts[i])) {
+      d->los.opts[d->los.size++] = f->los.opts[i];
+    }
   }
-  msg->body.player_update.num_others = count;
 
-  portals = map_portals(ctx->map, NULL);
-  msg->body.player_update.portals =
-      malloc(portals->size * sizeof(*msg->body.player_update.portals));
-  count = 0;
+  d->los_gone.opts = message_alloc(msg, b->los.size, sizeof(pos_t));
+  map_bits_clear(ctx->scratch);
+  for (uint32_t i = 0; i < f->los.size; i++) {
+    map_bits_add(ctx->scratch, f->los.opts[i]);
+  }
+  for (uint32_t i = 0; i < b->los.size; i++) {
+    if (!map_bits_contains(ctx->scratch, b->los.opts[i])) {
+      d->los_gone.opts[d->los_gone.size++] = b->los.opts[i];
+    }
+  }
 
-  for (uint32_t i = 0; i < portals->size; i++) {
-    portal_t *p;
+  for (uint8_t i = 0; i < b->num_others; i++) {
+    in_base[b->others[i].player_id] = i + 1;
+  }
 
-    p = portals_get_at(ctx->portals, portals->data[i]);
-    if (p == NULL) {
+  d->others = message_alloc(msg, f->num_others, sizeof(*d->others));
+  for (uint8_t i = 0; i < f->num_others; i++) {
+    uint8_t id = f->others[i].player_id;
+    bool same = in_base[id] != 0 &&
+                same_other(&f->others[i], &b->others[in_base[id] - 1]);
+    typeof(d->others) o;
+
+    in_base[id] = 0;
+    if (same) {
       continue;
     }
 
-    msg->body.player_update.portals[count].pos = portals->data[i];
-    msg->body.player_update.portals[count].kind = p->kind;
-    msg->body.player_update.portals[count].spell =
-        p->spell != NULL ? p->spell->id : 0;
-    count++;
+    o = &d->others[d->num_others++];
+    *o = f->others[i];
+    o->effects = message_alloc(msg, o->num_effects, sizeof(*o->effects));
+    if (o->num_effects > 0) {
+      memcpy(o->effects, f->others[i].effects,
+             o->num_effects * sizeof(*o->effects));
+    }
   }
 
-  msg->body.player_update.num_portals = count;
-
-  incident_add_to_message(ctx->incidents, p, msg);
+  d->others_gone = message_alloc(msg, b->num_others, sizeof(*d->others_gone));
+  for (uint8_t i = 0; i < b->num_others; i++) {
+    if (in_base[b->others[i].player_id] != 0) {
+      d->others_gone[d->num_others_gone++] = b->others[i].player_id;
+    }
+  }
 
-  map_opts_free(portals);
+  d->portals = message_alloc(msg, f->num_portals, sizeof(*d->portals));
+  for (uint8_t i = 0; i < f->num_portals; i++) {
+    if (i < b->num_portals && f->portals[i].kind == b->portals[i].kind &&
+        f->portals[i].spell == b->portals[i].spell &&
+        POS_EQ(f->portals[i].pos, b->portals[i].pos)) {
+      continue;
+    }
+    d->portals[d->num_portals++] = f->portals[i];
+  }
 
   return msg;
 }
 
+/* Only what the engine itself goes on: who sees what and the waits */
+static void update_headless(engine_t *ctx) {
+  if (!ctx->headless) {
+    visibility_build(ctx->visibility, ctx->players, ctx->player_count);
+  }
+
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    clear_waiting(&ctx->waiting[i]);
+    if (!ctx->pipelined) {
+      ctx->waiting[i].tick = ctx->tick;
+      ctx->waiting[i].type = MESSAGE_REPLY_PLAYER_UPDATE;
+    }
+  }
+  incident_ctx_clear(ctx->incidents);
+}
+
 static void update_players(engine_t *ctx) {
+  size_t events = incident_message_size(ctx->incidents);
+
+  memcpy(ctx->seen_from, ctx->sight,
+         ctx->player_count * sizeof(*ctx->seen_from));
+  if (quiet(ctx)) {
+    update_headless(ctx);
+    return;
+  }
+
+  visibility_build(ctx->visibility, ctx->players, ctx->player_count);
+  gather_round(ctx);
+
   for (uint8_t i = 0; i < ctx->player_count; i++) {
+    player_t *p = &ctx->players[i];
+    message_t *base = ctx->delta ? ctx->acked[i] : NULL;
+    message_t *full;
     message_t *msg;
 
-    msg = build_player_update(ctx, &ctx->players[i]);
     clear_waiting(&ctx->waiting[i]);
 
+    if (base == NULL) {
+      msg = build_player_update(ctx, p, events);
+      full = ctx->delta ? message_ref(msg) : NULL;
+    } else {
+      full = build_player_update(ctx, p, 0);
+      msg = build_delta(ctx, full, base, events);
+    }
+    incident_add_to_message(ctx->incidents, ctx->visibility, p, msg);
+
+    message_unref(ctx->waiting[i].full);
+    ctx->waiting[i].full = full;
+    player_server_send_msg(&ctx->players[i], msg);
+
+    if (ctx->pipelined) {
+      message_unref(msg);
+      continue;
+    }
     ctx->waiting[i].tick = ctx->tick;
     ctx->waiting[i].type = MESSAGE_REPLY_PLAYER_UPDATE;
     ctx->waiting[i].sent = msg;
-
-    player_server_send_msg(&ctx->players[i], msg);
   }
   incident_ctx_clear(ctx->incidents);
 }
@@ -488,53 +970,85 @@ static void ask_move(engine_t *ctx, uint8_t id) {
 
   p = &ctx->players[id];
 
-  moves = map_valid_moves(ctx->map, p->position, 15);
-
-  msg = message_ask_move(ctx->tick, moves->size, moves->data);
-
   clear_waiting(&ctx->waiting[id]);
+  map_bits_clear(ctx->waiting[id].allowed);
 
   ctx->waiting[id].tick = ctx->tick;
   ctx->waiting[id].type = MESSAGE_REPLY_MOVE;
+  p->activated_spell = PORTAL_NONE;
+
+  /* The reply is checked on its own, the moves are only listed to send */
+  if (quiet(ctx)) {
+    return;
+  }
+
+  /* Sent in row order rather than by distance, which packs far better */
+  moves = map_valid_moves(ctx->map, p->position, MESSAGE_MOVE_STEPS);
+  map_bits_clear(ctx->scratch);
+  map_bits_add_opts(ctx->scratch, moves);
+  map_opts_free(moves);
+  moves = map_bits_to_opts(ctx->scratch);
+  msg = message_ask_move(ctx->tick, moves->size, moves->data);
   ctx->waiting[id].sent = msg;
 
   player_server_send_msg(p, msg);
-
-  p->activated_spell = PORTAL_NONE;
   map_opts_free(moves);
 }
 
 static void ask_fight(engine_t *ctx) {
   for (uint8_t i = 0; i < ctx->player_count; i++) {
+    map_opts_t *in_range[PORTAL_NONE] = {NULL};
+    size_t arena = 0;
     message_t *msg;
     player_t *p = &ctx->players[i];
 
-    msg = message_ask_fight(ctx->tick);
+    common_log("Ask figth for %u (%d,%d)\n", p->id, p->position.x,
+               p->position.y);
 
-    printf("Ask figth for %u (%d,%d)\n", p->id, p->position.x, p->position.y);
+    /* resolve_fight() checks the targets itself */
+    if (quiet(ctx)) {
+      clear_waiting(&ctx->waiting[i]);
+      ctx->waiting[i].tick = ctx->tick;
+      ctx->waiting[i].type = MESSAGE_REPLY_FIGHT;
+      continue;
+    }
 
     for (uint8_t j = 0; j < PORTAL_NONE; j++) {
-      map_opts_t *in_range;
       const spell_t *spell;
 
       if (p->spells[j] == NULL || p->charges[j] == 0) {
-        msg->body.ask_fight.spell_id[j] = 0;
-        msg->body.ask_fight.spell_opts[j].size = 0;
-        msg->body.ask_fight.spell_opts[j].opts = NULL;
         continue;
       }
 
       spell = p->spells[j];
 
-      printf("Prepping spell for %u: %s, ragne %u\n", p->id, spell->name,
-             spell->max_range);
+      common_log("Prepping spell for %u: %s, ragne %u\n", p->id, spell->name,
+                 spell->max_range);
+
+      in_range[j] = map_reduce_to_distance(ctx->map, p->position, p->los,
+                                           spell->max_range);
+      arena += message_arena_size(in_range[j]->size, sizeof(pos_t));
+    }
+
+    msg = message_ask_fight(ctx->tick, arena);
+
+    for (uint8_t j = 0; j < PORTAL_NONE; j++) {
+      struct msg_opts *opts = &msg->body.ask_fight.spell_opts[j];
+
+      if (in_range[j] == NULL) {
+        msg->body.ask_fight.spell_id[j] = 0;
+        opts->size = 0;
+        opts->opts = NULL;
+        continue;
+      }
 
-      in_range = map_reduce_to_distance(ctx->map, p->position, p->los,
-                                        spell->max_range);
-      msg->body.ask_fight.spell_id[j] = spell->id;
-      map_opts_export(in_range, &msg->body.ask_fight.spell_opts[j].opts,
-                      &msg->body.ask_fight.spell_opts[j].size);
-      map_opts_free(in_range);
+      msg->body.ask_fight.spell_id[j] = p->spells[j]->id;
+      opts->size = in_range[j]->size;
+      opts->opts = message_alloc(msg, opts->size, sizeof(pos_t));
+      if (opts->size > 0) {
+        memcpy(opts->opts, in_range[j]->data, opts->size * sizeof(pos_t));
+      }
+      map_opts_free(in_range[j]);
     }
 
     clear_waiting(&ctx->waiting[i]);
@@ -553,8 +1067,8 @@ static bool verify_spell(engine_t *ctx, const spell_t *spell, player_t *p,
     return false;
   }
 
-  printf("Verifying spell %s ( id %u), num ranges %u, max range %d\n",
-         spell->name, spell->id, spell->num_ranges, spell->max_range);
+  common_log("Verifying spell %s ( id %u), num ranges %u, max range %d\n",
+             spell->name, spell->id, spell->num_ranges, spell->max_range);
 
   if (!map_within_distance(ctx->map, p->position, target,
                            spell->range[spell->num_ranges - 1].range)) {
@@ -568,28 +1082,18 @@ static bool verify_spell(engine_t *ctx, const spell_t *spell, player_t *p,
   return true;
 }
 
-static int8_t get_player_mod(player_t *p, enum spell_effect_types type) {
-  int8_t total = 0;
-
-  for (struct player_effect *eff = p->effects; eff != NULL; eff = eff->next) {
-    if (eff->eff.type == type) {
-      total += eff->eff.params.mod.value;
-    }
-  }
-  return total;
-}
-
 static void apply_dmg_at(engine_t *ctx, incident_target_t *incident_target,
                          player_t *p, int8_t dmg_min, int8_t dmg_max,
                          pos_t target, bool selfdmg) {
   int8_t dmg;
 
   if (dmg_max <= 0) {
-    printf("MAx dmg < 0\n");
+    common_log("MAx dmg < 0\n");
     return;
   }
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target);
+       i != OCCUPANCY_NONE; i = occupancy_next_player(ctx->occupancy, i)) {
     player_t *other = &ctx->players[i];
     incident_effect_t *eff;
 
@@ -597,37 +1101,33 @@ static void apply_dmg_at(engine_t *ctx, incident_target_t *incident_target,
       continue;
     }
 
-    if (!POS_EQ(target, other->position)) {
-      continue;
-    }
-
     if (other->health == 0 && other->injured_by == 0) {
       /* has been dead as before this round of damage */
       continue;
     }
 
-    dmg = (rand() % (dmg_max - dmg_min)) + 1 + dmg_min;
+    dmg = rng_below(&ctx->rng, dmg_max - dmg_min) + 1 + dmg_min;
 
-    dmg += get_player_mod(other, SPELL_EFFECT_DAMAGE_MOD);
+    dmg += player_mod(other, SPELL_EFFECT_DAMAGE_MOD);
 
     if (dmg < 0) {
       dmg = 0;
     }
 
-    eff = incident_new_effect(incident_target);
+    eff = incident_new_effect(ctx->incidents, incident_target);
     eff->type = SPELL_EFFECT_DAMAGE;
     eff->victim = &ctx->players[i];
     eff->at = target;
     eff->data.dmg = dmg;
-    printf("ADDING EFFECT FOR %d DAMAGE FOR PLAYER AT (%d,%d)\n", eff->data.dmg,
-           eff->victim->position.x, eff->victim->position.y);
+    common_log("ADDING EFFECT FOR %d DAMAGE FOR PLAYER AT (%d,%d)\n",
+               eff->data.dmg, eff->victim->position.x, eff->victim->position.y);
 
     if (dmg > 0) {
       other->health -= dmg;
       if (other->health < 0) {
         other->health = 0;
       }
-      other->injured_by |= (1 << p->id);
+      other->injured_by |= (uint64_t)1 << p->id;
     }
   }
 }
@@ -638,7 +1138,7 @@ static pos_t get_new_target(engine_t *ctx, pos_t from, pos_t to) {
   steps =
       ((to.x - from.x) * (to.x - from.x) + (to.y - from.y) * (to.y - from.y));
 
-  steps = ((rand() % 100) * steps) / 100;
+  steps = (rng_below(&ctx->rng, 100) * steps) / 100;
 
   if (steps < 3) {
     steps = 3;
@@ -668,9 +1168,39 @@ static void apply_splash(engine_t *ctx, const struct spell_effect *eff,
                          pos_t target, incident_target_t *inc_targ,
                          player_t *caster) {
 
-  map_opts_t *los = map_line_of_sight(ctx->map, target, DIRECTION_ANY);
-  map_opts_delete(los, target); // Not hitting target again...
-  map_opts_t *splashed = map_players(ctx->map, los);
+  map_opts_t *splashed;
+  uint32_t beyond = 0;
+
+  /* Only the player cells in sight matter, in row order */
+  map_bits_clear(ctx->scratch);
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    pos_t pos = ctx->players[i].position;
+
+    if (!POS_EQ(pos, target) && // Not hitting target again...
+        occupancy_has_player(ctx->occupancy, pos) &&
+        map_sees(ctx->map, target, DIRECTION_ANY, pos) &&
+        !map_bits_contains(ctx->scratch, pos)) {
+      map_bits_add(ctx->scratch, pos);
+      beyond += pos.y > target.y || (pos.y == target.y && pos.x > target.x);
+    }
+  }
+
+  if (beyond < 2) {
+    splashed = map_bits_to_opts(ctx->scratch);
+  } else {
+    /* Taking the target out of the whole line of sight moves its last cell
+     * into the target's place, which orders the splashes behind it */
+    map_opts_t *los = map_line_of_sight(ctx->map, target, DIRECTION_ANY);
+
+    map_opts_delete(los, target);
+    splashed = map_opts_new(ctx->player_count);
+    for (uint32_t i = 0; i < los->size; i++) {
+      if (occupancy_has_player(ctx->occupancy, los->data[i])) {
+        map_opts_append(splashed, los->data[i]);
+      }
+    }
+    map_opts_free(los);
+  }
 
   for (uint32_t s = 0; s < splashed->size; s++) {
     coord_t splash_min;
@@ -690,7 +1220,6 @@ static void apply_splash(engine_t *ctx, const struct spell_effect *eff,
                  splashed->data[s], true);
   }
 
-  map_opts_free(los);
   map_opts_free(splashed);
 }
 
@@ -705,16 +1234,16 @@ static void apply_push_pull(engine_t *ctx, const struct spell_effect *eff,
     return;
   }
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target), next;
+       i != OCCUPANCY_NONE; i = next) {
     player_t *candidate;
+
     candidate = &ctx->players[i];
-    if (!POS_EQ(candidate->position, target)) {
-      continue;
-    }
+    next = occupancy_next_player(ctx->occupancy, i);
 
     if (eff->params.move.max > eff->params.move.min) {
       steps = eff->params.move.min +
-              (rand() % (eff->params.move.max - eff->params.move.min));
+              rng_below(&ctx->rng, eff->params.move.max - eff->params.move.min);
     } else {
       steps = eff->params.move.max;
     }
@@ -723,12 +1252,12 @@ static void apply_push_pull(engine_t *ctx, const struct spell_effect *eff,
     } else {
       new_pos = map_push(ctx->map, caster->position, target, steps);
     }
-    inc_eff = incident_new_effect(inc_targ);
+    inc_eff = incident_new_effect(ctx->incidents, inc_targ);
     inc_eff->victim = candidate;
     inc_eff->at = candidate->position;
     inc_eff->data.new_pos = new_pos;
     inc_eff->type = eff->type;
-    candidate->position = new_pos;
+    place_player(ctx, candidate, new_pos);
   }
 }
 
@@ -756,25 +1285,26 @@ static void apply_push_random(engine_t *ctx, const struct spell_effect *eff,
   map_opts_delete_list(outer, inner);
 
   if (outer->size == 0) {
+    map_opts_free(outer);
+    map_opts_free(inner);
     return;
   }
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target), next;
+       i != OCCUPANCY_NONE; i = next) {
     player_t *candidate;
 
     candidate = &ctx->players[i];
-    if (!POS_EQ(candidate->position, target)) {
-      continue;
-    }
+    next = occupancy_next_player(ctx->occupancy, i);
 
-    map_opts_shuffle(outer);
-    new_pos = outer->data[i];
-    inc_eff = incident_new_effect(inc_targ);
+    map_opts_shuffle(outer, &ctx->rng);
+    new_pos = outer->data[0];
+    inc_eff = incident_new_effect(ctx->incidents, inc_targ);
     inc_eff->victim = candidate;
     inc_eff->at = candidate->position;
     inc_eff->data.new_pos = new_pos;
     inc_eff->type = SPELL_EFFECT_PUSH_RANDOM;
-    candidate->position = new_pos;
+    place_player(ctx, candidate, new_pos);
   }
   map_opts_free(outer);
   map_opts_free(inner);
@@ -785,19 +1315,17 @@ static void apply_heal(engine_t *ctx, const struct spell_effect *eff,
                        player_t *caster) {
   incident_effect_t *inc_eff;
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target);
+       i != OCCUPANCY_NONE; i = occupancy_next_player(ctx->occupancy, i)) {
     player_t *candidate;
     int8_t amount;
 
     candidate = &ctx->players[i];
-    if (!POS_EQ(candidate->position, target)) {
-      continue;
-    }
 
     amount = eff->params.heal.min +
-             (rand() % (eff->params.heal.max - eff->params.heal.min));
+             rng_below(&ctx->rng, eff->params.heal.max - eff->params.heal.min);
 
-    inc_eff = incident_new_effect(inc_targ);
+    inc_eff = incident_new_effect(ctx->incidents, inc_targ);
     inc_eff->victim = candidate;
     inc_eff->at = candidate->position;
     inc_eff->data.dmg = amount;
@@ -808,27 +1336,35 @@ static void apply_heal(engine_t *ctx, const struct spell_effect *eff,
     }
   }
 }
+/* Effects run out in the time step of the turn before the one they expire
+ * at, see time_effects() */
+static void add_effect(engine_t *ctx, player_t *p,
+                       const struct spell_effect *eff, int duration,
+                       const spell_t *spell, player_t *caster) {
+  uint32_t expires = player_add_effect(p, *eff, duration, spell, caster);
+
+  timers_add(ctx->timers, TIMER_EFFECT, p->id,
+             expires > ctx->turns ? expires - 1 : ctx->turns);
+}
+
 static void apply_poison(engine_t *ctx, const struct spell_effect *eff,
                          pos_t target, incident_target_t *inc_targ,
                          const spell_t *spell, player_t *caster) {
   incident_effect_t *inc_eff;
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target);
+       i != OCCUPANCY_NONE; i = occupancy_next_player(ctx->occupancy, i)) {
     player_t *candidate;
 
     candidate = &ctx->players[i];
-    if (!POS_EQ(candidate->position, target)) {
-      continue;
-    }
 
-    inc_eff = incident_new_effect(inc_targ);
+    inc_eff = incident_new_effect(ctx->incidents, inc_targ);
     inc_eff->victim = candidate;
     inc_eff->at = candidate->position;
     inc_eff->data.duration = eff->params.poison.duration;
     inc_eff->type = SPELL_EFFECT_POISON;
 
-    player_add_effect(candidate, *eff, inc_eff->data,
-                      eff->params.poison.duration, spell, caster);
+    add_effect(ctx, candidate, eff, eff->params.poison.duration, spell, caster);
   }
 }
 
@@ -839,25 +1375,27 @@ static void apply_poison_effects(engine_t *ctx) {
 
     candidate = &ctx->players[i];
 
-    for (struct player_effect *e = candidate->effects; e != NULL; e = e->next) {
+    for (uint8_t k = 0; k < candidate->num_effects; k++) {
+      uint32_t at = player_effect_at(candidate, k);
+      const struct spell_effect *e = &candidate->effects->eff[at];
       incident_effect_t *eff;
       incident_target_t *inc_targ;
       incident_t *inc;
 
-      if (e->eff.type != SPELL_EFFECT_POISON) {
+      if (e->type != SPELL_EFFECT_POISON) {
         continue;
       }
 
       if (candidate->health <= 0 && candidate->injured_by == 0) {
         continue;
       }
-      dmg = (rand() % (e->eff.params.poison.max - e->eff.params.poison.min)) +
-            1 + e->eff.params.poison.min;
+      dmg = rng_below(&ctx->rng, e->params.poison.max - e->params.poison.min) +
+            1 + e->params.poison.min;
 
       inc = incident_new(ctx->incidents);
       inc->type = INCIDENT_DELAYED_EFFECT;
-      inc_targ = incident_new_target(inc, candidate->position);
-      eff = incident_new_effect(inc_targ);
+      inc_targ = incident_new_target(ctx->incidents, inc, candidate->position);
+      eff = incident_new_effect(ctx->incidents, inc_targ);
       eff->type = SPELL_EFFECT_DAMAGE;
       eff->victim = &ctx->players[i];
       eff->at = candidate->position;
@@ -865,7 +1403,8 @@ static void apply_poison_effects(engine_t *ctx) {
 
       if (dmg > 0) {
         candidate->health -= dmg;
-        candidate->injured_by |= (1 << e->caster->id);
+        candidate->injured_by |= (uint64_t)1
+                                 << candidate->effects->caster[at];
         if (candidate->health < 0) {
           candidate->health = 0;
         }
@@ -880,22 +1419,19 @@ static void apply_mod(engine_t *ctx, const struct spell_effect *eff,
                       const spell_t *spell, player_t *caster) {
   incident_effect_t *inc_eff;
 
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target);
+       i != OCCUPANCY_NONE; i = occupancy_next_player(ctx->occupancy, i)) {
     player_t *candidate;
 
     candidate = &ctx->players[i];
-    if (!POS_EQ(candidate->position, target)) {
-      continue;
-    }
 
-    inc_eff = incident_new_effect(inc_targ);
+    inc_eff = incident_new_effect(ctx->incidents, inc_targ);
     inc_eff->victim = candidate;
     inc_eff->at = candidate->position;
     inc_eff->data.duration = eff->params.mod.duration;
     inc_eff->type = eff->type;
 
-    player_add_effect(candidate, *eff, inc_eff->data, eff->params.mod.duration,
-                      spell, caster);
+    add_effect(ctx, candidate, eff, eff->params.mod.duration, spell, caster);
   }
 }
 
@@ -945,8 +1481,8 @@ static void apply_spell(engine_t *ctx, const spell_t *spell, player_t *p,
   coord_t dist_square;
   incident_t *incident = incident_new(ctx->incidents);
 
-  printf("Applying spell with id %u, %u num_ranges, max_range %d\n", spell->id,
-         spell->num_ranges, spell->max_range);
+  common_log("Applying spell with id %u, %u num_ranges, max_range %d\n",
+             spell->id, spell->num_ranges, spell->max_range);
 
   dist_square = map_distance_squared(ctx->map, p->position, target);
 
@@ -961,33 +1497,35 @@ static void apply_spell(engine_t *ctx, const spell_t *spell, player_t *p,
   incident->spell = spell;
 
   /** TODO: Move to spell effects? */
-  for (uint8_t i = 0; i < ctx->player_count; i++) {
+  for (int16_t i = occupancy_first_player(ctx->occupancy, target);
+       i != OCCUPANCY_NONE; i = occupancy_next_player(ctx->occupancy, i)) {
     other = &ctx->players[i];
-    if (other->id != p->id && POS_EQ(other->position, target)) {
-      hit += get_player_mod(other, SPELL_EFFECT_BE_HIT_MOD);
+    if (other->id != p->id) {
+      hit += player_mod(other, SPELL_EFFECT_BE_HIT_MOD);
     }
   }
 
-  hit += get_player_mod(other, SPELL_EFFECT_HIT_MOD);
+  hit += player_mod(p, SPELL_EFFECT_HIT_MOD);
 
   for (int8_t i = 0; i < spell->burst; i++) {
     incident_target_t *target_incident;
     pos_t burst_target = target;
 
-    if (hit > 0 && rand() % 100 < hit) {
-      /* rand() starts at 0, so < gives fair % */
-      printf("Spell hit (%d)\n", hit);
-      target_incident = incident_new_target(incident, target);
+    if (hit > 0 && (int8_t)rng_below(&ctx->rng, 100) < hit) {
+      /* Draws start at 0, so < gives fair % */
+      common_log("Spell hit (%d)\n", hit);
+      target_incident = incident_new_target(ctx->incidents, incident, target);
       apply_dmg_at(ctx, target_incident, p, dmg_min, dmg_max, target, false);
     } else {
-      printf("Spell miss (%d)\n", hit);
+      common_log("Spell miss (%d)\n", hit);
       switch (spell->miss) {
       case SPELL_MISS_LOS: {
         int8_t miss_dmg_min = 0;
         int8_t miss_dmg_max = 0;
 
         burst_target = get_new_target(ctx, p->position, target);
-        target_incident = incident_new_target(incident, burst_target);
+        target_incident =
+            incident_new_target(ctx->incidents, incident, burst_target);
         dist_square = map_distance_squared(ctx->map, p->position, burst_target);
         spell_get_stats(spell, dist_square, NULL, &miss_dmg_min, &miss_dmg_max);
 
@@ -1000,9 +1538,15 @@ static void apply_spell(engine_t *ctx, const spell_t *spell, player_t *p,
 
         opts = map_valid_moves(ctx->map, target, spell->bounce_max);
         map_opts_delete(opts, target);
-        map_opts_shuffle(opts);
-        burst_target = opts->data[i];
-        target_incident = incident_new_target(incident, burst_target);
+        /* Nowhere to bounce to, e.g. from a pocket walled in all around */
+        if (opts->size == 0) {
+          map_opts_free(opts);
+          continue;
+        }
+        map_opts_shuffle(opts, &ctx->rng);
+        burst_target = opts->data[0];
+        target_incident =
+            incident_new_target(ctx->incidents, incident, burst_target);
         apply_dmg_at(ctx, target_incident, p, dmg_min, dmg_max, burst_target,
                      true);
 
@@ -1043,6 +1587,7 @@ static void resolve_fight(engine_t *ctx) {
           spell_get_by_id(ctx->waiting[i].incoming->body.reply_fight.spell_id);
 
       if (check == NULL) {
+        clear_waiting(&ctx->waiting[i]);
         continue;
       }
 
@@ -1103,7 +1648,90 @@ static void resolve_fight(engine_t *ctx) {
     resolve_deaths(ctx);
   }
 }
-void engine_tick(engine_t *ctx) {
+/* A turn of effects has passed, drops those that ran out */
+static void time_effects(engine_t *ctx) {
+  const uint32_t *due;
+  uint32_t num;
+
+  player_effects_turn(ctx->players, ctx->turns + 1);
+  num = timers_due(ctx->timers, TIMER_EFFECT, ctx->turns, &due);
+  for (uint32_t i = 0; i < num; i++) {
+    if (due[i] < ctx->player_count) {
+      player_expire_effects(&ctx->players[due[i]]);
+    }
+  }
+}
+
+static void activate_portals(engine_t *ctx) {
+  const uint32_t *due;
+  uint32_t num;
+
+  num = timers_due(ctx->timers, TIMER_PORTAL, ctx->turns, &due);
+  portals_activate(ctx->portals, due, num, ctx->turns, &ctx->rng);
+}
+
+static void record_keyframe(engine_t *ctx) {
+  engine_snapshot_t *keyframe;
+  const void *block;
+  size_t size;
+
+  keyframe = engine_snapshot(ctx, ctx->keyframe);
+  if (keyframe == NULL) {
+    common_log("No memory for the keyframe at turn %u\n", ctx->turns);
+    return;
+  }
+  ctx->keyframe = keyframe;
+  block = engine_snapshot_data(ctx->keyframe, &size);
+  recorder_keyframe(ctx->recorder, ctx->turns, ctx->tick, block, size);
+}
+
+/* Whether this step asked a player for something */
+static bool asked(engine_t *ctx) {
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    if (ctx->waiting[i].tick == ctx->tick) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The players step their engines up to here on the replies taken since the
+ * last one. With @param hashed, once a turn, they check that they end up
+ * where this one did. */
+static void send_lockstep(engine_t *ctx, bool hashed) {
+  uint8_t flags = (ctx->delta ? LOCKSTEP_DELTA : 0) |
+                  (ctx->pipelined ? LOCKSTEP_PIPELINED : 0);
+  uint64_t hash = 0;
+  message_t *msg;
+
+  if (hashed || ctx->lockstep_first) {
+    flags |= LOCKSTEP_HASHED;
+    hash = engine_state_hash(ctx);
+  }
+
+  if (ctx->lockstep_first) {
+    for (uint8_t i = 0; i < ctx->player_count; i++) {
+      msg = message_lockstep(ctx->tick, i, flags, hash, ctx->num_inputs,
+                             ctx->inputs, ctx->hashed_size, ctx->hashed);
+      player_server_send_msg(&ctx->players[i], msg);
+      message_unref(msg);
+    }
+    ctx->lockstep_first = false;
+  } else {
+    msg = message_lockstep(ctx->tick, 0, flags, hash, ctx->num_inputs,
+                           ctx->inputs, 0, NULL);
+    send_all(ctx, msg);
+    message_unref(msg);
+  }
+
+  ctx->num_inputs = 0;
+}
+
+/* One step of the state machine, false if it is still waiting on a player */
+static bool step(engine_t *ctx) {
+  state_t state = ctx->state;
+  uint8_t spawn_active = ctx->init_spawn_active;
+  uint32_t turns = ctx->turns;
   message_t *msg;
 
   ctx->tick++;
@@ -1126,6 +1754,10 @@ void engine_tick(engine_t *ctx) {
       send_all(ctx, msg);
       message_unref(msg);
       ctx->state = STATE_WAIT_MAP;
+      if (ctx->lockstep) {
+        ctx->lockstep_running = true;
+        ctx->lockstep_first = true;
+      }
     }
     break;
 
@@ -1144,13 +1776,14 @@ void engine_tick(engine_t *ctx) {
     if (players_ready(ctx)) {
       spawn_reply(ctx, ctx->init_spawn_active);
       clear_waiting(&ctx->waiting[ctx->init_spawn_active]);
-      printf("Got spawn reply from %d\n", ctx->init_spawn_active);
+      common_log("Got spawn reply from %d\n", ctx->init_spawn_active);
       ctx->init_spawn_active++;
       if (ctx->init_spawn_active < ctx->player_count) {
         ask_spawn(ctx, ctx->init_spawn_active);
       } else {
         update_players(ctx);
-        ctx->state = STATE_WAIT_PLAYER_UPDATE_ACK;
+        ctx->state =
+            ctx->pipelined ? STATE_ASK_MOVE : STATE_WAIT_PLAYER_UPDATE_ACK;
       }
     }
     break;
@@ -1164,10 +1797,10 @@ void engine_tick(engine_t *ctx) {
   case STATE_ASK_MOVE:
     for (uint8_t i = 0; i < ctx->player_count; i++) {
       if (ctx->players[i].health > 0) {
-        printf("asking move from %d", i);
+        common_log("asking move from %d", i);
         ask_move(ctx, i);
       } else {
-        printf("asking spawn from %d", i);
+        common_log("asking spawn from %d", i);
         ask_spawn(ctx, i);
       }
     }
@@ -1178,7 +1811,8 @@ void engine_tick(engine_t *ctx) {
     if (players_ready(ctx)) {
       resolve_moves(ctx);
       update_players(ctx);
-      ctx->state = STATE_WAIT_MOVE_PLAYER_UPDATE_ACK;
+      ctx->state =
+          ctx->pipelined ? STATE_ASK_FIGHT : STATE_WAIT_MOVE_PLAYER_UPDATE_ACK;
     }
     break;
 
@@ -1198,13 +1832,16 @@ void engine_tick(engine_t *ctx) {
     if (players_ready(ctx)) {
       resolve_fight(ctx);
       apply_poison_effects(ctx);
-      for (uint8_t i = 0; i < ctx->player_count; i++) {
-        player_time_effects(&ctx->players[i]);
-      }
+      time_effects(ctx);
       update_players(ctx);
       ctx->turns++;
-      portals_activate(ctx->portals, ctx->turns);
-      ctx->state = STATE_WAIT_FIGHT_PLAYER_UPDATE_ACK;
+      activate_portals(ctx);
+      ctx->state =
+          ctx->pipelined ? STATE_ASK_MOVE : STATE_WAIT_FIGHT_PLAYER_UPDATE_ACK;
+      if (ctx->recorder != NULL && ctx->keyframe_turns > 0 &&
+          ctx->turns % ctx->keyframe_turns == 0) {
+        record_keyframe(ctx);
+      }
     }
     break;
 
@@ -1215,6 +1852,115 @@ void engine_tick(engine_t *ctx) {
 
     break;
   }
+
+  /* The end of a turn goes out even if nothing is asked, with pipelined
+   * turns the last player update would not get to the players otherwise */
+  if (ctx->lockstep_running && (ctx->turns != turns || asked(ctx))) {
+    send_lockstep(ctx, ctx->turns != turns);
+  }
+
+  return ctx->state != state || ctx->init_spawn_active != spawn_active;
+}
+
+void engine_tick(engine_t *ctx) { step(ctx); }
+
+uint32_t engine_step_until_blocked(engine_t *ctx) {
+  uint32_t turns = ctx->turns;
+  uint32_t steps = 0;
+
+  while (ctx->turns == turns && step(ctx)) {
+    steps++;
+  }
+
+  return steps;
+}
+
+bool engine_run(engine_t *ctx, uint32_t turns) {
+  while (ctx->turns < turns) {
+    if (engine_step_until_blocked(ctx) == 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void engine_set_ready_func(engine_t *ctx, engine_ready_func_t ready,
+                           void *data) {
+  ctx->ready = ready;
+  ctx->ready_data = data;
+}
+
+void engine_set_delta_updates(engine_t *ctx, bool delta) {
+  ctx->delta = delta;
+}
+
+void engine_set_pipelined(engine_t *ctx, bool pipelined) {
+  ctx->pipelined = pipelined;
+}
+
+void engine_set_headless(engine_t *ctx, bool headless) {
+  /* The next tags go by the index again, which headless steps left as it
+   * was */
+  if (ctx->headless && !headless) {
+    view_sync(ctx);
+    visibility_build(ctx->visibility, ctx->players, ctx->player_count);
+  }
+  ctx->headless = headless;
+}
+
+void engine_set_lockstep(engine_t *ctx, bool lockstep) {
+  ctx->lockstep = lockstep;
+}
+
+bool engine_record(engine_t *ctx, const char *path, uint32_t keyframe_turns) {
+  uint8_t flags = ctx->pipelined ? RECORD_PIPELINED : 0;
+  message_t *msg;
+
+  if (ctx->recorder != NULL || ctx->tick != 0) {
+    return false;
+  }
+
+  ctx->recorder =
+      recorder_open(path, ctx->player_count, flags, keyframe_turns);
+  if (ctx->recorder == NULL) {
+    return false;
+  }
+  ctx->keyframe_turns = keyframe_turns;
+
+  msg = map_to_message(ctx->map, 0);
+  add_portals_to_map_msg(ctx, msg);
+  recorder_map(ctx->recorder, msg);
+  message_unref(msg);
+  record_keyframe(ctx);
+
+  return true;
+}
+
+bool engine_record_stop(engine_t *ctx) {
+  bool ok = recorder_close(ctx->recorder);
+
+  ctx->recorder = NULL;
+  engine_snapshot_free(ctx->keyframe);
+  ctx->keyframe = NULL;
+
+  return ok;
+}
+
+void engine_player_ready(engine_t *ctx, uint8_t id) {
+  if (id >= ctx->player_count || !poll_player(ctx, id, ctx->tick + 1)) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    if (ctx->waiting[i].tick != 0) {
+      return;
+    }
+  }
+
+  if (ctx->ready != NULL) {
+    ctx->ready(ctx->ready_data, ctx);
+  }
 }
 
 bool engine_add_player(engine_t *ctx, player_send_msg_func_t send,
@@ -1233,3 +1979,352 @@ bool engine_add_player(engine_t *ctx, player_send_msg_func_t send,
 
   return false;
 }
+
+void engine_free(engine_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  engine_record_stop(ctx);
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    clear_waiting(&ctx->waiting[i]);
+    message_unref(ctx->waiting[i].full);
+    map_bits_free(ctx->waiting[i].allowed);
+  }
+  free(ctx->waiting);
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    message_unref(ctx->acked[i]);
+  }
+  free(ctx->inputs);
+  free(ctx->hashed);
+  engine_snapshot_free(ctx->undo);
+  free(ctx->acked);
+  map_bits_free(ctx->scratch);
+  free(ctx->round.players);
+  free(ctx->round.portals);
+  free(ctx->round.effects);
+  player_destroy(ctx->players, ctx->player_count);
+  incident_ctx_free(ctx->incidents);
+  portals_free(ctx->portals);
+  occupancy_free(ctx->occupancy);
+  visibility_free(ctx->visibility);
+  free(ctx->sight);
+  free(ctx->seen_from);
+  free(ctx->tag_from);
+  free(ctx->tag_pos);
+  timers_free(ctx->timers);
+  free(ctx);
+}
+
+uint32_t engine_turns(engine_t *ctx) { return ctx->turns; }
+
+uint32_t engine_ticks(engine_t *ctx) { return ctx->tick; }
+
+const player_t *engine_player(engine_t *ctx, uint8_t id) {
+  if (id >= ctx->player_count) {
+    return NULL;
+  }
+  view_sync(ctx);
+  return &ctx->players[id];
+}
+
+uint32_t engine_next_event_turn(engine_t *ctx) {
+  return timers_next(ctx->timers);
+}
+
+const char *engine_state_name(engine_t *ctx) {
+  switch (ctx->state) {
+  case STATE_STARTING:
+    return "starting";
+  case STATE_WAIT_READY:
+    return "wait ready";
+  case STATE_WAIT_MAP:
+    return "wait map";
+  case STATE_WAIT_INIT_SPAWN:
+    return "wait init spawn";
+  case STATE_WAIT_PLAYER_UPDATE_ACK:
+    return "wait update ack";
+  case STATE_ASK_MOVE:
+    return "ask move";
+  case STATE_WAIT_MOVE:
+    return "wait move";
+  case STATE_WAIT_MOVE_PLAYER_UPDATE_ACK:
+    return "wait move update ack";
+  case STATE_ASK_FIGHT:
+    return "ask fight";
+  case STATE_WAIT_FIGHT:
+    return "wait fight";
+  case STATE_WAIT_FIGHT_PLAYER_UPDATE_ACK:
+    return "wait fight update ack";
+  }
+  return "unknown";
+}
+
+/* Everything before the parts only checks that the snapshot fits */
+static size_t save(engine_t *ctx, uint8_t *buf) {
+  uint32_t version = SNAPSHOT_VERSION;
+  coord_t width = map_width(ctx->map);
+  coord_t height = map_height(ctx->map);
+  uint8_t num_portals = portals_num(ctx->portals);
+  size_t at = 0;
+
+  at = common_put(buf, at, &version, sizeof(version));
+  at = common_put(buf, at, &ctx->player_count, sizeof(ctx->player_count));
+  at = common_put(buf, at, &width, sizeof(width));
+  at = common_put(buf, at, &height, sizeof(height));
+  at = common_put(buf, at, &num_portals, sizeof(num_portals));
+
+  at = common_put(buf, at, &ctx->state, sizeof(ctx->state));
+  at = common_put(buf, at, &ctx->init_spawn_active,
+                  sizeof(ctx->init_spawn_active));
+  at = common_put(buf, at, &ctx->tick, sizeof(ctx->tick));
+  at = common_put(buf, at, &ctx->turns, sizeof(ctx->turns));
+  at = common_put(buf, at, &ctx->rng, sizeof(ctx->rng));
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    struct waiting *w = &ctx->waiting[i];
+
+    at = common_put(buf, at, &w->type, sizeof(w->type));
+    at = common_put(buf, at, &w->tick, sizeof(w->tick));
+    at = common_put(buf, at, &w->fallback, sizeof(w->fallback));
+    at = map_bits_save(w->allowed, buf, at);
+    at = common_put(buf, at, &ctx->sight[i].from, sizeof(ctx->sight[i].from));
+    at = common_put(buf, at, &ctx->sight[i].facing,
+                    sizeof(ctx->sight[i].facing));
+  }
+
+  at = player_save(ctx->players, ctx->player_count, buf, at);
+  at = portals_save(ctx->portals, buf, at);
+  at = timers_save(ctx->timers, buf, at);
+  return map_save(ctx->map, buf, at);
+}
+
+/* 64 bit FNV-1a, a word at a time */
+static uint64_t hash_block(const uint8_t *data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t at = 0;
+
+  for (; at + sizeof(uint64_t) <= size; at += sizeof(uint64_t)) {
+    uint64_t word;
+
+    common_get(data, at, &word, sizeof(word));
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; at < size; at++) {
+    hash = (hash ^ data[at]) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+uint64_t engine_state_hash(engine_t *ctx) {
+  size_t size;
+
+  view_sync(ctx);
+  size = save(ctx, NULL);
+
+  if (size > ctx->hashed_capacity) {
+    uint8_t *hashed = realloc(ctx->hashed, size);
+
+    if (hashed == NULL) {
+      common_log("No memory to hash the state at tick %u\n", ctx->tick);
+      ctx->hashed_size = 0;
+      return 0;
+    }
+    ctx->hashed = hashed;
+    ctx->hashed_capacity = size;
+  }
+  ctx->hashed_size = save(ctx, ctx->hashed);
+
+  return hash_block(ctx->hashed, ctx->hashed_size);
+}
+
+static void drop_msgs(engine_snapshot_t *snap) {
+  for (uint32_t i = 0;
+       snap->msgs != NULL && i < snap->player_count * SNAPSHOT_MSGS; i++) {
+    message_unref(snap->msgs[i]);
+    snap->msgs[i] = NULL;
+  }
+}
+
+static void hold_msgs(engine_snapshot_t *snap, engine_t *ctx) {
+  drop_msgs(snap);
+  if (snap->msgs == NULL || snap->player_count != ctx->player_count) {
+    free(snap->msgs);
+    snap->msgs =
+        calloc(ctx->player_count * SNAPSHOT_MSGS, sizeof(*snap->msgs));
+  }
+  snap->player_count = ctx->player_count;
+
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    message_t **m = &snap->msgs[i * SNAPSHOT_MSGS];
+
+    m[0] = message_ref(ctx->waiting[i].sent);
+    m[1] = message_ref(ctx->waiting[i].incoming);
+    m[2] = message_ref(ctx->waiting[i].full);
+    m[3] = message_ref(ctx->acked[i]);
+  }
+}
+
+engine_snapshot_t *engine_snapshot(engine_t *ctx, engine_snapshot_t *reuse) {
+  engine_snapshot_t *snap = reuse;
+  size_t size;
+
+  view_sync(ctx);
+  size = save(ctx, NULL);
+
+  if (snap == NULL) {
+    snap = calloc(1, sizeof(*snap));
+    if (snap == NULL) {
+      return NULL;
+    }
+  }
+  if (size > snap->capacity) {
+    uint8_t *data = realloc(snap->data, size);
+
+    if (data == NULL) {
+      if (reuse == NULL) {
+        engine_snapshot_free(snap);
+      }
+      return NULL;
+    }
+    snap->data = data;
+    snap->capacity = size;
+  }
+  snap->size = save(ctx, snap->data);
+  hold_msgs(snap, ctx);
+
+  return snap;
+}
+
+/* Reads @param snap into @param ctx, false if it does not fit or is broken,
+ * in which case the engine is left half way */
+static bool load(engine_t *ctx, engine_snapshot_t *snap) {
+  struct common_reader r = {snap->data, snap->size, 0, false};
+  uint32_t version = 0;
+  uint8_t player_count = 0;
+  coord_t width = 0;
+  coord_t height = 0;
+  uint8_t num_portals = 0;
+
+  common_read(&r, &version, sizeof(version));
+  common_read(&r, &player_count, sizeof(player_count));
+  common_read(&r, &width, sizeof(width));
+  common_read(&r, &height, sizeof(height));
+  common_read(&r, &num_portals, sizeof(num_portals));
+  if (r.broken || version != SNAPSHOT_VERSION ||
+      player_count != ctx->player_count || width != map_width(ctx->map) ||
+      height != map_height(ctx->map) ||
+      num_portals != portals_num(ctx->portals)) {
+    return false;
+  }
+
+  common_read(&r, &ctx->state, sizeof(ctx->state));
+  common_read(&r, &ctx->init_spawn_active, sizeof(ctx->init_spawn_active));
+  common_read(&r, &ctx->tick, sizeof(ctx->tick));
+  common_read(&r, &ctx->turns, sizeof(ctx->turns));
+  common_read(&r, &ctx->rng, sizeof(ctx->rng));
+  if (ctx->state > STATE_WAIT_FIGHT_PLAYER_UPDATE_ACK ||
+      ctx->init_spawn_active > ctx->player_count ||
+      (ctx->state == STATE_WAIT_INIT_SPAWN &&
+       ctx->init_spawn_active == ctx->player_count)) {
+    r.broken = true;
+  }
+  for (uint8_t i = 0; i < ctx->player_count && !r.broken; i++) {
+    struct waiting *w = &ctx->waiting[i];
+    message_t **m = snap->msgs != NULL ? &snap->msgs[i * SNAPSHOT_MSGS] : NULL;
+
+    clear_waiting(w);
+    message_unref(w->full);
+    message_unref(ctx->acked[i]);
+    w->sent = m != NULL ? message_ref(m[0]) : NULL;
+    w->incoming = m != NULL ? message_ref(m[1]) : NULL;
+    w->full = m != NULL ? message_ref(m[2]) : NULL;
+    ctx->acked[i] = m != NULL ? message_ref(m[3]) : NULL;
+
+    common_read(&r, &w->type, sizeof(w->type));
+    common_read(&r, &w->tick, sizeof(w->tick));
+    common_read(&r, &w->fallback, sizeof(w->fallback));
+    map_bits_restore(&w->allowed, &r);
+    /* The asks fill it in place */
+    if (w->allowed == NULL || w->allowed->width != width ||
+        w->allowed->height != height) {
+      r.broken = true;
+    }
+    common_read(&r, &ctx->sight[i].from, sizeof(ctx->sight[i].from));
+    common_read(&r, &ctx->sight[i].facing, sizeof(ctx->sight[i].facing));
+    ctx->sight[i].due = false;
+    if (ctx->sight[i].facing > DIRECTION_ANY) {
+      r.broken = true;
+    }
+  }
+
+  player_restore(ctx->players, ctx->player_count, &r);
+  portals_restore(ctx->portals, &r);
+  timers_restore(ctx->timers, &r);
+  map_restore(ctx->map, &r);
+
+  return !r.broken && r.pos == r.size;
+}
+
+bool engine_restore(engine_t *ctx, engine_snapshot_t *snap) {
+  if (snap == NULL) {
+    return false;
+  }
+
+  /* Only blocks from engine_snapshot_data() can be broken, the engine is
+   * saved before reading one so nothing changes if it is */
+  if (snap->msgs == NULL) {
+    engine_snapshot_t *undo = engine_snapshot(ctx, ctx->undo);
+
+    if (undo == NULL) {
+      return false;
+    }
+    ctx->undo = undo;
+  }
+  if (!load(ctx, snap)) {
+    if (snap->msgs == NULL) {
+      load(ctx, ctx->undo);
+    }
+    return false;
+  }
+
+  /* The indexes follow from the players */
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    occupancy_move_player(ctx->occupancy, i, ctx->players[i].position);
+  }
+  visibility_build(ctx->visibility, ctx->players, ctx->player_count);
+  memcpy(ctx->seen_from, ctx->sight,
+         ctx->player_count * sizeof(*ctx->seen_from));
+  ctx->tags_due = 0;
+  incident_ctx_clear(ctx->incidents);
+
+  return true;
+}
+
+void engine_snapshot_free(engine_snapshot_t *snap) {
+  if (snap == NULL) {
+    return;
+  }
+
+  drop_msgs(snap);
+  free(snap->msgs);
+  free(snap->data);
+  free(snap);
+}
+
+const void *engine_snapshot_data(engine_snapshot_t *snap, size_t *size) {
+  *size = snap->size;
+  return snap->data;
+}
+
+engine_snapshot_t *engine_snapshot_from_data(const void *data, size_t size) {
+  engine_snapshot_t *snap;
+
+  snap = calloc(1, sizeof(*snap));
+  snap->data = malloc(size > 0 ? size : 1);
+  memcpy(snap->data, data, size);
+  snap->size = size;
+  snap->capacity = size;
+
+  return snap;
+}
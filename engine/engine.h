@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "map.h"
@@ -8,11 +9,102 @@
 #include "portals.h"
 
 typedef struct engine_ctx engine_t;
+/* The state of a match at one point, see engine_snapshot() */
+typedef struct engine_snapshot engine_snapshot_t;
 
+/* Called once every reply the engine waits for is in */
+typedef void (*engine_ready_func_t)(void *data, engine_t *engine);
+
+/* Everything random in the match is drawn from @param seed. NULL if there
+ * are more than PLAYER_MAX players. */
 engine_t *engine_new(uint8_t num_players, map_t *map, portals_ctx_t *portals,
-                     bool timer);
+                     bool timer, uint32_t seed);
+/* Frees the players and portals, the map belongs to the caller */
+void engine_free(engine_t *ctx);
 
 bool engine_add_player(engine_t *ctx, player_send_msg_func_t send,
                        void *send_ctx, player_get_msg_func_t get,
                        void *get_ctx);
+/* Advances one step, which may just be checking for replies */
 void engine_tick(engine_t *ctx);
+/* Advances until a reply is missing or a turn is over, returns the number of
+ * steps taken. 0 means nothing could be done. */
+uint32_t engine_step_until_blocked(engine_t *ctx);
+/* Steps until @param turns turns are played, false if it got stuck waiting on
+ * a player before that. Meant for players that answer straight away. */
+bool engine_run(engine_t *ctx, uint32_t turns);
+
+/* Instead of polling, a host can call engine_player_ready() when player
+ * @param id has sent a reply and step the engine once @param ready fires */
+void engine_set_ready_func(engine_t *ctx, engine_ready_func_t ready,
+                           void *data);
+void engine_player_ready(engine_t *ctx, uint8_t id);
+
+/* Player updates only carry what changed since the last one the player
+ * acked, see player_batch_update() and player_los_update() for applying them.
+ * The first update a player gets is always complete. */
+void engine_set_delta_updates(engine_t *ctx, bool delta);
+/* The ask for the next phase goes out right behind each player update,
+ * without waiting for the update to be acked. The reply to the ask acks the
+ * update too, acks that come anyway are dropped. */
+void engine_set_pipelined(engine_t *ctx, bool pipelined);
+/* Player updates and the asks for moves and fights are neither built nor
+ * sent, the engine still waits for the replies. For replays, which only need
+ * the match itself. */
+void engine_set_headless(engine_t *ctx, bool headless);
+/* After the map the players get nothing but a MESSAGE_LOCKSTEP for every
+ * step that asks them something or ends a turn, holding the replies taken
+ * since the last one, and once a turn engine_state_hash() after the step.
+ * The first one carries the state to start from. Each player runs its own
+ * engine on them, see lockstep.h, which costs a few bytes per player and
+ * step instead of player updates, but hides nothing from a player that looks
+ * at its engine. Has to be set before the first step, all players have to go
+ * through lockstep.h. */
+void engine_set_lockstep(engine_t *ctx, bool lockstep);
+
+/* Logs the match to @param path as described in record.h, with a keyframe
+ * at the start and every @param keyframe_turns turns, none but the first if
+ * that is 0. Has to be called before the first step and after the other
+ * settings. False if the file can not be created. */
+bool engine_record(engine_t *ctx, const char *path, uint32_t keyframe_turns);
+/* Ends the recording, false if not all of it made it to the file.
+ * engine_free() ends it too, but can not tell. */
+bool engine_record_stop(engine_t *ctx);
+
+uint32_t engine_turns(engine_t *ctx);
+/* Steps taken so far, which is the tick messages are sent with */
+uint32_t engine_ticks(engine_t *ctx);
+/* NULL if there is no player @param id */
+const player_t *engine_player(engine_t *ctx, uint8_t id);
+/* Earliest turn a portal comes back or an effect runs out, UINT32_MAX if
+ * nothing is pending. Until then the match only changes by what the players
+ * do, which lets a headless simulation of idle players skip ahead. */
+uint32_t engine_next_event_turn(engine_t *ctx);
+/* The step the next engine_tick() takes, for profiling */
+const char *engine_state_name(engine_t *ctx);
+/* Hash of what engine_snapshot() would save, equal for engines that went
+ * the same way. 0 if there is no memory for it. */
+uint64_t engine_state_hash(engine_t *ctx);
+
+/* Captures the match between two steps: players, effects, portals, timers,
+ * the player cells of the map, the rngs and what the engine waits for, in one
+ * block without pointers. The walls, spells and line of sight table are
+ * shared, and messages in flight are held by reference as they never change.
+ * Players and the ready func are not part of it. @param reuse, if not NULL,
+ * is overwritten instead of allocating a new snapshot. NULL if there is no
+ * memory, @param reuse is then left as it was. */
+engine_snapshot_t *engine_snapshot(engine_t *ctx, engine_snapshot_t *reuse);
+/* Puts @param ctx back to @param snap, taken of this engine or of one made
+ * with the same map, players and portals. False, with the engine untouched,
+ * if it does not fit. Incidents waiting for the next player update are
+ * dropped, which only matters during the first spawns. */
+bool engine_restore(engine_t *ctx, engine_snapshot_t *snap);
+void engine_snapshot_free(engine_snapshot_t *snap);
+/* The block, to write it out. It does not carry the messages in flight, a
+ * snapshot read back with engine_snapshot_from_data() restores without any,
+ * so the next player updates are complete. */
+const void *engine_snapshot_data(engine_snapshot_t *snap, size_t *size);
+/* @param data should be a block from engine_snapshot_data(). One that is cut
+ * short or made up is refused by engine_restore(), which then leaves the
+ * engine as it was. */
+engine_snapshot_t *engine_snapshot_from_data(const void *data, size_t size);
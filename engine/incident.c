@@ -9,30 +9,44 @@
 #include "message.h"
 #include "player.h"
 #include "spell.h"
+#include "visibility.h"
 
+/* Three flat logs, clearing just forgets what is in them */
 struct incident_ctx {
   uint32_t size;
   uint32_t capacity;
   incident_t *data;
-};
 
-static void free_effect(incident_effect_t *eff) {
-  if (eff == NULL) {
-    return;
-  }
+  uint32_t num_targets;
+  uint32_t targets_capacity;
+  incident_target_t *targets;
 
-  free_effect(eff->next);
-  free(eff);
-}
+  uint32_t num_effects;
+  uint32_t effects_capacity;
+  incident_effect_t *effects;
 
-static void free_target(incident_target_t *t) {
-  if (t == NULL) {
-    return;
+  /* Handed out when a log can not grow, never part of it */
+  incident_t spare;
+  incident_target_t spare_target;
+  incident_effect_t spare_effect;
+};
+
+/* Makes room for one more of @param each sized items. NULL, with @param data
+ * and @param capacity as they were, if there is no memory for it. */
+static void *grow(void *data, uint32_t size, uint32_t *capacity, size_t each) {
+  uint32_t grown;
+  void *to;
+
+  if (size < *capacity) {
+    return data;
   }
 
-  free_effect(t->effects);
-  free_target(t->next);
-  free(t);
+  grown = *capacity > 0 ? *capacity * 2 : 16;
+  to = realloc(data, each * grown);
+  if (to != NULL) {
+    *capacity = grown;
+  }
+  return to;
 }
 
 incident_ctx_t *incident_ctx_new(uint32_t capacity) {
@@ -43,22 +57,38 @@ incident_ctx_t *incident_ctx_new(uint32_t capacity) {
   ctx->capacity = capacity;
   ctx->data = calloc(capacity, sizeof(*ctx->data));
 
+  ctx->num_targets = 0;
+  ctx->targets_capacity = 0;
+  ctx->targets = NULL;
+
+  ctx->num_effects = 0;
+  ctx->effects_capacity = 0;
+  ctx->effects = NULL;
+
   return ctx;
 }
 
-void incident_ctx_clear(incident_ctx_t *ctx) {
-
-  for (uint32_t i = 0; i < ctx->size; i++) {
-    free_target(ctx->data[i].targets);
-    ctx->data[i].targets = NULL;
-    ctx->data[i].num_targets = 0;
+void incident_ctx_free(incident_ctx_t *ctx) {
+  if (ctx == NULL) {
+    return;
   }
 
+  free(ctx->data);
+  free(ctx->targets);
+  free(ctx->effects);
+  free(ctx);
+}
+
+void incident_ctx_clear(incident_ctx_t *ctx) {
   ctx->size = 0;
+  ctx->num_targets = 0;
+  ctx->num_effects = 0;
 }
 
-static bool add_target_to_msg(struct target *dst, incident_target_t *from,
-                              bool caster_seen, player_t *observer) {
+static bool add_target_to_msg(incident_ctx_t *ctx, message_t *msg,
+                              struct target *dst, incident_target_t *from,
+                              bool caster_seen, visibility_t *vis,
+                              uint64_t observer) {
   bool ret = false;
   if (caster_seen) {
     ret = true;
@@ -67,18 +97,21 @@ static bool add_target_to_msg(struct target *dst, incident_target_t *from,
 
   dst->num_effects = 0;
 
-  if (observer->health <= 0 || map_opts_contains(observer->los, from->pos)) {
+  if (visibility_seen_by(vis, from->pos) & observer) {
     uint8_t *c = NULL;
 
     dst->target = from->pos;
-    dst->effects = calloc(from->num_effects, sizeof(*dst->effects));
+    dst->effects =
+        message_alloc(msg, from->num_effects, sizeof(*dst->effects));
     dst->num_effects = 0;
 
     c = &dst->num_effects;
 
-    for (incident_effect_t *eff = from->effects; eff != NULL; eff = eff->next) {
+    for (uint32_t e = from->effects; e != INCIDENT_END;
+         e = ctx->effects[e].next) {
+      incident_effect_t *eff = &ctx->effects[e];
 
-      if (observer->health <= 0 || map_opts_contains(observer->los, eff->at)) {
+      if (visibility_seen_by(vis, eff->at) & observer) {
         dst->effects[*c].type = eff->type;
         dst->effects[*c].data = eff->data;
         dst->effects[*c].at = eff->at;
@@ -91,12 +124,32 @@ static bool add_target_to_msg(struct target *dst, incident_target_t *from,
   return ret;
 }
 
-void incident_add_to_message(incident_ctx_t *ctx, player_t *player,
-                             message_t *msg) {
+size_t incident_message_size(incident_ctx_t *ctx) {
+  size_t size = message_arena_size(ctx->size, sizeof(struct incident));
+
+  for (uint32_t i = 0; i < ctx->size; i++) {
+    incident_t *inc = &ctx->data[i];
+
+    size += message_arena_size(inc->num_targets, sizeof(struct target));
+    for (uint32_t t = inc->targets; t != INCIDENT_END;
+         t = ctx->targets[t].next) {
+      size += message_arena_size(ctx->targets[t].num_effects,
+                                 sizeof(struct applied_effect));
+    }
+  }
+
+  return size;
+}
+
+void incident_add_to_message(incident_ctx_t *ctx, visibility_t *vis,
+                             player_t *player, message_t *msg) {
+  uint64_t observer = (uint64_t)1 << player->id;
+
   msg->body.player_update.events =
-      malloc(ctx->size * sizeof(*msg->body.player_update.events));
+      message_alloc(msg, ctx->size, sizeof(*msg->body.player_update.events));
   msg->body.player_update.num_events = ctx->size;
-  printf("Adding %u events to message for player %u\n", ctx->size, player->id);
+  common_log("Adding %u events to message for player %u\n", ctx->size,
+             player->id);
   uint8_t *counter = NULL;
 
   for (uint32_t i = 0; i < ctx->size; i++) {
@@ -112,8 +165,8 @@ void incident_add_to_message(incident_ctx_t *ctx, player_t *player,
       msg->body.player_update.events[i].spell_kind = inc->spell->kind;
     }
 
-    if ((inc->player_origin != NULL && inc->player_origin->id == player->id) || player->health <= 0 ||
-        map_opts_contains(player->los, inc->from)) {
+    if ((inc->player_origin != NULL && inc->player_origin->id == player->id) ||
+        visibility_seen_by(vis, inc->from) & observer) {
 
       if (inc->player_origin != NULL) {
         msg->body.player_update.events[i].player_origin =
@@ -125,16 +178,18 @@ void incident_add_to_message(incident_ctx_t *ctx, player_t *player,
       add_effects = true;
     }
 
-    msg->body.player_update.events[i].targets = calloc(
-        inc->num_targets, sizeof(*msg->body.player_update.events[i].targets));
+    msg->body.player_update.events[i].targets =
+        message_alloc(msg, inc->num_targets,
+                      sizeof(*msg->body.player_update.events[i].targets));
     msg->body.player_update.events[i].num_targets = 0;
     counter = &msg->body.player_update.events[i].num_targets;
 
-    for (incident_target_t *t = inc->targets; t != NULL; t = t->next) {
-      printf("Processing effect\n");
+    for (uint32_t t = inc->targets; t != INCIDENT_END;
+         t = ctx->targets[t].next) {
+      common_log("Processing effect\n");
       if (add_target_to_msg(
-              &msg->body.player_update.events[i].targets[*counter], t,
-              add_effects, player)) {
+              ctx, msg, &msg->body.player_update.events[i].targets[*counter],
+              &ctx->targets[t], add_effects, vis, observer)) {
         *counter += 1;
       }
 
@@ -144,67 +199,101 @@ void incident_add_to_message(incident_ctx_t *ctx, player_t *player,
 }
 
 incident_t *incident_new(incident_ctx_t *ctx) {
+  incident_t *data;
   incident_t *inc;
-  if (ctx->size == ctx->capacity) {
-    ctx->capacity = ctx->capacity * 2;
-    // TODO: Fix NULL return
-    ctx->data = realloc(ctx->data, sizeof(*ctx->data) * ctx->capacity);
 
-    for (uint32_t i = ctx->size; i < ctx->capacity; i++) {
-      ctx->data[i].targets = NULL;
-    }
+  data = grow(ctx->data, ctx->size, &ctx->capacity, sizeof(*ctx->data));
+  if (data == NULL) {
+    common_log("No memory for another incident\n");
+    inc = &ctx->spare;
+  } else {
+    ctx->data = data;
+    inc = &ctx->data[ctx->size++];
   }
 
-  inc = &ctx->data[ctx->size];
-
   inc->from = POSITION_UNKNOWN;
   inc->player_origin = NULL;
   inc->spell = NULL;
   inc->num_targets = 0;
-  inc->targets = NULL;
+  inc->targets = INCIDENT_END;
+  inc->last_target = INCIDENT_END;
 
-  ctx->size++;
   return inc;
 }
 
-incident_target_t *incident_new_target(incident_t *ctx, pos_t at) {
+incident_target_t *incident_new_target(incident_ctx_t *ctx,
+                                       incident_t *incident, pos_t at) {
+  incident_target_t *targets = NULL;
   incident_target_t *t;
-  incident_target_t *old;
+  uint32_t id = ctx->num_targets;
 
-  t = calloc(1, sizeof(*t));
+  /* What goes into the spare is dropped along with it */
+  if (incident != &ctx->spare) {
+    targets = grow(ctx->targets, id, &ctx->targets_capacity,
+                   sizeof(*ctx->targets));
+  }
+  t = targets != NULL ? &targets[id] : &ctx->spare_target;
 
   t->pos = at;
+  t->effects = INCIDENT_END;
+  t->last_effect = INCIDENT_END;
+  t->num_effects = 0;
+  t->next = INCIDENT_END;
+
+  if (targets == NULL) {
+    if (incident != &ctx->spare) {
+      common_log("No memory for another incident target\n");
+    }
+    return t;
+  }
+  ctx->targets = targets;
+  ctx->num_targets++;
 
-  if (ctx->targets == NULL) {
-    ctx->targets = t;
+  if (incident->targets == INCIDENT_END) {
+    incident->targets = id;
   } else {
-    for (old = ctx->targets; old->next != NULL; old = old->next)
-      ;
-    old->next = t;
+    ctx->targets[incident->last_target].next = id;
   }
-
-  ctx->num_targets++;
+  incident->last_target = id;
+  incident->num_targets++;
 
   return t;
 }
 
-incident_effect_t *incident_new_effect(incident_target_t *ctx) {
+incident_effect_t *incident_new_effect(incident_ctx_t *ctx,
+                                       incident_target_t *target) {
+  incident_effect_t *effects = NULL;
   incident_effect_t *eff;
-  incident_effect_t *old;
-
-  eff = calloc(1, sizeof(*eff));
-  if (ctx->effects == NULL) {
-    ctx->effects = eff;
-  } else {
-    for (old = ctx->effects; old->next != NULL; old = old->next)
-      ;
+  uint32_t id = ctx->num_effects;
 
-    old->next = eff;
+  if (target != &ctx->spare_target) {
+    effects = grow(ctx->effects, id, &ctx->effects_capacity,
+                   sizeof(*ctx->effects));
   }
+  eff = effects != NULL ? &effects[id] : &ctx->spare_effect;
+  memset(eff, 0, sizeof(*eff));
+  eff->next = INCIDENT_END;
 
+  if (effects == NULL) {
+    if (target != &ctx->spare_target) {
+      common_log("No memory for another incident effect\n");
+    }
+    return eff;
+  }
+  ctx->effects = effects;
   ctx->num_effects++;
+
+  if (target->effects == INCIDENT_END) {
+    target->effects = id;
+  } else {
+    ctx->effects[target->last_effect].next = id;
+  }
+  target->last_effect = id;
+  target->num_effects++;
+
   return eff;
 }
+
 const char *incident_type_string(enum incident_type t) {
   switch (t) {
   case INCIDENT_SPELL:
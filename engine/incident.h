@@ -1,11 +1,13 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "common.h"
 #include "message.h"
 #include "player.h"
 #include "spell.h"
+#include "visibility.h"
 
 typedef struct incident_ctx incident_ctx_t;
 
@@ -17,19 +19,24 @@ enum incident_type {
   INCIDENT_PLAYER_MOVE
 };
 
+/* Targets and effects live in flat arrays in the incident_ctx and are
+ * chained by index, INCIDENT_END ends a chain */
+#define INCIDENT_END UINT32_MAX
+
 typedef struct incident_effect {
   player_t *victim;
   pos_t at;
   uint8_t type; /*spell effect enum */
   spell_effect_value_t data;
-  struct incident_effect *next;
+  uint32_t next;
 } incident_effect_t;
 
 typedef struct incident_target {
   pos_t pos;
-  incident_effect_t *effects;
+  uint32_t effects;
+  uint32_t last_effect;
   uint8_t num_effects;
-  struct incident_target *next;
+  uint32_t next;
 } incident_target_t;
 
 typedef struct {
@@ -37,20 +44,32 @@ typedef struct {
   pos_t from;
   const spell_t *spell;
 
-  incident_target_t *targets;
+  uint32_t targets;
+  uint32_t last_target;
   uint8_t num_targets;
   player_t *player_origin;
 } incident_t;
 
 incident_ctx_t *incident_ctx_new(uint32_t capacity);
+void incident_ctx_free(incident_ctx_t *ctx);
 
 void incident_ctx_clear(incident_ctx_t *ctx);
 
+/* Appending is O(1). A pointer returned stays valid until the next one of the
+ * same kind is added or the log is cleared, which keeps all the memory. If
+ * there is no memory for another one a spare outside the log is returned, so
+ * it can always be filled in. */
 incident_t *incident_new(incident_ctx_t *ctx);
-incident_target_t *incident_new_target(incident_t *incident, pos_t at);
-incident_effect_t *incident_new_effect(incident_target_t *target);
+incident_target_t *incident_new_target(incident_ctx_t *ctx,
+                                       incident_t *incident, pos_t at);
+incident_effect_t *incident_new_effect(incident_ctx_t *ctx,
+                                       incident_target_t *target);
 
-void incident_add_to_message(incident_ctx_t *ctx, player_t *player,
-                             message_t *msg);
+/* Upper bound of the message arena incident_add_to_message() uses */
+size_t incident_message_size(incident_ctx_t *ctx);
+/* Adds the incidents @param player gets to know about, @param vis has to be
+ * built for the current line of sight */
+void incident_add_to_message(incident_ctx_t *ctx, visibility_t *vis,
+                             player_t *player, message_t *msg);
 
 const char *incident_type_string(enum incident_type t);
@@ -0,0 +1,234 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "engine.h"
+#include "lockstep.h"
+#include "map.h"
+#include "message.h"
+#include "portals.h"
+#include "spell.h"
+
+/* The replies of one player not taken by the engine yet */
+struct seat {
+  lockstep_t *ctx;
+  uint8_t id;
+  struct msg_input *inputs;
+  uint32_t head;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+struct lockstep_ctx {
+  player_send_msg_func_t send;
+  void *send_data;
+
+  map_t *map;
+  engine_t *engine;
+  struct seat *seats;
+  uint8_t num_seats;
+  /* The player this is for, known from the first lockstep message */
+  uint8_t me;
+  bool started;
+
+  uint32_t desyncs;
+};
+
+/* False if there is no room for @param input */
+static bool seat_push(struct seat *seat, const struct msg_input *input) {
+  if (seat->head > 0 && seat->head == seat->size) {
+    seat->head = 0;
+    seat->size = 0;
+  }
+  if (seat->size == seat->capacity) {
+    uint32_t capacity = seat->capacity > 0 ? seat->capacity * 2 : 16;
+    struct msg_input *inputs =
+        realloc(seat->inputs, sizeof(*seat->inputs) * capacity);
+
+    if (inputs == NULL) {
+      return false;
+    }
+    seat->inputs = inputs;
+    seat->capacity = capacity;
+  }
+  seat->inputs[seat->size++] = *input;
+
+  return true;
+}
+
+/* Only what the engine sends the player this is for gets through */
+static void seat_send(void *data, message_t *msg) {
+  struct seat *seat = data;
+  lockstep_t *ctx = seat->ctx;
+
+  if (ctx->started && seat->id == ctx->me) {
+    ctx->send(ctx->send_data, msg);
+  }
+}
+
+/* A reply comes out on the step the server took it on, as in replay.c */
+static message_t *seat_get(void *data) {
+  struct seat *seat = data;
+  struct msg_input *input;
+
+  if (seat->head == seat->size) {
+    return NULL;
+  }
+
+  input = &seat->inputs[seat->head];
+  if (input->tick > engine_ticks(seat->ctx->engine)) {
+    return NULL;
+  }
+  seat->head++;
+
+  return message_from_input(input);
+}
+
+lockstep_t *lockstep_new(player_send_msg_func_t send, void *send_data) {
+  lockstep_t *ctx;
+
+  ctx = calloc(1, sizeof(*ctx));
+  ctx->send = send;
+  ctx->send_data = send_data;
+
+  return ctx;
+}
+
+static void drop_engine(lockstep_t *ctx) {
+  engine_free(ctx->engine);
+  map_free(ctx->map);
+  for (uint8_t i = 0; i < ctx->num_seats; i++) {
+    free(ctx->seats[i].inputs);
+  }
+  free(ctx->seats);
+
+  ctx->engine = NULL;
+  ctx->map = NULL;
+  ctx->seats = NULL;
+  ctx->num_seats = 0;
+  ctx->started = false;
+}
+
+void lockstep_free(lockstep_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  drop_engine(ctx);
+  free(ctx);
+}
+
+uint32_t lockstep_desyncs(lockstep_t *ctx) { return ctx->desyncs; }
+
+static void build_engine(lockstep_t *ctx, message_t *msg) {
+  portals_ctx_t *portals;
+
+  drop_engine(ctx);
+
+  ctx->map = map_new_from_message(msg);
+  map_precompute_los(ctx->map, 1, MAP_LOS_TABLE_MAX);
+  portals = portals_new_from_message(msg);
+  ctx->engine =
+      engine_new(msg->body.map.num_players, ctx->map, portals, false, 0);
+  if (ctx->engine == NULL) {
+    portals_free(portals);
+    map_free(ctx->map);
+    ctx->map = NULL;
+    return;
+  }
+
+  ctx->num_seats = msg->body.map.num_players;
+  ctx->seats = calloc(ctx->num_seats, sizeof(*ctx->seats));
+  for (uint8_t i = 0; i < ctx->num_seats; i++) {
+    ctx->seats[i].ctx = ctx;
+    ctx->seats[i].id = i;
+    engine_add_player(ctx->engine, seat_send, &ctx->seats[i], seat_get,
+                      &ctx->seats[i]);
+  }
+}
+
+static bool start(lockstep_t *ctx, message_t *msg) {
+  engine_snapshot_t *snap;
+  bool ok;
+
+  if (msg->body.lockstep.player_id >= ctx->num_seats) {
+    return false;
+  }
+
+  engine_set_delta_updates(ctx->engine,
+                           msg->body.lockstep.flags & LOCKSTEP_DELTA);
+  engine_set_pipelined(ctx->engine,
+                       msg->body.lockstep.flags & LOCKSTEP_PIPELINED);
+
+  snap = engine_snapshot_from_data(msg->body.lockstep.state,
+                                   msg->body.lockstep.state_size);
+  ok = engine_restore(ctx->engine, snap);
+  engine_snapshot_free(snap);
+  if (!ok) {
+    return false;
+  }
+
+  ctx->me = msg->body.lockstep.player_id;
+  ctx->started = true;
+
+  return true;
+}
+
+static void follow(lockstep_t *ctx, message_t *msg) {
+  if (ctx->engine == NULL) {
+    return;
+  }
+  if (!ctx->started && !start(ctx, msg)) {
+    common_log("Can not start the lockstep match\n");
+    return;
+  }
+
+  for (uint32_t i = 0; i < msg->body.lockstep.num_inputs; i++) {
+    struct msg_input input = msg->body.lockstep.inputs[i];
+
+    if (input.player >= ctx->num_seats) {
+      continue;
+    }
+    /* The server's engine drops fights with spells it does not have like
+     * fights without a spell */
+    if (input.type == MESSAGE_REPLY_FIGHT &&
+        spell_get_by_id(input.value) == NULL) {
+      input.value = 0;
+    }
+    if (!seat_push(&ctx->seats[input.player], &input)) {
+      common_log("Lockstep input dropped at tick %u\n", input.tick);
+      ctx->desyncs++;
+    }
+  }
+
+  while (engine_ticks(ctx->engine) < msg->tick) {
+    engine_tick(ctx->engine);
+  }
+
+  if (engine_ticks(ctx->engine) != msg->tick ||
+      (msg->body.lockstep.flags & LOCKSTEP_HASHED &&
+       engine_state_hash(ctx->engine) != msg->body.lockstep.hash)) {
+    common_log("Lockstep desync at tick %u\n", msg->tick);
+    ctx->desyncs++;
+  }
+}
+
+void lockstep_server_send(void *data, message_t *msg) {
+  lockstep_t *ctx = data;
+
+  switch (msg->type) {
+  case MESSAGE_MAP:
+    build_engine(ctx, msg);
+    ctx->send(ctx->send_data, msg);
+    break;
+
+  case MESSAGE_LOCKSTEP:
+    follow(ctx, msg);
+    break;
+
+  default:
+    ctx->send(ctx->send_data, msg);
+    break;
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "message.h"
+#include "player.h"
+
+/* Player side of a lockstep match, see engine_set_lockstep(). Sits between
+ * the connection to the server and the player: it builds its own engine from
+ * the map, steps it on the replies the server passes on and hands the player
+ * what that engine sends it, so the player gets the messages it would get
+ * from the server otherwise. The player's replies go to the server as they
+ * are. */
+typedef struct lockstep_ctx lockstep_t;
+
+/* @param send gets the messages for the player */
+lockstep_t *lockstep_new(player_send_msg_func_t send, void *send_data);
+void lockstep_free(lockstep_t *ctx);
+
+/* Takes a message from the server, it fits player_send_msg_func_t. Anything
+ * but the lockstep messages goes straight to the player. */
+void lockstep_server_send(void *data, message_t *msg);
+
+/* Steps after which the engine did not hash to what the server's did, and
+ * replies that could not be kept. The match goes on, but what the player
+ * gets can not be trusted any more. */
+uint32_t lockstep_desyncs(lockstep_t *ctx);
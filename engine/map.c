@@ -1,27 +1,67 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "map.h"
+#include "map_bits.h"
 #include "map_opts.h"
 #include "map_opts_ranked.h"
 
 #include "message.h"
-
-#define MAP_WALL (1 << 1);
-#define MAP_PORTAL (1 << 2);
-#define MAP_PLAYER (1 << 3);
+#include "rng.h"
 
 struct map_ctx {
   coord_t width;
   coord_t height;
-  uint8_t *data;
+  rng_t rng;
   map_opts_t *spaces;
+
+  /* One bit per cell in row order, walls are the cells not in floor */
+  map_bits_t *floor;
+  map_bits_t *portal_cells;
+  map_bits_t *player_cells;
   map_opts_t *players;
   map_opts_t *portals;
+  /* Floor outside the safe zone of every portal, which only changes with
+   * the portals. NULL until map_valid_spawns() needs it. */
+  map_bits_t *spawn_cells;
+  uint8_t spawn_zone;
+
+  /* Distance field for map_reachable(), reused between calls. A cell is part
+   * of the last fill when its stamp matches reach_gen. */
+  uint32_t *reach_stamp;
+  uint8_t *reach_dist;
+  pos_t *reach_queue;
+  uint32_t reach_gen;
+  /* Cells map_can_reach() looks at once the ones before are done */
+  pos_t *reach_next;
+  /* Planes for unset_reachable(), with flood_guard zero words either side
+   * so the cells a row away can be read without bounds checks, and the cells
+   * that have a neighbour to the left and to the right */
+  uint64_t *flood[2];
+  uint64_t *has_left;
+  uint64_t *has_right;
+  uint32_t flood_guard;
+
+  /* Optional line of sight table, see map_los_attach() */
+  map_los_t *los;
+};
+
+/* Row i holds one bit per floor cell, set if it is seen from floor cell i.
+ * Floor cells are numbered in row order. */
+struct map_los {
+  uint64_t *vis;
+  int32_t *index;
+  pos_t *cells;
+  uint32_t *row_start;
+  uint32_t count;
+  uint32_t words;
+  size_t bytes;
 };
 
 static inline bool in(map_t *ctx, pos_t p) {
@@ -30,21 +70,24 @@ static inline bool in(map_t *ctx, pos_t p) {
 
 static uint32_t to_id(map_t *ctx, pos_t pos) {
 
-  return pos.x * ctx->height + pos.y;
+  return pos.y * ctx->width + pos.x;
 }
 
-static void set_wall(map_t *ctx, pos_t p) {
-  if (!in(ctx, p)) {
-    return;
-  }
-  ctx->data[to_id(ctx, p)] |= MAP_WALL;
+/* The planes cover the whole map, so the cell id is the bit index */
+static inline bool plane_has(map_bits_t *plane, uint32_t id) {
+  return (plane->data[id / 64] >> (id % 64)) & 1;
 }
 
-static void unset_wall(map_t *ctx, pos_t p) {
-  if (!in(ctx, p)) {
-    return;
-  }
-  ctx->data[to_id(ctx, p)] &= ~MAP_WALL;
+static inline void plane_set(map_bits_t *plane, uint32_t id) {
+  plane->data[id / 64] |= (uint64_t)1 << (id % 64);
+}
+
+static inline void plane_unset(map_bits_t *plane, uint32_t id) {
+  plane->data[id / 64] &= ~((uint64_t)1 << (id % 64));
+}
+
+static inline void plane_set_word(uint64_t *words, uint32_t id) {
+  words[id / 64] |= (uint64_t)1 << (id % 64);
 }
 
 // NOTE: this is in fact distance^2, but that dont matter when comparing...
@@ -58,7 +101,7 @@ static coord_t distance(map_t *ctx, pos_t from, pos_t to) {
 }
 
 static void build_corridor(map_t *ctx, map_opts_t *curr, pos_t from, pos_t to) {
-  if (rand() % 2) {
+  if (rng_below(&ctx->rng, 2)) {
     if (from.x < to.x) {
       from.x++;
     } else if (from.x > to.x) {
@@ -97,7 +140,7 @@ static void create_room(map_t *ctx, pos_t at, uint32_t size) {
 
   while (curr->size < size) {
     pos_t nr = at;
-    uint32_t dir = rand() % 4;
+    uint32_t dir = rng_below(&ctx->rng, 4);
 
     tries++;
     if (tries > 20) {
@@ -152,9 +195,9 @@ static void create_room(map_t *ctx, pos_t at, uint32_t size) {
 add:
 
   for (uint32_t i = 0; i < curr->size; i++) {
-
-    unset_wall(ctx, curr->data[i]);
-    map_opts_add(ctx->spaces, curr->data[i]);
+    if (map_bits_add(ctx->floor, curr->data[i])) {
+      map_opts_append(ctx->spaces, curr->data[i]);
+    }
   }
 
   map_opts_free(curr);
@@ -168,31 +211,40 @@ map_t *map_new(coord_t width, coord_t height, int32_t room_factor,
 
   ctx->width = width;
   ctx->height = height;
-  ctx->data = calloc(width * height, sizeof(*ctx->data));
   ctx->spaces = map_opts_new(width * height);
+  ctx->floor = map_bits_new(width, height);
+  ctx->portal_cells = map_bits_new(width, height);
+  ctx->player_cells = map_bits_new(width, height);
   ctx->players = map_opts_new(10);
   ctx->portals = map_opts_new(10);
-
-  for (uint32_t x = 0; x < ctx->width; x++) {
-    for (uint32_t y = 0; y < ctx->height; y++) {
-      pos_t pos = {x, y};
-      set_wall(ctx, pos);
-    }
-  }
-
-  srand(seed);
+  ctx->spawn_cells = NULL;
+  ctx->spawn_zone = 0;
+  ctx->reach_stamp = NULL;
+  ctx->reach_dist = NULL;
+  ctx->reach_queue = NULL;
+  ctx->reach_gen = 0;
+  ctx->reach_next = NULL;
+  ctx->flood[0] = NULL;
+  ctx->flood[1] = NULL;
+  ctx->has_left = NULL;
+  ctx->has_right = NULL;
+  ctx->flood_guard = 0;
+  ctx->los = NULL;
+
+  /* Everything is wall until the rooms are dug out */
+  rng_seed(&ctx->rng, seed);
 
   for (coord_t i = width * height / room_factor; i > 0; i--) {
     pos_t p = {0};
 
-    p.x = (rand() % (width - 2)) + 1;
-    p.y = (rand() % (height - 2)) + 1;
+    p.x = rng_below(&ctx->rng, width - 2) + 1;
+    p.y = rng_below(&ctx->rng, height - 2) + 1;
 
     if (!map_is_wall(ctx, p)) {
       i++;
       continue;
     }
-    create_room(ctx, p, rand() % 20 + 5);
+    create_room(ctx, p, rng_below(&ctx->rng, 20) + 5);
   }
 
   return ctx;
@@ -200,68 +252,288 @@ map_t *map_new(coord_t width, coord_t height, int32_t room_factor,
 
 map_t *map_new_from_message(message_t *msg) {
   map_t *ctx;
+  uint32_t words;
 
   ctx = malloc(sizeof(*ctx));
   ctx->width = msg->body.map.width;
   ctx->height = msg->body.map.height;
-  ctx->data = malloc(ctx->width * ctx->height * sizeof(*ctx->data));
-
-  memcpy(ctx->data, msg->body.map.data,
-         ctx->width * ctx->height * sizeof(*ctx->data));
-
-  ctx->spaces = map_opts_new(ctx->width * ctx->height);
+  /* Nothing is generated on a copy, a fixed seed keeps it reproducible */
+  rng_seed(&ctx->rng, 0);
+  ctx->floor = map_bits_new(ctx->width, ctx->height);
+  ctx->portal_cells = map_bits_new(ctx->width, ctx->height);
+  ctx->player_cells = map_bits_new(ctx->width, ctx->height);
+
+  words = ctx->floor->words;
+  memcpy(ctx->floor->data, msg->body.map.data + MAP_PLANE_FLOOR * words,
+         words * sizeof(*ctx->floor->data));
+  memcpy(ctx->portal_cells->data, msg->body.map.data + MAP_PLANE_PORTAL * words,
+         words * sizeof(*ctx->portal_cells->data));
+  memcpy(ctx->player_cells->data, msg->body.map.data + MAP_PLANE_PLAYER * words,
+         words * sizeof(*ctx->player_cells->data));
+
+  ctx->spaces = map_bits_to_opts(ctx->floor);
   ctx->players = map_opts_new(msg->body.map.num_players);
   ctx->portals = map_opts_new(msg->body.map.num_portals);
+  ctx->spawn_cells = NULL;
+  ctx->spawn_zone = 0;
+  ctx->reach_stamp = NULL;
+  ctx->reach_dist = NULL;
+  ctx->reach_queue = NULL;
+  ctx->reach_gen = 0;
+  ctx->reach_next = NULL;
+  ctx->flood[0] = NULL;
+  ctx->flood[1] = NULL;
+  ctx->has_left = NULL;
+  ctx->has_right = NULL;
+  ctx->flood_guard = 0;
+  ctx->los = NULL;
 
   for (uint8_t i = 0; i < msg->body.map.num_portals; i++) {
     map_opts_add(ctx->portals, msg->body.map.portals[i].pos);
   }
 
-  for (uint32_t y = 0; y < ctx->height; y++) {
-    for (uint32_t x = 0; x < ctx->width; x++) {
-      pos_t p = {x, y};
-      if (!map_is_wall(ctx, p)) {
-        map_opts_add(ctx->spaces, p);
-      }
-    }
+  return ctx;
+}
+
+void map_free(map_t *ctx) {
+  if (ctx == NULL) {
+    return;
   }
 
-  return ctx;
+  map_opts_free(ctx->spaces);
+  map_bits_free(ctx->floor);
+  map_bits_free(ctx->portal_cells);
+  map_bits_free(ctx->player_cells);
+  map_opts_free(ctx->players);
+  map_opts_free(ctx->portals);
+  map_bits_free(ctx->spawn_cells);
+  free(ctx->reach_stamp);
+  free(ctx->reach_dist);
+  free(ctx->reach_queue);
+  free(ctx->reach_next);
+  free(ctx->flood[0]);
+  free(ctx->flood[1]);
+  free(ctx->has_left);
+  free(ctx->has_right);
+  map_los_free(ctx->los);
+  free(ctx);
 }
 
 coord_t map_height(map_t *ctx) { return ctx->height; }
 coord_t map_width(map_t *ctx) { return ctx->width; }
 
-static void valid_moves(map_t *ctx, map_opts_ranked_t *moves, pos_t from,
-                        uint8_t steps) {
-  pos_t south = from, west = from, east = from, north = from;
+static void reach_prepare(map_t *ctx) {
+  uint32_t cells = ctx->width * ctx->height;
+
+  if (ctx->reach_stamp == NULL) {
+    ctx->reach_stamp = calloc(cells, sizeof(*ctx->reach_stamp));
+    ctx->reach_dist = malloc(cells * sizeof(*ctx->reach_dist));
+    ctx->reach_queue = malloc(cells * sizeof(*ctx->reach_queue));
+    ctx->reach_next = malloc(cells * sizeof(*ctx->reach_next));
+  }
+
+  ctx->reach_gen++;
+  if (ctx->reach_gen == 0) {
+    /* Stamps wrapped, old fills could look current again */
+    memset(ctx->reach_stamp, 0, cells * sizeof(*ctx->reach_stamp));
+    ctx->reach_gen = 1;
+  }
+}
+
+/* Fills the distance field, the cells reached end up at the start of
+ * reach_queue in the order they were reached. Returns how many there are. */
+static uint32_t reach_fill(map_t *ctx, pos_t from, uint8_t steps) {
+  uint32_t head = 0;
+  uint32_t tail = 0;
+
+  reach_prepare(ctx);
 
   if (steps == 0 || !in(ctx, from) || map_is_wall(ctx, from)) {
+    return 0;
+  }
+
+  ctx->reach_stamp[to_id(ctx, from)] = ctx->reach_gen;
+  ctx->reach_dist[to_id(ctx, from)] = 0;
+  ctx->reach_queue[tail++] = from;
+
+  /* Breadth first, so cells come out ordered by distance and every cell is
+   * only visited once */
+  while (head < tail) {
+    pos_t curr = ctx->reach_queue[head++];
+    uint8_t dist = ctx->reach_dist[to_id(ctx, curr)];
+    pos_t next[4] = {curr, curr, curr, curr};
+
+    if (dist + 1 >= steps) {
+      continue;
+    }
+
+    next[0].x--;
+    next[1].x++;
+    next[2].y--;
+    next[3].y++;
+
+    for (uint8_t i = 0; i < 4; i++) {
+      uint32_t id;
+
+      if (!in(ctx, next[i]) || map_is_wall(ctx, next[i])) {
+        continue;
+      }
+
+      id = to_id(ctx, next[i]);
+      if (ctx->reach_stamp[id] == ctx->reach_gen) {
+        continue;
+      }
+
+      ctx->reach_stamp[id] = ctx->reach_gen;
+      ctx->reach_dist[id] = dist + 1;
+      ctx->reach_queue[tail++] = next[i];
+    }
+  }
+
+  return tail;
+}
+
+map_opts_ranked_t *map_reachable(map_t *ctx, pos_t from, uint8_t steps) {
+  map_opts_ranked_t *opts;
+  uint32_t num;
+
+  opts = map_opts_ranked_new(steps * 16 + 1);
+  num = reach_fill(ctx, from, steps);
+
+  /* The rank is the number of steps left on arrival */
+  for (uint32_t i = 0; i < num; i++) {
+    pos_t pos = ctx->reach_queue[i];
+    uint8_t dist = ctx->reach_dist[to_id(ctx, pos)];
+
+    map_opts_ranked_append(opts, pos, steps - dist);
+  }
+
+  return opts;
+}
+
+static void flood_prepare(map_t *ctx) {
+  uint32_t words = ctx->floor->words;
+
+  if (ctx->flood[0] != NULL) {
     return;
   }
 
-  if (!map_opts_ranked_add(moves, from, steps)) {
+  ctx->flood_guard = ctx->width / 64 + 1;
+  for (uint8_t i = 0; i < 2; i++) {
+    ctx->flood[i] =
+        calloc(words + 2 * ctx->flood_guard + 1, sizeof(*ctx->flood[i]));
+  }
+  ctx->has_left = calloc(words, sizeof(*ctx->has_left));
+  ctx->has_right = calloc(words, sizeof(*ctx->has_right));
+  for (uint32_t id = 0; id < (uint32_t)(ctx->width * ctx->height); id++) {
+    if (id % ctx->width > 0) {
+      plane_set_word(ctx->has_left, id);
+    }
+    if (id % ctx->width < (uint32_t)ctx->width - 1) {
+      plane_set_word(ctx->has_right, id);
+    }
+  }
+}
+
+/* 64 cells of a flood plane from guarded bit @param at on */
+static inline uint64_t flood_word(const uint64_t *plane, uint32_t at) {
+  uint32_t word = at / 64;
+  uint32_t bit = at % 64;
+
+  if (bit == 0) {
+    return plane[word];
+  }
+  return plane[word] >> bit | plane[word + 1] << (64 - bit);
+}
+
+/* Takes the cells map_valid_moves() would list out of @param cells. Rather
+ * than a cell at a time as in map_reachable(), every step moves the whole
+ * plane one cell each way at once, which is a few shifts per word. Only the
+ * rows the steps so far could reach are looked at. */
+static void unset_reachable(map_t *ctx, map_bits_t *cells, pos_t from,
+                            uint8_t steps) {
+  coord_t top;
+  coord_t bottom;
+  uint32_t guard;
+  uint32_t first;
+  uint32_t last;
+  uint64_t *curr;
+  uint64_t *next;
+
+  if (steps == 0 || !in(ctx, from) || map_is_wall(ctx, from)) {
     return;
   }
 
-  south.y++;
-  north.y--;
-  east.x++;
-  west.x--;
+  flood_prepare(ctx);
+  guard = ctx->flood_guard;
+  top = from.y - (steps - 1) > 0 ? from.y - (steps - 1) : 0;
+  bottom = from.y + (steps - 1) < ctx->height - 1 ? from.y + (steps - 1)
+                                                   : ctx->height - 1;
+  first = top * ctx->width / 64;
+  last = ((bottom + 1) * ctx->width + 63) / 64;
+
+  /* The guards around the rows keep what is outside them empty */
+  curr = ctx->flood[0];
+  next = ctx->flood[1];
+  for (uint8_t i = 0; i < 2; i++) {
+    memset(ctx->flood[i] + first, 0,
+           (last - first + 2 * guard + 1) * sizeof(*ctx->flood[i]));
+  }
+  plane_set_word(curr + guard, to_id(ctx, from));
+
+  for (uint8_t step = 1; step < steps; step++) {
+    /* Rows further than this are still empty */
+    coord_t up = from.y - step > top ? from.y - step : top;
+    coord_t down = from.y + step < bottom ? from.y + step : bottom;
+    uint64_t grown = 0;
+
+    for (uint32_t w = up * ctx->width / 64;
+         w < ((down + 1) * ctx->width + 63) / 64; w++) {
+      uint32_t at = (w + guard) * 64;
+      uint64_t word = curr[w + guard];
+
+      word |= flood_word(curr, at - 1) & ctx->has_left[w];
+      word |= flood_word(curr, at + 1) & ctx->has_right[w];
+      word |= flood_word(curr, at - ctx->width);
+      word |= flood_word(curr, at + ctx->width);
+      word &= ctx->floor->data[w];
+
+      grown |= word ^ curr[w + guard];
+      next[w + guard] = word;
+    }
+
+    curr = next;
+    next = curr == ctx->flood[0] ? ctx->flood[1] : ctx->flood[0];
+    if (grown == 0) {
+      break;
+    }
+  }
+
+  for (uint32_t w = first; w < last; w++) {
+    cells->data[w] &= ~curr[w + guard];
+  }
+}
+
+int32_t map_reachable_steps(map_t *ctx, pos_t pos) {
+  uint32_t id;
+
+  if (ctx->reach_stamp == NULL || !in(ctx, pos)) {
+    return -1;
+  }
+
+  id = to_id(ctx, pos);
+  if (ctx->reach_stamp[id] != ctx->reach_gen) {
+    return -1;
+  }
 
-  valid_moves(ctx, moves, west, steps - 1);
-  valid_moves(ctx, moves, east, steps - 1);
-  valid_moves(ctx, moves, north, steps - 1);
-  valid_moves(ctx, moves, south, steps - 1);
+  return ctx->reach_dist[id];
 }
 
 map_opts_t *map_valid_moves(map_t *ctx, pos_t from, uint8_t steps) {
   map_opts_ranked_t *opts;
   map_opts_t *ret;
 
-  opts = map_opts_ranked_new(steps * 16);
-
-  valid_moves(ctx, opts, from, steps);
+  opts = map_reachable(ctx, from, steps);
 
   ret = map_opts_ranked_to_opts(opts);
   map_opts_ranked_free(opts);
@@ -269,293 +541,766 @@ map_opts_t *map_valid_moves(map_t *ctx, pos_t from, uint8_t steps) {
   return ret;
 }
 
+static uint32_t steps_between(pos_t from, pos_t to) {
+  return abs(to.x - from.x) + abs(to.y - from.y);
+}
+
+bool map_can_reach(map_t *ctx, pos_t from, pos_t to, uint8_t steps) {
+  uint32_t length = steps_between(from, to);
+  uint32_t top = 0;
+  uint32_t num_next = 0;
+
+  if (!in(ctx, from) || !in(ctx, to) || map_is_wall(ctx, from) ||
+      map_is_wall(ctx, to) || length >= steps) {
+    return false;
+  }
+
+  reach_prepare(ctx);
+  ctx->reach_stamp[to_id(ctx, from)] = ctx->reach_gen;
+  ctx->reach_dist[to_id(ctx, from)] = 0;
+  ctx->reach_queue[top++] = from;
+
+  /* A* on the distance field: a step either keeps the shortest length a path
+   * through the cell could have or adds two to it. Cells that keep it go on
+   * a stack, which heads straight for @param to, the others wait in
+   * reach_next until every path of this length is ruled out. */
+  while (top > 0 || num_next > 0) {
+    pos_t curr;
+    uint32_t dist;
+    pos_t next[4];
+
+    if (top == 0) {
+      memcpy(ctx->reach_queue, ctx->reach_next,
+             num_next * sizeof(*ctx->reach_next));
+      top = num_next;
+      num_next = 0;
+      length += 2;
+    }
+
+    curr = ctx->reach_queue[--top];
+    dist = length - steps_between(curr, to);
+    if (POS_EQ(curr, to)) {
+      return true;
+    }
+    /* Found on a shorter path since it was put off */
+    if (ctx->reach_dist[to_id(ctx, curr)] != dist) {
+      continue;
+    }
+
+    next[0] = next[1] = next[2] = next[3] = curr;
+    next[0].x--;
+    next[1].x++;
+    next[2].y--;
+    next[3].y++;
+
+    for (uint8_t i = 0; i < 4; i++) {
+      uint32_t through;
+      uint32_t id;
+
+      if (!in(ctx, next[i])) {
+        continue;
+      }
+
+      through = dist + 1 + steps_between(next[i], to);
+      id = to_id(ctx, next[i]);
+      if (through >= steps || !plane_has(ctx->floor, id) ||
+          (ctx->reach_stamp[id] == ctx->reach_gen &&
+           ctx->reach_dist[id] <= dist + 1)) {
+        continue;
+      }
+
+      ctx->reach_stamp[id] = ctx->reach_gen;
+      ctx->reach_dist[id] = dist + 1;
+      if (through == length) {
+        ctx->reach_queue[top++] = next[i];
+      } else {
+        ctx->reach_next[num_next++] = next[i];
+      }
+    }
+  }
+
+  return false;
+}
+
 map_opts_t *map_valid_spawns(map_t *ctx, uint32_t num, uint8_t safe_zone) {
 
+  map_bits_t *free_cells;
   map_opts_t *opts;
   map_opts_t *ret;
 
-  opts = map_opts_clone(ctx->spaces);
-
-  for (uint32_t i = 0; i < ctx->portals->size; i++) {
-    map_opts_t *bad;
-    pos_t pos = ctx->portals->data[i];
+  if (ctx->spawn_cells == NULL || ctx->spawn_zone != safe_zone) {
+    map_bits_free(ctx->spawn_cells);
+    ctx->spawn_cells = map_bits_clone(ctx->floor);
+    ctx->spawn_zone = safe_zone;
 
-    bad = map_valid_moves(ctx, pos, safe_zone);
-    map_opts_delete_list(opts, bad);
-    map_opts_free(bad);
+    for (uint32_t i = 0; i < ctx->portals->size; i++) {
+      unset_reachable(ctx, ctx->spawn_cells, ctx->portals->data[i],
+                      safe_zone);
+    }
   }
+  free_cells = map_bits_clone(ctx->spawn_cells);
 
   for (uint32_t i = 0; i < ctx->players->size; i++) {
-    map_opts_t *bad;
-    map_opts_t *tmp;
     pos_t pos = ctx->players->data[i];
 
-    bad = map_valid_moves(ctx, pos, safe_zone);
-    map_opts_delete_list(opts, bad);
-    map_opts_free(bad);
-    tmp = map_opts_new(opts->size);
-
-    for (uint32_t j = 0; j < opts->size; j++) {
-      if (!map_has_los(ctx, pos, opts->data[j])) {
-        map_opts_add(tmp, opts->data[j]);
-      }
-    }
+    unset_reachable(ctx, free_cells, pos, safe_zone);
 
+    /* One shadowcast instead of a walk to every free cell */
+    opts = map_line_of_sight(ctx, pos, DIRECTION_ANY);
+    map_bits_delete_opts(free_cells, opts);
     map_opts_free(opts);
-    opts = tmp;
   }
 
-  map_opts_shuffle(opts);
+  opts = map_bits_to_opts(free_cells);
+  map_opts_shuffle(opts, &ctx->rng);
 
   if (opts->size <= num) {
+    map_bits_free(free_cells);
     return opts;
   }
 
   ret = map_opts_new(num);
 
-  while (ret->size < num) {
-    map_opts_t *bad;
-    pos_t pos = opts->data[0];
-
-    map_opts_add(ret, pos);
-
-    bad = map_valid_moves(ctx, pos, safe_zone);
-    map_opts_delete_list(opts, bad);
-    map_opts_free(bad);
+  /* Take them in shuffled order, skipping the ones too close to a pick */
+  for (uint32_t i = 0; i < opts->size && ret->size < num; i++) {
+    pos_t pos = opts->data[i];
 
-    if (opts->size == 0) {
-      break;
+    if (!map_bits_contains(free_cells, pos)) {
+      continue;
     }
+
+    map_opts_append(ret, pos);
+    unset_reachable(ctx, free_cells, pos, safe_zone);
   }
 
   map_opts_free(opts);
+  map_bits_free(free_cells);
   return ret;
 }
 
 map_opts_t *map_empty_spaces(map_t *ctx) {
+  map_bits_t *bits;
   map_opts_t *opts;
 
-  opts = map_opts_clone(ctx->spaces);
+  bits = map_bits_clone(ctx->floor);
 
-  map_opts_delete_list(opts, ctx->players);
-  map_opts_delete_list(opts, ctx->portals);
+  map_bits_delete_opts(bits, ctx->players);
+  map_bits_delete_opts(bits, ctx->portals);
+
+  opts = map_bits_to_opts(bits);
+  map_bits_free(bits);
 
   return opts;
 }
 
-static void los_north(map_t *ctx, map_opts_t *opts, pos_t start) {
+/* Bresenham walk behind map_has_los(), regardless of the visibility table */
+static bool los_walk(map_t *ctx, pos_t from, pos_t to) {
+  int32_t dx, dy, sx, sy, err, err2;
 
-  for (coord_t x = 0; x < ctx->width; x++) {
-    for (coord_t y = 0; y <= start.y; y++) {
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
-        continue;
-      }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
-      }
+  if (map_is_wall(ctx, from) || map_is_wall(ctx, to)) {
+    return false;
+  }
+
+  if (POS_EQ(to, from)) {
+    return true;
+  }
+
+  /* Attempts at Bresenham line drawing algorithm */
+
+  dx = abs(to.x - from.x);
+  dy = -abs(to.y - from.y);
+
+  sx = from.x < to.x ? 1 : -1;
+  sy = from.y < to.y ? 1 : -1;
+
+  err = dx + dy;
+
+  while (true) {
+    if (map_is_wall(ctx, from)) {
+      return false;
+    }
+    if (POS_EQ(from, to)) {
+      break;
+    }
+
+    err2 = err * 2;
+
+    if (err2 >= dy) {
+      err += dy;
+      from.x += sx;
+    }
+    if (err2 <= dx) {
+      err += dx;
+      from.y += sy;
     }
   }
+
+  return true;
 }
 
-static void los_south(map_t *ctx, map_opts_t *opts, pos_t start) {
-  for (coord_t x = 0; x < ctx->width; x++) {
-    for (coord_t y = start.y; y < ctx->height; y++) {
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
-        continue;
-      }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
-      }
-    }
+/* True if the offset d from the viewer is inside the cone seen when facing
+ * dir. Every cone is a half plane through the viewer. */
+static bool in_cone(enum direction dir, pos_t d) {
+  switch (dir) {
+  case DIRECTION_NORTH:
+    return d.y <= 0;
+  case DIRECTION_SOUTH:
+    return d.y >= 0;
+  case DIRECTION_WEST:
+    return d.x <= 0;
+  case DIRECTION_EAST:
+    return d.x >= 0;
+  case DIRECTION_NORTH_WEST:
+    return d.x + d.y <= 0;
+  case DIRECTION_NORTH_EAST:
+    return d.x - d.y >= 0;
+  case DIRECTION_SOUTH_WEST:
+    return d.x - d.y <= 0;
+  case DIRECTION_SOUTH_EAST:
+    return d.x + d.y >= 0;
+  case DIRECTION_ANY:
+    return true;
   }
+  return false;
 }
 
-static void los_west(map_t *ctx, map_opts_t *opts, pos_t start) {
-  for (coord_t y = 0; y < ctx->height; y++) {
-    for (coord_t x = 0; x <= start.x; x++) {
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
-        continue;
-      }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
+/* Tests every floor cell of the cone, used for viewers off the map and when
+ * shadowcasting runs out of memory */
+static void los_scan(map_t *ctx, map_bits_t *seen, pos_t start,
+                     enum direction dir) {
+  for (uint32_t w = 0; w < ctx->floor->words; w++) {
+    uint64_t word = ctx->floor->data[w];
+
+    while (word != 0) {
+      uint32_t id = w * 64 + __builtin_ctzll(word);
+      pos_t p = {id % ctx->width, id / ctx->width};
+      pos_t d = {p.x - start.x, p.y - start.y};
+
+      if (in_cone(dir, d) && los_walk(ctx, start, p)) {
+        map_bits_add(seen, p);
       }
+      word &= word - 1;
     }
   }
 }
 
-static void los_east(map_t *ctx, map_opts_t *opts, pos_t start) {
-  for (coord_t y = 0; y < ctx->height; y++) {
-    for (coord_t x = start.x; x < ctx->width; x++) {
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
-        continue;
-      }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
-      }
+/* Open interval of slopes lo_n / lo_d < s < hi_n / hi_d, denominators > 0 */
+struct shadow {
+  int32_t lo_n;
+  int32_t lo_d;
+  int32_t hi_n;
+  int32_t hi_d;
+};
+
+struct shadows {
+  uint32_t size;
+  uint32_t capacity;
+  struct shadow *data;
+};
+
+/* Buffers for los_octant(), shared between the octants of one query */
+struct los_scratch {
+  struct shadows curr;
+  struct shadows added;
+  struct shadows merged;
+};
+
+static void los_scratch_free(struct los_scratch *scratch) {
+  free(scratch->curr.data);
+  free(scratch->added.data);
+  free(scratch->merged.data);
+}
+
+static inline bool slope_lt(int32_t a_n, int32_t a_d, int32_t b_n,
+                            int32_t b_d) {
+  return (int64_t)a_n * b_d < (int64_t)b_n * a_d;
+}
+
+/* False if there is no memory for @param sh */
+static bool shadows_push(struct shadows *s, struct shadow sh) {
+  if (s->size == s->capacity) {
+    uint32_t capacity = s->capacity > 0 ? s->capacity * 2 : 16;
+    struct shadow *data = realloc(s->data, sizeof(*s->data) * capacity);
+
+    if (data == NULL) {
+      return false;
     }
+    s->data = data;
+    s->capacity = capacity;
   }
+  s->data[s->size] = sh;
+  s->size++;
+
+  return true;
 }
 
-static void los_north_west(map_t *ctx, map_opts_t *opts, pos_t start) {
-  coord_t max_x = start.x + start.y + 1;
+/* Merges the new shadows of one column into the sorted list. Shadows that
+ * only touch are kept apart, a line passing exactly through the shared corner
+ * may or may not be blocked. */
+static bool shadows_merge(struct shadows *curr, struct shadows *added,
+                          struct shadows *out) {
+  uint32_t i = 0;
+  uint32_t j = 0;
+
+  out->size = 0;
+
+  while (i < curr->size || j < added->size) {
+    struct shadow next;
+    struct shadow *last;
+
+    if (j == added->size ||
+        (i < curr->size &&
+         slope_lt(curr->data[i].lo_n, curr->data[i].lo_d, added->data[j].lo_n,
+                  added->data[j].lo_d))) {
+      next = curr->data[i++];
+    } else {
+      next = added->data[j++];
+    }
 
-  for (coord_t y = 0; y < ctx->height; y++) {
-    for (coord_t x = 0; x < ctx->width && x < max_x; x++) {
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
-        continue;
-      }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
+    last = out->size > 0 ? &out->data[out->size - 1] : NULL;
+    if (last != NULL &&
+        slope_lt(next.lo_n, next.lo_d, last->hi_n, last->hi_d)) {
+      if (slope_lt(last->hi_n, last->hi_d, next.hi_n, next.hi_d)) {
+        last->hi_n = next.hi_n;
+        last->hi_d = next.hi_d;
       }
+      continue;
     }
-
-    max_x--;
-    if (max_x < 0) {
-      return;
+    if (!shadows_push(out, next)) {
+      return false;
     }
   }
+
+  return true;
+}
+
+/* Maps column/row within an octant to a map offset */
+static const int8_t octants[8][4] = {
+    {1, 0, 0, 1},  {0, 1, 1, 0},  {0, -1, 1, 0}, {-1, 0, 0, 1},
+    {-1, 0, 0, -1}, {0, -1, -1, 0}, {0, 1, -1, 0}, {1, 0, 0, -1}};
+
+static pos_t octant_offset(uint8_t oct, coord_t col, coord_t row) {
+  pos_t d;
+
+  d.x = col * octants[oct][0] + row * octants[oct][1];
+  d.y = col * octants[oct][2] + row * octants[oct][3];
+  return d;
+}
+
+/* Number of cells from pos to the map edge, going in the direction of step */
+static coord_t cells_towards(map_t *ctx, pos_t pos, pos_t step) {
+  if (step.x > 0) {
+    return ctx->width - 1 - pos.x;
+  } else if (step.x < 0) {
+    return pos.x;
+  } else if (step.y > 0) {
+    return ctx->height - 1 - pos.y;
+  }
+  return pos.y;
 }
 
-static void los_north_east(map_t *ctx, map_opts_t *opts, pos_t start) {
+/*
+ * Shadowcasting, column by column away from the viewer. map_has_los() steps
+ * one cell per column and always picks the cell closest to the straight line,
+ * so a wall at (col, row) blocks every cell further out whose centre slope
+ * lies strictly within (row -+ 0.5) / col, and no other. Only the cells on
+ * the exact edge of a shadow depend on how the line rounds, those are left to
+ * map_has_los(). That gives exactly the cells the full scan would find.
+ *
+ * False if there is no memory for the shadows, @param seen is then only
+ * partly filled.
+ */
+static bool los_octant(map_t *ctx, map_bits_t *seen, pos_t start,
+                       enum direction dir, uint8_t oct,
+                       struct los_scratch *scratch) {
+  struct shadows *s = &scratch->curr;
+  struct shadows *added = &scratch->added;
+  pos_t major = octant_offset(oct, 1, 0);
+  pos_t minor = octant_offset(oct, 0, 1);
+  coord_t max_col = cells_towards(ctx, start, major);
+  coord_t max_row = cells_towards(ctx, start, minor);
+
+  /* The cones line up with the octants. An octant touching the cone with
+   * just one edge is left to the neighbour sharing that edge. */
+  if (!in_cone(dir, major) || !in_cone(dir, octant_offset(oct, 1, 1))) {
+    return true;
+  }
 
-  coord_t min_x = start.x - start.y;
+  s->size = 0;
 
-  for (coord_t y = 0; y < ctx->height; y++) {
-    for (coord_t x = min_x; x < ctx->width; x++) {
-      if (x < 0) {
+  for (coord_t col = 1; col <= max_col; col++) {
+    uint32_t k = 0;
+
+    added->size = 0;
+
+    for (coord_t row = 0; row <= col && row <= max_row; row++) {
+      pos_t d = octant_offset(oct, col, row);
+      pos_t p = {start.x + d.x, start.y + d.y};
+      int32_t lo_n = 2 * row - 1;
+      int32_t hi_n = 2 * row + 1;
+      int32_t den = 2 * col;
+      bool shadowed = false;
+      bool certain = true;
+
+      while (k < s->size &&
+             !slope_lt(lo_n, den, s->data[k].hi_n, s->data[k].hi_d)) {
+        k++;
+      }
+
+      if (k < s->size &&
+          !slope_lt(lo_n, den, s->data[k].lo_n, s->data[k].lo_d) &&
+          !slope_lt(s->data[k].hi_n, s->data[k].hi_d, hi_n, den)) {
+        /* Fully in shadow, jump past the last cell covered by it */
+        int64_t last = ((int64_t)den * s->data[k].hi_n - s->data[k].hi_d) /
+                       (2 * (int64_t)s->data[k].hi_d);
+        row = last;
         continue;
       }
 
-      pos_t p = {x, y};
       if (map_is_wall(ctx, p)) {
+        struct shadow sh = {lo_n, den, hi_n, den};
+        struct shadow *prev =
+            added->size > 0 ? &added->data[added->size - 1] : NULL;
+
+        /* Neighbouring walls in one column block the corner between them */
+        if (prev != NULL && prev->hi_n == lo_n) {
+          prev->hi_n = hi_n;
+        } else if (!shadows_push(added, sh)) {
+          return false;
+        }
         continue;
       }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
-      }
-    }
 
-    min_x++;
-    if (min_x >= ctx->width) {
-      return;
-    }
-  }
-}
+      for (uint32_t j = k; j < s->size && !slope_lt(row, col, s->data[j].lo_n,
+                                                    s->data[j].lo_d);
+           j++) {
+        struct shadow *sh = &s->data[j];
 
-static void los_south_west(map_t *ctx, map_opts_t *opts, pos_t start) {
-  coord_t max_x = start.x + (ctx->height - 1 - start.y) + 1;
+        if (slope_lt(sh->hi_n, sh->hi_d, row, col)) {
+          continue;
+        }
+        if (slope_lt(sh->lo_n, sh->lo_d, row, col) &&
+            slope_lt(row, col, sh->hi_n, sh->hi_d)) {
+          shadowed = true;
+          break;
+        }
+        /* Right on the edge of a shadow, it depends on how the line rounds */
+        certain = false;
+      }
 
-  for (coord_t y = ctx->height - 1; y >= 0; y--) {
-    for (coord_t x = 0; x < ctx->width && x < max_x; x++) {
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
+      if (shadowed) {
         continue;
       }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
+
+      if (certain || los_walk(ctx, start, p)) {
+        map_bits_add(seen, p);
       }
     }
 
-    max_x--;
-    if (max_x < 0) {
+    if (added->size > 0) {
+      struct shadows tmp;
+
+      if (!shadows_merge(s, added, &scratch->merged)) {
+        return false;
+      }
+      tmp = *s;
+      *s = scratch->merged;
+      scratch->merged = tmp;
+    }
+  }
+
+  return true;
+}
+
+/* Adds the cells seen from floor cell @param start to @param seen by
+ * shadowcasting, or by walking to every cell if there is no memory for it */
+static void los_cast(map_t *ctx, map_bits_t *seen, pos_t start,
+                     enum direction dir, struct los_scratch *scratch) {
+  map_bits_add(seen, start);
+  for (uint8_t oct = 0; oct < 8; oct++) {
+    if (!los_octant(ctx, seen, start, dir, oct, scratch)) {
+      los_scan(ctx, seen, start, dir);
       return;
     }
   }
 }
-static void los_south_east(map_t *ctx, map_opts_t *opts, pos_t start) {
 
-  coord_t min_x = start.x - (ctx->height - 1 - start.y);
+/* Reads the cone out of the row for @param from. Floor cells are numbered in
+ * row order, so north and south only need part of the row. */
+static map_opts_t *los_from_table(map_t *ctx, pos_t from, enum direction dir) {
+  map_los_t *los = ctx->los;
+  int32_t i = los->index[from.y * ctx->width + from.x];
+  uint32_t first = 0;
+  uint32_t last = los->count;
+  map_opts_t *opts = map_opts_new(64);
+  uint64_t *row;
+
+  if (i < 0) {
+    return opts;
+  }
+  row = los->vis + (size_t)i * los->words;
 
-  for (coord_t y = ctx->height - 1; y >= 0; y--) {
-    for (coord_t x = min_x; x < ctx->width; x++) {
-      if (x < 0) {
-        continue;
-      }
+  if (dir == DIRECTION_NORTH) {
+    last = los->row_start[from.y + 1];
+  } else if (dir == DIRECTION_SOUTH) {
+    first = los->row_start[from.y];
+  }
 
-      pos_t p = {x, y};
-      if (map_is_wall(ctx, p)) {
-        continue;
-      }
-      if (map_has_los(ctx, start, p)) {
-        map_opts_add(opts, p);
-      }
+  for (uint32_t w = first / 64; w * 64 < last; w++) {
+    uint64_t word = row[w];
+
+    if (w == first / 64) {
+      word &= ~(uint64_t)0 << (first % 64);
+    }
+    if ((w + 1) * 64 > last) {
+      word &= ~(uint64_t)0 >> (64 - last % 64);
     }
 
-    min_x++;
-    if (min_x >= ctx->width) {
-      return;
+    while (word != 0) {
+      pos_t p = los->cells[w * 64 + __builtin_ctzll(word)];
+      pos_t d = {p.x - from.x, p.y - from.y};
+
+      if (in_cone(dir, d)) {
+        map_opts_append(opts, p);
+      }
+      word &= word - 1;
     }
   }
+
+  return opts;
 }
 
 map_opts_t *map_line_of_sight(map_t *ctx, pos_t from, enum direction dir) {
   map_opts_t *opts;
+  map_bits_t *seen;
 
-  opts = map_opts_new(30);
+  if (dir > DIRECTION_ANY) {
+    common_log("Not implemented");
+    return map_opts_new(30);
+  }
 
-  switch (dir) {
-  case DIRECTION_NORTH:
-    los_north(ctx, opts, from);
-    break;
-  case DIRECTION_SOUTH:
-    los_south(ctx, opts, from);
-    break;
-  case DIRECTION_WEST:
-    los_west(ctx, opts, from);
-    break;
-  case DIRECTION_EAST:
-    los_east(ctx, opts, from);
-    break;
-  case DIRECTION_NORTH_WEST:
-    los_north_west(ctx, opts, from);
-    break;
-  case DIRECTION_NORTH_EAST:
-    los_north_east(ctx, opts, from);
-    break;
-  case DIRECTION_SOUTH_WEST:
-    los_south_west(ctx, opts, from);
-    break;
-  case DIRECTION_SOUTH_EAST:
-    los_south_east(ctx, opts, from);
-    break;
-  case DIRECTION_ANY:
-    los_north(ctx, opts, from);
-    los_south(ctx, opts, from);
-    break;
-  default:
-    printf("Not implemented");
+  if (ctx->los != NULL && in(ctx, from)) {
+    return los_from_table(ctx, from, dir);
   }
 
+  seen = map_bits_new(ctx->width, ctx->height);
+
+  if (!in(ctx, from)) {
+    los_scan(ctx, seen, from, dir);
+  } else if (!map_is_wall(ctx, from)) {
+    struct los_scratch scratch = {0};
+
+    los_cast(ctx, seen, from, dir, &scratch);
+    los_scratch_free(&scratch);
+  }
+
+  opts = map_bits_to_opts(seen);
+  map_bits_free(seen);
+
   return opts;
 }
 
+/* Fills row i of the table with every floor cell seen from floor cell i,
+ * found by shadowcasting in all directions. */
+static void vis_fill_row(map_t *ctx, map_los_t *los, uint32_t i,
+                         map_bits_t *seen, struct los_scratch *scratch) {
+  pos_t from = los->cells[i];
+  uint64_t *row = los->vis + (size_t)i * los->words;
+
+  map_bits_clear(seen);
+  los_cast(ctx, seen, from, DIRECTION_ANY, scratch);
+
+  for (uint32_t w = 0; w < seen->words; w++) {
+    uint64_t word = seen->data[w];
+
+    while (word != 0) {
+      int32_t j = los->index[w * 64 + __builtin_ctzll(word)];
+
+      row[j / 64] |= (uint64_t)1 << (j % 64);
+      word &= word - 1;
+    }
+  }
+}
+
+struct vis_job {
+  map_t *ctx;
+  map_los_t *los;
+  uint32_t first;
+  uint32_t step;
+};
+
+/* Rows are whole words, so workers filling different rows never share one */
+static void *vis_fill(void *arg) {
+  struct vis_job *job = arg;
+  map_t *ctx = job->ctx;
+  struct los_scratch scratch = {0};
+  map_bits_t *seen = map_bits_new(ctx->width, ctx->height);
+
+  for (uint32_t i = job->first; i < job->los->count; i += job->step) {
+    vis_fill_row(ctx, job->los, i, seen, &scratch);
+  }
+
+  los_scratch_free(&scratch);
+  map_bits_free(seen);
+
+  return NULL;
+}
+
+map_los_t *map_los_build(map_t *ctx, uint32_t threads, size_t max_bytes) {
+  uint32_t cells = ctx->width * ctx->height;
+  uint32_t count;
+  uint32_t words;
+  size_t bytes;
+  map_los_t *los;
+  pthread_t *workers;
+  struct vis_job *jobs;
+  bool *started;
+
+  /* Sized before anything is allocated, a map over the limit costs nothing */
+  count = map_bits_count(ctx->floor);
+  words = (count + 63) / 64;
+  bytes = (size_t)count * words * sizeof(*los->vis);
+
+  if (bytes > max_bytes) {
+    common_log("Line of sight table for %u cells needs %zu bytes, limit is "
+               "%zu. Using on the fly queries\n",
+               count, bytes, max_bytes);
+    return NULL;
+  }
+
+  los = malloc(sizeof(*los));
+  los->index = malloc(sizeof(*los->index) * (cells > 0 ? cells : 1));
+  los->cells = malloc(sizeof(*los->cells) * (count > 0 ? count : 1));
+  los->row_start = malloc(sizeof(*los->row_start) * (ctx->height + 1));
+  los->count = count;
+  los->words = words;
+  los->bytes = bytes;
+  los->vis = calloc(bytes > 0 ? bytes : 1, 1);
+
+  count = 0;
+  for (uint32_t i = 0; i < cells; i++) {
+    los->index[i] = -1;
+  }
+  for (uint32_t w = 0; w < ctx->floor->words; w++) {
+    uint64_t word = ctx->floor->data[w];
+
+    while (word != 0) {
+      uint32_t id = w * 64 + __builtin_ctzll(word);
+      pos_t p = {id % ctx->width, id / ctx->width};
+
+      los->index[id] = count;
+      los->cells[count] = p;
+      count++;
+      word &= word - 1;
+    }
+  }
+
+  los->row_start[0] = 0;
+  for (coord_t y = 0; y < ctx->height; y++) {
+    los->row_start[y + 1] =
+        los->row_start[y] + map_bits_count_rows(ctx->floor, y, y + 1);
+  }
+
+  if (threads == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? online : 1;
+#else
+    threads = 1;
+#endif
+  }
+  if (threads > count) {
+    threads = count > 0 ? count : 1;
+  }
+
+  workers = malloc(sizeof(*workers) * threads);
+  jobs = malloc(sizeof(*jobs) * threads);
+  started = malloc(sizeof(*started) * threads);
+
+  for (uint32_t t = 0; t < threads; t++) {
+    jobs[t].ctx = ctx;
+    jobs[t].los = los;
+    jobs[t].first = t;
+    jobs[t].step = threads;
+    /* Without threads (e.g. web builds) the share is done right here */
+    started[t] = t > 0 && pthread_create(&workers[t], NULL, vis_fill,
+                                         &jobs[t]) == 0;
+  }
+  for (uint32_t t = 0; t < threads; t++) {
+    if (!started[t]) {
+      vis_fill(&jobs[t]);
+    }
+  }
+  for (uint32_t t = 1; t < threads; t++) {
+    if (started[t]) {
+      pthread_join(workers[t], NULL);
+    }
+  }
+
+  free(workers);
+  free(jobs);
+  free(started);
+
+  common_log("Line of sight table for %u cells: %zu bytes, %u threads\n", count,
+             bytes, threads);
+
+  return los;
+}
+
+void map_los_attach(map_t *ctx, map_los_t *los) {
+  if (ctx->los != NULL) {
+    map_los_free(los);
+    return;
+  }
+  ctx->los = los;
+}
+
+void map_los_free(map_los_t *los) {
+  if (los == NULL) {
+    return;
+  }
+
+  free(los->vis);
+  free(los->index);
+  free(los->cells);
+  free(los->row_start);
+  free(los);
+}
+
+size_t map_precompute_los(map_t *ctx, uint32_t threads, size_t max_bytes) {
+  if (ctx->los == NULL) {
+    map_los_attach(ctx, map_los_build(ctx, threads, max_bytes));
+  }
+
+  return ctx->los != NULL ? ctx->los->bytes : 0;
+}
+
 void map_set_portal(map_t *ctx, pos_t pos) {
   if (!in(ctx, pos)) {
     return;
   }
-  ctx->data[to_id(ctx, pos)] |= MAP_PORTAL;
+  plane_set(ctx->portal_cells, to_id(ctx, pos));
   map_opts_add(ctx->portals, pos);
+  map_bits_free(ctx->spawn_cells);
+  ctx->spawn_cells = NULL;
 }
 
 void map_unset_portal(map_t *ctx, pos_t pos) {
   if (!in(ctx, pos)) {
     return;
   }
-  ctx->data[to_id(ctx, pos)] &= ~MAP_PORTAL;
+  plane_unset(ctx->portal_cells, to_id(ctx, pos));
 
   map_opts_delete(ctx->portals, pos);
+  map_bits_free(ctx->spawn_cells);
+  ctx->spawn_cells = NULL;
 }
 
 void map_set_player(map_t *ctx, pos_t pos) {
   if (!in(ctx, pos)) {
     return;
   }
-  ctx->data[to_id(ctx, pos)] |= MAP_PLAYER;
+  plane_set(ctx->player_cells, to_id(ctx, pos));
   map_opts_add(ctx->players, pos);
 }
 
@@ -563,17 +1308,42 @@ void map_unset_player(map_t *ctx, pos_t pos) {
   if (!in(ctx, pos)) {
     return;
   }
-  ctx->data[to_id(ctx, pos)] &= ~MAP_PLAYER;
+  plane_unset(ctx->player_cells, to_id(ctx, pos));
 
   map_opts_delete(ctx->players, pos);
 }
 
+size_t map_save(map_t *ctx, uint8_t *buf, size_t at) {
+  at = common_put(buf, at, &ctx->width, sizeof(ctx->width));
+  at = common_put(buf, at, &ctx->height, sizeof(ctx->height));
+  at = common_put(buf, at, &ctx->rng, sizeof(ctx->rng));
+  at = map_opts_save(ctx->players, buf, at);
+  return common_put(buf, at, ctx->player_cells->data,
+                    ctx->player_cells->words * sizeof(uint64_t));
+}
+
+void map_restore(map_t *ctx, struct common_reader *r) {
+  coord_t width = 0;
+  coord_t height = 0;
+
+  common_read(r, &width, sizeof(width));
+  common_read(r, &height, sizeof(height));
+  if (width != ctx->width || height != ctx->height) {
+    r->broken = true;
+    return;
+  }
+  common_read(r, &ctx->rng, sizeof(ctx->rng));
+  map_opts_restore(ctx->players, r);
+  common_read(r, ctx->player_cells->data,
+              ctx->player_cells->words * sizeof(uint64_t));
+}
+
 bool map_is_portal(map_t *ctx, pos_t pos) {
   if (!in(ctx, pos)) {
     return false;
   }
 
-  return ctx->data[to_id(ctx, pos)] & MAP_PORTAL;
+  return plane_has(ctx->portal_cells, to_id(ctx, pos));
 }
 
 bool map_is_wall(map_t *ctx, pos_t pos) {
@@ -582,7 +1352,7 @@ bool map_is_wall(map_t *ctx, pos_t pos) {
     return false;
   }
 
-  return ctx->data[to_id(ctx, pos)] & MAP_WALL;
+  return !plane_has(ctx->floor, to_id(ctx, pos));
 }
 
 bool map_is_player(map_t *ctx, pos_t pos) {
@@ -591,51 +1361,30 @@ bool map_is_player(map_t *ctx, pos_t pos) {
     return false;
   }
 
-  return ctx->data[to_id(ctx, pos)] & MAP_PLAYER;
+  return plane_has(ctx->player_cells, to_id(ctx, pos));
 }
 
 bool map_has_los(map_t *ctx, pos_t from, pos_t to) {
-  int32_t dx, dy, sx, sy, err, err2;
+  map_los_t *los = ctx->los;
 
-  if (map_is_wall(ctx, from) || map_is_wall(ctx, to)) {
-    return false;
-  }
-
-  if (POS_EQ(to, from)) {
-    return true;
-  }
+  if (los != NULL && in(ctx, from) && in(ctx, to)) {
+    int32_t a = los->index[from.y * ctx->width + from.x];
+    int32_t b = los->index[to.y * ctx->width + to.x];
 
-  /* Attempts at Bresenham line drawing algorithm */
-
-  dx = abs(to.x - from.x);
-  dy = -abs(to.y - from.y);
-
-  sx = from.x < to.x ? 1 : -1;
-  sy = from.y < to.y ? 1 : -1;
-
-  err = dx + dy;
-
-  while (true) {
-    if (map_is_wall(ctx, from)) {
+    if (a < 0 || b < 0) {
       return false;
     }
-    if (POS_EQ(from, to)) {
-      break;
-    }
+    return (los->vis[(size_t)a * los->words + b / 64] >> (b % 64)) & 1;
+  }
 
-    err2 = err * 2;
+  return los_walk(ctx, from, to);
+}
 
-    if (err2 >= dy) {
-      err += dy;
-      from.x += sx;
-    }
-    if (err2 <= dx) {
-      err += dx;
-      from.y += sy;
-    }
-  }
+bool map_sees(map_t *ctx, pos_t from, enum direction dir, pos_t to) {
+  pos_t d = {to.x - from.x, to.y - from.y};
 
-  return true;
+  return in(ctx, to) && in_cone(dir, d) && !map_is_wall(ctx, to) &&
+         map_has_los(ctx, from, to);
 }
 
 pos_t map_ends_up_at(map_t *ctx, pos_t from, pos_t to) {
@@ -796,50 +1545,59 @@ map_opts_t *map_reduce_to_distance(map_t *ctx, pos_t pos, map_opts_t *opts,
 }
 
 pos_t map_closest(map_t *ctx, pos_t from, map_opts_t *opts) {
-  uint32_t steps = 46;
+  uint8_t steps = 46;
   map_opts_ranked_t *found;
   pos_t ret = POSITION_UNKNOWN;
-  uint32_t rank = 0;
+  int32_t best = -1;
 
   if (POS_IS_UNKNOWN(from)) {
     return POSITION_UNKNOWN;
   }
 
-  found = map_opts_ranked_new(steps * 16);
+  found = map_reachable(ctx, from, steps);
 
-  valid_moves(ctx, found, from, steps);
+  for (uint32_t i = 0; i < opts->size; i++) {
+    int32_t dist = map_reachable_steps(ctx, opts->data[i]);
 
-  for (uint32_t i = 0; i < found->size; i++) {
-    for (uint32_t j = 0; j < opts->size; j++) {
-      if (!POS_EQ(opts->data[j], found->data[i].pos)) {
-        continue;
-      }
-      /*
-      printf("   (%d,%d) -> %d\n", found->data[i].pos.x, found->data[i].pos.y,
-             found->data[i].rank);
-*/
-      if (found->data[i].rank > rank) {
-        rank = found->data[i].rank;
-        ret = found->data[i].pos;
-      }
+    if (dist < 0) {
+      continue;
+    }
+
+    if (best < 0 || dist < best) {
+      best = dist;
+      ret = opts->data[i];
     }
   }
 
+  map_opts_ranked_free(found);
+
   return ret;
 }
 
 message_t *map_to_message(map_t *map, uint32_t tick) {
   message_t *msg;
+  uint32_t words;
 
-  msg = message_map(tick);
+  words = map->floor->words;
+  /* The portals are added by the engine */
+  msg = message_map(
+      tick,
+      message_arena_size(MAP_PLANES * words, sizeof(*map->floor->data)) +
+          message_arena_size(map->portals->size,
+                             sizeof(*msg->body.map.portals)));
 
   msg->body.map.width = map->width;
   msg->body.map.height = map->height;
 
-  msg->body.map.data = malloc(map->width * map->height * sizeof(*map->data));
+  msg->body.map.data =
+      message_alloc(msg, MAP_PLANES * words, sizeof(*msg->body.map.data));
 
-  memcpy(msg->body.map.data, map->data,
-         map->width * map->height * sizeof(*map->data));
+  memcpy(msg->body.map.data + MAP_PLANE_FLOOR * words, map->floor->data,
+         words * sizeof(*map->floor->data));
+  memcpy(msg->body.map.data + MAP_PLANE_PORTAL * words, map->portal_cells->data,
+         words * sizeof(*map->portal_cells->data));
+  memcpy(msg->body.map.data + MAP_PLANE_PLAYER * words, map->player_cells->data,
+         words * sizeof(*map->player_cells->data));
 
   return msg;
 }
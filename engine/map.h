@@ -1,18 +1,28 @@
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "common.h"
 #include "map_opts.h"
+#include "map_opts_ranked.h"
 #include "message.h"
 
 typedef struct map_ctx map_t;
+/* Line of sight table of a map, see map_los_build() */
+typedef struct map_los map_los_t;
+
+/* Default limit for map_precompute_los(), in bytes */
+#ifndef MAP_LOS_TABLE_MAX
+#define MAP_LOS_TABLE_MAX (16 * 1024 * 1024)
+#endif
 
 enum player { PLAYER_1 = (1 << 3), PLAYER_2 = (1 << 4) };
 
 map_t *map_new(coord_t width, coord_t height, int32_t room_factor,
                uint32_t seed);
 map_t *map_new_from_message(message_t *msg);
+void map_free(map_t *ctx);
 
 coord_t map_height(map_t *ctx);
 coord_t map_width(map_t *ctx);
@@ -24,11 +34,49 @@ void map_set_player(map_t *ctx, pos_t pos);
 void map_unset_player(map_t *ctx, pos_t pos);
 void map_set_portal(map_t *ctx, pos_t pos);
 void map_unset_portal(map_t *ctx, pos_t pos);
+
+/* What a match changes on the map: where players are and the rng. Walls,
+ * portals and the line of sight table are shared, not saved. Writes at
+ * @param at of @param buf, see common_put(). */
+size_t map_save(map_t *ctx, uint8_t *buf, size_t at);
+/* Reads what map_save() wrote, broken if it was saved from a map of another
+ * size */
+void map_restore(map_t *ctx, struct common_reader *r);
 map_opts_t *map_valid_spawns(map_t *ctx, uint32_t num, uint8_t safe_zone);
 map_opts_t *map_valid_moves(map_t *ctx, pos_t pos, uint8_t steps);
+
+/* Fills the map distance field from @param from. Returns every cell reachable
+ * in less than @param steps moves, closest first, ranked by steps left.
+ * map_reachable_steps() then gives the distance of any cell from the last
+ * fill, or -1 if it was not reached. */
+map_opts_ranked_t *map_reachable(map_t *ctx, pos_t from, uint8_t steps);
+int32_t map_reachable_steps(map_t *ctx, pos_t pos);
+/* Whether @param to is among map_valid_moves(@param from, @param steps),
+ * without listing them. Overwrites the distance field. */
+bool map_can_reach(map_t *ctx, pos_t from, pos_t to, uint8_t steps);
 map_opts_t *map_empty_spaces(map_t *ctx);
 map_opts_t *map_line_of_sight(map_t *ctx, pos_t pos, enum direction dir);
 bool map_has_los(map_t *ctx, pos_t from, pos_t to);
+/* Whether @param to is in map_line_of_sight(@param from, @param dir),
+ * without working out the rest of it */
+bool map_sees(map_t *ctx, pos_t from, enum direction dir, pos_t to);
+
+/* Precomputes line of sight between every pair of floor cells, spread over
+ * @param threads workers (0 for one per core). map_has_los() is then a bit
+ * lookup and map_line_of_sight() a row read. Walls must not change after this.
+ * Returns the table size in bytes, or 0 if it would exceed @param max_bytes
+ * and queries keep walking the map. Engines do not build it, whoever makes
+ * the map does, once. */
+size_t map_precompute_los(map_t *ctx, uint32_t threads, size_t max_bytes);
+/* The same table built apart from the map, NULL if it would exceed
+ * @param max_bytes. Only the walls are read, so it can be built on another
+ * thread while the map is in use, and handed over with map_los_attach() on
+ * the thread that uses the map. Queries give the same answers either way. */
+map_los_t *map_los_build(map_t *ctx, uint32_t threads, size_t max_bytes);
+/* The map takes @param los, which has to be built for it. Freed if the map
+ * has a table already, NULL does nothing. */
+void map_los_attach(map_t *ctx, map_los_t *los);
+void map_los_free(map_los_t *los);
 pos_t map_ends_up_at(map_t *ctx, pos_t from, pos_t to);
 pos_t map_push(map_t *ctx, pos_t from, pos_t to, coord_t steps);
 pos_t map_pull(map_t *ctx, pos_t from, pos_t to, coord_t steps);
@@ -0,0 +1,273 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "map_bits.h"
+#include "map_opts.h"
+
+static inline bool in(map_bits_t *bits, pos_t pos) {
+  pos.x -= bits->origin.x;
+  pos.y -= bits->origin.y;
+
+  return pos.x >= 0 && pos.y >= 0 && pos.x < bits->width &&
+         pos.y < bits->height;
+}
+
+static inline uint32_t to_bit(map_bits_t *bits, pos_t pos) {
+  return (pos.y - bits->origin.y) * bits->width + (pos.x - bits->origin.x);
+}
+
+map_bits_t *map_bits_new(coord_t width, coord_t height) {
+  map_bits_t *bits;
+
+  bits = malloc(sizeof(*bits));
+  bits->origin.x = 0;
+  bits->origin.y = 0;
+  bits->width = width;
+  bits->height = height;
+  bits->words = (width * height + 63) / 64;
+  bits->data = calloc(bits->words > 0 ? bits->words : 1, sizeof(*bits->data));
+
+  return bits;
+}
+
+map_bits_t *map_bits_new_covering(map_opts_t *opts) {
+  map_bits_t *bits;
+  pos_t min = {0, 0};
+  pos_t max = {-1, -1};
+
+  for (uint32_t i = 0; i < opts->size; i++) {
+    pos_t p = opts->data[i];
+
+    if (i == 0) {
+      min = p;
+      max = p;
+      continue;
+    }
+
+    min.x = p.x < min.x ? p.x : min.x;
+    min.y = p.y < min.y ? p.y : min.y;
+    max.x = p.x > max.x ? p.x : max.x;
+    max.y = p.y > max.y ? p.y : max.y;
+  }
+
+  bits = map_bits_new(max.x - min.x + 1, max.y - min.y + 1);
+  bits->origin = min;
+  map_bits_add_opts(bits, opts);
+
+  return bits;
+}
+
+map_bits_t *map_bits_clone(map_bits_t *src) {
+  map_bits_t *bits;
+
+  bits = map_bits_new(src->width, src->height);
+  bits->origin = src->origin;
+  memcpy(bits->data, src->data, src->words * sizeof(*src->data));
+
+  return bits;
+}
+
+bool map_bits_contains(map_bits_t *bits, pos_t pos) {
+  uint32_t bit;
+
+  if (bits == NULL || !in(bits, pos)) {
+    return false;
+  }
+
+  bit = to_bit(bits, pos);
+  return (bits->data[bit / 64] >> (bit % 64)) & 1;
+}
+
+bool map_bits_add(map_bits_t *bits, pos_t pos) {
+  uint32_t bit;
+  uint64_t mask;
+
+  if (!in(bits, pos)) {
+    return false;
+  }
+
+  bit = to_bit(bits, pos);
+  mask = (uint64_t)1 << (bit % 64);
+
+  if (bits->data[bit / 64] & mask) {
+    return false;
+  }
+
+  bits->data[bit / 64] |= mask;
+  return true;
+}
+
+bool map_bits_delete(map_bits_t *bits, pos_t pos) {
+  uint32_t bit;
+  uint64_t mask;
+
+  if (!in(bits, pos)) {
+    return false;
+  }
+
+  bit = to_bit(bits, pos);
+  mask = (uint64_t)1 << (bit % 64);
+
+  if (!(bits->data[bit / 64] & mask)) {
+    return false;
+  }
+
+  bits->data[bit / 64] &= ~mask;
+  return true;
+}
+
+void map_bits_clear(map_bits_t *bits) {
+  memset(bits->data, 0, bits->words * sizeof(*bits->data));
+}
+
+uint32_t map_bits_count(map_bits_t *bits) {
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < bits->words; i++) {
+    count += __builtin_popcountll(bits->data[i]);
+  }
+
+  return count;
+}
+
+uint32_t map_bits_count_rows(map_bits_t *bits, coord_t first, coord_t last) {
+  uint32_t from = first * bits->width;
+  uint32_t to = last * bits->width;
+  uint32_t count = 0;
+
+  for (uint32_t i = from / 64; i * 64 < to; i++) {
+    uint64_t word = bits->data[i];
+
+    if (i == from / 64) {
+      word &= ~(uint64_t)0 << (from % 64);
+    }
+    if ((i + 1) * 64 > to) {
+      word &= ~(uint64_t)0 >> (64 - to % 64);
+    }
+    count += __builtin_popcountll(word);
+  }
+
+  return count;
+}
+
+void map_bits_union(map_bits_t *dst, map_bits_t *src) {
+  for (uint32_t i = 0; i < dst->words; i++) {
+    dst->data[i] |= src->data[i];
+  }
+}
+
+void map_bits_intersect(map_bits_t *dst, map_bits_t *src) {
+  for (uint32_t i = 0; i < dst->words; i++) {
+    dst->data[i] &= src->data[i];
+  }
+}
+
+void map_bits_difference(map_bits_t *dst, map_bits_t *src) {
+  for (uint32_t i = 0; i < dst->words; i++) {
+    dst->data[i] &= ~src->data[i];
+  }
+}
+
+void map_bits_add_opts(map_bits_t *bits, map_opts_t *opts) {
+  for (uint32_t i = 0; i < opts->size; i++) {
+    map_bits_add(bits, opts->data[i]);
+  }
+}
+
+void map_bits_delete_opts(map_bits_t *bits, map_opts_t *opts) {
+  for (uint32_t i = 0; i < opts->size; i++) {
+    map_bits_delete(bits, opts->data[i]);
+  }
+}
+
+map_bits_t *map_bits_from_opts(coord_t width, coord_t height,
+                               map_opts_t *opts) {
+  map_bits_t *bits;
+
+  bits = map_bits_new(width, height);
+  map_bits_add_opts(bits, opts);
+
+  return bits;
+}
+
+map_opts_t *map_bits_to_opts(map_bits_t *bits) {
+  map_opts_t *opts;
+
+  opts = map_opts_new(map_bits_count(bits) + 1);
+
+  for (uint32_t i = 0; i < bits->words; i++) {
+    uint64_t word = bits->data[i];
+
+    while (word != 0) {
+      uint32_t bit = i * 64 + __builtin_ctzll(word);
+      pos_t pos;
+
+      pos.x = bits->origin.x + bit % bits->width;
+      pos.y = bits->origin.y + bit / bits->width;
+      opts->data[opts->size] = pos;
+      opts->size++;
+
+      word &= word - 1;
+    }
+  }
+
+  return opts;
+}
+
+size_t map_bits_save(map_bits_t *bits, uint8_t *buf, size_t at) {
+  uint8_t present = bits != NULL;
+
+  at = common_put(buf, at, &present, sizeof(present));
+  if (bits == NULL) {
+    return at;
+  }
+  at = common_put(buf, at, &bits->origin, sizeof(bits->origin));
+  at = common_put(buf, at, &bits->width, sizeof(bits->width));
+  at = common_put(buf, at, &bits->height, sizeof(bits->height));
+  return common_put(buf, at, bits->data, bits->words * sizeof(*bits->data));
+}
+
+void map_bits_restore(map_bits_t **bits, struct common_reader *r) {
+  uint8_t present = 0;
+  pos_t origin = {0, 0};
+  coord_t width = 0;
+  coord_t height = 0;
+  map_bits_t *b = *bits;
+
+  common_read(r, &present, sizeof(present));
+  if (!present) {
+    map_bits_free(b);
+    *bits = NULL;
+    return;
+  }
+  common_read(r, &origin, sizeof(origin));
+  common_read(r, &width, sizeof(width));
+  common_read(r, &height, sizeof(height));
+  /* The words have to be in the block before they are allocated */
+  if (width < 0 || height < 0 ||
+      !common_has(r, ((uint64_t)width * height + 63) / 64, sizeof(*b->data))) {
+    r->broken = true;
+    return;
+  }
+
+  if (b == NULL || b->width != width || b->height != height) {
+    map_bits_free(b);
+    b = map_bits_new(width, height);
+    *bits = b;
+  }
+  b->origin = origin;
+
+  common_read(r, b->data, b->words * sizeof(*b->data));
+}
+
+void map_bits_free(map_bits_t *bits) {
+
+  if (bits == NULL) {
+    return;
+  }
+  free(bits->data);
+  free(bits);
+}
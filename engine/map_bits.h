@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "map_opts.h"
+
+/* A set of positions within a rectangle of the map, one bit per cell in row
+ * order. Membership is O(1) and the set operations work a word at a time.
+ * Sets combined with each other must cover the same rectangle. */
+typedef struct {
+  pos_t origin;
+  coord_t width;
+  coord_t height;
+  uint32_t words;
+  uint64_t *data;
+} map_bits_t;
+
+map_bits_t *map_bits_new(coord_t width, coord_t height);
+map_bits_t *map_bits_new_covering(map_opts_t *opts);
+map_bits_t *map_bits_clone(map_bits_t *src);
+
+bool map_bits_contains(map_bits_t *bits, pos_t pos);
+bool map_bits_add(map_bits_t *bits, pos_t pos);
+bool map_bits_delete(map_bits_t *bits, pos_t pos);
+void map_bits_clear(map_bits_t *bits);
+uint32_t map_bits_count(map_bits_t *bits);
+/* Cells set in rows first up to, but not including, last */
+uint32_t map_bits_count_rows(map_bits_t *bits, coord_t first, coord_t last);
+
+void map_bits_union(map_bits_t *dst, map_bits_t *src);
+void map_bits_intersect(map_bits_t *dst, map_bits_t *src);
+void map_bits_difference(map_bits_t *dst, map_bits_t *src);
+
+void map_bits_add_opts(map_bits_t *bits, map_opts_t *opts);
+void map_bits_delete_opts(map_bits_t *bits, map_opts_t *opts);
+map_bits_t *map_bits_from_opts(coord_t width, coord_t height,
+                               map_opts_t *opts);
+map_opts_t *map_bits_to_opts(map_bits_t *bits);
+
+/* Writes @param bits, which may be NULL, at @param at of @param buf, see
+ * common_put() */
+size_t map_bits_save(map_bits_t *bits, uint8_t *buf, size_t at);
+/* Reads what map_bits_save() wrote into @param bits, which is replaced when
+ * it is missing or covers another rectangle, and freed for a saved NULL */
+void map_bits_restore(map_bits_t **bits, struct common_reader *r);
+
+void map_bits_free(map_bits_t *bits);
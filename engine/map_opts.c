@@ -5,8 +5,12 @@
 #include <string.h>
 
 #include "common.h"
+#include "map_bits.h"
 #include "map_opts.h"
 
+/* Below this, scanning the list beats setting up a bit set */
+#define SMALL_LIST 8
+
 map_opts_t *map_opts_new(uint32_t capacity) {
   map_opts_t *ctx;
 
@@ -63,6 +67,24 @@ bool map_opts_add(map_opts_t *opts, pos_t pos) {
   return true;
 }
 
+bool map_opts_append(map_opts_t *opts, pos_t pos) {
+  if (opts->size == opts->capacity) {
+    uint32_t capacity = opts->capacity > 0 ? opts->capacity * 2 : 1;
+    pos_t *data = realloc(opts->data, sizeof(*opts->data) * capacity);
+
+    if (data == NULL) {
+      return false;
+    }
+    opts->data = data;
+    opts->capacity = capacity;
+  }
+
+  opts->data[opts->size] = pos;
+  opts->size++;
+
+  return true;
+}
+
 bool map_opts_delete(map_opts_t *opts, pos_t pos) {
 
   for (uint32_t i = 0; i < opts->size; i++) {
@@ -77,9 +99,27 @@ bool map_opts_delete(map_opts_t *opts, pos_t pos) {
 }
 
 void map_opts_delete_list(map_opts_t *opts, map_opts_t *del) {
-  for (uint32_t i = 0; i < del->size; i++) {
-    map_opts_delete(opts, del->data[i]);
+  map_bits_t *bits;
+  uint32_t kept = 0;
+
+  if (del->size < SMALL_LIST) {
+    for (uint32_t i = 0; i < del->size; i++) {
+      map_opts_delete(opts, del->data[i]);
+    }
+    return;
+  }
+
+  bits = map_bits_new_covering(del);
+
+  for (uint32_t i = 0; i < opts->size; i++) {
+    if (!map_bits_contains(bits, opts->data[i])) {
+      opts->data[kept] = opts->data[i];
+      kept++;
+    }
   }
+  opts->size = kept;
+
+  map_bits_free(bits);
 }
 
 static void swap(map_opts_t *opts, uint32_t a, uint32_t b) {
@@ -90,10 +130,10 @@ static void swap(map_opts_t *opts, uint32_t a, uint32_t b) {
   opts->data[b] = tmp;
 }
 
-void map_opts_shuffle(map_opts_t *opts) {
+void map_opts_shuffle(map_opts_t *opts, rng_t *rng) {
 
   for (uint32_t i = 0; i < opts->size; i++) {
-    swap(opts, i, rand() % opts->size);
+    swap(opts, i, rng_below(rng, opts->size));
   }
 }
 
@@ -101,6 +141,7 @@ map_opts_t *map_opts_overlap(map_opts_t *a, map_opts_t *b) {
   map_opts_t *big;
   map_opts_t *small;
   map_opts_t *ret;
+  map_bits_t *bits;
 
   if (a->size > b->size) {
     big = a;
@@ -111,12 +152,26 @@ map_opts_t *map_opts_overlap(map_opts_t *a, map_opts_t *b) {
   }
 
   ret = map_opts_new(small->size);
+
+  if (big->size < SMALL_LIST) {
+    for (uint32_t i = 0; i < small->size; i++) {
+      if (map_opts_contains(big, small->data[i])) {
+        ret->data[ret->size] = small->data[i];
+        ret->size++;
+      }
+    }
+    return ret;
+  }
+
+  bits = map_bits_new_covering(big);
   for (uint32_t i = 0; i < small->size; i++) {
-    if (map_opts_contains(big, small->data[i])) {
+    if (map_bits_contains(bits, small->data[i])) {
       ret->data[ret->size] = small->data[i];
       ret->size++;
     }
   }
+  map_bits_free(bits);
+
   return ret;
 }
 
@@ -145,6 +200,37 @@ map_opts_t *map_opts_import(pos_t *data, uint32_t size) {
   return tmp;
 }
 
+size_t map_opts_save(map_opts_t *opts, uint8_t *buf, size_t at) {
+  uint32_t empty = 0;
+
+  if (opts == NULL) {
+    return common_put(buf, at, &empty, sizeof(empty));
+  }
+  at = common_put(buf, at, &opts->size, sizeof(opts->size));
+  return common_put(buf, at, opts->data, opts->size * sizeof(*opts->data));
+}
+
+void map_opts_restore(map_opts_t *opts, struct common_reader *r) {
+  uint32_t size = 0;
+
+  common_read(r, &size, sizeof(size));
+  if (!common_has(r, size, sizeof(*opts->data))) {
+    return;
+  }
+  if (size > opts->capacity) {
+    pos_t *data = realloc(opts->data, sizeof(*opts->data) * size);
+
+    if (data == NULL) {
+      r->broken = true;
+      return;
+    }
+    opts->data = data;
+    opts->capacity = size;
+  }
+  common_read(r, opts->data, size * sizeof(*opts->data));
+  opts->size = size;
+}
+
 void map_opts_free(map_opts_t *opts) {
 
   if (opts == NULL) {
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "common.h"
+#include "rng.h"
 
 typedef struct {
   uint32_t size;
@@ -19,13 +20,22 @@ map_opts_t *map_opts_overlap(map_opts_t *a, map_opts_t *b);
 bool map_opts_contains(map_opts_t *opts, pos_t needle);
 
 bool map_opts_add(map_opts_t *opts, pos_t id);
+/* Like map_opts_add, but the caller guarantees that pos is new. False, with
+ * @param pos left out, if there is no memory for it. */
+bool map_opts_append(map_opts_t *opts, pos_t pos);
 bool map_opts_delete(map_opts_t *opts, pos_t id);
 void map_opts_delete_list(map_opts_t *opts, map_opts_t *del);
-void map_opts_shuffle(map_opts_t *opts);
+void map_opts_shuffle(map_opts_t *opts, rng_t *rng);
 
 void map_opts_export(map_opts_t *src, pos_t **data, uint32_t *size);
 map_opts_t *map_opts_import(pos_t *data, uint32_t size);
 
+/* Writes @param opts at @param at of @param buf, see common_put(). NULL is
+ * written as an empty list. */
+size_t map_opts_save(map_opts_t *opts, uint8_t *buf, size_t at);
+/* Reads what map_opts_save() wrote into @param opts, growing it as needed */
+void map_opts_restore(map_opts_t *opts, struct common_reader *r);
+
 void map_opts_free(map_opts_t *opts);
 
 void map_opts_print(map_opts_t *opts);
@@ -44,6 +44,27 @@ bool map_opts_ranked_add(map_opts_ranked_t *opts, pos_t pos, uint32_t rank) {
   return true;
 }
 
+bool map_opts_ranked_append(map_opts_ranked_t *opts, pos_t pos,
+                            uint32_t rank) {
+  if (opts->size == opts->capacity) {
+    uint32_t capacity = opts->capacity * 2;
+    struct map_opts_rank *data =
+        realloc(opts->data, sizeof(*opts->data) * capacity);
+
+    if (data == NULL) {
+      return false;
+    }
+    opts->data = data;
+    opts->capacity = capacity;
+  }
+
+  opts->data[opts->size].pos = pos;
+  opts->data[opts->size].rank = rank;
+  opts->size++;
+
+  return true;
+}
+
 map_opts_t *map_opts_ranked_to_opts(map_opts_ranked_t *opts) {
   map_opts_t *ret;
 
@@ -20,6 +20,9 @@ typedef struct {
 map_opts_ranked_t * map_opts_ranked_new(uint32_t capacity);
 
 bool map_opts_ranked_add(map_opts_ranked_t *opts, pos_t pos, uint32_t rank);
+/* Like map_opts_ranked_add, but the caller guarantees that pos is new. False,
+ * with @param pos left out, if there is no memory for it. */
+bool map_opts_ranked_append(map_opts_ranked_t *opts, pos_t pos, uint32_t rank);
 
 map_opts_t *map_opts_ranked_to_opts(map_opts_ranked_t *opts);
 
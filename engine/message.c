@@ -1,3 +1,4 @@
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,16 +8,41 @@
 #include "map_opts.h"
 #include "message.h"
 
+/* Arrays that did not fit the arena */
+struct spill {
+  struct spill *next;
+  uint64_t data[];
+};
+
+/* The arena for the inner arrays follows the box in the same allocation */
 struct msg_box {
   message_t msg;
-  int8_t refcount;
+  /* Shared by the engine and clients on other threads */
+  atomic_int refcount;
+  size_t arena_size;
+  size_t arena_used;
+  struct spill *spill;
+  uint64_t arena[];
 };
 
 static message_t *new_msg(uint32_t tick, enum message_type type) {
+  return message_new(tick, type, 0);
+}
+
+size_t message_arena_size(size_t count, size_t each) {
+  return (count * each + 7) & ~(size_t)7;
+}
+
+message_t *message_new(uint32_t tick, enum message_type type, size_t arena) {
   struct msg_box *box;
 
-  box = malloc(sizeof(*box));
-  box->refcount = 1;
+  arena = message_arena_size(arena, 1);
+
+  box = malloc(sizeof(*box) + arena);
+  atomic_init(&box->refcount, 1);
+  box->arena_size = arena;
+  box->arena_used = 0;
+  box->spill = NULL;
 
   box->msg.tick = tick;
   box->msg.type = type;
@@ -24,12 +50,32 @@ static message_t *new_msg(uint32_t tick, enum message_type type) {
   return &box->msg;
 }
 
-message_t *message_map(uint32_t tick) {
-  message_t *msg;
+void *message_alloc(message_t *msg, size_t count, size_t each) {
+  struct msg_box *box = (struct msg_box *)msg;
+  size_t size = message_arena_size(count, each);
+  struct spill *spill;
+  void *ptr;
+
+  if (size == 0) {
+    return NULL;
+  }
 
-  msg = new_msg(tick, MESSAGE_MAP);
+  if (size <= box->arena_size - box->arena_used) {
+    ptr = (uint8_t *)box->arena + box->arena_used;
+    box->arena_used += size;
+    memset(ptr, 0, size);
+    return ptr;
+  }
 
-  return msg;
+  spill = calloc(1, sizeof(*spill) + size);
+  spill->next = box->spill;
+  box->spill = spill;
+
+  return spill->data;
+}
+
+message_t *message_map(uint32_t tick, size_t arena) {
+  return message_new(tick, MESSAGE_MAP, arena);
 }
 
 message_t *message_reply_map(uint32_t tick) {
@@ -93,13 +139,26 @@ message_t *message_ask_ready(uint32_t tick) {
   return msg;
 }
 
-message_t *message_player_update(uint32_t tick) {
+message_t *message_player_update(uint32_t tick, size_t arena) {
   message_t *msg;
 
-  msg = new_msg(tick, MESSAGE_PLAYER_UPDATE);
+  msg = message_new(tick, MESSAGE_PLAYER_UPDATE, arena);
 
+  msg->body.player_update.los.opts = NULL;
+  msg->body.player_update.los.size = 0;
+  msg->body.player_update.effects = NULL;
+  msg->body.player_update.num_effects = 0;
+  msg->body.player_update.others = NULL;
+  msg->body.player_update.num_others = 0;
+  msg->body.player_update.portals = NULL;
+  msg->body.player_update.num_portals = 0;
   msg->body.player_update.events = NULL;
   msg->body.player_update.num_events = 0;
+  msg->body.player_update.base = 0;
+  msg->body.player_update.los_gone.opts = NULL;
+  msg->body.player_update.los_gone.size = 0;
+  msg->body.player_update.others_gone = NULL;
+  msg->body.player_update.num_others_gone = 0;
 
   return msg;
 }
@@ -108,33 +167,109 @@ message_t *message_ask_spawn(uint32_t tick, uint8_t player_id, uint32_t size,
                              pos_t *data) {
   message_t *msg;
 
-  msg = new_msg(tick, MESSAGE_ASK_SPAWN);
+  msg = message_new(tick, MESSAGE_ASK_SPAWN,
+                    message_arena_size(size, sizeof(*data)));
   msg->body.ask_spawn.player_id = player_id;
   msg->body.ask_spawn.size = size;
-  msg->body.ask_spawn.opts = malloc(size * sizeof(*data));
-  memcpy(msg->body.ask_spawn.opts, data, size * sizeof(*data));
+  msg->body.ask_spawn.opts = message_alloc(msg, size, sizeof(*data));
+  if (size > 0) {
+    memcpy(msg->body.ask_spawn.opts, data, size * sizeof(*data));
+  }
 
   return msg;
 }
 message_t *message_ask_move(uint32_t tick, uint32_t size, pos_t *data) {
   message_t *msg;
 
-  msg = new_msg(tick, MESSAGE_ASK_MOVE);
+  msg = message_new(tick, MESSAGE_ASK_MOVE,
+                    message_arena_size(size, sizeof(*data)));
   msg->body.ask_move.size = size;
-  msg->body.ask_move.opts = malloc(size * sizeof(*data));
-  memcpy(msg->body.ask_spawn.opts, data, size * sizeof(*data));
+  msg->body.ask_move.opts = message_alloc(msg, size, sizeof(*data));
+  if (size > 0) {
+    memcpy(msg->body.ask_move.opts, data, size * sizeof(*data));
+  }
 
   return msg;
 }
 
-message_t *message_ask_fight(uint32_t tick) {
+message_t *message_ask_fight(uint32_t tick, size_t arena) {
+  return message_new(tick, MESSAGE_ASK_FIGHT, arena);
+}
+
+message_t *message_lockstep(uint32_t tick, uint8_t player_id, uint8_t flags,
+                            uint64_t hash, uint32_t num_inputs,
+                            const struct msg_input *inputs,
+                            uint32_t state_size, const void *state) {
+  typeof(((message_t *)0)->body.lockstep) *l;
   message_t *msg;
 
-  msg = new_msg(tick, MESSAGE_ASK_FIGHT);
+  msg = message_new(tick, MESSAGE_LOCKSTEP,
+                    message_arena_size(num_inputs, sizeof(*inputs)) +
+                        message_arena_size(state_size, 1));
+  l = &msg->body.lockstep;
+  l->player_id = player_id;
+  l->flags = flags;
+  l->hash = hash;
+  l->num_inputs = num_inputs;
+  l->inputs = message_alloc(msg, num_inputs, sizeof(*inputs));
+  if (num_inputs > 0) {
+    memcpy(l->inputs, inputs, num_inputs * sizeof(*inputs));
+  }
+  l->state_size = state_size;
+  l->state = message_alloc(msg, state_size, 1);
+  if (state_size > 0) {
+    memcpy(l->state, state, state_size);
+  }
 
   return msg;
 }
 
+void message_to_input(message_t *msg, uint8_t player, uint32_t tick,
+                      struct msg_input *input) {
+  input->player = player;
+  input->type = msg->type;
+  input->tick = tick;
+  input->reply_tick = msg->tick;
+  input->pos = POSITION_UNKNOWN;
+  input->value = 0;
+
+  switch (msg->type) {
+  case MESSAGE_REPLY_SPAWN:
+    input->pos = msg->body.reply_spawn.dst;
+    input->value = msg->body.reply_spawn.face;
+    break;
+  case MESSAGE_REPLY_MOVE:
+    input->pos = msg->body.reply_move.dst;
+    input->value = msg->body.reply_move.face;
+    break;
+  case MESSAGE_REPLY_FIGHT:
+    input->pos = msg->body.reply_fight.target;
+    input->value = msg->body.reply_fight.spell_id;
+    break;
+  default:
+    break;
+  }
+}
+
+message_t *message_from_input(const struct msg_input *input) {
+  switch (input->type) {
+  case MESSAGE_REPLY_READY:
+    return message_reply_ready(input->reply_tick);
+  case MESSAGE_REPLY_MAP:
+    return message_reply_map(input->reply_tick);
+  case MESSAGE_REPLY_SPAWN:
+    return message_reply_spawn(input->reply_tick, input->pos, input->value);
+  case MESSAGE_REPLY_MOVE:
+    return message_reply_move(input->reply_tick, input->pos, input->value);
+  case MESSAGE_REPLY_FIGHT:
+    return message_reply_fight(input->reply_tick, input->value, input->pos);
+  case MESSAGE_REPLY_PLAYER_UPDATE:
+    return message_reply_player_update(input->reply_tick);
+  default:
+    return NULL;
+  }
+}
+
 message_t *message_ref(message_t *msg) {
   struct msg_box *box;
 
@@ -143,7 +278,7 @@ message_t *message_ref(message_t *msg) {
   }
 
   box = (struct msg_box *)msg;
-  box->refcount++;
+  atomic_fetch_add_explicit(&box->refcount, 1, memory_order_relaxed);
 
   return msg;
 }
@@ -156,46 +291,17 @@ void message_unref(message_t *msg) {
   }
 
   box = (struct msg_box *)msg;
-  box->refcount--;
 
-  if (box->refcount > 0) {
+  /* The last owner has to see everything the others wrote before freeing */
+  if (atomic_fetch_sub_explicit(&box->refcount, 1, memory_order_acq_rel) > 1) {
     return;
   }
 
-  switch (msg->type) {
-  case MESSAGE_MAP:
-    free(msg->body.map.data);
-    free(msg->body.map.portals);
-    break;
-  case MESSAGE_ASK_SPAWN:
-    free(msg->body.ask_spawn.opts);
-    break;
-
-  case MESSAGE_ASK_MOVE:
-    free(msg->body.ask_move.opts);
-    break;
+  while (box->spill != NULL) {
+    struct spill *next = box->spill->next;
 
-  case MESSAGE_ASK_FIGHT:
-    for (uint8_t i = 0; i < PORTAL_NONE; i++) {
-      free(msg->body.ask_fight.spell_opts[i].opts);
-    }
-    break;
-
-  case MESSAGE_PLAYER_UPDATE:
-    free(msg->body.player_update.los.opts);
-    free(msg->body.player_update.others);
-    free(msg->body.player_update.portals);
-    for (uint8_t i = 0; i < msg->body.player_update.num_events; i++) {
-      for (uint8_t j = 0; j < msg->body.player_update.events[i].num_targets;
-           j++) {
-        free(msg->body.player_update.events[i].targets[j].effects);
-      }
-      free(msg->body.player_update.events[i].targets);
-    }
-    free(msg->body.player_update.events);
-    break;
-  default:
-    break;
+    free(box->spill);
+    box->spill = next;
   }
 
   free(box);
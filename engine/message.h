@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "common.h"
@@ -17,7 +18,25 @@ enum message_type {
   MESSAGE_ASK_FIGHT,
   MESSAGE_REPLY_FIGHT,
   MESSAGE_PLAYER_UPDATE,
-  MESSAGE_REPLY_PLAYER_UPDATE
+  MESSAGE_REPLY_PLAYER_UPDATE,
+  MESSAGE_LOCKSTEP
+};
+
+/* Settings of a lockstep match the players' engines have to share */
+#define LOCKSTEP_DELTA 0x01
+#define LOCKSTEP_PIPELINED 0x02
+/* The message carries a hash, which it does once per turn */
+#define LOCKSTEP_HASHED 0x04
+
+/* Moves are asked within this many steps, see map_valid_moves() */
+#define MESSAGE_MOVE_STEPS 15
+
+/* Planes in the map message, each one map_bits_t worth of words */
+enum map_plane {
+  MAP_PLANE_FLOOR,
+  MAP_PLANE_PORTAL,
+  MAP_PLANE_PLAYER,
+  MAP_PLANES,
 };
 
 struct msg_opts {
@@ -35,6 +54,16 @@ struct msg_portal_kind {
   uint8_t kind;
 };
 
+/* A reply the engine took, as lockstep passes it on to the players */
+struct msg_input {
+  uint8_t player;
+  uint8_t type; /* enum message_type of the reply */
+  uint32_t tick;       /* Step it counted for */
+  uint32_t reply_tick; /* Tick of the reply itself */
+  pos_t pos;
+  uint8_t value; /* Facing, or spell id for fights */
+};
+
 struct applied_effect {
   uint8_t type; /*spell effect enum */
   uint8_t victim;
@@ -69,7 +98,8 @@ typedef struct {
     struct {
       coord_t width;
       coord_t height;
-      uint8_t *data;
+      /* Floor, portal and player bit planes, one bit per cell in row order */
+      uint64_t *data;
 
       uint8_t num_players;
       uint8_t num_portals;
@@ -145,15 +175,47 @@ typedef struct {
       struct incident *events;
       uint32_t num_events;
 
+      /* Tick of the acked update this one is a delta against, 0 when it is
+       * complete. A delta only holds the LoS cells, others and portals that
+       * changed since, and lists what went out of sight. */
+      uint32_t base;
+      struct msg_opts los_gone;
+      uint8_t *others_gone;
+      uint8_t num_others_gone;
+
     } player_update;
 
+    /* Sent after every step that asks the players something or ends a turn,
+     * see engine_set_lockstep() */
+    struct {
+      /* Who it went to, only in the first one, which carries the state */
+      uint8_t player_id;
+      uint8_t flags; /* LOCKSTEP_ */
+      /* engine_state_hash() after step tick, with LOCKSTEP_HASHED */
+      uint64_t hash;
+      struct msg_input *inputs;
+      uint32_t num_inputs;
+      /* engine_snapshot_data() block to start from */
+      uint8_t *state;
+      uint32_t state_size;
+    } lockstep;
+
   } body;
 } message_t;
 
+/* Messages are built in one allocation. The builder adds up the sizes of the
+ * inner arrays with message_arena_size() and gets them from message_alloc(),
+ * message_unref() then frees everything at once. */
+message_t *message_new(uint32_t tick, enum message_type type, size_t arena);
+size_t message_arena_size(size_t count, size_t each);
+/* Zeroed, 8 byte aligned memory living as long as @param msg. Once the arena
+ * is used up it comes from malloc(), so a low estimate only costs speed. */
+void *message_alloc(message_t *msg, size_t count, size_t each);
+
 message_t *message_ask_ready(uint32_t tick);
 message_t *message_reply_ready(uint32_t tick);
 
-message_t *message_map(uint32_t tick);
+message_t *message_map(uint32_t tick, size_t arena);
 message_t *message_reply_map(uint32_t tick);
 
 message_t *message_ask_spawn(uint32_t tick, uint8_t player_id, uint32_t size,
@@ -163,12 +225,22 @@ message_t *message_reply_spawn(uint32_t tick, pos_t pos, uint8_t facing);
 message_t *message_ask_move(uint32_t tick, uint32_t size, pos_t *options);
 message_t *message_reply_move(uint32_t tick, pos_t pos, uint8_t facing);
 
-message_t *message_ask_fight(uint32_t tick);
+message_t *message_ask_fight(uint32_t tick, size_t arena);
 message_t *message_reply_fight(uint32_t tick, uint8_t spell_id, pos_t target);
 
-message_t *message_player_update(uint32_t tick);
+message_t *message_player_update(uint32_t tick, size_t arena);
 message_t *message_reply_player_update(uint32_t tick);
 
+message_t *message_lockstep(uint32_t tick, uint8_t player_id, uint8_t flags,
+                            uint64_t hash, uint32_t num_inputs,
+                            const struct msg_input *inputs,
+                            uint32_t state_size, const void *state);
+/* @param msg is a reply by @param player that counted for step @param tick */
+void message_to_input(message_t *msg, uint8_t player, uint32_t tick,
+                      struct msg_input *input);
+/* The reply back from @param input */
+message_t *message_from_input(const struct msg_input *input);
+
 message_t *message_report(uint32_t tick);
 message_t *message_reply_report(uint32_t tick);
 message_t *message_ref(message_t *msg);
@@ -0,0 +1,129 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "occupancy.h"
+
+/* Cells and links hold id + 1, so 0 is an empty cell or the end of a list */
+struct occupancy_ctx {
+  coord_t width;
+  coord_t height;
+  uint16_t *head;
+  uint16_t *portal;
+
+  uint8_t num_players;
+  pos_t *at;
+  uint16_t *next;
+};
+
+static inline bool in(occupancy_t *ctx, pos_t p) {
+  return p.x < ctx->width && p.y < ctx->height && p.x >= 0 && p.y >= 0;
+}
+
+static inline uint32_t to_id(occupancy_t *ctx, pos_t pos) {
+  return pos.y * ctx->width + pos.x;
+}
+
+occupancy_t *occupancy_new(coord_t width, coord_t height, uint8_t num_players) {
+  occupancy_t *ctx;
+
+  ctx = malloc(sizeof(*ctx));
+  ctx->width = width;
+  ctx->height = height;
+  ctx->head = calloc(width * height, sizeof(*ctx->head));
+  ctx->portal = calloc(width * height, sizeof(*ctx->portal));
+  ctx->num_players = num_players;
+  ctx->at = malloc(num_players * sizeof(*ctx->at));
+  ctx->next = calloc(num_players, sizeof(*ctx->next));
+
+  for (uint8_t i = 0; i < num_players; i++) {
+    ctx->at[i] = POSITION_UNKNOWN;
+  }
+
+  return ctx;
+}
+
+void occupancy_free(occupancy_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  free(ctx->head);
+  free(ctx->portal);
+  free(ctx->at);
+  free(ctx->next);
+  free(ctx);
+}
+
+static void unlink_player(occupancy_t *ctx, uint8_t id) {
+  uint16_t *link;
+
+  if (!in(ctx, ctx->at[id])) {
+    return;
+  }
+
+  link = &ctx->head[to_id(ctx, ctx->at[id])];
+  while (*link != id + 1) {
+    link = &ctx->next[*link - 1];
+  }
+  *link = ctx->next[id];
+  ctx->next[id] = 0;
+}
+
+static void link_player(occupancy_t *ctx, uint8_t id) {
+  uint16_t *link;
+
+  if (!in(ctx, ctx->at[id])) {
+    return;
+  }
+
+  link = &ctx->head[to_id(ctx, ctx->at[id])];
+  while (*link != 0 && *link < id + 1) {
+    link = &ctx->next[*link - 1];
+  }
+  ctx->next[id] = *link;
+  *link = id + 1;
+}
+
+void occupancy_move_player(occupancy_t *ctx, uint8_t id, pos_t to) {
+  if (id >= ctx->num_players) {
+    return;
+  }
+
+  unlink_player(ctx, id);
+  ctx->at[id] = to;
+  link_player(ctx, id);
+}
+
+int16_t occupancy_first_player(occupancy_t *ctx, pos_t pos) {
+  if (!in(ctx, pos)) {
+    return OCCUPANCY_NONE;
+  }
+
+  return (int16_t)ctx->head[to_id(ctx, pos)] - 1;
+}
+
+int16_t occupancy_next_player(occupancy_t *ctx, uint8_t id) {
+  return (int16_t)ctx->next[id] - 1;
+}
+
+bool occupancy_has_player(occupancy_t *ctx, pos_t pos) {
+  return occupancy_first_player(ctx, pos) != OCCUPANCY_NONE;
+}
+
+void occupancy_set_portal(occupancy_t *ctx, pos_t pos, uint8_t portal_id) {
+  if (!in(ctx, pos)) {
+    return;
+  }
+
+  ctx->portal[to_id(ctx, pos)] = portal_id + 1;
+}
+
+int16_t occupancy_portal_at(occupancy_t *ctx, pos_t pos) {
+  if (!in(ctx, pos)) {
+    return OCCUPANCY_NONE;
+  }
+
+  return (int16_t)ctx->portal[to_id(ctx, pos)] - 1;
+}
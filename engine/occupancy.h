@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define OCCUPANCY_NONE -1
+
+/* Which players and portal are on each cell of the map. Every cell keeps its
+ * players linked in id order, so moving one player touches only the cells it
+ * leaves and enters. Positions off the map are not indexed. */
+typedef struct occupancy_ctx occupancy_t;
+
+occupancy_t *occupancy_new(coord_t width, coord_t height, uint8_t num_players);
+void occupancy_free(occupancy_t *ctx);
+
+void occupancy_move_player(occupancy_t *ctx, uint8_t id, pos_t to);
+
+/* Players at @param pos in id order:
+ * for (int16_t i = occupancy_first_player(o, pos); i != OCCUPANCY_NONE;
+ *      i = occupancy_next_player(o, i))
+ * Fetch the next id before moving player i. */
+int16_t occupancy_first_player(occupancy_t *ctx, pos_t pos);
+int16_t occupancy_next_player(occupancy_t *ctx, uint8_t id);
+bool occupancy_has_player(occupancy_t *ctx, pos_t pos);
+
+void occupancy_set_portal(occupancy_t *ctx, pos_t pos, uint8_t portal_id);
+int16_t occupancy_portal_at(occupancy_t *ctx, pos_t pos);
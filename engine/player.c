@@ -7,25 +7,108 @@
 #include "player.h"
 #include "spell.h"
 
-static struct player_effect *time_effect(struct player_effect *eff) {
-  struct player_effect *next;
+/* Room for effects each player starts with, doubled for all when one of
+ * them runs out */
+#define EFFECTS_CAPACITY 4
 
-  if (eff == NULL) {
+static struct player_effects *effects_new(uint32_t num_players) {
+  struct player_effects *fx;
+  size_t size = (size_t)num_players * EFFECTS_CAPACITY;
+
+  fx = malloc(sizeof(*fx));
+
+  fx->num_players = num_players;
+  fx->capacity = EFFECTS_CAPACITY;
+  fx->turn = 0;
+  fx->eff = calloc(size, sizeof(*fx->eff));
+  fx->expires = calloc(size, sizeof(*fx->expires));
+  fx->spell = calloc(size, sizeof(*fx->spell));
+  fx->caster = calloc(size, sizeof(*fx->caster));
+
+  return fx;
+}
+
+static void effects_free(struct player_effects *fx) {
+  if (fx == NULL) {
+    return;
+  }
+  free(fx->eff);
+  free(fx->expires);
+  free(fx->spell);
+  free(fx->caster);
+  free(fx);
+}
+
+/* Copies the players' runs of @param size byte entries from @param from to
+ * @param to entries each into a new column, NULL if there is no memory */
+static void *grow_column(const void *column, uint32_t num_players,
+                         uint32_t from, uint32_t to, size_t size) {
+  const uint8_t *old = column;
+  uint8_t *c;
+
+  c = malloc((size_t)num_players * to * size);
+  if (c == NULL) {
     return NULL;
   }
 
-  eff->duration--;
+  for (uint32_t i = 0; i < num_players; i++) {
+    memcpy(c + i * to * size, old + i * from * size, from * size);
+  }
+  return c;
+}
 
-  if (eff->duration > 0) {
-    eff->next = time_effect(eff->next);
+/* False if the player already has as many effects as messages can carry, or
+ * there is no memory for more. The columns are only swapped once all of them
+ * grew, so they stay as they were otherwise. */
+static bool make_room(player_t *ctx) {
+  struct player_effects *fx = ctx->effects;
+  uint32_t n = fx->num_players;
+  uint32_t from = fx->capacity;
+  struct spell_effect *eff;
+  uint32_t *expires;
+  const spell_t **spell;
+  uint8_t *caster;
+  uint32_t to = from * 2;
+
+  if (ctx->num_effects < from) {
+    return true;
+  }
+  if (ctx->num_effects == UINT8_MAX) {
+    return false;
+  }
 
-    return eff;
+  eff = grow_column(fx->eff, n, from, to, sizeof(*fx->eff));
+  expires = grow_column(fx->expires, n, from, to, sizeof(*fx->expires));
+  spell = grow_column(fx->spell, n, from, to, sizeof(*fx->spell));
+  caster = grow_column(fx->caster, n, from, to, sizeof(*fx->caster));
+  if (eff == NULL || expires == NULL || spell == NULL || caster == NULL) {
+    free(eff);
+    free(expires);
+    free(spell);
+    free(caster);
+    return false;
   }
 
-  next = eff->next;
-  free(eff);
+  free(fx->eff);
+  free(fx->expires);
+  free(fx->spell);
+  free(fx->caster);
+  fx->eff = eff;
+  fx->expires = expires;
+  fx->spell = spell;
+  fx->caster = caster;
+  fx->capacity = to;
+
+  return true;
+}
+
+static bool is_mod(enum spell_effect_types type) {
+  return type >= SPELL_EFFECT_DAMAGE_MOD && type <= SPELL_EFFECT_BE_HIT_MOD;
+}
 
-  return time_effect(next);
+static void clear_effects(player_t *ctx) {
+  ctx->num_effects = 0;
+  memset(ctx->mods, 0, sizeof(ctx->mods));
 }
 
 static void reset(player_t *ctx) {
@@ -37,11 +120,10 @@ static void reset(player_t *ctx) {
   map_opts_free(ctx->los);
   ctx->los = NULL;
   ctx->los = map_opts_new(1);
+  map_bits_free(ctx->los_set);
+  ctx->los_set = NULL;
 
-  for (struct player_effect *eff = ctx->effects; eff != NULL; eff = eff->next) {
-    eff->duration = 0;
-  }
-  ctx->effects = time_effect(ctx->effects);
+  clear_effects(ctx);
 
   for (uint8_t i = 0; i < PORTAL_NONE; i++) {
     ctx->spells[i] = NULL;
@@ -51,119 +133,280 @@ static void reset(player_t *ctx) {
 player_t *player_new(uint32_t id) {
   player_t *ctx;
 
-  ctx = malloc(sizeof(*ctx));
-
-  ctx->facing = DIRECTION_ANY;
+  ctx = player_create(1);
   ctx->id = id;
-  ctx->kills = 0;
-  ctx->deaths = 0;
 
-  reset(ctx);
   return ctx;
 }
 
 player_t *player_create(uint32_t num) {
   player_t *players;
+  struct player_effects *effects;
 
   players = malloc(sizeof(*players) * num);
 
   memset(players, 0, sizeof(*players) * num);
 
+  effects = effects_new(num);
+
   for (uint32_t i = 0; i < num; i++) {
     players[i].facing = DIRECTION_ANY;
     players[i].id = i;
+    players[i].index = i;
+    players[i].effects = effects;
   }
 
   return players;
 }
 
+void player_destroy(player_t *players, uint32_t num) {
+  if (players == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < num; i++) {
+    reset(&players[i]);
+    map_opts_free(players[i].los);
+  }
+  if (num > 0) {
+    effects_free(players[0].effects);
+  }
+  free(players);
+}
+
+/* Fields are written one by one and spells as their ids, so the block holds
+ * no pointers */
+size_t player_save(player_t *players, uint32_t num, uint8_t *buf, size_t at) {
+  struct player_effects *fx = players->effects;
+
+  at = common_put(buf, at, &fx->turn, sizeof(fx->turn));
+
+  for (uint32_t i = 0; i < num; i++) {
+    player_t *p = &players[i];
+    uint32_t first = player_effect_at(p, 0);
+
+    at = common_put(buf, at, &p->facing, sizeof(p->facing));
+    at = common_put(buf, at, &p->position, sizeof(p->position));
+    for (uint8_t j = 0; j < PORTAL_NONE; j++) {
+      uint8_t spell = p->spells[j] != NULL ? p->spells[j]->id : 0;
+
+      at = common_put(buf, at, &spell, sizeof(spell));
+    }
+    at = common_put(buf, at, p->charges, sizeof(p->charges));
+    at = common_put(buf, at, &p->health, sizeof(p->health));
+    at = common_put(buf, at, &p->kills, sizeof(p->kills));
+    at = common_put(buf, at, &p->deaths, sizeof(p->deaths));
+    at = common_put(buf, at, &p->updated, sizeof(p->updated));
+    at = common_put(buf, at, &p->activated_spell, sizeof(p->activated_spell));
+    at = common_put(buf, at, &p->injured_by, sizeof(p->injured_by));
+    at = common_put(buf, at, &p->tagged, sizeof(p->tagged));
+    at = map_opts_save(p->los, buf, at);
+    at = map_bits_save(p->los_set, buf, at);
+
+    at = common_put(buf, at, &p->num_effects, sizeof(p->num_effects));
+    at = common_put(buf, at, p->mods, sizeof(p->mods));
+    for (uint8_t j = 0; j < p->num_effects; j++) {
+      uint8_t spell = fx->spell[first + j]->id;
+
+      at = common_put(buf, at, &fx->eff[first + j], sizeof(*fx->eff));
+      at = common_put(buf, at, &fx->expires[first + j], sizeof(*fx->expires));
+      at = common_put(buf, at, &spell, sizeof(spell));
+      at = common_put(buf, at, &fx->caster[first + j], sizeof(*fx->caster));
+    }
+  }
+  return at;
+}
+
+/* Spells are kept as pointers, so ids no spell has break the block */
+static const spell_t *restore_spell(struct common_reader *r) {
+  uint8_t id = 0;
+  const spell_t *spell;
+
+  common_read(r, &id, sizeof(id));
+  spell = spell_get_by_id(id);
+  if (id != 0 && spell == NULL) {
+    r->broken = true;
+  }
+  return spell;
+}
+
+void player_restore(player_t *players, uint32_t num, struct common_reader *r) {
+  struct player_effects *fx = players->effects;
+  /* What player_save() writes per effect */
+  size_t each = sizeof(*fx->eff) + sizeof(*fx->expires) + sizeof(uint8_t) +
+                sizeof(*fx->caster);
+
+  common_read(r, &fx->turn, sizeof(fx->turn));
+
+  for (uint32_t i = 0; i < num && !r->broken; i++) {
+    player_t *p = &players[i];
+    uint8_t num_effects = 0;
+
+    common_read(r, &p->facing, sizeof(p->facing));
+    common_read(r, &p->position, sizeof(p->position));
+    for (uint8_t j = 0; j < PORTAL_NONE; j++) {
+      p->spells[j] = restore_spell(r);
+    }
+    common_read(r, p->charges, sizeof(p->charges));
+    common_read(r, &p->health, sizeof(p->health));
+    common_read(r, &p->kills, sizeof(p->kills));
+    common_read(r, &p->deaths, sizeof(p->deaths));
+    common_read(r, &p->updated, sizeof(p->updated));
+    common_read(r, &p->activated_spell, sizeof(p->activated_spell));
+    common_read(r, &p->injured_by, sizeof(p->injured_by));
+    common_read(r, &p->tagged, sizeof(p->tagged));
+    if (p->los == NULL) {
+      p->los = map_opts_new(1);
+    }
+    map_opts_restore(p->los, r);
+    map_bits_restore(&p->los_set, r);
+    if (p->activated_spell > PORTAL_NONE) {
+      r->broken = true;
+    }
+
+    common_read(r, &num_effects, sizeof(num_effects));
+    common_read(r, p->mods, sizeof(p->mods));
+    p->num_effects = 0;
+    if (!common_has(r, num_effects, each)) {
+      break;
+    }
+    while (p->num_effects < num_effects && !r->broken) {
+      uint32_t e;
+
+      /* What is left of the block would be read as the next player */
+      if (!make_room(p)) {
+        r->broken = true;
+        break;
+      }
+      e = player_effect_at(p, p->num_effects++);
+
+      common_read(r, &fx->eff[e], sizeof(*fx->eff));
+      common_read(r, &fx->expires[e], sizeof(*fx->expires));
+      fx->spell[e] = restore_spell(r);
+      common_read(r, &fx->caster[e], sizeof(*fx->caster));
+      if (fx->spell[e] == NULL || fx->caster[e] >= num) {
+        r->broken = true;
+      }
+    }
+  }
+}
+
 void player_tag(player_t *ctx, uint8_t other_id) {
-  ctx->tagged |= (1 << other_id);
+  ctx->tagged |= (uint64_t)1 << other_id;
 }
 
 bool player_is_tagged(player_t *ctx, uint8_t other_id) {
-  return (ctx->tagged & (1 << other_id)) > 0;
+  return (ctx->tagged & (uint64_t)1 << other_id) > 0;
 }
 
 void player_clear_tags(player_t *ctx) { ctx->tagged = 0; }
 
-void player_add_effect(player_t *ctx, struct spell_effect from,
-                       spell_effect_value_t value, int duration,
-                       const spell_t *spell, player_t *caster) {
-
-  struct player_effect *eff;
+uint32_t player_add_effect(player_t *ctx, struct spell_effect from,
+                           int duration, const spell_t *spell,
+                           player_t *caster) {
+  struct player_effects *fx = ctx->effects;
+  uint32_t expires = fx->turn + (duration > 0 ? duration : 0);
+  uint32_t at;
 
-  eff = calloc(1, sizeof(*eff));
+  if (!make_room(ctx)) {
+    common_log("Player %u has too many effects\n", ctx->id);
+    return fx->turn;
+  }
 
-  eff->eff = from;
-  eff->value = value;
-  eff->duration = duration;
-  eff->spell = spell;
-  eff->caster = caster;
+  at = player_effect_at(ctx, ctx->num_effects++);
+  fx->eff[at] = from;
+  fx->expires[at] = expires;
+  fx->spell[at] = spell;
+  fx->caster[at] = caster->id;
 
-  if (ctx->effects == NULL) {
-    ctx->effects = eff;
-  } else {
-    struct player_effect *e;
-    for (e = ctx->effects; e->next != NULL; e = e->next)
-      ;
-    e->next = eff;
+  if (is_mod(from.type)) {
+    ctx->mods[from.type - SPELL_EFFECT_DAMAGE_MOD] += from.params.mod.value;
   }
+  return expires;
 }
 
-void player_time_effects(player_t *ctx) {
-  ctx->effects = time_effect(ctx->effects);
+void player_effects_turn(player_t *players, uint32_t turn) {
+  players->effects->turn = turn;
 }
 
+void player_expire_effects(player_t *ctx) {
+  struct player_effects *fx = ctx->effects;
+  uint32_t first = player_effect_at(ctx, 0);
+  uint8_t kept = 0;
+
+  for (uint8_t i = 0; i < ctx->num_effects; i++) {
+    uint32_t at = first + i;
+
+    if (fx->expires[at] <= fx->turn) {
+      if (is_mod(fx->eff[at].type)) {
+        ctx->mods[fx->eff[at].type - SPELL_EFFECT_DAMAGE_MOD] -=
+            fx->eff[at].params.mod.value;
+      }
+      continue;
+    }
+
+    if (kept != i) {
+      fx->eff[first + kept] = fx->eff[at];
+      fx->expires[first + kept] = fx->expires[at];
+      fx->spell[first + kept] = fx->spell[at];
+      fx->caster[first + kept] = fx->caster[at];
+    }
+    kept++;
+  }
+  ctx->num_effects = kept;
+}
+
+/* Messages only carry the spell and the turns left, so that is all a client
+ * knows of the effects */
 static void player_set_effects(player_t *ctx, struct msg_spell *effects,
                                uint8_t num_effects) {
-  struct player_effect *eff;
-  struct player_effect *last;
-  for (struct player_effect *eff = ctx->effects; eff != NULL; eff = eff->next) {
-    eff->duration = 0;
-  }
-  ctx->effects = time_effect(ctx->effects);
+  struct player_effects *fx = ctx->effects;
+
+  clear_effects(ctx);
 
   for (uint8_t i = 0; i < num_effects; i++) {
-    eff = calloc(1, sizeof(*eff));
+    const spell_t *spell = spell_get_by_id(effects[i].id);
+    uint32_t at;
 
-    if (ctx->effects == NULL) {
-      ctx->effects = eff;
-    } else {
-      last->next = eff;
+    /* player_effects_to_msg() needs the spell */
+    if (spell == NULL) {
+      continue;
+    }
+    if (!make_room(ctx)) {
+      break;
     }
-    last = eff;
 
-    eff->duration = effects[i].charges;
-    eff->spell = spell_get_by_id(effects[i].id);
+    at = player_effect_at(ctx, ctx->num_effects++);
+    memset(&fx->eff[at], 0, sizeof(fx->eff[at]));
+    fx->expires[at] = fx->turn + effects[i].charges;
+    fx->spell[at] = spell;
+    fx->caster[at] = 0;
   }
 }
 
-void player_add_effects_to_msg(player_t *ctx, struct msg_spell **effect,
-                               uint8_t *num_effect) {
+uint8_t player_num_effects(player_t *ctx) { return ctx->num_effects; }
 
-  *num_effect = 0;
-  for (struct player_effect *eff = ctx->effects; eff != NULL; eff = eff->next) {
-    *num_effect = *num_effect + 1;
-  }
-  if (*num_effect == 0) {
-    return;
-  }
-  *effect = malloc(sizeof(**effect) * (*num_effect));
-  uint8_t i = 0;
-  for (struct player_effect *eff = ctx->effects; eff != NULL; eff = eff->next) {
-    (*effect)[i].id = eff->spell->id;
-    (*effect)[i].charges = eff->duration;
+uint8_t player_effects_to_msg(player_t *ctx, struct msg_spell *effects) {
+  struct player_effects *fx = ctx->effects;
+  uint32_t first = player_effect_at(ctx, 0);
 
-    i++;
+  for (uint8_t i = 0; i < ctx->num_effects; i++) {
+    effects[i].id = fx->spell[first + i]->id;
+    effects[i].charges = fx->expires[first + i] - fx->turn;
   }
+  return ctx->num_effects;
 }
 
 void player_batch_update(player_t *ctx, uint32_t num_players, message_t *msg) {
   player_t *me;
 
-  for (uint32_t i = 0; i < num_players; i++) {
-    ctx[i].position = POSITION_UNKNOWN;
+  if (msg->body.player_update.base == 0) {
+    for (uint32_t i = 0; i < num_players; i++) {
+      ctx[i].position = POSITION_UNKNOWN;
+    }
+  }
+  for (uint8_t i = 0; i < msg->body.player_update.num_others_gone; i++) {
+    ctx[msg->body.player_update.others_gone[i]].position = POSITION_UNKNOWN;
   }
 
   for (uint8_t i = 0; i < msg->body.player_update.num_others; i++) {
@@ -201,12 +444,25 @@ void player_batch_update(player_t *ctx, uint32_t num_players, message_t *msg) {
                      msg->body.player_update.num_effects);
 }
 
+void player_los_update(map_opts_t *los, message_t *msg) {
+  if (msg->body.player_update.base == 0) {
+    los->size = 0;
+  }
+  for (uint32_t i = 0; i < msg->body.player_update.los_gone.size; i++) {
+    map_opts_delete(los, msg->body.player_update.los_gone.opts[i]);
+  }
+  for (uint32_t i = 0; i < msg->body.player_update.los.size; i++) {
+    map_opts_append(los, msg->body.player_update.los.opts[i]);
+  }
+}
+
 void player_killed(player_t *ctx) {
   reset(ctx);
   ctx->deaths++;
 }
 
-void player_spawn(player_t *ctx, pos_t pos, enum direction facing) {
+void player_spawn(player_t *ctx, pos_t pos, enum direction facing,
+                  rng_t *rng) {
 
   enum portal_type spell_kind;
 
@@ -214,12 +470,13 @@ void player_spawn(player_t *ctx, pos_t pos, enum direction facing) {
   ctx->position = pos;
   ctx->health = 100;
 
-  spell_kind = rand() % PORTAL_NONE;
+  spell_kind = rng_below(rng, PORTAL_NONE);
 
-  ctx->spells[spell_kind] = spell_get_random(spell_kind);
+  ctx->spells[spell_kind] = spell_get_random(spell_kind, rng);
   ctx->charges[spell_kind] = ctx->spells[spell_kind]->charges;
 
-  printf("PLayer %u got spell %s\n", ctx->id, ctx->spells[spell_kind]->name);
+  common_log("PLayer %u got spell %s\n", ctx->id,
+             ctx->spells[spell_kind]->name);
 }
 
 void player_client_send_msg(player_t *ctx, message_t *msg) {
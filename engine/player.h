@@ -3,23 +3,36 @@
 #include <stdint.h>
 
 #include "common.h"
+#include "map_bits.h"
 #include "map_opts.h"
 #include "message.h"
+#include "rng.h"
 #include "spell.h"
 
+/* Most players in a match, other players are tracked in 64 bit masks */
+#define PLAYER_MAX 64
+
 typedef struct player_ctx player_t;
 
 typedef void (*player_send_msg_func_t)(void *user_data, message_t *msg);
 typedef message_t *(*player_get_msg_func_t)(void *user_data);
 typedef void (*player_new_msg_func_t)(message_t *message, void *user_data);
 
-struct player_effect {
-  struct spell_effect eff;
-  spell_effect_value_t value;
-  int duration;
-  const spell_t *spell;
-  player_t *caster;
-  struct player_effect *next;
+/* Modifier effects, from SPELL_EFFECT_DAMAGE_MOD on, that have totals */
+#define PLAYER_MODS (SPELL_EFFECT_BE_HIT_MOD - SPELL_EFFECT_DAMAGE_MOD + 1)
+
+/* Ongoing effects of all players in a block from player_create(), a column
+ * per field. Player i has its effects at i * capacity on, oldest first.
+ * Effects run out at a turn rather than counting down, see
+ * player_effects_turn(). */
+struct player_effects {
+  uint32_t num_players;
+  uint32_t capacity;
+  uint32_t turn;
+  struct spell_effect *eff;
+  uint32_t *expires;
+  const spell_t **spell;
+  uint8_t *caster;
 };
 
 struct player_ctx {
@@ -34,13 +47,21 @@ struct player_ctx {
   uint32_t updated;
 
   map_opts_t *los;
+  map_bits_t *los_set; /* Same cells as los, for lookups */
 
   enum portal_type activated_spell;
 
-  uint32_t injured_by;
-  uint32_t tagged;
+  /* Bit per player id, see PLAYER_MAX */
+  uint64_t injured_by;
+  uint64_t tagged;
 
-  struct player_effect *effects;
+  /* Place in the block from player_create(), for the effects columns */
+  uint32_t index;
+  struct player_effects *effects;
+  uint8_t num_effects;
+  /* Sum of the values of each kind of modifier effect, wide enough for as
+   * many effects as a player can have */
+  int16_t mods[PLAYER_MODS];
 
   struct {
     player_send_msg_func_t client_send;
@@ -56,24 +77,54 @@ struct player_ctx {
   } brain;
 };
 
+/* A block of one, free it with player_destroy() */
 player_t *player_new(uint32_t id);
 player_t *player_create(uint32_t num);
-
-void player_add_effect(player_t *ctx, struct spell_effect from,
-                       spell_effect_value_t value, int duration,
-                       const spell_t *spell, player_t *caster);
-void player_time_effects(player_t *ctx);
-void player_add_effects_to_msg(player_t *ctx, struct msg_spell **effect,
-                               uint8_t *num_effect);
+/* Frees a block from player_create() */
+void player_destroy(player_t *players, uint32_t num);
+
+/* Everything about a block of players but their brains, written at @param at
+ * of @param buf, see common_put() */
+size_t player_save(player_t *players, uint32_t num, uint8_t *buf, size_t at);
+/* Reads what player_save() wrote into a block of as many players */
+void player_restore(player_t *players, uint32_t num, struct common_reader *r);
+
+/* Returns the turn the effect runs out at */
+uint32_t player_add_effect(player_t *ctx, struct spell_effect from,
+                           int duration, const spell_t *spell,
+                           player_t *caster);
+/* Sets the turn the effects of the block of @param players are at, the
+ * durations sent in updates count down from it */
+void player_effects_turn(player_t *players, uint32_t turn);
+/* Drops the effects that have run out by the turn the block is at */
+void player_expire_effects(player_t *ctx);
+uint8_t player_num_effects(player_t *ctx);
+/* Where effect @param i of the player is in the effects columns */
+static inline uint32_t player_effect_at(player_t *ctx, uint8_t i) {
+  return ctx->index * ctx->effects->capacity + i;
+}
+/* Total of the modifier effects of @param type on the player, held to what
+ * an int8_t takes */
+static inline int8_t player_mod(player_t *ctx, enum spell_effect_types type) {
+  int16_t total = ctx->mods[type - SPELL_EFFECT_DAMAGE_MOD];
+
+  return total < INT8_MIN ? INT8_MIN : total > INT8_MAX ? INT8_MAX : total;
+}
+/* Writes the effects as sent in messages, @param effects needs room for
+ * player_num_effects(). Returns how many there are. */
+uint8_t player_effects_to_msg(player_t *ctx, struct msg_spell *effects);
 
 /* Note that @param firs is a pointer to the memory block from players_create */
 void player_batch_update(player_t *first, uint32_t num_players, message_t *msg);
+/* Brings @param los, the cells the player saw so far, up to date */
+void player_los_update(map_opts_t *los, message_t *msg);
 
 void player_tag(player_t *ctx, uint8_t other_id);
 bool player_is_tagged(player_t *ctx, uint8_t other_id);
 void player_clear_tags(player_t *ctx);
 
-void player_spawn(player_t *ctx, pos_t pos, enum direction facing);
+void player_spawn(player_t *ctx, pos_t pos, enum direction facing,
+                  rng_t *rng);
 void player_killed(player_t *ctx);
 
 void player_client_send_msg(player_t *ctx, message_t *msg);
@@ -1,16 +1,61 @@
-#include <stdio.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "message.h"
 #include "player_local.h"
 
+/* Messages in flight per direction, a power of two. The engine sends a few
+ * messages per turn before it waits for the client, so this is plenty. */
+#define RING_SIZE 256
+#define CACHE_LINE 64
+
+/* Single producer, single consumer. Each index is only written by its own
+ * side and sits on its own cache line. */
+struct ring {
+  _Atomic uint32_t head; /* Next to take, moved by the consumer */
+  char pad_head[CACHE_LINE - sizeof(uint32_t)];
+  _Atomic uint32_t tail; /* Next free slot, moved by the producer */
+  char pad_tail[CACHE_LINE - sizeof(uint32_t)];
+  message_t *msgs[RING_SIZE];
+};
+
 struct ctx {
   char tag[4];
-  message_t *to_client;
-  message_t *to_server;
+  struct ring to_client;
+  struct ring to_server;
 };
 
+/* Waits for room instead of dropping anything, so the other side has to be
+ * reading on another thread once a ring is full */
+static void ring_push(struct ring *r, message_t *msg) {
+  uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+  while (tail - atomic_load_explicit(&r->head, memory_order_acquire) ==
+         RING_SIZE) {
+    sched_yield();
+  }
+
+  r->msgs[tail & (RING_SIZE - 1)] = msg;
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+static message_t *ring_pop(struct ring *r) {
+  uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  message_t *msg;
+
+  if (head == atomic_load_explicit(&r->tail, memory_order_acquire)) {
+    return NULL;
+  }
+
+  msg = r->msgs[head & (RING_SIZE - 1)];
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+  return msg;
+}
+
 void *player_local_new(void) {
   struct ctx *c;
 
@@ -18,80 +63,73 @@ void *player_local_new(void) {
 
   strcpy(c->tag, "PLC");
 
-  c->to_client = NULL;
-  c->to_server = NULL;
+  atomic_init(&c->to_client.head, 0);
+  atomic_init(&c->to_client.tail, 0);
+  atomic_init(&c->to_server.head, 0);
+  atomic_init(&c->to_server.tail, 0);
 
   return c;
 }
 
 void player_local_free(void **data) {
-  struct ctx *c = (struct ctx *)(*data);
+  struct ctx *c;
+  message_t *msg;
 
-  if (data == NULL || strcmp(c->tag, "PLC") != 0) {
+  if (data == NULL || *data == NULL) {
+    return;
+  }
+  c = (struct ctx *)(*data);
+  if (strcmp(c->tag, "PLC") != 0) {
     return;
   }
 
-  message_unref(c->to_client);
-  message_unref(c->to_server);
+  while ((msg = ring_pop(&c->to_client)) != NULL) {
+    message_unref(msg);
+  }
+  while ((msg = ring_pop(&c->to_server)) != NULL) {
+    message_unref(msg);
+  }
 
   free(c);
   *data = NULL;
 }
 
 message_t *player_local_get(void *ctx) {
-  message_t *tmp;
   struct ctx *c = (struct ctx *)(ctx);
 
   if (c == NULL) {
     return NULL;
   }
-  tmp = c->to_client;
-
-  c->to_client = NULL;
 
-  return tmp;
+  return ring_pop(&c->to_client);
 }
 
 void player_local_send(void *ctx, message_t *msg) {
   struct ctx *c = (struct ctx *)(ctx);
 
-  if (c == NULL) {
+  if (c == NULL || msg == NULL) {
     return;
   }
 
-  if (c->to_server != NULL) {
-    printf("OVERWRITING CLIENT MESSAGE!!!!!");
-    message_unref(c->to_server);
-  }
-
-  c->to_server = message_ref(msg);
+  ring_push(&c->to_server, message_ref(msg));
 }
 
 message_t *player_local_server_get(void *ctx) {
-  message_t *tmp;
   struct ctx *c = (struct ctx *)(ctx);
 
   if (c == NULL) {
     return NULL;
   }
-  tmp = c->to_server;
-
-  c->to_server = NULL;
 
-  return tmp;
+  return ring_pop(&c->to_server);
 }
 
 void player_local_server_send(void *ctx, message_t *msg) {
   struct ctx *c = (struct ctx *)(ctx);
 
-  if (c == NULL) {
+  if (c == NULL || msg == NULL) {
     return;
   }
 
-  if (c->to_client != NULL) {
-    printf("OVERWRITING SERVER MESSAGE!!!!!");
-    message_unref(c->to_client);
-  }
-
-  c->to_client = message_ref(msg);
+  ring_push(&c->to_client, message_ref(msg));
 }
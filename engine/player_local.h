@@ -2,6 +2,11 @@
 
 #include "message.h"
 
+/* Connects a client in the same process to the engine. Each direction is a
+ * lock-free queue with one sender and one reader, so the engine and the
+ * client can run on separate threads. Sending takes a reference, getting
+ * hands it over to the caller. */
+
 void* player_local_new(void);
 
 void player_local_free(void** ctx);
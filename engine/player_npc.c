@@ -4,11 +4,13 @@
 
 #include "common.h"
 #include "map.h"
+#include "map_bits.h"
 #include "map_opts.h"
 #include "message.h"
 #include "player.h"
 #include "player_npc.h"
 #include "portals.h"
+#include "rng.h"
 #include "spell.h"
 
 #define ACCEPTABLE_LOS 45
@@ -22,9 +24,11 @@ struct ctx {
   player_t *players;
   uint8_t player_count;
   map_opts_t *poi;
+  map_bits_t *poi_set;
+  rng_t rng;
 };
 
-void *player_npc_new(void) {
+void *player_npc_new(uint32_t seed) {
   struct ctx *c;
 
   c = malloc(sizeof(*c));
@@ -33,6 +37,12 @@ void *player_npc_new(void) {
 
   c->to_server = NULL;
   c->poi = map_opts_new(20);
+  c->poi_set = NULL;
+  c->map = NULL;
+  c->portals = NULL;
+  c->players = NULL;
+  c->player_count = 0;
+  rng_seed(&c->rng, seed);
 
   return c;
 }
@@ -47,6 +57,10 @@ void player_npc_free(void **data) {
   message_unref(c->to_server);
 
   map_opts_free(c->poi);
+  map_bits_free(c->poi_set);
+  map_free(c->map);
+  portals_free(c->portals);
+  player_destroy(c->players, c->player_count);
   free(c);
   *data = NULL;
 }
@@ -69,26 +83,38 @@ message_t *player_npc_server_get(void *ctx) {
 static void reply(struct ctx *ctx, message_t *msg) {
 
   if (ctx->to_server != NULL) {
-    printf("Warning: NPC -> server message not collected\n");
+    common_log("Warning: NPC -> server message not collected\n");
     message_unref(ctx->to_server);
   }
   ctx->to_server = msg;
 }
 
+static void poi_add(struct ctx *ctx, pos_t pos) {
+  if (map_bits_add(ctx->poi_set, pos)) {
+    map_opts_append(ctx->poi, pos);
+  }
+}
+
+static void poi_delete(struct ctx *ctx, pos_t pos) {
+  if (map_bits_delete(ctx->poi_set, pos)) {
+    map_opts_delete(ctx->poi, pos);
+  }
+}
+
 static pos_t select_move(struct ctx *ctx, pos_t *opts, uint32_t opts_num) {
   pos_t pos = POSITION_UNKNOWN;
   uint8_t spell_opts = 0;
 
   map_opts_t *inc = NULL;
 
-  printf("======= DETERMINING MOVE ===========\n");
+  common_log("======= DETERMINING MOVE ===========\n");
   /*
-   printf("Starting position: (%d,%d)\n", ctx->me->position.x,
-          ctx->me->position.y);
-   printf("Options: ");
+   common_log("Starting position: (%d,%d)\n", ctx->me->position.x,
+              ctx->me->position.y);
+   common_log("Options: ");
  */
   if (opts_num == 0) {
-    printf("No options provided! \n");
+    common_log("No options provided! \n");
     return ctx->me->position;
   }
   inc = map_opts_import(opts, opts_num);
@@ -102,7 +128,7 @@ static pos_t select_move(struct ctx *ctx, pos_t *opts, uint32_t opts_num) {
   }
 
   if (spell_opts < 2) {
-    printf("Not enough spells, hunt an active portal\n");
+    common_log("Not enough spells, hunt an active portal\n");
     map_opts_t *portals = map_opts_new(portals_num(ctx->portals));
 
     for (uint8_t i = 0; i < portals_num(ctx->portals); i++) {
@@ -115,57 +141,57 @@ static pos_t select_move(struct ctx *ctx, pos_t *opts, uint32_t opts_num) {
 
     pos_t target = map_closest(ctx->map, ctx->me->position, portals);
     if (!POS_IS_UNKNOWN(target)) {
-      printf("Found the closest portal: (%d,%d)\n", target.x, target.y);
+      common_log("Found the closest portal: (%d,%d)\n", target.x, target.y);
     } else {
-      printf("All portals too far away or not interesting\n");
+      common_log("All portals too far away or not interesting\n");
     }
     pos = map_closest(ctx->map, target, inc);
 
     map_opts_free(portals);
 
     if (!POS_IS_UNKNOWN(pos)) {
-      printf("Found the closest option in opts: (%d,%d)\n", pos.x, pos.y);
+      common_log("Found the closest option in opts: (%d,%d)\n", pos.x, pos.y);
 
       goto out;
     }
   }
 
   if (ctx->poi->size == 0) {
-    printf("No points of interest, picking at random\n");
-    pos = opts[rand() % opts_num];
+    common_log("No points of interest, picking at random\n");
+    pos = opts[rng_below(&ctx->rng, opts_num)];
     goto out;
   }
 
   for (uint32_t i = 0; i < opts_num; i++) {
-    if (map_opts_contains(ctx->poi, opts[i])) {
+    if (map_bits_contains(ctx->poi_set, opts[i])) {
       pos = opts[i];
-      printf("Points of interest, within reach, go there\n");
+      common_log("Points of interest, within reach, go there\n");
       goto out;
     }
   }
 
   pos_t target = map_closest(ctx->map, ctx->me->position, ctx->poi);
   if (!POS_IS_UNKNOWN(pos)) {
-    printf("Found the PoI: (%d,%d)\n", target.x, target.y);
+    common_log("Found the PoI: (%d,%d)\n", target.x, target.y);
   }
   pos = map_closest(ctx->map, target, inc);
 
   if (POS_IS_UNKNOWN(pos)) {
-    printf("Points of interest too far, picking at random\n");
-    pos = opts[rand() % opts_num];
+    common_log("Points of interest too far, picking at random\n");
+    pos = opts[rng_below(&ctx->rng, opts_num)];
   }
 
 out:
   map_opts_free(inc);
-  printf("Move to (%d,%d)\n", pos.x, pos.y);
-  printf(" ========= DONE SELECTING MOVE ===========\n");
+  common_log("Move to (%d,%d)\n", pos.x, pos.y);
+  common_log(" ========= DONE SELECTING MOVE ===========\n");
   return pos;
 }
 
 static uint8_t select_direction(struct ctx *ctx, pos_t pos) {
   uint8_t opts[DIRECTION_ANY];
-  uint32_t max;
-  uint8_t candidate;
+  uint32_t max = 0;
+  uint8_t candidate = 0;
 
   /* Pick out a direction resulting in a suitably big LOS if possible */
 
@@ -176,8 +202,8 @@ static uint8_t select_direction(struct ctx *ctx, pos_t pos) {
   for (uint8_t i = 0; i < DIRECTION_ANY; i++) {
     uint8_t from, to, tmp;
 
-    from = rand() % DIRECTION_ANY;
-    to = rand() % DIRECTION_ANY;
+    from = rng_below(&ctx->rng, DIRECTION_ANY);
+    to = rng_below(&ctx->rng, DIRECTION_ANY);
 
     tmp = opts[to];
     opts[to] = opts[from];
@@ -280,6 +306,7 @@ void player_npc_server_send(void *data, message_t *msg) {
     ctx->portals = portals_new_from_message(msg);
     ctx->player_count = msg->body.map.num_players;
     ctx->players = player_create(ctx->player_count);
+    ctx->poi_set = map_bits_new(map_width(ctx->map), map_height(ctx->map));
 
     ctx->to_server = message_reply_map(msg->tick);
     break;
@@ -325,7 +352,7 @@ void player_npc_server_send(void *data, message_t *msg) {
     for (uint8_t i = 0; i < portals_num(ctx->portals); i++) {
       portal_t *p = portals_get(ctx->portals, i);
       if (p->spell != NULL && ctx->me->spells[p->spell->kind] == NULL) {
-        map_opts_add(ctx->poi, p->position);
+        poi_add(ctx, p->position);
       }
     }
 
@@ -335,13 +362,15 @@ void player_npc_server_send(void *data, message_t *msg) {
       add =
           map_valid_moves(ctx->map, msg->body.player_update.events[i].from, 3);
 
-      map_opts_shuffle(add);
+      map_opts_shuffle(add, &ctx->rng);
 
-      map_opts_add(ctx->poi, add->data[0]);
+      if (add->size > 0) {
+        poi_add(ctx, add->data[0]);
+      }
       map_opts_free(add);
     }
 
-    map_opts_delete(ctx->poi, ctx->me->position);
+    poi_delete(ctx, ctx->me->position);
 
     reply(ctx, message_reply_player_update(msg->tick));
 
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "message.h"
 
-void* player_npc_new(void);
+/* @param seed makes the NPC decide the same way every time */
+void* player_npc_new(uint32_t seed);
 void player_npc_free(void** ctx);
 
 message_t * player_npc_server_get(void *ctx);
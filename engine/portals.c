@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "common.h"
 #include "message.h"
 #include "portals.h"
 #include "spell.h"
@@ -10,6 +11,10 @@ struct portals_ctx {
   uint32_t size;
   uint32_t capacity;
   portal_t *data;
+
+  /* Portals taken from since the last portals_activate() */
+  uint8_t *taken;
+  uint32_t num_taken;
 };
 
 portals_ctx_t *portals_new(uint32_t capacity) {
@@ -19,6 +24,8 @@ portals_ctx_t *portals_new(uint32_t capacity) {
   ctx->data = malloc(sizeof(*ctx->data) * capacity);
   ctx->size = 0;
   ctx->capacity = capacity;
+  ctx->taken = malloc(sizeof(*ctx->taken) * capacity);
+  ctx->num_taken = 0;
 
   spell_init();
 
@@ -32,6 +39,8 @@ portals_ctx_t *portals_new_from_message(message_t *msg) {
   ctx->data = malloc(sizeof(*ctx->data) * msg->body.map.num_portals);
   ctx->size = 0;
   ctx->capacity = msg->body.map.num_portals;
+  ctx->taken = malloc(sizeof(*ctx->taken) * ctx->capacity);
+  ctx->num_taken = 0;
 
   spell_init();
 
@@ -45,6 +54,7 @@ portals_ctx_t *portals_new_from_message(message_t *msg) {
     portal->kind = msg->body.map.portals[i].kind;
     portal->spell = NULL;
     portal->activate = UINT32_MAX;
+    portal->taken = false;
 
     ctx->size++;
   }
@@ -52,6 +62,16 @@ portals_ctx_t *portals_new_from_message(message_t *msg) {
   return ctx;
 }
 
+void portals_free(portals_ctx_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  free(ctx->data);
+  free(ctx->taken);
+  free(ctx);
+}
+
 void portals_update(portals_ctx_t *ctx, message_t *msg) {
   for (uint8_t i = 0; i < msg->body.player_update.num_portals; i++) {
 
@@ -70,6 +90,56 @@ void portals_update(portals_ctx_t *ctx, message_t *msg) {
   }
 }
 
+size_t portals_save(portals_ctx_t *ctx, uint8_t *buf, size_t at) {
+  at = common_put(buf, at, &ctx->size, sizeof(ctx->size));
+  for (uint32_t i = 0; i < ctx->size; i++) {
+    portal_t *portal = &ctx->data[i];
+    uint8_t spell = portal->spell != NULL ? portal->spell->id : 0;
+
+    at = common_put(buf, at, &spell, sizeof(spell));
+    at = common_put(buf, at, &portal->activate, sizeof(portal->activate));
+    at = common_put(buf, at, &portal->taken, sizeof(portal->taken));
+  }
+  at = common_put(buf, at, &ctx->num_taken, sizeof(ctx->num_taken));
+  return common_put(buf, at, ctx->taken, ctx->num_taken * sizeof(*ctx->taken));
+}
+
+void portals_restore(portals_ctx_t *ctx, struct common_reader *r) {
+  uint32_t size = 0;
+  uint32_t num_taken = 0;
+
+  common_read(r, &size, sizeof(size));
+  if (size != ctx->size) {
+    r->broken = true;
+    return;
+  }
+  for (uint32_t i = 0; i < ctx->size && !r->broken; i++) {
+    portal_t *portal = &ctx->data[i];
+    uint8_t spell = 0;
+
+    common_read(r, &spell, sizeof(spell));
+    common_read(r, &portal->activate, sizeof(portal->activate));
+    common_read(r, &portal->taken, sizeof(portal->taken));
+    portal->spell = spell_get_by_id(spell);
+    if (spell != 0 && portal->spell == NULL) {
+      r->broken = true;
+    }
+  }
+
+  common_read(r, &num_taken, sizeof(num_taken));
+  if (num_taken > ctx->capacity) {
+    r->broken = true;
+    return;
+  }
+  common_read(r, ctx->taken, num_taken * sizeof(*ctx->taken));
+  for (uint32_t i = 0; i < num_taken && !r->broken; i++) {
+    if (ctx->taken[i] >= ctx->size) {
+      r->broken = true;
+    }
+  }
+  ctx->num_taken = r->broken ? 0 : num_taken;
+}
+
 uint8_t portals_num(portals_ctx_t *ctx) {
   return ctx->size;
 }
@@ -81,21 +151,38 @@ portal_t *portals_get(portals_ctx_t *ctx, uint8_t id) {
   return &ctx->data[id];
 }
 
-void portals_add_kind(portals_ctx_t *ctx, enum portal_type kind, pos_t pos) {
+void portals_add_kind(portals_ctx_t *ctx, enum portal_type kind, pos_t pos,
+                      rng_t *rng) {
   portal_t *portal;
 
   if (ctx->size == ctx->capacity) {
-    ctx->capacity = ctx->capacity * 2;
-    // TODO: Fix NULL return
-    ctx->data = realloc(ctx->data, sizeof(*ctx->data) * ctx->capacity);
+    uint32_t capacity = ctx->capacity == 0 ? 16 : ctx->capacity * 2;
+    portal_t *data;
+    uint8_t *taken;
+
+    /* A grown data array is fine to keep with the old capacity */
+    data = realloc(ctx->data, sizeof(*ctx->data) * capacity);
+    if (data == NULL) {
+      common_log("No memory for another portal\n");
+      return;
+    }
+    ctx->data = data;
+    taken = realloc(ctx->taken, sizeof(*ctx->taken) * capacity);
+    if (taken == NULL) {
+      common_log("No memory for another portal\n");
+      return;
+    }
+    ctx->taken = taken;
+    ctx->capacity = capacity;
   }
 
   portal = &ctx->data[ctx->size];
 
   portal->position = pos;
   portal->kind = kind;
-  portal->spell = spell_get_random(kind);
+  portal->spell = spell_get_random(kind, rng);
   portal->activate = UINT32_MAX;
+  portal->taken = false;
 
   ctx->size++;
 }
@@ -110,24 +197,40 @@ portal_t *portals_get_at(portals_ctx_t *ctx, pos_t pos) {
   return NULL;
 }
 
-void portals_activate(portals_ctx_t *ctx, uint32_t active) {
-  for (uint32_t i = 0; i < ctx->size; i++) {
-    if (ctx->data[i].activate <= active) {
-      ctx->data[i].spell = spell_get_random(ctx->data[i].kind);
-      ctx->data[i].activate = UINT32_MAX;
+void portals_activate(portals_ctx_t *ctx, const uint32_t *due,
+                      uint32_t num_due, uint32_t active, rng_t *rng) {
+  for (uint32_t i = 0; i < num_due; i++) {
+    portal_t *portal = portals_get(ctx, due[i]);
+
+    /* Taken from again since, a later timer is on its way */
+    if (portal == NULL || portal->activate > active) {
+      continue;
     }
+    portal->spell = spell_get_random(portal->kind, rng);
+    portal->activate = UINT32_MAX;
+  }
+
+  for (uint32_t i = 0; i < ctx->num_taken; i++) {
+    portal_t *portal = &ctx->data[ctx->taken[i]];
 
-    if (ctx->data[i].activate != UINT32_MAX) {
-      /* Ensure that portals waiting for activation does not provide spells */
-      ctx->data[i].spell = NULL;
+    /* Ensure that portals waiting for activation does not provide spells */
+    if (portal->activate != UINT32_MAX) {
+      portal->spell = NULL;
     }
+    portal->taken = false;
   }
+  ctx->num_taken = 0;
 }
 
-const spell_t *portal_get_spell(portal_t *ctx, uint32_t ready_again) {
-  const spell_t *ret = ctx->spell;
+const spell_t *portals_take(portals_ctx_t *ctx, uint8_t id,
+                            uint32_t ready_again) {
+  portal_t *portal = &ctx->data[id];
 
-  ctx->activate = ready_again;
+  portal->activate = ready_again;
+  if (!portal->taken) {
+    portal->taken = true;
+    ctx->taken[ctx->num_taken++] = id;
+  }
 
-  return ret;
+  return portal->spell;
 }
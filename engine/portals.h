@@ -1,8 +1,10 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "common.h"
 #include "message.h"
+#include "rng.h"
 #include "spell.h"
 
 typedef struct portals_ctx portals_ctx_t;
@@ -11,19 +13,35 @@ typedef struct {
   pos_t position;
   uint32_t activate;
   const spell_t *spell;
+  bool taken;
 } portal_t;
 
 portals_ctx_t *portals_new(uint32_t capacity);
 portals_ctx_t *portals_new_from_message(message_t *msg);
+void portals_free(portals_ctx_t *ctx);
 void portals_update(portals_ctx_t *ctx, message_t *msg);
 
+/* The spells and timers of the portals, which are otherwise fixed. Writes at
+ * @param at of @param buf, see common_put(). */
+size_t portals_save(portals_ctx_t *ctx, uint8_t *buf, size_t at);
+/* Reads what portals_save() wrote, broken if the number of portals differs */
+void portals_restore(portals_ctx_t *ctx, struct common_reader *r);
+
 uint8_t portals_num(portals_ctx_t *ctx);
 portal_t *portals_get(portals_ctx_t *ctx, uint8_t id);
 
-void portals_add_kind(portals_ctx_t *ctx, enum portal_type kind, pos_t pos);
+void portals_add_kind(portals_ctx_t *ctx, enum portal_type kind, pos_t pos,
+                      rng_t *rng);
 
 portal_t *portals_get_at(portals_ctx_t *ctx, pos_t pos);
 
-void portals_activate(portals_ctx_t *ctx, uint32_t active);
+/* Gives the portals in @param due, ascending ids, a new spell if they are
+ * still due at turn @param active. Portals taken from since the last call
+ * lose their spell until they are ready again. */
+void portals_activate(portals_ctx_t *ctx, const uint32_t *due,
+                      uint32_t num_due, uint32_t active, rng_t *rng);
 
-const spell_t *portal_get_spell(portal_t *ctx, uint32_t ready_again);
+/* The spell of portal @param id, which is empty from the next
+ * portals_activate() until turn @param ready_again */
+const spell_t *portals_take(portals_ctx_t *ctx, uint8_t id,
+                            uint32_t ready_again);
@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "message.h"
+#include "record.h"
+#include "wire.h"
+
+/* Records are small and many, a match writes them a buffer at a time */
+#define RECORD_BUFFER (64 * 1024)
+
+struct recorder_ctx {
+  FILE *file;
+  bool failed;
+  /* Wire frame of the message being recorded */
+  uint8_t *frame;
+  size_t capacity;
+};
+
+static void put(recorder_t *ctx, const void *src, size_t size) {
+  if (!ctx->failed && fwrite(src, 1, size, ctx->file) != size) {
+    ctx->failed = true;
+  }
+}
+
+static void put_frame(recorder_t *ctx, uint8_t kind, uint32_t size) {
+  put(ctx, &kind, sizeof(kind));
+  put(ctx, &size, sizeof(size));
+}
+
+/* Encodes @param msg into ctx->frame, returns its size. Without memory for
+ * it the recording fails and 0 is returned. */
+static size_t encode(recorder_t *ctx, message_t *msg) {
+  size_t size = wire_encode(msg, ctx->frame, ctx->capacity);
+
+  if (size > ctx->capacity) {
+    uint8_t *frame = realloc(ctx->frame, size);
+
+    if (frame == NULL) {
+      ctx->failed = true;
+      return 0;
+    }
+    ctx->frame = frame;
+    ctx->capacity = size;
+    size = wire_encode(msg, ctx->frame, ctx->capacity);
+  }
+
+  return size;
+}
+
+recorder_t *recorder_open(const char *path, uint8_t players, uint8_t flags,
+                          uint32_t keyframe_turns) {
+  uint32_t version = RECORD_VERSION;
+  recorder_t *ctx;
+  FILE *file;
+
+  file = fopen(path, "wb");
+  if (file == NULL) {
+    return NULL;
+  }
+
+  ctx = malloc(sizeof(*ctx));
+  ctx->file = file;
+  ctx->failed = false;
+  ctx->capacity = 256;
+  ctx->frame = malloc(ctx->capacity);
+  setvbuf(file, NULL, _IOFBF, RECORD_BUFFER);
+
+  put(ctx, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+  put(ctx, &version, sizeof(version));
+  put(ctx, &players, sizeof(players));
+  put(ctx, &flags, sizeof(flags));
+  put(ctx, &keyframe_turns, sizeof(keyframe_turns));
+
+  return ctx;
+}
+
+bool recorder_close(recorder_t *ctx) {
+  bool ok;
+
+  if (ctx == NULL) {
+    return true;
+  }
+
+  ok = !ctx->failed;
+  if (fclose(ctx->file) != 0) {
+    ok = false;
+  }
+  free(ctx->frame);
+  free(ctx);
+
+  return ok;
+}
+
+void recorder_map(recorder_t *ctx, message_t *msg) {
+  size_t size = encode(ctx, msg);
+
+  put_frame(ctx, RECORD_MAP, size);
+  put(ctx, ctx->frame, size);
+}
+
+void recorder_keyframe(recorder_t *ctx, uint32_t turns, uint32_t tick,
+                       const void *block, size_t size) {
+  put_frame(ctx, RECORD_KEYFRAME, sizeof(turns) + sizeof(tick) + size);
+  put(ctx, &turns, sizeof(turns));
+  put(ctx, &tick, sizeof(tick));
+  put(ctx, block, size);
+}
+
+void recorder_reply(recorder_t *ctx, uint8_t player, uint32_t tick,
+                    message_t *msg) {
+  size_t size = encode(ctx, msg);
+
+  put_frame(ctx, RECORD_REPLY, sizeof(player) + sizeof(tick) + size);
+  put(ctx, &player, sizeof(player));
+  put(ctx, &tick, sizeof(tick));
+  put(ctx, ctx->frame, size);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+/* Append only log of a match, enough to play it again with replay.h.
+ *
+ * The file starts with:
+ *   magic    "RSPR"
+ *   version  u32
+ *   players  u8
+ *   flags    u8, RECORD_PIPELINED
+ *   keyframe u32, turns between keyframes
+ *
+ * followed by records of a kind u8 and a payload size u32, then the payload:
+ *   RECORD_MAP       the map message the players get, as a wire frame
+ *   RECORD_KEYFRAME  turns u32, tick u32, an engine_snapshot_data() block
+ *   RECORD_REPLY     player u8, tick u32 it counted for, the wire frame
+ *
+ * Numbers are in host byte order. Only the replies the engine takes are
+ * logged, everything else it does follows from them and the keyframe before.
+ * Writes go through a buffer, a record is only sure to be in the file once
+ * the recorder is closed. */
+
+#define RECORD_VERSION 1
+#define RECORD_MAGIC "RSPR"
+#define RECORD_MAGIC_SIZE 4
+
+/* Bytes before the first record */
+#define RECORD_HEADER_SIZE (RECORD_MAGIC_SIZE + 4 + 1 + 1 + 4)
+/* Bytes before the payload of a record */
+#define RECORD_FRAME_SIZE (1 + 4)
+
+/* The engine asks for the next phase without waiting for update acks */
+#define RECORD_PIPELINED 0x01
+
+enum record_kind {
+  RECORD_MAP = 1,
+  RECORD_KEYFRAME,
+  RECORD_REPLY,
+};
+
+typedef struct recorder_ctx recorder_t;
+
+/* Creates @param path, or truncates it, and writes the header. NULL if it
+ * can not be opened. */
+recorder_t *recorder_open(const char *path, uint8_t players, uint8_t flags,
+                          uint32_t keyframe_turns);
+/* Flushes and closes, false if any write failed along the way */
+bool recorder_close(recorder_t *ctx);
+
+void recorder_map(recorder_t *ctx, message_t *msg);
+void recorder_keyframe(recorder_t *ctx, uint32_t turns, uint32_t tick,
+                       const void *block, size_t size);
+/* @param tick is the step @param msg counted for, which the engine polled it
+ * on or the one after, and not the tick the message carries */
+void recorder_reply(recorder_t *ctx, uint8_t player, uint32_t tick,
+                    message_t *msg);
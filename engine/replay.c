@@ -0,0 +1,422 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "portals.h"
+#include "record.h"
+#include "replay.h"
+#include "wire.h"
+
+/* A recorded map decodes to about as many bytes as its frame has and replies
+ * carry no arrays, frames claiming more than this per byte are refused */
+#define ARENA_PER_BYTE 16
+
+struct reply {
+  uint32_t tick;
+  uint32_t size;
+  const uint8_t *frame;
+};
+
+struct keyframe {
+  uint32_t turns;
+  uint32_t tick;
+  const uint8_t *block;
+  uint32_t size;
+  /* Replies of each player recorded before it */
+  uint32_t *cursors;
+};
+
+struct source {
+  replay_t *ctx;
+  struct reply *replies;
+  uint32_t num_replies;
+  uint32_t capacity;
+  uint32_t next;
+};
+
+struct replay_ctx {
+  uint8_t *data;
+  size_t size;
+
+  uint8_t players;
+  uint8_t flags;
+  struct source *sources;
+  struct keyframe *keyframes;
+  uint32_t num_keyframes;
+  uint32_t keyframes_capacity;
+
+  map_t *map;
+  engine_t *engine;
+  engine_snapshot_t *check;
+  /* A player was asked for a reply after its last one */
+  bool starved;
+};
+
+static void source_send(void *data, message_t *msg) {
+  (void)data;
+  (void)msg;
+}
+
+static message_t *source_get(void *data) {
+  struct source *s = data;
+  struct reply *r;
+
+  if (s->next == s->num_replies) {
+    s->ctx->starved = true;
+    return NULL;
+  }
+
+  r = &s->replies[s->next];
+  if (r->tick > engine_ticks(s->ctx->engine)) {
+    return NULL;
+  }
+  s->next++;
+
+  return wire_decode(r->frame, r->size, (size_t)r->size * ARENA_PER_BYTE);
+}
+
+static bool read_file(replay_t *ctx, const char *path) {
+  FILE *file;
+  long size;
+
+  file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+
+  if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return false;
+  }
+
+  ctx->size = size;
+  ctx->data = malloc(size > 0 ? size : 1);
+  if (fread(ctx->data, 1, ctx->size, file) != ctx->size) {
+    fclose(file);
+    return false;
+  }
+
+  fclose(file);
+  return true;
+}
+
+/* False if there is no memory for it, records that make no sense are left
+ * out */
+static bool add_reply(replay_t *ctx, const uint8_t *payload, uint32_t size) {
+  uint8_t player;
+  struct source *s;
+  struct reply *r;
+
+  if (size < sizeof(player) + sizeof(r->tick)) {
+    return true;
+  }
+  common_get(payload, 0, &player, sizeof(player));
+  if (player >= ctx->players) {
+    return true;
+  }
+
+  s = &ctx->sources[player];
+  if (s->num_replies == s->capacity) {
+    uint32_t capacity = s->capacity == 0 ? 256 : s->capacity * 2;
+    struct reply *replies =
+        realloc(s->replies, capacity * sizeof(*s->replies));
+
+    if (replies == NULL) {
+      return false;
+    }
+    s->replies = replies;
+    s->capacity = capacity;
+  }
+
+  r = &s->replies[s->num_replies++];
+  common_get(payload, sizeof(player), &r->tick, sizeof(r->tick));
+  r->frame = payload + sizeof(player) + sizeof(r->tick);
+  r->size = size - sizeof(player) - sizeof(r->tick);
+
+  return true;
+}
+
+/* Like add_reply() */
+static bool add_keyframe(replay_t *ctx, const uint8_t *payload,
+                         uint32_t size) {
+  struct keyframe *k;
+
+  uint32_t turns;
+  uint32_t tick;
+
+  if (size < sizeof(turns) + sizeof(tick)) {
+    return true;
+  }
+  common_get(payload, 0, &turns, sizeof(turns));
+  common_get(payload, sizeof(turns), &tick, sizeof(tick));
+  /* Seeking relies on the order, one that goes back has been tampered with */
+  if (ctx->num_keyframes > 0 &&
+      (turns < ctx->keyframes[ctx->num_keyframes - 1].turns ||
+       tick < ctx->keyframes[ctx->num_keyframes - 1].tick)) {
+    return true;
+  }
+
+  if (ctx->num_keyframes == ctx->keyframes_capacity) {
+    uint32_t capacity =
+        ctx->keyframes_capacity == 0 ? 16 : ctx->keyframes_capacity * 2;
+    struct keyframe *keyframes =
+        realloc(ctx->keyframes, capacity * sizeof(*ctx->keyframes));
+
+    if (keyframes == NULL) {
+      return false;
+    }
+    ctx->keyframes = keyframes;
+    ctx->keyframes_capacity = capacity;
+  }
+
+  /* scan() keeps the frame inside the file, the block is what is left of
+   * it and engine_restore() refuses it if that does not add up */
+  k = &ctx->keyframes[ctx->num_keyframes];
+  k->cursors = malloc(ctx->players * sizeof(*k->cursors));
+  if (k->cursors == NULL) {
+    return false;
+  }
+  ctx->num_keyframes++;
+  k->turns = turns;
+  k->tick = tick;
+  k->block = payload + sizeof(turns) + sizeof(tick);
+  k->size = size - sizeof(turns) - sizeof(tick);
+  for (uint8_t i = 0; i < ctx->players; i++) {
+    k->cursors[i] = ctx->sources[i].num_replies;
+  }
+
+  return true;
+}
+
+/* Indexes the records, returns the map message. NULL if there is none or no
+ * memory for the index. */
+static message_t *scan(replay_t *ctx) {
+  message_t *map = NULL;
+  size_t at = RECORD_HEADER_SIZE;
+
+  while (at + RECORD_FRAME_SIZE <= ctx->size) {
+    const uint8_t *payload;
+    uint8_t kind;
+    uint32_t size;
+    bool ok = true;
+
+    at = common_get(ctx->data, at, &kind, sizeof(kind));
+    at = common_get(ctx->data, at, &size, sizeof(size));
+    if (size > ctx->size - at) {
+      break;
+    }
+    payload = ctx->data + at;
+    at += size;
+
+    switch (kind) {
+    case RECORD_MAP:
+      if (map == NULL) {
+        map = wire_decode(payload, size, (size_t)size * ARENA_PER_BYTE);
+      }
+      break;
+    case RECORD_KEYFRAME:
+      ok = add_keyframe(ctx, payload, size);
+      break;
+    case RECORD_REPLY:
+      ok = add_reply(ctx, payload, size);
+      break;
+    }
+
+    if (!ok) {
+      message_unref(map);
+      return NULL;
+    }
+  }
+
+  return map;
+}
+
+static bool read_header(replay_t *ctx) {
+  uint32_t version;
+  size_t at = RECORD_MAGIC_SIZE;
+
+  if (ctx->size < RECORD_HEADER_SIZE ||
+      memcmp(ctx->data, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+    return false;
+  }
+
+  at = common_get(ctx->data, at, &version, sizeof(version));
+  at = common_get(ctx->data, at, &ctx->players, sizeof(ctx->players));
+  common_get(ctx->data, at, &ctx->flags, sizeof(ctx->flags));
+
+  return version == RECORD_VERSION && ctx->players > 0;
+}
+
+replay_t *replay_open(const char *path) {
+  portals_ctx_t *portals;
+  message_t *msg;
+  replay_t *ctx;
+
+  ctx = calloc(1, sizeof(*ctx));
+  if (!read_file(ctx, path) || !read_header(ctx)) {
+    replay_free(ctx);
+    return NULL;
+  }
+
+  ctx->sources = calloc(ctx->players, sizeof(*ctx->sources));
+  msg = scan(ctx);
+  if (msg == NULL || msg->type != MESSAGE_MAP || ctx->num_keyframes == 0) {
+    message_unref(msg);
+    replay_free(ctx);
+    return NULL;
+  }
+
+  ctx->map = map_new_from_message(msg);
+  portals = portals_new_from_message(msg);
+  message_unref(msg);
+
+  ctx->engine = engine_new(ctx->players, ctx->map, portals, false, 0);
+  if (ctx->engine == NULL) {
+    portals_free(portals);
+    replay_free(ctx);
+    return NULL;
+  }
+  engine_set_pipelined(ctx->engine, ctx->flags & RECORD_PIPELINED);
+  engine_set_headless(ctx->engine, true);
+  for (uint8_t i = 0; i < ctx->players; i++) {
+    ctx->sources[i].ctx = ctx;
+    engine_add_player(ctx->engine, source_send, &ctx->sources[i], source_get,
+                      &ctx->sources[i]);
+  }
+
+  if (!replay_seek(ctx, 0)) {
+    replay_free(ctx);
+    return NULL;
+  }
+
+  return ctx;
+}
+
+void replay_free(replay_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  engine_free(ctx->engine);
+  map_free(ctx->map);
+  engine_snapshot_free(ctx->check);
+  for (uint32_t i = 0; i < ctx->num_keyframes; i++) {
+    free(ctx->keyframes[i].cursors);
+  }
+  free(ctx->keyframes);
+  for (uint8_t i = 0; ctx->sources != NULL && i < ctx->players; i++) {
+    free(ctx->sources[i].replies);
+  }
+  free(ctx->sources);
+  free(ctx->data);
+  free(ctx);
+}
+
+engine_t *replay_engine(replay_t *ctx) { return ctx->engine; }
+
+uint32_t replay_keyframes(replay_t *ctx) { return ctx->num_keyframes; }
+
+uint32_t replay_last_keyframe(replay_t *ctx) {
+  return ctx->keyframes[ctx->num_keyframes - 1].turns;
+}
+
+static bool restore(replay_t *ctx, struct keyframe *k) {
+  engine_snapshot_t *snap;
+  bool ok;
+
+  snap = engine_snapshot_from_data(k->block, k->size);
+  ok = engine_restore(ctx->engine, snap);
+  engine_snapshot_free(snap);
+  if (!ok) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < ctx->players; i++) {
+    ctx->sources[i].next = k->cursors[i];
+  }
+  ctx->starved = false;
+
+  return true;
+}
+
+bool replay_seek(replay_t *ctx, uint32_t tick) {
+  struct keyframe *k = &ctx->keyframes[0];
+
+  for (uint32_t i = 1; i < ctx->num_keyframes; i++) {
+    if (ctx->keyframes[i].tick > tick) {
+      break;
+    }
+    k = &ctx->keyframes[i];
+  }
+
+  if (!restore(ctx, k)) {
+    return false;
+  }
+  while (engine_ticks(ctx->engine) < tick && !ctx->starved) {
+    engine_tick(ctx->engine);
+  }
+
+  return engine_ticks(ctx->engine) >= tick;
+}
+
+bool replay_seek_turn(replay_t *ctx, uint32_t turns) {
+  struct keyframe *k = &ctx->keyframes[0];
+
+  for (uint32_t i = 1; i < ctx->num_keyframes; i++) {
+    if (ctx->keyframes[i].turns > turns) {
+      break;
+    }
+    k = &ctx->keyframes[i];
+  }
+
+  return restore(ctx, k) && replay_run(ctx, turns);
+}
+
+bool replay_run(replay_t *ctx, uint32_t turns) {
+  while (engine_turns(ctx->engine) < turns && !ctx->starved) {
+    engine_tick(ctx->engine);
+  }
+
+  return engine_turns(ctx->engine) >= turns;
+}
+
+uint32_t replay_verify(replay_t *ctx) {
+  uint32_t differ = 0;
+
+  if (!restore(ctx, &ctx->keyframes[0])) {
+    return ctx->num_keyframes;
+  }
+
+  for (uint32_t i = 1; i < ctx->num_keyframes; i++) {
+    struct keyframe *k = &ctx->keyframes[i];
+    engine_snapshot_t *check;
+    const void *block;
+    size_t size;
+
+    if (!replay_run(ctx, k->turns)) {
+      return differ + ctx->num_keyframes - i;
+    }
+
+    check = engine_snapshot(ctx->engine, ctx->check);
+    if (check == NULL) {
+      return differ + ctx->num_keyframes - i;
+    }
+    ctx->check = check;
+    block = engine_snapshot_data(ctx->check, &size);
+    if (engine_ticks(ctx->engine) != k->tick || size != k->size ||
+        memcmp(block, k->block, size) != 0) {
+      /* Check the rest from where they should be */
+      differ++;
+      restore(ctx, k);
+    }
+  }
+
+  return differ;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+/* Plays a match recorded with engine_record() again, see record.h. The
+ * engine is restored from the keyframe closest before the point asked for
+ * and fed the recorded replies from there, each on the step it was first
+ * taken on, so ticks come out as they did. It runs headless. */
+typedef struct replay_ctx replay_t;
+
+/* Reads all of @param path. NULL if it is not a recording or has no map and
+ * first keyframe. A record cut short, as a crash would leave it, ends the
+ * recording. */
+replay_t *replay_open(const char *path);
+void replay_free(replay_t *ctx);
+
+/* The engine being replayed, it belongs to the replay */
+engine_t *replay_engine(replay_t *ctx);
+uint32_t replay_keyframes(replay_t *ctx);
+/* Turns done at the last keyframe, the match may go on a bit after it */
+uint32_t replay_last_keyframe(replay_t *ctx);
+
+/* Puts the match where it was after step @param tick. False if the
+ * recording ends before that, the engine is then as far as it got. */
+bool replay_seek(replay_t *ctx, uint32_t tick);
+/* Puts the match where it was as turn @param turns was done */
+bool replay_seek_turn(replay_t *ctx, uint32_t turns);
+/* Plays on until @param turns turns are done, false if the recording ends
+ * before */
+bool replay_run(replay_t *ctx, uint32_t turns);
+/* Plays the whole recording from the start and compares the engine with
+ * every keyframe it passes. Returns how many differ or are never reached. */
+uint32_t replay_verify(replay_t *ctx);
@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+#include "rng.h"
+
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+/* splitmix64 spreads the seed over the state, which must not be all zero */
+void rng_seed(rng_t *rng, uint64_t seed) {
+  for (uint8_t i = 0; i < 4; i++) {
+    uint64_t z;
+
+    seed += 0x9e3779b97f4a7c15;
+    z = seed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    rng->s[i] = z ^ (z >> 31);
+  }
+}
+
+uint64_t rng_next(rng_t *rng) {
+  uint64_t *s = rng->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return result;
+}
+
+/* Multiply and shift instead of %, Lemire's method without the rejection
+ * step. Each value comes up floor or ceil of 2^32 / bound times out of 2^32,
+ * so the odds are off by up to bound / 2^32 of themselves, under 2^-16 for
+ * bounds up to 2^16. Not exactly uniform, just close. */
+uint32_t rng_below(rng_t *rng, uint32_t bound) {
+  return ((rng_next(rng) >> 32) * bound) >> 32;
+}
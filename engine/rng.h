@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+/* xoshiro256** pseudo random numbers. Each match, map and NPC owns one, so
+ * matches do not share state and replay the same from the same seed. */
+typedef struct {
+  uint64_t s[4];
+} rng_t;
+
+void rng_seed(rng_t *rng, uint64_t seed);
+uint64_t rng_next(rng_t *rng);
+
+/* Uniform in [0, bound), 0 when bound is 0 */
+uint32_t rng_below(rng_t *rng, uint32_t bound);
@@ -0,0 +1,271 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "engine.h"
+#include "rng.h"
+#include "scheduler.h"
+
+struct match {
+  uint32_t id;
+  uint32_t turns;
+};
+
+/* The owner takes from the tail, thieves from the head */
+struct queue {
+  pthread_mutex_t lock;
+  struct match *data;
+  uint32_t head;
+  uint32_t tail;
+};
+
+struct worker {
+  scheduler_t *ctx;
+  uint32_t index;
+  rng_t rng;
+  struct scheduler_stats stats;
+};
+
+struct scheduler_ctx {
+  uint32_t workers;
+  scheduler_setup_func_t setup;
+  scheduler_done_func_t done;
+  void *data;
+
+  struct match *pending;
+  uint32_t size;
+  uint32_t capacity;
+
+  struct queue *queues;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+scheduler_t *scheduler_new(uint32_t workers, scheduler_setup_func_t setup,
+                           scheduler_done_func_t done, void *data) {
+  scheduler_t *ctx;
+
+  if (workers == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = online > 0 ? online : 1;
+#else
+    workers = 1;
+#endif
+  }
+
+  ctx = malloc(sizeof(*ctx));
+  ctx->workers = workers;
+  ctx->setup = setup;
+  ctx->done = done;
+  ctx->data = data;
+
+  ctx->size = 0;
+  ctx->capacity = 64;
+  ctx->pending = malloc(sizeof(*ctx->pending) * ctx->capacity);
+
+  ctx->queues = calloc(workers, sizeof(*ctx->queues));
+  for (uint32_t i = 0; i < workers; i++) {
+    pthread_mutex_init(&ctx->queues[i].lock, NULL);
+  }
+
+  return ctx;
+}
+
+void scheduler_free(scheduler_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < ctx->workers; i++) {
+    pthread_mutex_destroy(&ctx->queues[i].lock);
+    free(ctx->queues[i].data);
+  }
+  free(ctx->queues);
+  free(ctx->pending);
+  free(ctx);
+}
+
+uint32_t scheduler_add(scheduler_t *ctx, uint32_t turns) {
+  if (ctx->size == ctx->capacity) {
+    struct match *pending =
+        realloc(ctx->pending, sizeof(*ctx->pending) * ctx->capacity * 2);
+
+    if (pending == NULL) {
+      return UINT32_MAX;
+    }
+    ctx->pending = pending;
+    ctx->capacity *= 2;
+  }
+
+  ctx->pending[ctx->size].id = ctx->size;
+  ctx->pending[ctx->size].turns = turns;
+
+  return ctx->size++;
+}
+
+static bool take(struct queue *q, bool own, struct match *m) {
+  bool found = false;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head != q->tail) {
+    if (own) {
+      q->tail--;
+      *m = q->data[q->tail];
+    } else {
+      *m = q->data[q->head];
+      q->head++;
+    }
+    found = true;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return found;
+}
+
+/* Nothing is queued while running, so once every queue is empty we are done */
+static bool steal(struct worker *w, struct match *m) {
+  scheduler_t *ctx = w->ctx;
+  uint32_t start = rng_below(&w->rng, ctx->workers);
+
+  for (uint32_t i = 0; i < ctx->workers; i++) {
+    uint32_t victim = (start + i) % ctx->workers;
+
+    if (victim != w->index && take(&ctx->queues[victim], false, m)) {
+      w->stats.steals++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void play(struct worker *w, struct match *m) {
+  scheduler_t *ctx = w->ctx;
+  uint64_t ticks = 0;
+  engine_t *engine;
+
+  engine = ctx->setup(ctx->data, m->id);
+  if (engine == NULL) {
+    return;
+  }
+
+  /* Players answer as they are asked, so a blocked engine is a stuck one */
+  while (engine_turns(engine) < m->turns) {
+    uint32_t steps = engine_step_until_blocked(engine);
+
+    if (steps == 0) {
+      break;
+    }
+    ticks += steps;
+  }
+
+  w->stats.matches++;
+  w->stats.ticks += ticks;
+  w->stats.turns += engine_turns(engine);
+  if (engine_turns(engine) < m->turns) {
+    w->stats.stalled++;
+  }
+
+  ctx->done(ctx->data, m->id, engine);
+}
+
+static void *work(void *arg) {
+  struct worker *w = arg;
+  struct queue *own = &w->ctx->queues[w->index];
+  struct match m;
+  bool was_quiet;
+
+  was_quiet = common_log_quiet(true);
+
+  while (take(own, true, &m) || steal(w, &m)) {
+    play(w, &m);
+  }
+
+  common_log_quiet(was_quiet);
+
+  return NULL;
+}
+
+bool scheduler_run(scheduler_t *ctx, struct scheduler_stats *stats) {
+  uint32_t share = ctx->size / ctx->workers + 1;
+  pthread_t *threads;
+  struct worker *workers;
+  bool *started;
+  double start;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->workers = ctx->workers;
+
+  /* Deal the matches out round robin, stealing evens out the rest */
+  for (uint32_t i = 0; i < ctx->workers; i++) {
+    struct queue *q = &ctx->queues[i];
+    struct match *data = realloc(q->data, sizeof(*q->data) * share);
+
+    if (data == NULL) {
+      return false;
+    }
+    q->data = data;
+    q->head = 0;
+    q->tail = 0;
+  }
+
+  threads = malloc(sizeof(*threads) * ctx->workers);
+  workers = calloc(ctx->workers, sizeof(*workers));
+  started = malloc(sizeof(*started) * ctx->workers);
+  if (threads == NULL || workers == NULL || started == NULL) {
+    free(threads);
+    free(workers);
+    free(started);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < ctx->size; i++) {
+    struct queue *q = &ctx->queues[i % ctx->workers];
+
+    q->data[q->tail++] = ctx->pending[i];
+  }
+  ctx->size = 0;
+
+  start = now();
+  for (uint32_t i = 0; i < ctx->workers; i++) {
+    workers[i].ctx = ctx;
+    workers[i].index = i;
+    rng_seed(&workers[i].rng, i);
+    /* Worker 0 is the calling thread, the others steal from it if they could
+     * not be started (e.g. web builds) */
+    started[i] =
+        i > 0 && pthread_create(&threads[i], NULL, work, &workers[i]) == 0;
+  }
+  work(&workers[0]);
+  for (uint32_t i = 1; i < ctx->workers; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  stats->seconds = now() - start;
+  for (uint32_t i = 0; i < ctx->workers; i++) {
+    stats->matches += workers[i].stats.matches;
+    stats->stalled += workers[i].stats.stalled;
+    stats->steals += workers[i].stats.steals;
+    stats->turns += workers[i].stats.turns;
+    stats->ticks += workers[i].stats.ticks;
+  }
+
+  free(threads);
+  free(workers);
+  free(started);
+
+  return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+/* Runs many matches on a pool of worker threads, one match per task. Every
+ * worker owns a queue of matches and steals from the others once it runs dry,
+ * so long and short matches even out. A match only ever touches its own
+ * engine, map, players and rng, so matches need no locking between them.
+ * Workers turn common_log() off. */
+typedef struct scheduler_ctx scheduler_t;
+
+/* Builds the engine for match @param id with all players added, on the worker
+ * that runs it. Build the line of sight table single threaded there,
+ * map_precompute_los(map, 1, ...), or every match starts a thread per core.
+ * NULL skips the match. */
+typedef engine_t *(*scheduler_setup_func_t)(void *data, uint32_t id);
+/* Called on the worker once match @param id is over, frees the engine */
+typedef void (*scheduler_done_func_t)(void *data, uint32_t id,
+                                      engine_t *engine);
+
+struct scheduler_stats {
+  uint32_t workers;
+  uint32_t matches;
+  uint32_t stalled;
+  uint32_t steals;
+  uint64_t turns;
+  uint64_t ticks;
+  double seconds;
+};
+
+/* @param workers 0 is one per online core */
+scheduler_t *scheduler_new(uint32_t workers, scheduler_setup_func_t setup,
+                           scheduler_done_func_t done, void *data);
+void scheduler_free(scheduler_t *ctx);
+
+/* Queues a match that is over after @param turns turns, returns its id.
+ * UINT32_MAX, with nothing queued, if there is no memory for it. */
+uint32_t scheduler_add(scheduler_t *ctx, uint32_t turns);
+
+/* Runs every queued match to the end and empties the queue. False, with the
+ * matches still queued and nothing run, if there is no memory to run them. */
+bool scheduler_run(scheduler_t *ctx, struct scheduler_stats *stats);
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -437,58 +438,72 @@ static spell_t fire[] = {
 };
 
 static const spell_t **by_id = NULL;
-static void admin(spell_t *s, enum portal_type kind, uint8_t num) {
-  static uint8_t id = 0;
+/* Highest id in by_id */
+static uint8_t spell_count = 0;
+static pthread_once_t by_id_once = PTHREAD_ONCE_INIT;
 
+static void admin(spell_t *s, enum portal_type kind, uint8_t num,
+                  uint8_t *id) {
   for (uint8_t i = 0; i < num; i++) {
     uint8_t max_ranges = sizeof(s[i].range) / sizeof(struct spell_range);
     uint8_t max_effects = sizeof(s[i].effect) / sizeof(struct spell_effect);
 
-    if (s[i].id == 0) {
-      id++;
-      s[i].id = id;
+    (*id)++;
+    s[i].id = *id;
+    s[i].kind = kind;
 
-      s[i].num_ranges = 0;
-      for (uint8_t j = 0; j < max_ranges; j++) {
-        if (s[i].range[j].range >= s[i].max_range) {
-          s[i].num_ranges++;
-          s[i].max_range = s[i].range[j].range;
-        }
-      }
-      s[i].num_effects = 0;
-      for (uint8_t j = 0; j < max_effects; j++) {
-        if (s[i].effect[j].type > 0) {
-          s[i].num_effects++;
-        }
+    s[i].num_ranges = 0;
+    for (uint8_t j = 0; j < max_ranges; j++) {
+      if (s[i].range[j].range >= s[i].max_range) {
+        s[i].num_ranges++;
+        s[i].max_range = s[i].range[j].range;
       }
-
-      printf("Setting up %s with max range %d and num_ranges %u\n", s[i].name,
-             s[i].max_range, s[i].num_ranges);
     }
-    s[i].kind = kind;
-    if (by_id != NULL) {
-      by_id[id] = &s[i];
+    s[i].num_effects = 0;
+    for (uint8_t j = 0; j < max_effects; j++) {
+      if (s[i].effect[j].type > 0) {
+        s[i].num_effects++;
+      }
     }
+
+    by_id[*id] = &s[i];
   }
 }
 
+/* The tables are shared by every match in the process, so they are filled in
+ * once and only read after that */
+static void setup(void) {
+  uint8_t id = 0;
+
+  spell_count += sizeof(water) / sizeof(spell_t);
+  spell_count += sizeof(earth) / sizeof(spell_t);
+  spell_count += sizeof(air) / sizeof(spell_t);
+  spell_count += sizeof(fire) / sizeof(spell_t);
+
+  /* id 0 is always no spell */
+  by_id = calloc(spell_count + 1, sizeof(*by_id));
+
+  admin(water, PORTAL_WATER, sizeof(water) / sizeof(spell_t), &id);
+  admin(earth, PORTAL_EARTH, sizeof(earth) / sizeof(spell_t), &id);
+  admin(air, PORTAL_AIR, sizeof(air) / sizeof(spell_t), &id);
+  admin(fire, PORTAL_FIRE, sizeof(fire) / sizeof(spell_t), &id);
+}
+
 const spell_t *spell_get_kind(enum portal_type type, uint8_t *num_spells) {
 
+  spell_init();
+
   switch (type) {
   case PORTAL_WATER:
     *num_spells = sizeof(water) / sizeof(spell_t);
-    admin(water, type, *num_spells);
     return water;
   case PORTAL_EARTH:
     *num_spells = sizeof(earth) / sizeof(spell_t);
-    admin(earth, type, *num_spells);
     return earth;
   case PORTAL_AIR:
     *num_spells = sizeof(air) / sizeof(spell_t);
-    admin(air, type, *num_spells);
     return air;
   case PORTAL_FIRE:
-    admin(fire, type, *num_spells);
     *num_spells = sizeof(fire) / sizeof(spell_t);
     return fire;
   default:
@@ -497,42 +512,23 @@ const spell_t *spell_get_kind(enum portal_type type, uint8_t *num_spells) {
   }
 }
 
-void spell_init(void) {
-  uint8_t num;
-
-  if (by_id == NULL) {
-    uint8_t spell_count = 0;
-
-    spell_count += sizeof(water) / sizeof(spell_t);
-    spell_count += sizeof(earth) / sizeof(spell_t);
-    spell_count += sizeof(air) / sizeof(spell_t);
-    spell_count += sizeof(fire) / sizeof(spell_t);
+void spell_init(void) { pthread_once(&by_id_once, setup); }
 
-    /* id 0 is always no spell */
-    by_id = calloc(spell_count + 1, sizeof(spell_t));
-  }
-
-  spell_get_kind(PORTAL_WATER, &num);
-  spell_get_kind(PORTAL_EARTH, &num);
-  spell_get_kind(PORTAL_AIR, &num);
-  spell_get_kind(PORTAL_FIRE, &num);
-}
-
-const spell_t *spell_get_random(enum portal_type type) {
+const spell_t *spell_get_random(enum portal_type type, rng_t *rng) {
   uint8_t num;
   switch (type) {
   case PORTAL_WATER:
     num = sizeof(water) / sizeof(spell_t);
-    return &water[rand() % num];
+    return &water[rng_below(rng, num)];
   case PORTAL_EARTH:
     num = sizeof(earth) / sizeof(spell_t);
-    return &earth[rand() % num];
+    return &earth[rng_below(rng, num)];
   case PORTAL_AIR:
     num = sizeof(air) / sizeof(spell_t);
-    return &air[rand() % num];
+    return &air[rng_below(rng, num)];
   case PORTAL_FIRE:
     num = sizeof(fire) / sizeof(spell_t);
-    return &fire[rand() % num];
+    return &fire[rng_below(rng, num)];
   default:
     return NULL;
   }
@@ -540,18 +536,20 @@ const spell_t *spell_get_random(enum portal_type type) {
 
 const spell_t *spell_get_by_id(uint8_t id) {
 
-  if (by_id == NULL || id == 0) {
+  if (by_id == NULL || id == 0 || id > spell_count) {
     return NULL;
   }
 
   return by_id[id];
 }
 const char *spell_id_to_name(uint8_t id) {
-  if (id == 0 || by_id == NULL) {
+  const spell_t *spell = spell_get_by_id(id);
+
+  if (spell == NULL) {
     return "Unknown spell";
   }
 
-  return by_id[id]->name;
+  return spell->name;
 }
 
 static inline void set_int(int8_t *dst, int8_t val) {
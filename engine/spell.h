@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #include "common.h"
+#include "rng.h"
 
 enum spell_miss {
   SPELL_MISS_LOS, /* Assigns random target square close to target, but hits on
@@ -105,7 +106,8 @@ typedef struct {
 
 void spell_init(void);
 const spell_t *spell_get_kind(enum portal_type, uint8_t *num_spells);
-const spell_t *spell_get_random(enum portal_type);
+const spell_t *spell_get_random(enum portal_type type, rng_t *rng);
+/* NULL for 0 and ids no spell has */
 const spell_t *spell_get_by_id(uint8_t id);
 const char *spell_id_to_name(uint8_t id);
 void spell_get_stats(const spell_t *spell, coord_t distance_squared,
@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "timers.h"
+
+/* Turns in one lap of the wheel, a power of two. Effects and portals are due
+ * a few turns out, later timers share a slot and wait for their lap. */
+#define WHEEL_SIZE 64
+
+struct timer {
+  uint32_t turn;
+  uint32_t id;
+  enum timer_kind kind;
+};
+
+struct slot {
+  struct timer *timers;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+struct timers_ctx {
+  struct slot wheel[WHEEL_SIZE];
+  uint32_t size;
+  /* Last turn taken, where timers_next() starts looking */
+  uint32_t now;
+
+  uint32_t *due;
+  uint32_t due_capacity;
+};
+
+timers_t *timers_new(void) {
+  timers_t *ctx;
+
+  ctx = calloc(1, sizeof(*ctx));
+
+  return ctx;
+}
+
+void timers_free(timers_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < WHEEL_SIZE; i++) {
+    free(ctx->wheel[i].timers);
+  }
+  free(ctx->due);
+  free(ctx);
+}
+
+/* False, with @param s as it was, if there is no memory */
+static bool reserve(struct slot *s, uint32_t size) {
+  uint32_t capacity = s->capacity;
+  struct timer *timers;
+
+  if (size <= capacity) {
+    return true;
+  }
+  while (capacity < size) {
+    capacity = capacity == 0 ? 8 : capacity * 2;
+  }
+  timers = realloc(s->timers, sizeof(*s->timers) * capacity);
+  if (timers == NULL) {
+    return false;
+  }
+  s->timers = timers;
+  s->capacity = capacity;
+
+  return true;
+}
+
+void timers_add(timers_t *ctx, enum timer_kind kind, uint32_t id,
+                uint32_t turn) {
+  struct slot *s = &ctx->wheel[turn & (WHEEL_SIZE - 1)];
+
+  if (!reserve(s, s->size + 1)) {
+    common_log("No memory for a timer at turn %u\n", turn);
+    return;
+  }
+
+  s->timers[s->size].turn = turn;
+  s->timers[s->size].id = id;
+  s->timers[s->size].kind = kind;
+  s->size++;
+  ctx->size++;
+}
+
+/* Keeps @param ids sorted and without repeats, the slot is short */
+static uint32_t insert_id(uint32_t *ids, uint32_t num, uint32_t id) {
+  uint32_t at = num;
+
+  while (at > 0 && ids[at - 1] > id) {
+    at--;
+  }
+  if (at > 0 && ids[at - 1] == id) {
+    return num;
+  }
+  for (uint32_t i = num; i > at; i--) {
+    ids[i] = ids[i - 1];
+  }
+  ids[at] = id;
+
+  return num + 1;
+}
+
+uint32_t timers_due(timers_t *ctx, enum timer_kind kind, uint32_t turn,
+                    const uint32_t **ids) {
+  struct slot *s = &ctx->wheel[turn & (WHEEL_SIZE - 1)];
+  uint32_t kept = 0;
+  uint32_t num = 0;
+
+  if (s->size > ctx->due_capacity) {
+    uint32_t *due = realloc(ctx->due, sizeof(*ctx->due) * s->capacity);
+
+    /* Whatever is due stays in the slot and comes up a wheel later */
+    if (due == NULL) {
+      common_log("No memory for the timers due at turn %u\n", turn);
+      *ids = ctx->due;
+      return 0;
+    }
+    ctx->due = due;
+    ctx->due_capacity = s->capacity;
+  }
+
+  for (uint32_t i = 0; i < s->size; i++) {
+    struct timer *t = &s->timers[i];
+
+    if (t->kind == kind && t->turn <= turn) {
+      num = insert_id(ctx->due, num, t->id);
+      continue;
+    }
+    s->timers[kept++] = *t;
+  }
+  ctx->size -= s->size - kept;
+  s->size = kept;
+  ctx->now = turn;
+
+  *ids = ctx->due;
+  return num;
+}
+
+uint32_t timers_next(timers_t *ctx) {
+  uint32_t next = UINT32_MAX;
+
+  if (ctx->size == 0) {
+    return next;
+  }
+
+  /* Anything due within a lap is found in its own slot */
+  for (uint32_t turn = ctx->now; turn != ctx->now + WHEEL_SIZE; turn++) {
+    struct slot *s = &ctx->wheel[turn & (WHEEL_SIZE - 1)];
+
+    for (uint32_t i = 0; i < s->size; i++) {
+      if (s->timers[i].turn <= turn) {
+        return s->timers[i].turn < ctx->now ? ctx->now : turn;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < WHEEL_SIZE; i++) {
+    for (uint32_t j = 0; j < ctx->wheel[i].size; j++) {
+      if (ctx->wheel[i].timers[j].turn < next) {
+        next = ctx->wheel[i].timers[j].turn;
+      }
+    }
+  }
+  return next;
+}
+
+size_t timers_save(timers_t *ctx, uint8_t *buf, size_t at) {
+  at = common_put(buf, at, &ctx->now, sizeof(ctx->now));
+  for (uint32_t i = 0; i < WHEEL_SIZE; i++) {
+    struct slot *s = &ctx->wheel[i];
+
+    at = common_put(buf, at, &s->size, sizeof(s->size));
+    at = common_put(buf, at, s->timers, s->size * sizeof(*s->timers));
+  }
+  return at;
+}
+
+void timers_restore(timers_t *ctx, struct common_reader *r) {
+  common_read(r, &ctx->now, sizeof(ctx->now));
+  ctx->size = 0;
+  for (uint32_t i = 0; i < WHEEL_SIZE; i++) {
+    struct slot *s = &ctx->wheel[i];
+    uint32_t size = 0;
+
+    s->size = 0;
+    common_read(r, &size, sizeof(size));
+    if (!common_has(r, size, sizeof(*s->timers))) {
+      continue;
+    }
+    if (!reserve(s, size)) {
+      r->broken = true;
+      continue;
+    }
+    common_read(r, s->timers, size * sizeof(*s->timers));
+    s->size = size;
+    ctx->size += size;
+
+    /* A timer in the wrong slot would never come due */
+    for (uint32_t j = 0; j < size; j++) {
+      if ((s->timers[j].turn & (WHEEL_SIZE - 1)) != i ||
+          s->timers[j].kind >= TIMER_KINDS) {
+        r->broken = true;
+      }
+    }
+  }
+}
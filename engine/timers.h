@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Things that happen on a later turn of a match, in a wheel with a slot per
+ * turn, so a turn only looks at what is due on it. A timer is an id of some
+ * kind and a turn. Timers are never cancelled; whoever handles them checks
+ * that the thing is still due and ignores it otherwise. */
+typedef struct timers_ctx timers_t;
+
+enum timer_kind {
+  TIMER_PORTAL = 0, /* Portal id, gets a new spell */
+  TIMER_EFFECT,     /* Player id, has an effect that runs out */
+  TIMER_KINDS
+};
+
+timers_t *timers_new(void);
+void timers_free(timers_t *ctx);
+
+/* @param turn has to be no earlier than the last turn passed to timers_due()
+ * for @param kind */
+void timers_add(timers_t *ctx, enum timer_kind kind, uint32_t id,
+                uint32_t turn);
+/* Takes the timers of @param kind that are due at @param turn, has to be
+ * called for every turn. Points @param ids at their ids, ascending and each
+ * once, valid until the next call. Returns how many there are. */
+uint32_t timers_due(timers_t *ctx, enum timer_kind kind, uint32_t turn,
+                    const uint32_t **ids);
+/* Earliest turn any timer is due at, UINT32_MAX if there are none */
+uint32_t timers_next(timers_t *ctx);
+
+/* Writes the pending timers at @param at of @param buf, see common_put() */
+size_t timers_save(timers_t *ctx, uint8_t *buf, size_t at);
+/* Replaces the pending timers with what timers_save() wrote */
+void timers_restore(timers_t *ctx, struct common_reader *r);
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "map_opts.h"
+#include "player.h"
+#include "visibility.h"
+
+struct visibility_ctx {
+  coord_t width;
+  coord_t height;
+  uint64_t *cells;
+  /* Players that are dead */
+  uint64_t dead;
+
+  /* Cells set by the last build, so clearing does not touch the whole map */
+  uint32_t *touched;
+  uint32_t num_touched;
+  uint32_t touched_capacity;
+};
+
+static inline bool in(visibility_t *ctx, pos_t p) {
+  return p.x < ctx->width && p.y < ctx->height && p.x >= 0 && p.y >= 0;
+}
+
+static inline uint32_t to_id(visibility_t *ctx, pos_t pos) {
+  return pos.y * ctx->width + pos.x;
+}
+
+visibility_t *visibility_new(coord_t width, coord_t height) {
+  visibility_t *ctx;
+
+  ctx = malloc(sizeof(*ctx));
+  ctx->width = width;
+  ctx->height = height;
+  ctx->cells = calloc(width * height, sizeof(*ctx->cells));
+  ctx->dead = 0;
+  ctx->touched = NULL;
+  ctx->num_touched = 0;
+  ctx->touched_capacity = 0;
+
+  return ctx;
+}
+
+void visibility_free(visibility_t *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+  free(ctx->cells);
+  free(ctx->touched);
+  free(ctx);
+}
+
+void visibility_build(visibility_t *ctx, player_t *players,
+                      uint8_t num_players) {
+  for (uint32_t i = 0; i < ctx->num_touched; i++) {
+    ctx->cells[ctx->touched[i]] = 0;
+  }
+  ctx->num_touched = 0;
+  ctx->dead = 0;
+
+  for (uint8_t i = 0; i < num_players; i++) {
+    player_t *p = &players[i];
+    uint64_t bit = (uint64_t)1 << p->id;
+
+    if (p->health <= 0) {
+      ctx->dead |= bit;
+    }
+    if (p->los == NULL) {
+      continue;
+    }
+
+    for (uint32_t j = 0; j < p->los->size; j++) {
+      uint32_t id;
+
+      if (!in(ctx, p->los->data[j])) {
+        continue;
+      }
+      id = to_id(ctx, p->los->data[j]);
+
+      if (ctx->cells[id] == 0) {
+        if (ctx->num_touched == ctx->touched_capacity) {
+          uint32_t capacity =
+              ctx->touched_capacity > 0 ? ctx->touched_capacity * 2 : 256;
+          uint32_t *touched =
+              realloc(ctx->touched, sizeof(*ctx->touched) * capacity);
+
+          /* A cell that is not touched would never be cleared, it is left
+           * out as if nobody saw it */
+          if (touched == NULL) {
+            common_log("No memory to index the cells seen\n");
+            continue;
+          }
+          ctx->touched = touched;
+          ctx->touched_capacity = capacity;
+        }
+        ctx->touched[ctx->num_touched++] = id;
+      }
+      ctx->cells[id] |= bit;
+    }
+  }
+}
+
+uint64_t visibility_in_sight(visibility_t *ctx, pos_t pos) {
+  if (!in(ctx, pos)) {
+    return 0;
+  }
+  return ctx->cells[to_id(ctx, pos)];
+}
+
+uint64_t visibility_seen_by(visibility_t *ctx, pos_t pos) {
+  return visibility_in_sight(ctx, pos) | ctx->dead;
+}
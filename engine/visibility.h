@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "common.h"
+#include "player.h"
+
+/* Which players see each cell of the map, as a mask with a bit per player
+ * id. Built from the players' line of sight once per round of player
+ * updates, after which "does this player see that cell" is a single AND.
+ * Positions off the map are seen by nobody. */
+typedef struct visibility_ctx visibility_t;
+
+visibility_t *visibility_new(coord_t width, coord_t height);
+void visibility_free(visibility_t *ctx);
+
+void visibility_build(visibility_t *ctx, player_t *players,
+                      uint8_t num_players);
+
+/* Players with @param pos in their line of sight */
+uint64_t visibility_in_sight(visibility_t *ctx, pos_t pos);
+/* Players told about what happens at @param pos, which also includes the
+ * dead as they see everything */
+uint64_t visibility_seen_by(visibility_t *ctx, pos_t pos);
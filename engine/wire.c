@@ -0,0 +1,1216 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "message.h"
+#include "spell.h"
+#include "wire.h"
+
+/* Longest varint a frame length can take */
+#define LENGTH_MAX 5
+
+/* Bounding boxes wider or higher than this are only sent as offsets */
+#define BOX_MAX (1 << 20)
+
+/* Decoding sets aside at most ARENA_SLACK bytes and ARENA_PER_BYTE per frame
+ * byte up front, the rest of what a frame claims comes from message_alloc()
+ * as it is read. Long runs of cells easily take a hundred times their bytes
+ * once decoded, which the slack covers for the usual line of sight. */
+#define ARENA_SLACK 4096
+#define ARENA_PER_BYTE 16
+
+/* How a position list is laid out after its smallest x and y */
+enum layout {
+  LAYOUT_OFFSETS, /* Bit packed offsets of every position, in list order */
+  LAYOUT_MASK,    /* One bit per cell of the bounding box, in row order */
+  LAYOUT_RUNS,    /* Gaps and lengths of runs of cells, in row order */
+};
+
+struct writer {
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+  uint64_t bits;
+  uint8_t num_bits;
+};
+
+struct reader {
+  const uint8_t *buf;
+  size_t size;
+  size_t pos;
+  bool broken;
+  uint64_t bits;
+  uint8_t num_bits;
+
+  message_t *msg;
+  /* What the frame claims its arrays need and is not carved yet */
+  size_t arena_left;
+  /* Most positions a list in this type of message may hold */
+  uint32_t list_max;
+};
+
+/* Arrays are carved out of the decode arena the way message_alloc() does */
+static size_t block(size_t count, size_t each) {
+  return message_arena_size(count, each);
+}
+
+static uint32_t plane_words(coord_t width, coord_t height) {
+  return ((uint64_t)width * height + 63) / 64;
+}
+
+static uint32_t plane_bytes(coord_t width, coord_t height) {
+  return ((uint64_t)width * height + 7) / 8;
+}
+
+static uint8_t bits_for(uint32_t v) {
+  return v == 0 ? 0 : 32 - __builtin_clz(v);
+}
+
+static uint8_t varint_size(uint64_t v) {
+  uint8_t size = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    size++;
+  }
+  return size;
+}
+
+static void put_u8(struct writer *w, uint8_t v) {
+  if (w->len < w->size) {
+    w->buf[w->len] = v;
+  }
+  w->len++;
+}
+
+static void put_varint(struct writer *w, uint64_t v) {
+  while (v >= 0x80) {
+    put_u8(w, (v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  put_u8(w, v);
+}
+
+static void put_signed(struct writer *w, int64_t v) {
+  put_varint(w, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void put_pos(struct writer *w, pos_t pos) {
+  put_signed(w, pos.x);
+  put_signed(w, pos.y);
+}
+
+static void put_bits(struct writer *w, uint32_t v, uint8_t num) {
+  w->bits |= (uint64_t)v << w->num_bits;
+  w->num_bits += num;
+
+  while (w->num_bits >= 8) {
+    put_u8(w, w->bits & 0xff);
+    w->bits >>= 8;
+    w->num_bits -= 8;
+  }
+}
+
+static void flush_bits(struct writer *w) {
+  if (w->num_bits > 0) {
+    put_u8(w, w->bits & 0xff);
+  }
+  w->bits = 0;
+  w->num_bits = 0;
+}
+
+/* Row order is what the mask and run layouts give back */
+static bool in_row_order(pos_t *data, uint32_t size) {
+  for (uint32_t i = 1; i < size; i++) {
+    if (data[i].y < data[i - 1].y ||
+        (data[i].y == data[i - 1].y && data[i].x <= data[i - 1].x)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint64_t cell(pos_t pos, pos_t min, uint64_t width) {
+  return (uint64_t)((int64_t)pos.y - min.y) * width +
+         (uint64_t)((int64_t)pos.x - min.x);
+}
+
+static void put_offsets(struct writer *w, pos_t *data, uint32_t size,
+                        pos_t min, pos_t max) {
+  uint8_t bits_x = bits_for((uint32_t)((int64_t)max.x - min.x));
+  uint8_t bits_y = bits_for((uint32_t)((int64_t)max.y - min.y));
+
+  put_u8(w, bits_x);
+  put_u8(w, bits_y);
+
+  for (uint32_t i = 0; i < size; i++) {
+    put_bits(w, (uint32_t)((int64_t)data[i].x - min.x), bits_x);
+    put_bits(w, (uint32_t)((int64_t)data[i].y - min.y), bits_y);
+  }
+  flush_bits(w);
+}
+
+static void put_mask(struct writer *w, pos_t *data, uint32_t size, pos_t min,
+                     uint64_t width, uint64_t height) {
+  uint64_t bytes = (width * height + 7) / 8;
+  uint64_t at = 0;
+  uint8_t byte = 0;
+
+  put_varint(w, width);
+  put_varint(w, height);
+
+  for (uint32_t i = 0; i < size; i++) {
+    uint64_t c = cell(data[i], min, width);
+
+    for (; at < c / 8; at++) {
+      put_u8(w, byte);
+      byte = 0;
+    }
+    byte |= 1 << (c % 8);
+  }
+  for (; at < bytes; at++) {
+    put_u8(w, byte);
+    byte = 0;
+  }
+}
+
+static void put_runs(struct writer *w, pos_t *data, uint32_t size, pos_t min,
+                     uint64_t width) {
+  uint64_t end = 0;
+
+  put_varint(w, width);
+
+  for (uint32_t i = 0; i < size;) {
+    uint64_t start = cell(data[i], min, width);
+    uint32_t len = 1;
+
+    while (i + len < size &&
+           cell(data[i + len], min, width) == start + len) {
+      len++;
+    }
+
+    put_varint(w, start - end);
+    put_varint(w, len);
+
+    end = start + len;
+    i += len;
+  }
+}
+
+/* Sends the list in whichever layout takes the fewest bytes. Lists out of row
+ * order only fit the offsets, as the others would lose the order. */
+static void put_positions(struct writer *w, pos_t *data, uint32_t size) {
+  struct writer measure = {0};
+  uint64_t width;
+  uint64_t height;
+  size_t best;
+  enum layout layout = LAYOUT_OFFSETS;
+  pos_t min;
+  pos_t max;
+
+  put_varint(w, size);
+  if (size == 0) {
+    return;
+  }
+
+  min = data[0];
+  max = data[0];
+  for (uint32_t i = 1; i < size; i++) {
+    min.x = data[i].x < min.x ? data[i].x : min.x;
+    min.y = data[i].y < min.y ? data[i].y : min.y;
+    max.x = data[i].x > max.x ? data[i].x : max.x;
+    max.y = data[i].y > max.y ? data[i].y : max.y;
+  }
+  width = (int64_t)max.x - min.x + 1;
+  height = (int64_t)max.y - min.y + 1;
+
+  best = 2 + ((uint64_t)size * (bits_for(width - 1) + bits_for(height - 1)) +
+               7) / 8;
+
+  if (width <= BOX_MAX && height <= BOX_MAX && in_row_order(data, size)) {
+    size_t mask =
+        varint_size(width) + varint_size(height) + (width * height + 7) / 8;
+
+    if (mask < best) {
+      best = mask;
+      layout = LAYOUT_MASK;
+    }
+
+    measure.len = 0;
+    put_runs(&measure, data, size, min, width);
+    if (measure.len < best) {
+      best = measure.len;
+      layout = LAYOUT_RUNS;
+    }
+  }
+
+  put_u8(w, layout);
+  put_pos(w, min);
+
+  switch (layout) {
+  case LAYOUT_OFFSETS:
+    put_offsets(w, data, size, min, max);
+    break;
+  case LAYOUT_MASK:
+    put_mask(w, data, size, min, width, height);
+    break;
+  case LAYOUT_RUNS:
+    put_runs(w, data, size, min, width);
+    break;
+  }
+}
+
+static void put_spells(struct writer *w, struct msg_spell *spells,
+                       uint8_t num) {
+  for (uint8_t i = 0; i < num; i++) {
+    put_u8(w, spells[i].id);
+    put_u8(w, spells[i].charges);
+  }
+}
+
+static bool moves_player(uint8_t type) {
+  return type == SPELL_EFFECT_PUSH || type == SPELL_EFFECT_PULL ||
+         type == SPELL_EFFECT_PUSH_RANDOM;
+}
+
+static void put_effect(struct writer *w, struct applied_effect *eff) {
+  put_u8(w, eff->type);
+  put_u8(w, eff->victim);
+  put_pos(w, eff->at);
+  put_signed(w, eff->duration);
+
+  /* Only the member the effect type uses is sent */
+  if (moves_player(eff->type)) {
+    put_pos(w, eff->data.new_pos);
+  } else if (eff->type == SPELL_EFFECT_SPLASH) {
+    put_pos(w, eff->data.area.center);
+    put_signed(w, eff->data.area.radius);
+  } else {
+    put_signed(w, eff->data.dmg);
+  }
+}
+
+static void put_map(struct writer *w, message_t *msg) {
+  uint32_t words = plane_words(msg->body.map.width, msg->body.map.height);
+  uint32_t bytes = plane_bytes(msg->body.map.width, msg->body.map.height);
+
+  put_signed(w, msg->body.map.width);
+  put_signed(w, msg->body.map.height);
+  put_u8(w, msg->body.map.num_players);
+
+  put_u8(w, msg->body.map.num_portals);
+  for (uint8_t i = 0; i < msg->body.map.num_portals; i++) {
+    put_pos(w, msg->body.map.portals[i].pos);
+    put_u8(w, msg->body.map.portals[i].kind);
+  }
+
+  for (uint8_t plane = 0; plane < MAP_PLANES; plane++) {
+    uint64_t *data = msg->body.map.data + plane * words;
+
+    for (uint32_t i = 0; i < bytes; i++) {
+      put_u8(w, data[i / 8] >> (8 * (i % 8)));
+    }
+  }
+}
+
+static void put_player_update(struct writer *w, message_t *msg) {
+  typeof(msg->body.player_update) *u = &msg->body.player_update;
+
+  put_u8(w, u->player_id);
+  put_pos(w, u->pos);
+  put_u8(w, u->face);
+  put_signed(w, u->health);
+  put_signed(w, u->kills);
+  put_signed(w, u->deaths);
+  put_spells(w, u->spells, PORTAL_NONE);
+  put_positions(w, u->los.opts, u->los.size);
+
+  put_u8(w, u->num_effects);
+  put_spells(w, u->effects, u->num_effects);
+
+  put_u8(w, u->num_others);
+  for (uint8_t i = 0; i < u->num_others; i++) {
+    put_u8(w, u->others[i].player_id);
+    put_pos(w, u->others[i].pos);
+    put_u8(w, u->others[i].face);
+    put_signed(w, u->others[i].health);
+    put_signed(w, u->others[i].kills);
+    put_signed(w, u->others[i].deaths);
+    put_spells(w, u->others[i].spells, PORTAL_NONE);
+    put_u8(w, u->others[i].num_effects);
+    put_spells(w, u->others[i].effects, u->others[i].num_effects);
+  }
+
+  put_u8(w, u->num_portals);
+  for (uint8_t i = 0; i < u->num_portals; i++) {
+    put_u8(w, u->portals[i].kind);
+    put_u8(w, u->portals[i].spell);
+    put_pos(w, u->portals[i].pos);
+  }
+
+  put_varint(w, u->num_events);
+  for (uint32_t i = 0; i < u->num_events; i++) {
+    struct incident *inc = &u->events[i];
+
+    put_pos(w, inc->from);
+    put_u8(w, inc->incident_type);
+    put_u8(w, inc->spell_kind);
+    put_u8(w, inc->spell_id);
+    put_u8(w, inc->player_origin);
+
+    put_u8(w, inc->num_targets);
+    for (uint8_t j = 0; j < inc->num_targets; j++) {
+      struct target *t = &inc->targets[j];
+
+      put_pos(w, t->target);
+      put_u8(w, t->num_effects);
+      for (uint8_t k = 0; k < t->num_effects; k++) {
+        put_effect(w, &t->effects[k]);
+      }
+    }
+  }
+
+  put_varint(w, u->base);
+  if (u->base != 0) {
+    put_positions(w, u->los_gone.opts, u->los_gone.size);
+    put_u8(w, u->num_others_gone);
+    for (uint8_t i = 0; i < u->num_others_gone; i++) {
+      put_u8(w, u->others_gone[i]);
+    }
+  }
+}
+
+static bool input_has_pos(uint8_t type) {
+  return type == MESSAGE_REPLY_SPAWN || type == MESSAGE_REPLY_MOVE ||
+         type == MESSAGE_REPLY_FIGHT;
+}
+
+/* Input ticks go as what they are behind the frame's, mostly 0 or 1 */
+static void put_lockstep(struct writer *w, message_t *msg) {
+  typeof(msg->body.lockstep) *l = &msg->body.lockstep;
+
+  put_u8(w, l->flags);
+  for (uint8_t i = 0; l->flags & LOCKSTEP_HASHED && i < 8; i++) {
+    put_u8(w, l->hash >> (8 * i));
+  }
+
+  put_varint(w, l->num_inputs);
+  for (uint32_t i = 0; i < l->num_inputs; i++) {
+    struct msg_input *in = &l->inputs[i];
+
+    put_u8(w, in->player);
+    put_u8(w, in->type);
+    put_varint(w, msg->tick - in->tick);
+    put_varint(w, in->tick - in->reply_tick);
+    if (input_has_pos(in->type)) {
+      put_pos(w, in->pos);
+      put_u8(w, in->value);
+    }
+  }
+
+  /* Only the first one goes to a single player */
+  put_varint(w, l->state_size);
+  if (l->state_size > 0) {
+    put_u8(w, l->player_id);
+  }
+  for (uint32_t i = 0; i < l->state_size; i++) {
+    put_u8(w, l->state[i]);
+  }
+}
+
+static void put_body(struct writer *w, message_t *msg) {
+  switch (msg->type) {
+  case MESSAGE_MAP:
+    put_map(w, msg);
+    break;
+
+  case MESSAGE_ASK_SPAWN:
+    put_u8(w, msg->body.ask_spawn.player_id);
+    put_positions(w, msg->body.ask_spawn.opts, msg->body.ask_spawn.size);
+    break;
+
+  case MESSAGE_REPLY_SPAWN:
+    put_pos(w, msg->body.reply_spawn.dst);
+    put_u8(w, msg->body.reply_spawn.face);
+    break;
+
+  case MESSAGE_ASK_MOVE:
+    put_positions(w, msg->body.ask_move.opts, msg->body.ask_move.size);
+    break;
+
+  case MESSAGE_REPLY_MOVE:
+    put_pos(w, msg->body.reply_move.dst);
+    put_u8(w, msg->body.reply_move.face);
+    break;
+
+  case MESSAGE_ASK_FIGHT:
+    for (uint8_t i = 0; i < PORTAL_NONE; i++) {
+      put_u8(w, msg->body.ask_fight.spell_id[i]);
+      put_positions(w, msg->body.ask_fight.spell_opts[i].opts,
+                    msg->body.ask_fight.spell_opts[i].size);
+    }
+    break;
+
+  case MESSAGE_REPLY_FIGHT:
+    put_u8(w, msg->body.reply_fight.spell_id);
+    put_pos(w, msg->body.reply_fight.target);
+    break;
+
+  case MESSAGE_PLAYER_UPDATE:
+    put_player_update(w, msg);
+    break;
+
+  case MESSAGE_LOCKSTEP:
+    put_lockstep(w, msg);
+    break;
+
+  case MESSAGE_ASK_READY:
+  case MESSAGE_REPLY_READY:
+  case MESSAGE_REPLY_MAP:
+  case MESSAGE_REPLY_PLAYER_UPDATE:
+    break;
+  }
+}
+
+/* Bytes wire_decode() has to carve out for the inner arrays of @param msg */
+static size_t arena_size(message_t *msg) {
+  typeof(msg->body.player_update) *u = &msg->body.player_update;
+  size_t size = 0;
+
+  switch (msg->type) {
+  case MESSAGE_MAP:
+    size += block(MAP_PLANES * plane_words(msg->body.map.width,
+                                           msg->body.map.height),
+                  sizeof(*msg->body.map.data));
+    size += block(msg->body.map.num_portals, sizeof(*msg->body.map.portals));
+    break;
+
+  case MESSAGE_ASK_SPAWN:
+    size += block(msg->body.ask_spawn.size, sizeof(pos_t));
+    break;
+
+  case MESSAGE_ASK_MOVE:
+    size += block(msg->body.ask_move.size, sizeof(pos_t));
+    break;
+
+  case MESSAGE_ASK_FIGHT:
+    for (uint8_t i = 0; i < PORTAL_NONE; i++) {
+      size += block(msg->body.ask_fight.spell_opts[i].size, sizeof(pos_t));
+    }
+    break;
+
+  case MESSAGE_PLAYER_UPDATE:
+    size += block(u->los.size, sizeof(pos_t));
+    size += block(u->num_effects, sizeof(*u->effects));
+    size += block(u->num_others, sizeof(*u->others));
+    for (uint8_t i = 0; i < u->num_others; i++) {
+      size += block(u->others[i].num_effects, sizeof(*u->others[i].effects));
+    }
+    size += block(u->num_portals, sizeof(*u->portals));
+    size += block(u->num_events, sizeof(*u->events));
+    for (uint32_t i = 0; i < u->num_events; i++) {
+      size += block(u->events[i].num_targets, sizeof(*u->events[i].targets));
+      for (uint8_t j = 0; j < u->events[i].num_targets; j++) {
+        size += block(u->events[i].targets[j].num_effects,
+                      sizeof(*u->events[i].targets[j].effects));
+      }
+    }
+    size += block(u->los_gone.size, sizeof(pos_t));
+    size += block(u->num_others_gone, sizeof(*u->others_gone));
+    break;
+
+  case MESSAGE_LOCKSTEP:
+    size += block(msg->body.lockstep.num_inputs,
+                  sizeof(*msg->body.lockstep.inputs));
+    size += block(msg->body.lockstep.state_size, 1);
+    break;
+
+  default:
+    break;
+  }
+
+  return size;
+}
+
+static size_t encode_at(message_t *msg, uint8_t *buf, size_t size) {
+  struct writer w = {.buf = buf, .size = size};
+
+  put_u8(&w, WIRE_VERSION);
+  put_u8(&w, msg->type);
+  put_varint(&w, msg->tick);
+  put_varint(&w, arena_size(msg));
+  put_body(&w, msg);
+
+  return w.len;
+}
+
+size_t wire_encode(message_t *msg, uint8_t *buf, size_t size) {
+  size_t room = size > LENGTH_MAX ? size - LENGTH_MAX : 0;
+  size_t len;
+  uint8_t prefix;
+  struct writer w = {.buf = buf, .size = size};
+
+  /* Write past the longest length first and move it in place after, which
+   * saves measuring the message before writing it */
+  len = encode_at(msg, room > 0 ? buf + LENGTH_MAX : NULL, room);
+  prefix = varint_size(len);
+
+  if (prefix + len > size) {
+    return prefix + len;
+  }
+
+  if (len > room) {
+    /* Fits, but only without the spare room for the length */
+    encode_at(msg, buf + prefix, size - prefix);
+  } else {
+    memmove(buf + prefix, buf + LENGTH_MAX, len);
+  }
+  put_varint(&w, len);
+
+  return prefix + len;
+}
+
+static uint8_t get_u8(struct reader *r) {
+  if (r->pos >= r->size) {
+    r->broken = true;
+    return 0;
+  }
+  return r->buf[r->pos++];
+}
+
+/* 0 is no spell, ids no spell has are refused here so the engine never
+ * looks them up */
+static uint8_t get_spell_id(struct reader *r) {
+  uint8_t id = get_u8(r);
+
+  spell_init();
+  if (id != 0 && spell_get_by_id(id) == NULL) {
+    r->broken = true;
+    return 0;
+  }
+  return id;
+}
+
+static uint64_t get_varint(struct reader *r) {
+  uint64_t v = 0;
+
+  for (uint8_t shift = 0; shift < 64; shift += 7) {
+    uint8_t b = get_u8(r);
+
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return v;
+    }
+  }
+
+  r->broken = true;
+  return 0;
+}
+
+static uint32_t get_u32(struct reader *r) {
+  uint64_t v = get_varint(r);
+
+  if (v > UINT32_MAX) {
+    r->broken = true;
+    return 0;
+  }
+  return v;
+}
+
+static int64_t get_signed(struct reader *r) {
+  uint64_t v = get_varint(r);
+
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int8_t get_i8(struct reader *r) {
+  int64_t v = get_signed(r);
+
+  if (v < INT8_MIN || v > INT8_MAX) {
+    r->broken = true;
+    return 0;
+  }
+  return v;
+}
+
+static coord_t get_coord(struct reader *r) {
+  int64_t v = get_signed(r);
+
+  if (v < INT32_MIN || v > INT32_MAX) {
+    r->broken = true;
+    return 0;
+  }
+  return v;
+}
+
+static pos_t get_pos(struct reader *r) {
+  pos_t pos;
+
+  pos.x = get_coord(r);
+  pos.y = get_coord(r);
+
+  return pos;
+}
+
+static uint32_t get_bits(struct reader *r, uint8_t num) {
+  uint32_t v;
+
+  while (r->num_bits < num) {
+    r->bits |= (uint64_t)get_u8(r) << r->num_bits;
+    r->num_bits += 8;
+  }
+
+  v = r->bits & ((1ULL << num) - 1);
+  r->bits >>= num;
+  r->num_bits -= num;
+
+  return v;
+}
+
+static void drop_bits(struct reader *r) {
+  r->bits = 0;
+  r->num_bits = 0;
+}
+
+/* Memory for @param count elements, taken off what the frame claimed */
+static void *claim(struct reader *r, size_t count, size_t each) {
+  if (count == 0 || r->broken) {
+    return NULL;
+  }
+
+  if (count > r->arena_left / each || block(count, each) > r->arena_left) {
+    r->broken = true;
+    return NULL;
+  }
+  r->arena_left -= block(count, each);
+
+  return message_alloc(r->msg, count, each);
+}
+
+/* Like claim() for arrays whose elements take a byte of the frame at least,
+ * so a count the rest of the frame can not hold is refused before anything
+ * is allocated */
+static void *carve(struct reader *r, size_t count, size_t each) {
+  if (count > r->size - r->pos) {
+    r->broken = true;
+    return NULL;
+  }
+
+  return claim(r, count, each);
+}
+
+/* Position of @param c in the bounding box at @param min, which has to fit a
+ * coord_t */
+static pos_t get_cell(struct reader *r, uint64_t c, pos_t min,
+                      uint64_t width) {
+  int64_t x = min.x + (int64_t)(c % width);
+  int64_t y = min.y + (int64_t)(c / width);
+  pos_t pos = {0, 0};
+
+  if (x > INT32_MAX || y > INT32_MAX) {
+    r->broken = true;
+    return pos;
+  }
+  pos.x = x;
+  pos.y = y;
+
+  return pos;
+}
+
+static void get_offsets(struct reader *r, pos_t *out, uint32_t size,
+                        pos_t min) {
+  uint8_t bits_x = get_u8(r);
+  uint8_t bits_y = get_u8(r);
+
+  if (bits_x > 32 || bits_y > 32 ||
+      (uint64_t)size * (bits_x + bits_y) > 8 * (uint64_t)(r->size - r->pos)) {
+    r->broken = true;
+    return;
+  }
+
+  for (uint32_t i = 0; i < size; i++) {
+    int64_t x = min.x + (int64_t)get_bits(r, bits_x);
+    int64_t y = min.y + (int64_t)get_bits(r, bits_y);
+
+    if (x > INT32_MAX || y > INT32_MAX) {
+      r->broken = true;
+    }
+    out[i].x = x;
+    out[i].y = y;
+  }
+  drop_bits(r);
+}
+
+static void get_mask(struct reader *r, pos_t *out, uint32_t size, pos_t min) {
+  uint64_t width = get_varint(r);
+  uint64_t height = get_varint(r);
+  uint64_t bytes;
+  uint32_t count = 0;
+
+  if (width == 0 || height == 0 || width > BOX_MAX || height > BOX_MAX) {
+    r->broken = true;
+    return;
+  }
+
+  bytes = (width * height + 7) / 8;
+  if (bytes > r->size - r->pos) {
+    r->broken = true;
+    return;
+  }
+
+  for (uint64_t i = 0; i < bytes; i++) {
+    uint8_t byte = get_u8(r);
+
+    while (byte != 0) {
+      uint64_t c = i * 8 + __builtin_ctz(byte);
+
+      if (c >= width * height || count == size) {
+        r->broken = true;
+        return;
+      }
+      out[count++] = get_cell(r, c, min, width);
+      byte &= byte - 1;
+    }
+  }
+
+  if (count != size) {
+    r->broken = true;
+  }
+}
+
+static void get_runs(struct reader *r, pos_t *out, uint32_t size, pos_t min) {
+  uint64_t width = get_varint(r);
+  uint64_t end = 0;
+  uint32_t count = 0;
+
+  if (width == 0 || width > BOX_MAX) {
+    r->broken = true;
+    return;
+  }
+
+  while (count < size && !r->broken) {
+    uint64_t gap = get_varint(r);
+    uint64_t len = get_varint(r);
+
+    if (len == 0 || len > size - count || gap > (uint64_t)BOX_MAX * BOX_MAX) {
+      r->broken = true;
+      return;
+    }
+
+    end += gap;
+    for (uint64_t i = 0; i < len; i++) {
+      out[count++] = get_cell(r, end + i, min, width);
+    }
+    end += len;
+  }
+}
+
+static void get_positions(struct reader *r, pos_t **data, uint32_t *size) {
+  uint8_t layout;
+  pos_t min;
+  pos_t *out;
+
+  *data = NULL;
+  *size = get_u32(r);
+  if (*size == 0) {
+    return;
+  }
+  if (*size > r->list_max) {
+    r->broken = true;
+    *size = 0;
+    return;
+  }
+
+  layout = get_u8(r);
+  min = get_pos(r);
+
+  /* Runs take a few bytes however long they are */
+  out = claim(r, *size, sizeof(*out));
+  if (out == NULL) {
+    *size = 0;
+    return;
+  }
+
+  switch (layout) {
+  case LAYOUT_OFFSETS:
+    get_offsets(r, out, *size, min);
+    break;
+  case LAYOUT_MASK:
+    get_mask(r, out, *size, min);
+    break;
+  case LAYOUT_RUNS:
+    get_runs(r, out, *size, min);
+    break;
+  default:
+    r->broken = true;
+    break;
+  }
+
+  *data = out;
+}
+
+static void get_spells(struct reader *r, struct msg_spell *spells,
+                       uint8_t num) {
+  for (uint8_t i = 0; i < num; i++) {
+    spells[i].id = get_u8(r);
+    spells[i].charges = get_u8(r);
+  }
+}
+
+static void get_effect(struct reader *r, struct applied_effect *eff) {
+  eff->type = get_u8(r);
+  eff->victim = get_u8(r);
+  eff->at = get_pos(r);
+  eff->duration = get_i8(r);
+
+  if (moves_player(eff->type)) {
+    eff->data.new_pos = get_pos(r);
+  } else if (eff->type == SPELL_EFFECT_SPLASH) {
+    eff->data.area.center = get_pos(r);
+    eff->data.area.radius = get_coord(r);
+  } else {
+    eff->data.dmg = get_i8(r);
+  }
+}
+
+static void get_map(struct reader *r, message_t *msg) {
+  uint32_t words;
+  uint32_t bytes;
+
+  msg->body.map.width = get_coord(r);
+  msg->body.map.height = get_coord(r);
+  msg->body.map.num_players = get_u8(r);
+
+  if (msg->body.map.width < 0 || msg->body.map.height < 0 ||
+      (uint64_t)msg->body.map.width * msg->body.map.height >
+          8 * (uint64_t)WIRE_FRAME_MAX) {
+    r->broken = true;
+    return;
+  }
+
+  msg->body.map.num_portals = get_u8(r);
+  msg->body.map.portals =
+      carve(r, msg->body.map.num_portals, sizeof(*msg->body.map.portals));
+  for (uint8_t i = 0; i < msg->body.map.num_portals && !r->broken; i++) {
+    msg->body.map.portals[i].pos = get_pos(r);
+    msg->body.map.portals[i].kind = get_u8(r);
+  }
+
+  words = plane_words(msg->body.map.width, msg->body.map.height);
+  bytes = plane_bytes(msg->body.map.width, msg->body.map.height);
+  if ((uint64_t)bytes * MAP_PLANES > r->size - r->pos) {
+    r->broken = true;
+    return;
+  }
+
+  msg->body.map.data =
+      carve(r, MAP_PLANES * words, sizeof(*msg->body.map.data));
+  if (msg->body.map.data == NULL) {
+    return;
+  }
+
+  for (uint8_t plane = 0; plane < MAP_PLANES; plane++) {
+    uint64_t *data = msg->body.map.data + plane * words;
+
+    for (uint32_t i = 0; i < bytes; i++) {
+      data[i / 8] |= (uint64_t)get_u8(r) << (8 * (i % 8));
+    }
+  }
+}
+
+static void get_player_update(struct reader *r, message_t *msg) {
+  typeof(msg->body.player_update) *u = &msg->body.player_update;
+
+  u->player_id = get_u8(r);
+  u->pos = get_pos(r);
+  u->face = get_u8(r);
+  u->health = get_i8(r);
+  u->kills = get_i8(r);
+  u->deaths = get_i8(r);
+  get_spells(r, u->spells, PORTAL_NONE);
+  get_positions(r, &u->los.opts, &u->los.size);
+
+  u->num_effects = get_u8(r);
+  u->effects = carve(r, u->num_effects, sizeof(*u->effects));
+  if (r->broken) {
+    return;
+  }
+  get_spells(r, u->effects, u->num_effects);
+
+  u->num_others = get_u8(r);
+  u->others = carve(r, u->num_others, sizeof(*u->others));
+  for (uint8_t i = 0; i < u->num_others && !r->broken; i++) {
+    u->others[i].player_id = get_u8(r);
+    u->others[i].pos = get_pos(r);
+    u->others[i].face = get_u8(r);
+    u->others[i].health = get_i8(r);
+    u->others[i].kills = get_i8(r);
+    u->others[i].deaths = get_i8(r);
+    get_spells(r, u->others[i].spells, PORTAL_NONE);
+    u->others[i].num_effects = get_u8(r);
+    u->others[i].effects =
+        carve(r, u->others[i].num_effects, sizeof(*u->others[i].effects));
+    if (r->broken) {
+      return;
+    }
+    get_spells(r, u->others[i].effects, u->others[i].num_effects);
+  }
+
+  u->num_portals = get_u8(r);
+  u->portals = carve(r, u->num_portals, sizeof(*u->portals));
+  for (uint8_t i = 0; i < u->num_portals && !r->broken; i++) {
+    u->portals[i].kind = get_u8(r);
+    u->portals[i].spell = get_u8(r);
+    u->portals[i].pos = get_pos(r);
+  }
+
+  u->num_events = get_u32(r);
+  u->events = carve(r, u->num_events, sizeof(*u->events));
+  for (uint32_t i = 0; i < u->num_events && !r->broken; i++) {
+    struct incident *inc = &u->events[i];
+
+    inc->from = get_pos(r);
+    inc->incident_type = get_u8(r);
+    inc->spell_kind = get_u8(r);
+    inc->spell_id = get_u8(r);
+    inc->player_origin = get_u8(r);
+
+    inc->num_targets = get_u8(r);
+    inc->targets = carve(r, inc->num_targets, sizeof(*inc->targets));
+    for (uint8_t j = 0; j < inc->num_targets && !r->broken; j++) {
+      struct target *t = &inc->targets[j];
+
+      t->target = get_pos(r);
+      t->num_effects = get_u8(r);
+      t->effects = carve(r, t->num_effects, sizeof(*t->effects));
+      for (uint8_t k = 0; k < t->num_effects && !r->broken; k++) {
+        get_effect(r, &t->effects[k]);
+      }
+    }
+  }
+
+  u->base = get_u32(r);
+  u->los_gone.opts = NULL;
+  u->los_gone.size = 0;
+  u->others_gone = NULL;
+  u->num_others_gone = 0;
+  if (u->base == 0) {
+    return;
+  }
+  get_positions(r, &u->los_gone.opts, &u->los_gone.size);
+  u->num_others_gone = get_u8(r);
+  u->others_gone = carve(r, u->num_others_gone, sizeof(*u->others_gone));
+  for (uint8_t i = 0; i < u->num_others_gone && !r->broken; i++) {
+    u->others_gone[i] = get_u8(r);
+  }
+}
+
+static void get_lockstep(struct reader *r, message_t *msg) {
+  typeof(msg->body.lockstep) *l = &msg->body.lockstep;
+
+  l->player_id = 0;
+  l->flags = get_u8(r);
+  l->hash = 0;
+  for (uint8_t i = 0; l->flags & LOCKSTEP_HASHED && i < 8; i++) {
+    l->hash |= (uint64_t)get_u8(r) << (8 * i);
+  }
+
+  l->num_inputs = get_u32(r);
+  l->inputs = carve(r, l->num_inputs, sizeof(*l->inputs));
+  for (uint32_t i = 0; i < l->num_inputs && !r->broken; i++) {
+    struct msg_input *in = &l->inputs[i];
+    uint64_t behind;
+
+    in->player = get_u8(r);
+    in->type = get_u8(r);
+    behind = get_varint(r);
+    if (behind > msg->tick) {
+      r->broken = true;
+      return;
+    }
+    in->tick = msg->tick - behind;
+    behind = get_varint(r);
+    if (behind > in->tick) {
+      r->broken = true;
+      return;
+    }
+    in->reply_tick = in->tick - behind;
+    in->pos = POSITION_UNKNOWN;
+    in->value = 0;
+    if (input_has_pos(in->type)) {
+      in->pos = get_pos(r);
+      in->value =
+          in->type == MESSAGE_REPLY_FIGHT ? get_spell_id(r) : get_u8(r);
+    }
+  }
+
+  l->state_size = get_u32(r);
+  if (l->state_size > 0) {
+    l->player_id = get_u8(r);
+  }
+  if (l->state_size > r->size - r->pos) {
+    r->broken = true;
+    return;
+  }
+  l->state = carve(r, l->state_size, 1);
+  for (uint32_t i = 0; i < l->state_size && !r->broken; i++) {
+    l->state[i] = get_u8(r);
+  }
+}
+
+static void get_body(struct reader *r, message_t *msg) {
+  switch (msg->type) {
+  case MESSAGE_MAP:
+    get_map(r, msg);
+    break;
+
+  case MESSAGE_ASK_SPAWN:
+    msg->body.ask_spawn.player_id = get_u8(r);
+    get_positions(r, &msg->body.ask_spawn.opts, &msg->body.ask_spawn.size);
+    break;
+
+  case MESSAGE_REPLY_SPAWN:
+    msg->body.reply_spawn.dst = get_pos(r);
+    msg->body.reply_spawn.face = get_u8(r);
+    break;
+
+  case MESSAGE_ASK_MOVE:
+    get_positions(r, &msg->body.ask_move.opts, &msg->body.ask_move.size);
+    break;
+
+  case MESSAGE_REPLY_MOVE:
+    msg->body.reply_move.dst = get_pos(r);
+    msg->body.reply_move.face = get_u8(r);
+    break;
+
+  case MESSAGE_ASK_FIGHT:
+    for (uint8_t i = 0; i < PORTAL_NONE; i++) {
+      msg->body.ask_fight.spell_id[i] = get_u8(r);
+      get_positions(r, &msg->body.ask_fight.spell_opts[i].opts,
+                    &msg->body.ask_fight.spell_opts[i].size);
+    }
+    break;
+
+  case MESSAGE_REPLY_FIGHT:
+    msg->body.reply_fight.spell_id = get_spell_id(r);
+    msg->body.reply_fight.target = get_pos(r);
+    break;
+
+  case MESSAGE_PLAYER_UPDATE:
+    get_player_update(r, msg);
+    break;
+
+  case MESSAGE_LOCKSTEP:
+    get_lockstep(r, msg);
+    break;
+
+  case MESSAGE_ASK_READY:
+  case MESSAGE_REPLY_READY:
+  case MESSAGE_REPLY_MAP:
+  case MESSAGE_REPLY_PLAYER_UPDATE:
+    break;
+  }
+}
+
+/* Most positions a list in a message of @param type may hold. Moves are only
+ * asked within MESSAGE_MOVE_STEPS, the other lists can cover the whole map
+ * and only the caller's arena limit bounds them. */
+static uint32_t list_max(uint8_t type) {
+  switch (type) {
+  case MESSAGE_ASK_MOVE:
+    return (2 * MESSAGE_MOVE_STEPS + 1) * (2 * MESSAGE_MOVE_STEPS + 1);
+  case MESSAGE_ASK_SPAWN:
+  case MESSAGE_ASK_FIGHT:
+  case MESSAGE_PLAYER_UPDATE:
+    return UINT32_MAX;
+  default:
+    return 0;
+  }
+}
+
+/* Frames of the other types, the replies among them, may not claim an arena */
+static bool has_arrays(uint8_t type) {
+  return list_max(type) > 0 || type == MESSAGE_MAP ||
+         type == MESSAGE_LOCKSTEP;
+}
+
+/* Reads the length prefix into @param len, returns its size in bytes. 0 if
+ * it is not all there yet, more than LENGTH_MAX if it is garbage. */
+static uint8_t get_length(const uint8_t *buf, size_t size, uint64_t *len) {
+  *len = 0;
+
+  for (uint8_t i = 0; i < LENGTH_MAX; i++) {
+    if (i >= size) {
+      return 0;
+    }
+
+    *len |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+    if ((buf[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+
+  return LENGTH_MAX + 1;
+}
+
+size_t wire_frame_size(const uint8_t *buf, size_t size) {
+  uint64_t len;
+  uint8_t prefix = get_length(buf, size, &len);
+
+  if (prefix == 0) {
+    return 0;
+  }
+  if (prefix > LENGTH_MAX) {
+    return SIZE_MAX;
+  }
+
+  return prefix + len;
+}
+
+message_t *wire_decode(const uint8_t *buf, size_t size, size_t max_arena) {
+  struct reader r = {0};
+  size_t frame = wire_frame_size(buf, size);
+  uint8_t version;
+  uint8_t type;
+  uint32_t tick;
+  uint64_t arena;
+  size_t reserve;
+  message_t *msg;
+
+  if (frame == 0 || frame > size || frame > WIRE_FRAME_MAX) {
+    return NULL;
+  }
+
+  r.buf = buf;
+  r.size = frame;
+  r.pos = get_length(buf, size, &arena);
+
+  version = get_u8(&r);
+  type = get_u8(&r);
+  tick = get_u32(&r);
+  arena = get_varint(&r);
+
+  if (r.broken || version != WIRE_VERSION || type > MESSAGE_LOCKSTEP ||
+      arena > max_arena || (!has_arrays(type) && arena > 0)) {
+    return NULL;
+  }
+
+  /* A frame that claims far more than it holds gets no more than a small
+   * arena until its arrays turn out to need it */
+  reserve = ARENA_SLACK + frame * ARENA_PER_BYTE;
+  msg = message_new(tick, type, arena < reserve ? arena : reserve);
+  r.msg = msg;
+  r.arena_left = arena;
+  r.list_max = list_max(type);
+
+  get_body(&r, msg);
+
+  if (r.broken || r.pos != r.size) {
+    message_unref(msg);
+    return NULL;
+  }
+
+  return msg;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+/* Binary encoding of message_t for sending it between processes.
+ *
+ * A frame is the length of the rest as a varint, followed by:
+ *   version  u8
+ *   type     u8, enum message_type
+ *   tick     varint
+ *   arena    varint, bytes the inner arrays need once decoded
+ *   body     depends on type
+ *
+ * Counts and ticks are LEB128 varints, signed values are zigzagged first.
+ * Position lists are stored as the smallest x and y and then in one of three
+ * layouts, whichever is smallest: every position's offset bit packed with
+ * just enough bits for the largest one, a bit per cell of the bounding box,
+ * or the gaps and lengths of runs of cells. The last two only work for lists
+ * in row order, which is what the engine sends. Map planes are sent as their
+ * bits, lockstep inputs with their ticks as how far they are behind the
+ * frame's.
+ *
+ * Decoding makes one allocation that holds the message and its inner arrays,
+ * message_unref() frees it. The arena size a frame carries is only trusted
+ * as far as the caller's limit goes. Runs of cells take a few bytes however
+ * long they are, so that limit is all that bounds what a frame can make the
+ * decoder allocate. */
+
+#define WIRE_VERSION 3
+
+/* Refuse frames that claim more than this, in bytes */
+#ifndef WIRE_FRAME_MAX
+#define WIRE_FRAME_MAX (16 * 1024 * 1024)
+#endif
+
+/* Encodes @param msg into @param buf, returns the frame size. If that is more
+ * than @param size nothing usable was written, call again with a bigger
+ * buffer. wire_encode(msg, NULL, 0) just measures. */
+size_t wire_encode(message_t *msg, uint8_t *buf, size_t size);
+
+/* Size of the whole frame starting at @param buf, 0 if not even the length
+ * is in yet */
+size_t wire_frame_size(const uint8_t *buf, size_t size);
+
+/* Decodes the frame at the start of @param buf, NULL if it is incomplete,
+ * broken, of another version or its arrays need more than @param max_arena
+ * bytes */
+message_t *wire_decode(const uint8_t *buf, size_t size, size_t max_arena);
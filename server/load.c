@@ -0,0 +1,653 @@
+/* memmem() */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "lockstep.h"
+#include "message.h"
+#include "rng.h"
+#include "wire.h"
+#include "ws.h"
+
+/* Opens a lot of WebSocket connections to respawn-server and plays every
+ * one of them with a bot that answers at once, so what is measured is the
+ * server. Reports how long turns take and how long the server sits on a
+ * reply before the next message comes. */
+
+#define MAX_EVENTS 256
+#define HANDSHAKE_MAX 8192
+#define REPLY_MAX 256
+
+enum client_state {
+  CLIENT_CONNECTING,
+  CLIENT_HANDSHAKE,
+  CLIENT_OPEN,
+  CLIENT_DONE,
+};
+
+struct load;
+
+struct client {
+  struct load *load;
+  int fd;
+  enum client_state state;
+  struct ws_buf in;
+  struct ws_buf out;
+  char accept[WS_ACCEPT_SIZE];
+  rng_t rng;
+  bool polling_out;
+  bool closing;
+  /* Runs the match for a server in lockstep, NULL otherwise */
+  lockstep_t *lockstep;
+
+  /* When the last move or spawn was asked for, 0 before the first */
+  double asked;
+  /* When the last reply went out, 0 if nothing is outstanding */
+  double replied;
+};
+
+struct samples {
+  double *data;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+struct setup {
+  struct sockaddr_in addr;
+  uint32_t connections;
+  uint32_t ramp;
+  double timeout;
+  uint32_t seed;
+  /* Player updates are not acked, for a server with pipelined turns */
+  bool no_acks;
+  bool lockstep;
+};
+
+struct load {
+  struct setup s;
+  int epoll;
+
+  struct client *clients;
+  uint32_t opened;
+  uint32_t done;
+  uint32_t failed;
+  uint64_t messages;
+  uint64_t bytes;
+  uint32_t desyncs;
+
+  struct samples turns;
+  struct samples rounds;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static void sample(struct samples *s, double value) {
+  if (s->size == s->capacity) {
+    uint32_t capacity = s->capacity > 0 ? s->capacity * 2 : 1024;
+    double *data = realloc(s->data, sizeof(*s->data) * capacity);
+
+    /* The percentiles just leave it out */
+    if (data == NULL) {
+      return;
+    }
+    s->data = data;
+    s->capacity = capacity;
+  }
+  s->data[s->size++] = value;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void print_samples(const char *name, struct samples *s) {
+  if (s->size == 0) {
+    printf("%s: no samples\n", name);
+    return;
+  }
+
+  qsort(s->data, s->size, sizeof(*s->data), compare_double);
+  printf("%s ms: p50 %.3f, p99 %.3f, max %.3f (%u samples)\n", name,
+         s->data[(s->size - 1) / 2] * 1e3,
+         s->data[(uint32_t)((s->size - 1) * 0.99)] * 1e3,
+         s->data[s->size - 1] * 1e3, s->size);
+}
+
+static void watch(struct load *load, struct client *c, bool out) {
+  struct epoll_event ev = {
+      .events = EPOLLIN | (out ? EPOLLOUT : 0),
+      .data.ptr = c,
+  };
+
+  if (c->polling_out != out) {
+    epoll_ctl(load->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+    c->polling_out = out;
+  }
+}
+
+static void finish(struct load *load, struct client *c, bool ok) {
+  if (c->state == CLIENT_DONE) {
+    return;
+  }
+
+  epoll_ctl(load->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  c->state = CLIENT_DONE;
+  ws_buf_free(&c->in);
+  ws_buf_free(&c->out);
+  if (c->lockstep != NULL) {
+    load->desyncs += lockstep_desyncs(c->lockstep);
+    lockstep_free(c->lockstep);
+    c->lockstep = NULL;
+  }
+
+  load->done++;
+  if (!ok) {
+    load->failed++;
+  }
+}
+
+static bool flush(struct load *load, struct client *c) {
+  if (!ws_buf_flush(&c->out, c->fd)) {
+    return false;
+  }
+  watch(load, c, ws_buf_len(&c->out) > 0);
+  return true;
+}
+
+/* Clients mask everything they send */
+static void add_frame(struct client *c, enum ws_opcode opcode,
+                      const uint8_t *data, size_t size) {
+  uint32_t r = rng_next(&c->rng);
+  uint8_t mask[4] = {r, r >> 8, r >> 16, r >> 24};
+
+  ws_buf_add_frame(&c->out, opcode, data, size, mask);
+}
+
+static void send_msg(struct client *c, message_t *msg) {
+  uint8_t buf[REPLY_MAX];
+  size_t size = wire_encode(msg, buf, sizeof(buf));
+
+  message_unref(msg);
+  if (size <= sizeof(buf)) {
+    add_frame(c, WS_BINARY, buf, size);
+  }
+  c->replied = now();
+}
+
+static pos_t pick(struct client *c, pos_t *opts, uint32_t size) {
+  if (size == 0) {
+    return POSITION_UNKNOWN;
+  }
+  return opts[rng_below(&c->rng, size)];
+}
+
+static void ask_fight(struct client *c, message_t *msg) {
+  uint8_t slots[PORTAL_NONE];
+  uint8_t num_slots = 0;
+  uint8_t slot;
+
+  for (uint8_t i = 0; i < PORTAL_NONE; i++) {
+    if (msg->body.ask_fight.spell_opts[i].size > 0) {
+      slots[num_slots++] = i;
+    }
+  }
+
+  if (num_slots == 0) {
+    send_msg(c, message_reply_fight(msg->tick, 0, POSITION_UNKNOWN));
+    return;
+  }
+
+  slot = slots[rng_below(&c->rng, num_slots)];
+  send_msg(c, message_reply_fight(
+                  msg->tick, msg->body.ask_fight.spell_id[slot],
+                  pick(c, msg->body.ask_fight.spell_opts[slot].opts,
+                       msg->body.ask_fight.spell_opts[slot].size)));
+}
+
+static void answer(struct client *c, message_t *msg) {
+  struct load *load = c->load;
+  double t = now();
+
+  load->messages++;
+  if (c->replied > 0) {
+    sample(&load->rounds, t - c->replied);
+    c->replied = 0;
+  }
+
+  switch (msg->type) {
+  case MESSAGE_ASK_READY:
+    send_msg(c, message_reply_ready(msg->tick));
+    break;
+
+  case MESSAGE_MAP:
+    send_msg(c, message_reply_map(msg->tick));
+    break;
+
+  case MESSAGE_ASK_SPAWN:
+    if (c->asked > 0) {
+      sample(&load->turns, t - c->asked);
+    }
+    c->asked = t;
+    send_msg(c, message_reply_spawn(msg->tick,
+                                    pick(c, msg->body.ask_spawn.opts,
+                                         msg->body.ask_spawn.size),
+                                    rng_below(&c->rng, DIRECTION_ANY)));
+    break;
+
+  case MESSAGE_ASK_MOVE:
+    if (c->asked > 0) {
+      sample(&load->turns, t - c->asked);
+    }
+    c->asked = t;
+    send_msg(c, message_reply_move(msg->tick,
+                                   pick(c, msg->body.ask_move.opts,
+                                        msg->body.ask_move.size),
+                                   rng_below(&c->rng, DIRECTION_ANY)));
+    break;
+
+  case MESSAGE_ASK_FIGHT:
+    ask_fight(c, msg);
+    break;
+
+  case MESSAGE_PLAYER_UPDATE:
+    if (!load->s.no_acks) {
+      send_msg(c, message_reply_player_update(msg->tick));
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+/* What the lockstep engine has for the player, see player_send_msg_func_t */
+static void relay(void *data, message_t *msg) { answer(data, msg); }
+
+/* Checks the server's 101 and its Sec-WebSocket-Accept */
+static bool handshake(struct client *c) {
+  uint8_t *head = ws_buf_head(&c->in);
+  size_t size = ws_buf_len(&c->in);
+  const char *end;
+  const char *accept;
+  char *line;
+
+  end = memmem(head, size, "\r\n\r\n", 4);
+  if (end == NULL) {
+    return size < HANDSHAKE_MAX;
+  }
+
+  line = strndup((const char *)head, end - (const char *)head);
+  if (strncmp(line, "HTTP/1.1 101", 12) != 0) {
+    free(line);
+    return false;
+  }
+
+  accept = strcasestr(line, "\r\nSec-WebSocket-Accept:");
+  if (accept == NULL) {
+    free(line);
+    return false;
+  }
+  accept += strlen("\r\nSec-WebSocket-Accept:");
+  accept += strspn(accept, " \t");
+  if (strncmp(accept, c->accept, WS_ACCEPT_SIZE - 1) != 0) {
+    free(line);
+    return false;
+  }
+  free(line);
+
+  ws_buf_consume(&c->in, end + 4 - (const char *)head);
+  c->state = CLIENT_OPEN;
+  return true;
+}
+
+/* Handles the complete frames in the input, false once the connection is
+ * over */
+static bool frames(struct client *c) {
+  for (;;) {
+    struct ws_frame frame;
+    uint8_t *head = ws_buf_head(&c->in);
+    size_t size = ws_buf_len(&c->in);
+    uint8_t *payload;
+    message_t *msg;
+    int header;
+
+    header = ws_parse_header(head, size, &frame);
+    if (header == 0) {
+      return true;
+    }
+    /* The server neither masks nor splits its messages */
+    if (header < 0 || frame.masked ||
+        (frame.opcode == WS_BINARY && !frame.fin) ||
+        frame.length > WIRE_FRAME_MAX) {
+      return false;
+    }
+    if (size < header + frame.length) {
+      return true;
+    }
+    payload = head + header;
+
+    switch (frame.opcode) {
+    case WS_PING:
+      add_frame(c, WS_PONG, payload, frame.length);
+      break;
+
+    case WS_CLOSE:
+      if (!c->closing) {
+        add_frame(c, WS_CLOSE, payload, frame.length >= 2 ? 2 : 0);
+      }
+      ws_buf_flush(&c->out, c->fd);
+      c->closing = true;
+      return false;
+
+    case WS_BINARY:
+      if (wire_frame_size(payload, frame.length) != frame.length) {
+        return false;
+      }
+      /* Updates of long runs of cells rightly take far more than their
+       * frame, the server under load is trusted with that */
+      msg = wire_decode(payload, frame.length, WIRE_FRAME_MAX);
+      if (msg == NULL) {
+        return false;
+      }
+      c->load->bytes += frame.length;
+      if (c->lockstep != NULL) {
+        lockstep_server_send(c->lockstep, msg);
+      } else {
+        answer(c, msg);
+      }
+      message_unref(msg);
+      break;
+
+    default:
+      break;
+    }
+
+    ws_buf_consume(&c->in, header + frame.length);
+  }
+}
+
+static void readable(struct load *load, struct client *c) {
+  bool open = ws_buf_read(&c->in, c->fd, WIRE_FRAME_MAX + WS_HEADER_MAX);
+
+  if (c->state == CLIENT_HANDSHAKE && !handshake(c)) {
+    finish(load, c, false);
+    return;
+  }
+  if (c->state == CLIENT_OPEN && !frames(c)) {
+    /* A close from the server is how a finished match ends */
+    finish(load, c, c->closing);
+    return;
+  }
+  if (!open) {
+    finish(load, c, false);
+    return;
+  }
+  if (!flush(load, c)) {
+    finish(load, c, false);
+  }
+}
+
+static void connected(struct load *load, struct client *c) {
+  struct setup *s = &load->s;
+  char request[512];
+  uint8_t nonce[16];
+  char key[32];
+  char host[INET_ADDRSTRLEN];
+  int err = 0;
+  socklen_t len = sizeof(err);
+  int size;
+
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+    finish(load, c, false);
+    return;
+  }
+
+  for (uint8_t i = 0; i < sizeof(nonce); i++) {
+    nonce[i] = rng_next(&c->rng);
+  }
+  ws_base64(nonce, sizeof(nonce), key);
+  ws_accept_key(key, strlen(key), c->accept);
+  inet_ntop(AF_INET, &s->addr.sin_addr, host, sizeof(host));
+
+  size = snprintf(request, sizeof(request),
+                  "GET / HTTP/1.1\r\n"
+                  "Host: %s:%u\r\n"
+                  "Upgrade: websocket\r\n"
+                  "Connection: Upgrade\r\n"
+                  "Sec-WebSocket-Key: %s\r\n"
+                  "Sec-WebSocket-Version: 13\r\n"
+                  "\r\n",
+                  host, ntohs(s->addr.sin_port), key);
+  c->state = CLIENT_HANDSHAKE;
+
+  if (!ws_buf_append(&c->out, request, size) || !flush(load, c)) {
+    finish(load, c, false);
+  }
+}
+
+static void open_more(struct load *load) {
+  struct setup *s = &load->s;
+  uint32_t until = load->opened + s->ramp;
+
+  if (until > s->connections) {
+    until = s->connections;
+  }
+
+  for (; load->opened < until; load->opened++) {
+    struct client *c = &load->clients[load->opened];
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    int one = 1;
+
+    c->load = load;
+    rng_seed(&c->rng, (uint64_t)s->seed << 32 | load->opened);
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+      c->state = CLIENT_DONE;
+      load->done++;
+      load->failed++;
+      continue;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, (struct sockaddr *)&s->addr, sizeof(s->addr)) < 0 &&
+        errno != EINPROGRESS) {
+      close(c->fd);
+      c->state = CLIENT_DONE;
+      load->done++;
+      load->failed++;
+      continue;
+    }
+
+    if (s->lockstep) {
+      c->lockstep = lockstep_new(relay, c);
+    }
+    c->state = CLIENT_CONNECTING;
+    c->polling_out = true;
+    epoll_ctl(load->epoll, EPOLL_CTL_ADD, c->fd, &ev);
+  }
+}
+
+/* Thousands of connections need more descriptors than the default soft
+ * limit */
+static void raise_fd_limit(void) {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-a address] [-P port] [-c connections] [-r ramp]\n"
+          "          [-T timeout] [-s seed] [-n] [-l]\n"
+          "  -c connections, a multiple of the server's players per match\n"
+          "  -r connections opened per loop while ramping up\n"
+          "  -T seconds to wait for the server to end all matches\n"
+          "  -n leaves player updates unacked, for a server run with -a\n"
+          "  -l runs the matches on the client, for a server run with -l\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct load load = {
+      .s =
+          {
+              .addr =
+                  {
+                      .sin_family = AF_INET,
+                      .sin_port = htons(8080),
+                      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+                  },
+              .connections = 100,
+              .ramp = 256,
+              .timeout = 60.0,
+              .seed = 1,
+              .no_acks = false,
+              .lockstep = false,
+          },
+  };
+  struct setup *s = &load.s;
+  struct epoll_event events[MAX_EVENTS];
+  double start;
+  double seconds;
+  uint32_t finished;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "a:P:c:r:T:s:nl")) != -1) {
+    switch (opt) {
+    case 'a':
+      if (inet_pton(AF_INET, optarg, &s->addr.sin_addr) != 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'P':
+      s->addr.sin_port = htons(atoi(optarg));
+      break;
+    case 'c':
+      s->connections = atoi(optarg);
+      break;
+    case 'r':
+      s->ramp = atoi(optarg);
+      break;
+    case 'T':
+      s->timeout = atof(optarg);
+      break;
+    case 's':
+      s->seed = atoi(optarg);
+      break;
+    case 'n':
+      s->no_acks = true;
+      break;
+    case 'l':
+      s->lockstep = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (s->connections == 0 || s->ramp == 0 || s->timeout <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  common_log_quiet(true);
+  raise_fd_limit();
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  load.clients = calloc(s->connections, sizeof(*load.clients));
+  load.epoll = epoll_create1(EPOLL_CLOEXEC);
+
+  start = now();
+  while (!stop && load.done < s->connections &&
+         now() - start < s->timeout) {
+    int num;
+
+    open_more(&load);
+    num = epoll_wait(load.epoll, events, MAX_EVENTS, 100);
+
+    for (int i = 0; i < num; i++) {
+      struct client *c = events[i].data.ptr;
+
+      if (c->state == CLIENT_DONE) {
+        continue;
+      }
+      if (c->state == CLIENT_CONNECTING) {
+        connected(&load, c);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        readable(&load, c);
+      }
+      if (c->state != CLIENT_DONE && events[i].events & EPOLLOUT &&
+          !flush(&load, c)) {
+        finish(&load, c, false);
+      }
+    }
+  }
+  seconds = now() - start;
+  finished = load.done - load.failed;
+
+  for (uint32_t i = 0; i < load.opened; i++) {
+    finish(&load, &load.clients[i], false);
+  }
+
+  printf("%u connections, %u finished their match, %u failed or timed out "
+         "in %.1f s\n",
+         s->connections, finished, s->connections - finished, seconds);
+  printf("%lu messages, %.0f messages/s, %lu bytes received\n",
+         (unsigned long)load.messages,
+         seconds > 0 ? load.messages / seconds : 0.0,
+         (unsigned long)load.bytes);
+  if (s->lockstep) {
+    printf("%u steps out of sync with the server\n", load.desyncs);
+  }
+  print_samples("Turn", &load.turns);
+  print_samples("Reply to next message", &load.rounds);
+
+  free(load.turns.data);
+  free(load.rounds.data);
+  free(load.clients);
+  close(load.epoll);
+
+  return finished < s->connections;
+}
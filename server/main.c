@@ -0,0 +1,1128 @@
+/* accept4() and memmem() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "wire.h"
+#include "ws.h"
+
+/* Hosts matches for remote players over WebSocket, every binary message
+ * holding one wire frame (see wire.h). Connections wait in the lobby until
+ * there are enough for a match, which then steps whenever
+ * engine_player_ready() says all replies are in. All matches share one
+ * thread and one epoll loop. The line of sight table of each map is built
+ * on a thread of its own, see los_builder(), the match plays on walked
+ * queries until it is in. */
+
+#define MAX_PLAYERS 32
+#define MAX_EVENTS 256
+#define HANDSHAKE_MAX 8192
+/* Replies are a few bytes, anything near this is not a player */
+#define MESSAGE_MAX 65536
+/* Replies waiting for the engine. It takes one a step and only asks again
+ * once every player's is in, so a player never has more than a few. */
+#define INBOX_MAX 8
+/* Quiet connections are pinged after this many seconds and dropped after
+ * the second */
+#define PING_AFTER 15.0
+#define DROP_AFTER 45.0
+#define REPORT_EVERY 5.0
+/* Turns between keyframes of a recording, see engine_record() */
+#define KEYFRAME_TURNS 50
+
+enum conn_state {
+  CONN_HANDSHAKE,
+  CONN_OPEN,
+  CONN_CLOSING,
+};
+
+/* Close codes from RFC 6455 */
+enum close_code {
+  CLOSE_NORMAL = 1000,
+  CLOSE_GOING_AWAY = 1001,
+  CLOSE_PROTOCOL = 1002,
+  CLOSE_UNSUPPORTED = 1003,
+  CLOSE_INVALID = 1007,
+  CLOSE_POLICY = 1008,
+  CLOSE_TOO_BIG = 1009,
+  CLOSE_INTERNAL = 1011,
+};
+
+struct server;
+struct match;
+
+struct inbox {
+  message_t **msgs;
+  uint32_t head;
+  uint32_t size;
+  uint32_t capacity;
+};
+
+struct conn {
+  struct server *srv;
+  int fd;
+  enum conn_state state;
+  struct ws_buf in;
+  struct ws_buf out;
+  /* Fragments of a message that is not complete yet */
+  struct ws_buf fragments;
+  bool fragmented;
+  struct inbox inbox;
+
+  struct match *match;
+  uint8_t id;
+
+  bool dirty;
+  bool polling_out;
+  double seen;
+  bool pinged;
+
+  struct conn *prev;
+  struct conn *next;
+};
+
+struct match {
+  struct server *srv;
+  uint32_t id;
+  engine_t *engine;
+  map_t *map;
+  struct conn *conns[MAX_PLAYERS];
+  uint8_t players;
+  /* A player left, the match is ended on the next run */
+  bool over;
+  bool queued;
+  struct match *next;
+
+  /* The line of sight table is being built, the map has to stay until then.
+   * ended is set if the match is over before. */
+  bool building;
+  bool ended;
+  map_los_t *los;
+  struct match *los_next;
+};
+
+struct setup {
+  uint16_t port;
+  uint8_t players;
+  uint32_t turns;
+  uint32_t seed;
+  coord_t width;
+  coord_t height;
+  int32_t room_factor;
+  bool delta;
+  bool pipelined;
+  /* Players run the match themselves on the relayed replies */
+  bool lockstep;
+  /* Directory each match is recorded to, NULL for none */
+  const char *record;
+  bool verbose;
+};
+
+struct server {
+  struct setup s;
+  int epoll;
+  int listener;
+
+  struct conn *conns;
+  uint32_t num_conns;
+  struct conn *lobby[MAX_PLAYERS];
+  uint8_t waiting;
+
+  struct match *queue;
+  struct conn **dirty;
+  uint32_t num_dirty;
+  uint32_t dirty_capacity;
+  /* Closed this round, freed once no event can point at them */
+  struct conn *dead;
+
+  /* Matches waiting for their line of sight table, taken by the builder
+   * under los_lock. It hands them back through los_done. */
+  pthread_t builder;
+  bool has_builder;
+  pthread_mutex_t los_lock;
+  pthread_cond_t los_wake;
+  struct match *los_queue;
+  struct match *los_tail;
+  bool los_stop;
+  int los_done[2];
+
+  uint32_t matches;
+  uint32_t running;
+  uint32_t finished;
+  uint32_t abandoned;
+  uint64_t turns;
+  uint64_t messages;
+  uint64_t bytes;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+/* False if there is no room for @param msg */
+static bool inbox_push(struct inbox *box, message_t *msg) {
+  if (box->head > 0 && box->head == box->size) {
+    box->head = 0;
+    box->size = 0;
+  }
+  if (box->size == box->capacity) {
+    uint32_t capacity = box->capacity > 0 ? box->capacity * 2 : 4;
+    message_t **msgs = realloc(box->msgs, sizeof(*box->msgs) * capacity);
+
+    if (msgs == NULL) {
+      return false;
+    }
+    box->msgs = msgs;
+    box->capacity = capacity;
+  }
+  box->msgs[box->size++] = msg;
+
+  return true;
+}
+
+static message_t *inbox_pop(struct inbox *box) {
+  if (box->head == box->size) {
+    return NULL;
+  }
+  return box->msgs[box->head++];
+}
+
+static void inbox_free(struct inbox *box) {
+  while (box->head < box->size) {
+    message_unref(box->msgs[box->head++]);
+  }
+  free(box->msgs);
+  box->msgs = NULL;
+  box->head = 0;
+  box->size = 0;
+  box->capacity = 0;
+}
+
+static void watch(struct server *srv, struct conn *c, bool out) {
+  struct epoll_event ev = {
+      .events = EPOLLIN | (out ? EPOLLOUT : 0),
+      .data.ptr = c,
+  };
+
+  if (c->polling_out != out) {
+    epoll_ctl(srv->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+    c->polling_out = out;
+  }
+}
+
+static void mark_dirty(struct server *srv, struct conn *c) {
+  if (c->dirty) {
+    return;
+  }
+  if (srv->num_dirty == srv->dirty_capacity) {
+    uint32_t capacity =
+        srv->dirty_capacity > 0 ? srv->dirty_capacity * 2 : 256;
+    struct conn **dirty = realloc(srv->dirty, sizeof(*dirty) * capacity);
+
+    /* What it has to send waits for the next time it is marked */
+    if (dirty == NULL) {
+      return;
+    }
+    srv->dirty = dirty;
+    srv->dirty_capacity = capacity;
+  }
+  srv->dirty[srv->num_dirty++] = c;
+  c->dirty = true;
+}
+
+static void send_close(struct conn *c, enum close_code code) {
+  uint8_t payload[2] = {code >> 8, code & 0xff};
+
+  if (c->state == CONN_OPEN) {
+    ws_buf_add_frame(&c->out, WS_CLOSE, payload, sizeof(payload), NULL);
+    mark_dirty(c->srv, c);
+  }
+  c->state = CONN_CLOSING;
+}
+
+static void queue_match(struct server *srv, struct match *m) {
+  if (!m->queued) {
+    m->queued = true;
+    m->next = srv->queue;
+    srv->queue = m;
+  }
+}
+
+static void conn_close(struct server *srv, struct conn *c) {
+  if (c->fd < 0) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < srv->waiting; i++) {
+    if (srv->lobby[i] == c) {
+      srv->lobby[i] = srv->lobby[--srv->waiting];
+      break;
+    }
+  }
+
+  if (c->match != NULL) {
+    c->match->conns[c->id] = NULL;
+    c->match->over = true;
+    queue_match(srv, c->match);
+    c->match = NULL;
+  }
+
+  epoll_ctl(srv->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    srv->conns = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  srv->num_conns--;
+
+  c->next = srv->dead;
+  srv->dead = c;
+}
+
+/* Engine side of a remote player, see player_send_msg_func_t */
+static void conn_send(void *data, message_t *msg) {
+  struct conn *c = data;
+  size_t room = 1024;
+  size_t size;
+  uint8_t header;
+  uint8_t *at;
+
+  if (c->state != CONN_OPEN) {
+    return;
+  }
+
+  /* Encode behind the longest header and move it up once the size is known,
+   * only messages bigger than the guess are encoded twice */
+  for (;;) {
+    at = ws_buf_reserve(&c->out, WS_HEADER_MAX + room);
+    if (at == NULL) {
+      common_log("No memory to send player %u a message\n", c->id);
+      send_close(c, CLOSE_INTERNAL);
+      return;
+    }
+    size = wire_encode(msg, at + WS_HEADER_MAX, room);
+    if (size <= room) {
+      break;
+    }
+    ws_buf_unreserve(&c->out, WS_HEADER_MAX + room);
+    room = size;
+  }
+
+  header = ws_write_header(at, WS_BINARY, size, NULL);
+  memmove(at + header, at + WS_HEADER_MAX, size);
+  ws_buf_unreserve(&c->out, WS_HEADER_MAX - header + room - size);
+
+  c->srv->messages++;
+  c->srv->bytes += size;
+  mark_dirty(c->srv, c);
+}
+
+static message_t *conn_get(void *data) {
+  struct conn *c = data;
+
+  return inbox_pop(&c->inbox);
+}
+
+static void match_ready(void *data, engine_t *engine) {
+  struct match *m = data;
+
+  (void)engine;
+  queue_match(m->srv, m);
+}
+
+/* Builds the tables queued by build_los(), one at a time. Only the walls of
+ * a map are read, which the match running on it never changes. */
+static void *los_builder(void *data) {
+  struct server *srv = data;
+
+  common_log_quiet(!srv->s.verbose);
+  pthread_mutex_lock(&srv->los_lock);
+  for (;;) {
+    struct match *m;
+
+    while (srv->los_queue == NULL && !srv->los_stop) {
+      pthread_cond_wait(&srv->los_wake, &srv->los_lock);
+    }
+    m = srv->los_queue;
+    if (m == NULL) {
+      break;
+    }
+    srv->los_queue = m->los_next;
+    pthread_mutex_unlock(&srv->los_lock);
+
+    m->los = map_los_build(m->map, 1, MAP_LOS_TABLE_MAX);
+    while (write(srv->los_done[1], &m, sizeof(m)) < 0 && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&srv->los_lock);
+  }
+  pthread_mutex_unlock(&srv->los_lock);
+
+  return NULL;
+}
+
+/* A table takes tens of milliseconds, which every match would stall for if
+ * it was built here. Without the builder it is. */
+static void build_los(struct server *srv, struct match *m) {
+  if (!srv->has_builder) {
+    map_precompute_los(m->map, 1, MAP_LOS_TABLE_MAX);
+    return;
+  }
+
+  m->building = true;
+  m->los_next = NULL;
+  pthread_mutex_lock(&srv->los_lock);
+  if (srv->los_queue == NULL) {
+    srv->los_queue = m;
+  } else {
+    srv->los_tail->los_next = m;
+  }
+  srv->los_tail = m;
+  pthread_cond_signal(&srv->los_wake);
+  pthread_mutex_unlock(&srv->los_lock);
+}
+
+static void match_free(struct match *m) {
+  map_los_free(m->los);
+  map_free(m->map);
+  free(m);
+}
+
+/* Hands the tables the builder is done with to their maps */
+static void los_built(struct server *srv) {
+  struct match *m;
+
+  while (read(srv->los_done[0], &m, sizeof(m)) == sizeof(m)) {
+    m->building = false;
+    if (m->ended) {
+      match_free(m);
+      continue;
+    }
+    map_los_attach(m->map, m->los);
+    m->los = NULL;
+  }
+}
+
+static bool start_builder(struct server *srv) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = srv->los_done};
+
+  if (pipe2(srv->los_done, O_CLOEXEC) < 0) {
+    return false;
+  }
+  /* Only the loop's end may not block */
+  fcntl(srv->los_done[0], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&srv->los_lock, NULL);
+  pthread_cond_init(&srv->los_wake, NULL);
+
+  if (pthread_create(&srv->builder, NULL, los_builder, srv) != 0) {
+    close(srv->los_done[0]);
+    close(srv->los_done[1]);
+    return false;
+  }
+  epoll_ctl(srv->epoll, EPOLL_CTL_ADD, srv->los_done[0], &ev);
+  srv->has_builder = true;
+
+  return true;
+}
+
+/* Waits for the tables still queued and frees the matches that ended */
+static void stop_builder(struct server *srv) {
+  if (!srv->has_builder) {
+    return;
+  }
+
+  pthread_mutex_lock(&srv->los_lock);
+  srv->los_stop = true;
+  pthread_cond_signal(&srv->los_wake);
+  pthread_mutex_unlock(&srv->los_lock);
+  pthread_join(srv->builder, NULL);
+
+  los_built(srv);
+  close(srv->los_done[0]);
+  close(srv->los_done[1]);
+  pthread_mutex_destroy(&srv->los_lock);
+  pthread_cond_destroy(&srv->los_wake);
+  srv->has_builder = false;
+}
+
+static void match_start(struct server *srv) {
+  struct setup *s = &srv->s;
+  uint32_t seed = s->seed + srv->matches;
+  char path[4096];
+  struct match *m;
+
+  m = calloc(1, sizeof(*m));
+  m->srv = srv;
+  m->id = srv->matches++;
+  m->players = s->players;
+  m->map = map_new(s->width, s->height, s->room_factor, seed);
+  build_los(srv, m);
+  m->engine = engine_new(s->players, m->map, NULL, false, seed);
+  engine_set_delta_updates(m->engine, s->delta);
+  engine_set_pipelined(m->engine, s->pipelined);
+  engine_set_lockstep(m->engine, s->lockstep);
+  engine_set_ready_func(m->engine, match_ready, m);
+
+  for (uint8_t i = 0; i < s->players; i++) {
+    struct conn *c = srv->lobby[i];
+
+    c->match = m;
+    c->id = i;
+    m->conns[i] = c;
+    engine_add_player(m->engine, conn_send, c, conn_get, c);
+  }
+  if (s->record != NULL) {
+    snprintf(path, sizeof(path), "%s/match-%u.rsp", s->record, m->id);
+    if (!engine_record(m->engine, path, KEYFRAME_TURNS)) {
+      fprintf(stderr, "Can not record match %u to %s\n", m->id, path);
+    }
+  }
+  srv->waiting = 0;
+  srv->running++;
+
+  queue_match(srv, m);
+}
+
+static void match_end(struct server *srv, struct match *m) {
+  for (uint8_t i = 0; i < m->players; i++) {
+    struct conn *c = m->conns[i];
+
+    if (c == NULL) {
+      continue;
+    }
+    c->match = NULL;
+    inbox_free(&c->inbox);
+    send_close(c, m->over ? CLOSE_GOING_AWAY : CLOSE_NORMAL);
+  }
+
+  if (m->over) {
+    srv->abandoned++;
+  } else {
+    srv->finished++;
+  }
+  srv->turns += engine_turns(m->engine);
+  srv->running--;
+
+  if (!engine_record_stop(m->engine)) {
+    fprintf(stderr, "Recording of match %u is incomplete\n", m->id);
+  }
+  engine_free(m->engine);
+  m->engine = NULL;
+  if (m->building) {
+    m->ended = true;
+    return;
+  }
+  match_free(m);
+}
+
+static void run_matches(struct server *srv) {
+  while (srv->queue != NULL) {
+    struct match *m = srv->queue;
+
+    srv->queue = m->next;
+    m->queued = false;
+
+    if (!m->over) {
+      while (engine_turns(m->engine) < srv->s.turns &&
+             engine_step_until_blocked(m->engine) > 0) {
+      }
+    }
+
+    if (m->over || engine_turns(m->engine) >= srv->s.turns) {
+      match_end(srv, m);
+    }
+  }
+}
+
+/* The value of a header line from @param from to @param eol, without the
+ * spaces around it */
+static char *header_value(char *from, char *eol, size_t *size) {
+  while (*from == ' ' && from < eol) {
+    from++;
+  }
+  *size = eol - from;
+  while (*size > 0 && from[*size - 1] == ' ') {
+    (*size)--;
+  }
+
+  return from;
+}
+
+/* Reads the HTTP upgrade request, false if the connection has to go */
+static bool handshake(struct server *srv, struct conn *c) {
+  static const char reply[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Accept: %s\r\n\r\n";
+  static const char refused[] = "HTTP/1.1 400 Bad Request\r\n"
+                                "Connection: close\r\n\r\n";
+  static const char wrong_version[] = "HTTP/1.1 426 Upgrade Required\r\n"
+                                      "Sec-WebSocket-Version: 13\r\n"
+                                      "Connection: close\r\n\r\n";
+  char *request = (char *)ws_buf_head(&c->in);
+  size_t size = ws_buf_len(&c->in);
+  char *end;
+  char *key = NULL;
+  size_t key_size = 0;
+  bool version = false;
+  bool upgrade = false;
+  char accept[WS_ACCEPT_SIZE];
+  char buf[sizeof(reply) + WS_ACCEPT_SIZE];
+
+  end = memmem(request, size, "\r\n\r\n", 4);
+  if (end == NULL) {
+    return size < HANDSHAKE_MAX;
+  }
+
+  for (char *line = request; line < end;) {
+    char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+    size_t len = eol - line;
+
+    if (len > 18 && strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+      key = header_value(line + 18, eol, &key_size);
+    } else if (len > 22 &&
+               strncasecmp(line, "Sec-WebSocket-Version:", 22) == 0) {
+      size_t value_size;
+      char *value = header_value(line + 22, eol, &value_size);
+
+      version = value_size == 2 && strncmp(value, "13", 2) == 0;
+    } else if (len > 8 && strncasecmp(line, "Upgrade:", 8) == 0) {
+      for (char *p = line + 8; p + 9 <= eol; p++) {
+        if (strncasecmp(p, "websocket", 9) == 0) {
+          upgrade = true;
+        }
+      }
+    }
+    line = eol + 2;
+  }
+
+  if (strncmp(request, "GET ", 4) != 0 || key == NULL ||
+      !ws_key_valid(key, key_size) || !upgrade) {
+    ws_buf_append(&c->out, refused, sizeof(refused) - 1);
+    ws_buf_flush(&c->out, c->fd);
+    return false;
+  }
+  if (!version) {
+    ws_buf_append(&c->out, wrong_version, sizeof(wrong_version) - 1);
+    ws_buf_flush(&c->out, c->fd);
+    return false;
+  }
+
+  ws_accept_key(key, key_size, accept);
+  snprintf(buf, sizeof(buf), reply, accept);
+  if (!ws_buf_append(&c->out, buf, strlen(buf))) {
+    return false;
+  }
+  mark_dirty(srv, c);
+
+  ws_buf_consume(&c->in, end + 4 - request);
+  c->state = CONN_OPEN;
+
+  srv->lobby[srv->waiting++] = c;
+  if (srv->waiting == srv->s.players) {
+    match_start(srv);
+  }
+
+  return true;
+}
+
+static bool is_reply(uint8_t type) {
+  switch (type) {
+  case MESSAGE_REPLY_READY:
+  case MESSAGE_REPLY_MAP:
+  case MESSAGE_REPLY_SPAWN:
+  case MESSAGE_REPLY_MOVE:
+  case MESSAGE_REPLY_FIGHT:
+  case MESSAGE_REPLY_PLAYER_UPDATE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool deliver(struct conn *c, uint8_t *data, size_t size) {
+  message_t *msg;
+
+  if (wire_frame_size(data, size) != size) {
+    return false;
+  }
+  msg = wire_decode(data, size, MESSAGE_MAX);
+  if (msg == NULL) {
+    return false;
+  }
+
+  /* Players only ever reply, and no faster than they are asked */
+  if (!is_reply(msg->type) || c->inbox.size - c->inbox.head >= INBOX_MAX) {
+    message_unref(msg);
+    send_close(c, CLOSE_POLICY);
+    return false;
+  }
+
+  /* Nobody asked anything before the match starts */
+  if (c->match == NULL || c->match->over) {
+    message_unref(msg);
+    return true;
+  }
+
+  if (!inbox_push(&c->inbox, msg)) {
+    message_unref(msg);
+    send_close(c, CLOSE_INTERNAL);
+    return false;
+  }
+  engine_player_ready(c->match->engine, c->id);
+
+  return true;
+}
+
+/* Sends the close frame for a broken connection right away, it is dropped
+ * without waiting for the answer */
+static bool fail(struct conn *c, enum close_code code) {
+  send_close(c, code);
+  ws_buf_flush(&c->out, c->fd);
+  return false;
+}
+
+/* Handles the complete frames in the input, false if the connection has to
+ * go */
+static bool frames(struct server *srv, struct conn *c) {
+  for (;;) {
+    struct ws_frame frame;
+    uint8_t *head = ws_buf_head(&c->in);
+    size_t size = ws_buf_len(&c->in);
+    uint8_t *payload;
+    int header;
+
+    header = ws_parse_header(head, size, &frame);
+    if (header == 0) {
+      return true;
+    }
+    if (header < 0 || !frame.masked) {
+      return fail(c, CLOSE_PROTOCOL);
+    }
+    if (frame.length > MESSAGE_MAX ||
+        ws_buf_len(&c->fragments) + frame.length > MESSAGE_MAX) {
+      return fail(c, CLOSE_TOO_BIG);
+    }
+    if (size < header + frame.length) {
+      return true;
+    }
+
+    payload = head + header;
+    ws_mask(payload, frame.length, frame.mask, 0);
+
+    switch (frame.opcode) {
+    case WS_PING:
+      ws_buf_add_frame(&c->out, WS_PONG, payload, frame.length, NULL);
+      mark_dirty(srv, c);
+      break;
+
+    case WS_PONG:
+      break;
+
+    case WS_CLOSE:
+      if (c->state == CONN_OPEN) {
+        ws_buf_add_frame(&c->out, WS_CLOSE, payload,
+                         frame.length >= 2 ? 2 : 0, NULL);
+      }
+      ws_buf_flush(&c->out, c->fd);
+      return false;
+
+    case WS_BINARY:
+    case WS_CONTINUATION:
+      if ((frame.opcode == WS_BINARY) == c->fragmented) {
+        return fail(c, CLOSE_PROTOCOL);
+      }
+      if (c->state != CONN_OPEN) {
+        break;
+      }
+
+      if (frame.fin && !c->fragmented) {
+        if (!deliver(c, payload, frame.length)) {
+          return fail(c, CLOSE_INVALID);
+        }
+        break;
+      }
+
+      if (!ws_buf_append(&c->fragments, payload, frame.length)) {
+        return fail(c, CLOSE_INTERNAL);
+      }
+      c->fragmented = !frame.fin;
+      if (frame.fin) {
+        bool ok = deliver(c, ws_buf_head(&c->fragments),
+                          ws_buf_len(&c->fragments));
+
+        ws_buf_consume(&c->fragments, ws_buf_len(&c->fragments));
+        if (!ok) {
+          return fail(c, CLOSE_INVALID);
+        }
+      }
+      break;
+
+    default:
+      return fail(c, CLOSE_UNSUPPORTED);
+    }
+
+    ws_buf_consume(&c->in, header + frame.length);
+  }
+}
+
+static void readable(struct server *srv, struct conn *c) {
+  /* frames() turns down anything longer, more is never needed at once */
+  bool open = ws_buf_read(&c->in, c->fd, MESSAGE_MAX + WS_HEADER_MAX);
+
+  c->seen = now();
+  c->pinged = false;
+
+  if (c->state == CONN_HANDSHAKE && !handshake(srv, c)) {
+    conn_close(srv, c);
+    return;
+  }
+  if (c->state != CONN_HANDSHAKE && !frames(srv, c)) {
+    conn_close(srv, c);
+    return;
+  }
+  if (!open) {
+    conn_close(srv, c);
+  }
+}
+
+static void accept_all(struct server *srv) {
+  for (;;) {
+    struct epoll_event ev = {.events = EPOLLIN};
+    struct conn *c;
+    int one = 1;
+    int fd;
+
+    fd = accept4(srv->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c = calloc(1, sizeof(*c));
+    c->srv = srv;
+    c->fd = fd;
+    c->state = CONN_HANDSHAKE;
+    c->seen = now();
+
+    c->next = srv->conns;
+    if (srv->conns != NULL) {
+      srv->conns->prev = c;
+    }
+    srv->conns = c;
+    srv->num_conns++;
+
+    ev.data.ptr = c;
+    epoll_ctl(srv->epoll, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+static void flush_dirty(struct server *srv) {
+  for (uint32_t i = 0; i < srv->num_dirty; i++) {
+    struct conn *c = srv->dirty[i];
+
+    c->dirty = false;
+    if (c->fd < 0) {
+      continue;
+    }
+
+    if (!ws_buf_flush(&c->out, c->fd)) {
+      conn_close(srv, c);
+      continue;
+    }
+    watch(srv, c, ws_buf_len(&c->out) > 0);
+
+    /* Our close is out, the client answers it and hangs up */
+    if (c->state == CONN_CLOSING && ws_buf_len(&c->out) == 0) {
+      shutdown(c->fd, SHUT_WR);
+    }
+  }
+  srv->num_dirty = 0;
+}
+
+static void check_idle(struct server *srv) {
+  static const uint8_t ping[] = {'r', 's', 'p'};
+  double t = now();
+
+  for (struct conn *c = srv->conns; c != NULL;) {
+    struct conn *next = c->next;
+
+    if (t - c->seen > DROP_AFTER) {
+      conn_close(srv, c);
+    } else if (t - c->seen > PING_AFTER && !c->pinged &&
+               c->state == CONN_OPEN) {
+      ws_buf_add_frame(&c->out, WS_PING, ping, sizeof(ping), NULL);
+      mark_dirty(srv, c);
+      c->pinged = true;
+    }
+    c = next;
+  }
+}
+
+static void bury(struct server *srv) {
+  while (srv->dead != NULL) {
+    struct conn *c = srv->dead;
+
+    srv->dead = c->next;
+    ws_buf_free(&c->in);
+    ws_buf_free(&c->out);
+    ws_buf_free(&c->fragments);
+    inbox_free(&c->inbox);
+    free(c);
+  }
+}
+
+static void report(struct server *srv, double seconds) {
+  printf("%u connections, %u waiting, %u matches running, %u finished, "
+         "%u abandoned, %lu turns, %.0f messages/s, %.0f bytes/turn\n",
+         srv->num_conns, srv->waiting, srv->running, srv->finished,
+         srv->abandoned, (unsigned long)srv->turns,
+         seconds > 0 ? srv->messages / seconds : 0.0,
+         srv->turns > 0 ? (double)srv->bytes / srv->turns : 0.0);
+  fflush(stdout);
+}
+
+static int listen_on(uint16_t port) {
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  int one = 1;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Thousands of players need more descriptors than the default soft limit */
+static void raise_fd_limit(void) {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-P port] [-p players] [-t turns] [-s seed]\n"
+          "          [-W width] [-H height] [-r room factor] [-d] [-a]\n"
+          "          [-l] [-R dir] [-v]\n"
+          "  -p players per match, a match starts once that many are in\n"
+          "  -d sends player updates as deltas\n"
+          "  -a sends the next ask without waiting for update acks\n"
+          "  -l only relays the replies, for clients that run the match\n"
+          "  -R records each match to dir, see respawn-replay\n"
+          "  -v keeps the engine output, which is off by default\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct server srv = {
+      .s =
+          {
+              .port = 8080,
+              .players = 4,
+              .turns = 100,
+              .seed = 1,
+              .width = 80,
+              .height = 40,
+              .room_factor = 20,
+              .delta = false,
+              .pipelined = false,
+              .lockstep = false,
+              .record = NULL,
+              .verbose = false,
+          },
+  };
+  struct setup *s = &srv.s;
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  struct epoll_event events[MAX_EVENTS];
+  double start;
+  double last_check;
+  double last_report;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "P:p:t:s:W:H:r:dalR:v")) != -1) {
+    switch (opt) {
+    case 'P':
+      s->port = atoi(optarg);
+      break;
+    case 'p':
+      s->players = atoi(optarg);
+      break;
+    case 't':
+      s->turns = atoi(optarg);
+      break;
+    case 's':
+      s->seed = atoi(optarg);
+      break;
+    case 'W':
+      s->width = atoi(optarg);
+      break;
+    case 'H':
+      s->height = atoi(optarg);
+      break;
+    case 'r':
+      s->room_factor = atoi(optarg);
+      break;
+    case 'd':
+      s->delta = true;
+      break;
+    case 'a':
+      s->pipelined = true;
+      break;
+    case 'l':
+      s->lockstep = true;
+      break;
+    case 'R':
+      s->record = optarg;
+      break;
+    case 'v':
+      s->verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (s->players == 0 || s->players > MAX_PLAYERS || s->width < 3 ||
+      s->height < 3 || s->room_factor <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  common_log_quiet(!s->verbose);
+  raise_fd_limit();
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  srv.listener = listen_on(s->port);
+  if (srv.listener < 0) {
+    fprintf(stderr, "Could not listen on port %u: %s\n", s->port,
+            strerror(errno));
+    return 1;
+  }
+  srv.epoll = epoll_create1(EPOLL_CLOEXEC);
+  epoll_ctl(srv.epoll, EPOLL_CTL_ADD, srv.listener, &ev);
+  if (!start_builder(&srv)) {
+    fprintf(stderr, "No line of sight thread, matches stall while their "
+                    "table is built\n");
+  }
+
+  printf("Listening on port %u, %u players per match, %u turns\n", s->port,
+         s->players, s->turns);
+  fflush(stdout);
+
+  start = now();
+  last_check = start;
+  last_report = start;
+
+  while (!stop) {
+    int num = epoll_wait(srv.epoll, events, MAX_EVENTS, 1000);
+    double t;
+
+    for (int i = 0; i < num; i++) {
+      struct conn *c = events[i].data.ptr;
+
+      if (c == NULL) {
+        accept_all(&srv);
+        continue;
+      }
+      if (events[i].data.ptr == srv.los_done) {
+        los_built(&srv);
+        continue;
+      }
+      if (c->fd < 0) {
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        readable(&srv, c);
+      }
+      if (c->fd >= 0 && events[i].events & EPOLLOUT) {
+        mark_dirty(&srv, c);
+      }
+    }
+
+    run_matches(&srv);
+    flush_dirty(&srv);
+
+    t = now();
+    if (t - last_check >= 1.0) {
+      check_idle(&srv);
+      flush_dirty(&srv);
+      last_check = t;
+    }
+    if (t - last_report >= REPORT_EVERY) {
+      report(&srv, t - start);
+      last_report = t;
+    }
+
+    bury(&srv);
+  }
+
+  report(&srv, now() - start);
+
+  while (srv.conns != NULL) {
+    conn_close(&srv, srv.conns);
+  }
+  run_matches(&srv);
+  bury(&srv);
+  stop_builder(&srv);
+  free(srv.dirty);
+  close(srv.epoll);
+  close(srv.listener);
+
+  return 0;
+}
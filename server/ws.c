@@ -0,0 +1,390 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ws.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* Reads are done in chunks of this */
+#define READ_CHUNK 4096
+
+int ws_parse_header(const uint8_t *buf, size_t size, struct ws_frame *frame) {
+  uint8_t header = 2;
+  uint8_t len;
+
+  if (size < 2) {
+    return 0;
+  }
+
+  frame->fin = buf[0] & 0x80;
+  frame->opcode = buf[0] & 0x0f;
+  frame->masked = buf[1] & 0x80;
+  len = buf[1] & 0x7f;
+
+  /* No extensions are negotiated, so the reserved bits have to be clear */
+  if (buf[0] & 0x70) {
+    return -1;
+  }
+
+  if (len == 126) {
+    header += 2;
+  } else if (len == 127) {
+    header += 8;
+  }
+  if (frame->masked) {
+    header += 4;
+  }
+  if (size < header) {
+    return 0;
+  }
+
+  if (len == 126) {
+    frame->length = (uint64_t)buf[2] << 8 | buf[3];
+  } else if (len == 127) {
+    frame->length = 0;
+    for (uint8_t i = 0; i < 8; i++) {
+      frame->length = frame->length << 8 | buf[2 + i];
+    }
+    if (frame->length >> 63) {
+      return -1;
+    }
+  } else {
+    frame->length = len;
+  }
+
+  /* Control frames are short and never fragmented */
+  if (frame->opcode & 0x8 && (!frame->fin || frame->length > 125)) {
+    return -1;
+  }
+
+  if (frame->masked) {
+    memcpy(frame->mask, buf + header - 4, 4);
+  }
+  frame->header = header;
+
+  return header;
+}
+
+uint8_t ws_write_header(uint8_t *buf, enum ws_opcode opcode, uint64_t length,
+                        const uint8_t *mask) {
+  uint8_t header = 2;
+
+  buf[0] = 0x80 | opcode;
+  if (length < 126) {
+    buf[1] = length;
+  } else if (length <= UINT16_MAX) {
+    buf[1] = 126;
+    buf[2] = length >> 8;
+    buf[3] = length;
+    header += 2;
+  } else {
+    buf[1] = 127;
+    for (uint8_t i = 0; i < 8; i++) {
+      buf[2 + i] = length >> (56 - 8 * i);
+    }
+    header += 8;
+  }
+
+  if (mask != NULL) {
+    buf[1] |= 0x80;
+    memcpy(buf + header, mask, 4);
+    header += 4;
+  }
+
+  return header;
+}
+
+void ws_mask(uint8_t *data, size_t size, const uint8_t mask[4],
+             uint64_t offset) {
+  for (size_t i = 0; i < size; i++) {
+    data[i] ^= mask[(offset + i) % 4];
+  }
+}
+
+static uint32_t rol(uint32_t v, uint8_t bits) {
+  return v << bits | v >> (32 - bits);
+}
+
+static void sha1_block(uint32_t h[5], const uint8_t *block) {
+  uint32_t w[80];
+  uint32_t a = h[0];
+  uint32_t b = h[1];
+  uint32_t c = h[2];
+  uint32_t d = h[3];
+  uint32_t e = h[4];
+
+  for (uint8_t i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (uint8_t i = 16; i < 80; i++) {
+    w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  for (uint8_t i = 0; i < 80; i++) {
+    uint32_t f;
+    uint32_t k;
+    uint32_t t;
+
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    t = rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol(b, 30);
+    b = a;
+    a = t;
+  }
+
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+/* Only ever hashes a key and the GUID, so it all fits on the stack */
+static void sha1(const uint8_t *data, size_t size, uint8_t out[20]) {
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                   0xc3d2e1f0};
+  uint8_t block[64];
+  size_t done = 0;
+
+  for (; size - done >= 64; done += 64) {
+    sha1_block(h, data + done);
+  }
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, data + done, size - done);
+  block[size - done] = 0x80;
+  if (size - done >= 56) {
+    sha1_block(h, block);
+    memset(block, 0, sizeof(block));
+  }
+  for (uint8_t i = 0; i < 8; i++) {
+    block[63 - i] = (uint64_t)size * 8 >> (8 * i);
+  }
+  sha1_block(h, block);
+
+  for (uint8_t i = 0; i < 20; i++) {
+    out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+  }
+}
+
+size_t ws_base64(const uint8_t *data, size_t size, char *out) {
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char *o = out;
+  size_t i;
+
+  for (i = 0; i + 3 <= size; i += 3) {
+    uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+
+    *o++ = b64[v >> 18 & 0x3f];
+    *o++ = b64[v >> 12 & 0x3f];
+    *o++ = b64[v >> 6 & 0x3f];
+    *o++ = b64[v & 0x3f];
+  }
+  if (size - i == 1) {
+    *o++ = b64[data[i] >> 2];
+    *o++ = b64[(data[i] & 0x3) << 4];
+    *o++ = '=';
+    *o++ = '=';
+  } else if (size - i == 2) {
+    *o++ = b64[data[i] >> 2];
+    *o++ = b64[(data[i] & 0x3) << 4 | data[i + 1] >> 4];
+    *o++ = b64[(data[i + 1] & 0xf) << 2];
+    *o++ = '=';
+  }
+  *o = '\0';
+
+  return o - out;
+}
+
+void ws_accept_key(const char *key, size_t size, char out[WS_ACCEPT_SIZE]) {
+  uint8_t input[128];
+  uint8_t digest[20];
+  size_t len = sizeof(WS_GUID) - 1;
+
+  if (size > sizeof(input) - len) {
+    size = sizeof(input) - len;
+  }
+  memcpy(input, key, size);
+  memcpy(input + size, WS_GUID, len);
+  sha1(input, size + len, digest);
+  ws_base64(digest, sizeof(digest), out);
+}
+
+bool ws_key_valid(const char *key, size_t size) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                                 "abcdefghijklmnopqrstuvwxyz0123456789+/";
+  const char *last;
+
+  /* 16 bytes are 22 characters and two of padding */
+  if (size != 24 || key[22] != '=' || key[23] != '=') {
+    return false;
+  }
+  for (size_t i = 0; i < 22; i++) {
+    if (key[i] == '\0' || strchr(alphabet, key[i]) == NULL) {
+      return false;
+    }
+  }
+
+  /* The last character only carries two bits of the 16th byte */
+  last = strchr(alphabet, key[21]);
+  return (last - alphabet) % 16 == 0;
+}
+
+uint8_t *ws_buf_reserve(struct ws_buf *buf, size_t size) {
+  uint8_t *ptr;
+
+  if (buf->start > 0 && buf->start == buf->size) {
+    buf->start = 0;
+    buf->size = 0;
+  }
+
+  if (buf->size + size > buf->capacity) {
+    uint8_t *data;
+    size_t capacity = buf->capacity;
+
+    /* Drop what was consumed before growing */
+    if (buf->start > 0) {
+      memmove(buf->data, buf->data + buf->start, buf->size - buf->start);
+      buf->size -= buf->start;
+      buf->start = 0;
+    }
+    while (buf->size + size > capacity) {
+      capacity = capacity > 0 ? capacity * 2 : READ_CHUNK;
+    }
+    data = realloc(buf->data, capacity);
+    if (data == NULL) {
+      return NULL;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+  }
+
+  ptr = buf->data + buf->size;
+  buf->size += size;
+
+  return ptr;
+}
+
+void ws_buf_unreserve(struct ws_buf *buf, size_t size) {
+  buf->size -= size;
+}
+
+bool ws_buf_append(struct ws_buf *buf, const void *data, size_t size) {
+  uint8_t *to;
+
+  if (size == 0) {
+    return true;
+  }
+
+  to = ws_buf_reserve(buf, size);
+  if (to == NULL) {
+    return false;
+  }
+  memcpy(to, data, size);
+
+  return true;
+}
+
+void ws_buf_consume(struct ws_buf *buf, size_t size) {
+  buf->start += size;
+  if (buf->start >= buf->size) {
+    buf->start = 0;
+    buf->size = 0;
+  }
+}
+
+bool ws_buf_add_frame(struct ws_buf *buf, enum ws_opcode opcode,
+                      const uint8_t *data, size_t size, const uint8_t *mask) {
+  uint8_t header[WS_HEADER_MAX];
+  uint8_t len = ws_write_header(header, opcode, size, mask);
+  uint8_t *at;
+
+  at = ws_buf_reserve(buf, len + size);
+  if (at == NULL) {
+    return false;
+  }
+
+  memcpy(at, header, len);
+  if (size > 0) {
+    memcpy(at + len, data, size);
+  }
+  if (mask != NULL) {
+    ws_mask(at + len, size, mask, 0);
+  }
+
+  return true;
+}
+
+size_t ws_buf_len(struct ws_buf *buf) { return buf->size - buf->start; }
+
+uint8_t *ws_buf_head(struct ws_buf *buf) { return buf->data + buf->start; }
+
+void ws_buf_free(struct ws_buf *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->start = 0;
+  buf->size = 0;
+  buf->capacity = 0;
+}
+
+bool ws_buf_read(struct ws_buf *buf, int fd, size_t max) {
+  while (ws_buf_len(buf) < max) {
+    size_t chunk = max - ws_buf_len(buf);
+    uint8_t *to;
+    ssize_t got;
+
+    chunk = chunk < READ_CHUNK ? chunk : READ_CHUNK;
+    to = ws_buf_reserve(buf, chunk);
+    if (to == NULL) {
+      return false;
+    }
+    got = read(fd, to, chunk);
+    ws_buf_unreserve(buf, chunk - (got > 0 ? got : 0));
+
+    if (got == 0) {
+      return false;
+    }
+    if (got < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if ((size_t)got < chunk) {
+      return true;
+    }
+  }
+
+  return true;
+}
+
+bool ws_buf_flush(struct ws_buf *buf, int fd) {
+  while (ws_buf_len(buf) > 0) {
+    ssize_t sent = write(fd, ws_buf_head(buf), ws_buf_len(buf));
+
+    if (sent < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    ws_buf_consume(buf, sent);
+  }
+
+  return true;
+}
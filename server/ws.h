@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The parts of WebSocket (RFC 6455) respawn-server and respawn-load share:
+ * frame headers, the handshake key and buffers for non-blocking sockets */
+
+enum ws_opcode {
+  WS_CONTINUATION = 0x0,
+  WS_TEXT = 0x1,
+  WS_BINARY = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING = 0x9,
+  WS_PONG = 0xa,
+};
+
+/* Longest frame header, with a 64 bit length and a mask */
+#define WS_HEADER_MAX 14
+/* Sec-WebSocket-Accept value including the terminating zero */
+#define WS_ACCEPT_SIZE 29
+
+struct ws_frame {
+  bool fin;
+  uint8_t opcode;
+  bool masked;
+  uint8_t mask[4];
+  uint64_t length;
+  /* Bytes before the payload */
+  uint8_t header;
+};
+
+/* Parses the frame header at @param buf. Returns 0 while it is incomplete,
+ * -1 if it breaks the RFC and otherwise the header size. */
+int ws_parse_header(const uint8_t *buf, size_t size, struct ws_frame *frame);
+/* Writes the header of a final frame, masked when @param mask is set, and
+ * returns its size. @param buf needs WS_HEADER_MAX bytes. */
+uint8_t ws_write_header(uint8_t *buf, enum ws_opcode opcode, uint64_t length,
+                        const uint8_t *mask);
+/* Masking and unmasking are the same, @param offset is where @param data
+ * starts in the payload */
+void ws_mask(uint8_t *data, size_t size, const uint8_t mask[4],
+             uint64_t offset);
+
+/* Writes @param size bytes as base64 with a terminating zero to @param out,
+ * which needs 4 * ((size + 2) / 3) + 1 bytes. Returns the length. */
+size_t ws_base64(const uint8_t *data, size_t size, char *out);
+/* Sec-WebSocket-Accept for the client's Sec-WebSocket-Key */
+void ws_accept_key(const char *key, size_t size, char out[WS_ACCEPT_SIZE]);
+/* Whether @param key is 16 bytes in base64, as the RFC asks of a
+ * Sec-WebSocket-Key */
+bool ws_key_valid(const char *key, size_t size);
+
+/* Byte queue, taken from the front and added to at the back */
+struct ws_buf {
+  uint8_t *data;
+  size_t start;
+  size_t size;
+  size_t capacity;
+};
+
+/* Grows @param buf by @param size bytes and returns where they start, NULL
+ * with @param buf as it was if there is no memory for them */
+uint8_t *ws_buf_reserve(struct ws_buf *buf, size_t size);
+/* Gives back the last @param size reserved bytes */
+void ws_buf_unreserve(struct ws_buf *buf, size_t size);
+/* False, with nothing appended, if there is no memory */
+bool ws_buf_append(struct ws_buf *buf, const void *data, size_t size);
+void ws_buf_consume(struct ws_buf *buf, size_t size);
+/* Appends a whole frame, masked when @param mask is set. False, with nothing
+ * appended, if there is no memory. */
+bool ws_buf_add_frame(struct ws_buf *buf, enum ws_opcode opcode,
+                      const uint8_t *data, size_t size, const uint8_t *mask);
+size_t ws_buf_len(struct ws_buf *buf);
+uint8_t *ws_buf_head(struct ws_buf *buf);
+void ws_buf_free(struct ws_buf *buf);
+
+/* Reads what @param fd has until @param buf holds @param max bytes, the rest
+ * waits in the socket. Returns false once it is closed or failed, or there is
+ * no memory to read into. */
+bool ws_buf_read(struct ws_buf *buf, int fd, size_t max);
+/* Writes as much as @param fd takes, false if it failed */
+bool ws_buf_flush(struct ws_buf *buf, int fd);
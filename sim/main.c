@@ -0,0 +1,335 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "player_npc.h"
+#include "scheduler.h"
+
+/* Runs NPC only matches as fast as possible and reports where the time goes.
+ * Every engine_tick() is timed and booked on the step it ran. With -j the
+ * matches run on the scheduler instead and only the totals are reported. */
+
+#define MAX_PHASES 16
+#define MAX_PLAYERS 32
+/* Turns between keyframes of a recording, see engine_record() */
+#define KEYFRAME_TURNS 50
+
+struct phase {
+  const char *name;
+  uint64_t ticks;
+  double seconds;
+};
+
+struct setup {
+  uint8_t players;
+  uint32_t matches;
+  uint32_t turns;
+  uint32_t seed;
+  coord_t width;
+  coord_t height;
+  int32_t room_factor;
+  uint32_t workers;
+  /* Directory each match is recorded to, NULL for none */
+  const char *record;
+  bool verbose;
+};
+
+struct match {
+  map_t *map;
+  void *npcs[MAX_PLAYERS];
+};
+
+struct pool {
+  struct setup *s;
+  struct match *matches;
+};
+
+struct totals {
+  struct phase phases[MAX_PHASES];
+  uint8_t num_phases;
+  uint64_t ticks;
+  uint64_t turns;
+  uint32_t stalled;
+  double seconds;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void book(struct totals *t, const char *name, double seconds) {
+  uint8_t i;
+
+  for (i = 0; i < t->num_phases; i++) {
+    if (strcmp(t->phases[i].name, name) == 0) {
+      break;
+    }
+  }
+
+  if (i == t->num_phases) {
+    if (t->num_phases == MAX_PHASES) {
+      return;
+    }
+    t->phases[i].name = name;
+    t->phases[i].ticks = 0;
+    t->phases[i].seconds = 0;
+    t->num_phases++;
+  }
+
+  t->phases[i].ticks++;
+  t->phases[i].seconds += seconds;
+}
+
+/* @param threads for the line of sight table, see map_precompute_los(). NULL
+ * if the engine can not be set up. */
+static engine_t *match_start(struct setup *s, uint32_t id, struct match *m,
+                             uint32_t threads) {
+  uint32_t seed = s->seed + id;
+  char path[4096];
+  engine_t *engine;
+
+  m->map = map_new(s->width, s->height, s->room_factor, seed);
+  map_precompute_los(m->map, threads, MAP_LOS_TABLE_MAX);
+  engine = engine_new(s->players, m->map, NULL, false, seed);
+  if (engine == NULL) {
+    fprintf(stderr, "Can not set up match %u\n", id);
+    map_free(m->map);
+    return NULL;
+  }
+
+  for (uint8_t i = 0; i < s->players; i++) {
+    m->npcs[i] = player_npc_new(seed * UINT8_MAX + i);
+    engine_add_player(engine, player_npc_server_send, m->npcs[i],
+                      player_npc_server_get, m->npcs[i]);
+  }
+
+  if (s->record != NULL) {
+    snprintf(path, sizeof(path), "%s/match-%u.rsp", s->record, id);
+    if (!engine_record(engine, path, KEYFRAME_TURNS)) {
+      fprintf(stderr, "Can not record match %u to %s\n", id, path);
+    }
+  }
+
+  return engine;
+}
+
+static void match_end(struct setup *s, struct match *m, engine_t *engine) {
+  if (!engine_record_stop(engine)) {
+    fprintf(stderr, "Recording of a match is incomplete\n");
+  }
+  engine_free(engine);
+  for (uint8_t i = 0; i < s->players; i++) {
+    player_npc_free(&m->npcs[i]);
+  }
+  map_free(m->map);
+}
+
+static void run_match(struct setup *s, uint32_t id, struct totals *t) {
+  uint64_t max_ticks = (uint64_t)s->turns * 64 + 1024;
+  uint64_t ticks = 0;
+  struct match m;
+  engine_t *engine;
+  double start;
+
+  start = now();
+  engine = match_start(s, id, &m, 0);
+  book(t, "setup", now() - start);
+  if (engine == NULL) {
+    return;
+  }
+
+  while (engine_turns(engine) < s->turns && ticks < max_ticks) {
+    const char *name = engine_state_name(engine);
+    double tick_start = now();
+
+    engine_tick(engine);
+    book(t, name, now() - tick_start);
+    ticks++;
+  }
+
+  if (engine_turns(engine) < s->turns) {
+    fprintf(stderr, "Match %u stalled after %u turns\n", id,
+            engine_turns(engine));
+    t->stalled++;
+  }
+
+  t->ticks += ticks;
+  t->turns += engine_turns(engine);
+
+  start = now();
+  match_end(s, &m, engine);
+  book(t, "teardown", now() - start);
+}
+
+static engine_t *pool_setup(void *data, uint32_t id) {
+  struct pool *pool = data;
+
+  return match_start(pool->s, id, &pool->matches[id], 1);
+}
+
+static void pool_done(void *data, uint32_t id, engine_t *engine) {
+  struct pool *pool = data;
+
+  match_end(pool->s, &pool->matches[id], engine);
+}
+
+static void run_pool(struct setup *s, struct totals *t) {
+  struct pool pool = {.s = s};
+  struct scheduler_stats stats;
+  scheduler_t *scheduler;
+
+  pool.matches = malloc(sizeof(*pool.matches) * s->matches);
+  scheduler = scheduler_new(s->workers, pool_setup, pool_done, &pool);
+
+  for (uint32_t m = 0; m < s->matches; m++) {
+    if (scheduler_add(scheduler, s->turns) == UINT32_MAX) {
+      fprintf(stderr, "No memory to queue match %u\n", m);
+      break;
+    }
+  }
+  if (!scheduler_run(scheduler, &stats)) {
+    fprintf(stderr, "No memory to run the matches\n");
+  }
+
+  t->turns = stats.turns;
+  t->ticks = stats.ticks;
+  t->stalled = stats.stalled;
+  t->seconds = stats.seconds;
+
+  printf("%u workers, %u steals, %.1f matches/s\n", stats.workers,
+         stats.steals, stats.matches / stats.seconds);
+
+  scheduler_free(scheduler);
+  free(pool.matches);
+}
+
+static void report(struct setup *s, struct totals *t) {
+  printf("%u matches, %u players, %dx%d map, room factor %d, seed %u\n",
+         s->matches, s->players, s->width, s->height, s->room_factor,
+         s->seed);
+  printf("%lu turns in %.3f s: %.1f turns/s\n", (unsigned long)t->turns,
+         t->seconds, t->turns / t->seconds);
+  printf("%lu ticks: %.1f ticks/s\n\n", (unsigned long)t->ticks,
+         t->ticks / t->seconds);
+
+  if (t->num_phases == 0) {
+    goto out;
+  }
+
+  printf("%-24s %10s %12s %12s %7s\n", "phase", "ticks", "total ms",
+         "us/tick", "share");
+  for (uint8_t i = 0; i < t->num_phases; i++) {
+    struct phase *p = &t->phases[i];
+
+    printf("%-24s %10lu %12.2f %12.2f %6.1f%%\n", p->name,
+           (unsigned long)p->ticks, p->seconds * 1e3,
+           p->seconds * 1e6 / p->ticks, p->seconds * 100 / t->seconds);
+  }
+
+out:
+  if (t->stalled > 0) {
+    printf("\n%u matches stalled\n", t->stalled);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-p players] [-m matches] [-t turns] [-s seed]\n"
+          "          [-W width] [-H height] [-r room factor] [-j workers]\n"
+          "          [-R dir] [-v]\n"
+          "  -j runs the matches on that many threads, 0 is one per core\n"
+          "  -R records each match to dir, see respawn-replay\n"
+          "  -v keeps the engine and NPC output, which is off by default\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct setup s = {
+      .players = 4,
+      .matches = 1,
+      .turns = 100,
+      .seed = 1,
+      .width = 80,
+      .height = 40,
+      .room_factor = 20,
+      .workers = 0,
+      .record = NULL,
+      .verbose = false,
+  };
+  struct totals t = {0};
+  bool pool = false;
+  double start;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:m:t:s:W:H:r:j:R:v")) != -1) {
+    switch (opt) {
+    case 'p':
+      s.players = atoi(optarg);
+      break;
+    case 'm':
+      s.matches = atoi(optarg);
+      break;
+    case 't':
+      s.turns = atoi(optarg);
+      break;
+    case 's':
+      s.seed = atoi(optarg);
+      break;
+    case 'W':
+      s.width = atoi(optarg);
+      break;
+    case 'H':
+      s.height = atoi(optarg);
+      break;
+    case 'r':
+      s.room_factor = atoi(optarg);
+      break;
+    case 'j':
+      s.workers = atoi(optarg);
+      pool = true;
+      break;
+    case 'R':
+      s.record = optarg;
+      break;
+    case 'v':
+      s.verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (s.players == 0 || s.players > MAX_PLAYERS || s.width < 3 || s.height < 3 ||
+      s.room_factor <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* The engine logs every step, which would swamp both timings and report */
+  common_log_quiet(!s.verbose);
+
+  if (pool) {
+    run_pool(&s, &t);
+  } else {
+    start = now();
+    for (uint32_t m = 0; m < s.matches; m++) {
+      run_match(&s, m, &t);
+    }
+    t.seconds = now() - start;
+  }
+
+  report(&s, &t);
+
+  return t.stalled > 0 ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "engine.h"
+#include "player.h"
+#include "replay.h"
+
+/* Plays recorded matches again, see engine_record(). By default every file
+ * is played to the end and checked against its keyframes, which is how a
+ * tournament is re-verified, with -j on that many threads. With -t or -k it
+ * goes to that point of each file instead and shows the players there. */
+
+struct setup {
+  bool seek;
+  bool by_tick;
+  uint32_t at;
+  uint32_t workers;
+  bool verbose;
+};
+
+/* Files handed out to the verifying threads */
+struct pool {
+  struct setup *s;
+  char **files;
+  int num_files;
+  int next;
+  pthread_mutex_t lock;
+  uint64_t turns;
+  uint32_t failed;
+};
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void show(engine_t *engine) {
+  printf("  turn %u, tick %u, %s\n", engine_turns(engine),
+         engine_ticks(engine), engine_state_name(engine));
+
+  for (uint8_t i = 0; engine_player(engine, i) != NULL; i++) {
+    const player_t *p = engine_player(engine, i);
+
+    printf("  player %2u at (%3d,%3d) health %3d kills %3d deaths %3d\n", i,
+           p->position.x, p->position.y, p->health, p->kills, p->deaths);
+  }
+}
+
+static bool seek(struct setup *s, const char *path, replay_t *replay) {
+  bool ok;
+
+  if (s->by_tick) {
+    ok = replay_seek(replay, s->at);
+  } else {
+    ok = replay_seek_turn(replay, s->at);
+  }
+
+  printf("%s:%s\n", path, ok ? "" : " recording ends before that");
+  show(replay_engine(replay));
+
+  return ok;
+}
+
+/* @param turns gets the turns played */
+static bool verify(const char *path, replay_t *replay, uint64_t *turns) {
+  uint32_t differ = replay_verify(replay);
+
+  replay_run(replay, UINT32_MAX);
+  *turns += engine_turns(replay_engine(replay));
+
+  if (differ > 0) {
+    printf("%s: %u of %u keyframes differ\n", path, differ,
+           replay_keyframes(replay));
+  }
+
+  return differ == 0;
+}
+
+static bool verify_file(const char *path, uint64_t *turns) {
+  replay_t *replay = replay_open(path);
+  bool ok;
+
+  if (replay == NULL) {
+    fprintf(stderr, "%s: not a recording\n", path);
+    return false;
+  }
+
+  ok = verify(path, replay, turns);
+  replay_free(replay);
+
+  return ok;
+}
+
+static void *work(void *data) {
+  struct pool *pool = data;
+  uint64_t turns = 0;
+  uint32_t failed = 0;
+  int i;
+
+  common_log_quiet(!pool->s->verbose);
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->num_files) {
+      break;
+    }
+
+    if (!verify_file(pool->files[i], &turns)) {
+      failed++;
+    }
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->turns += turns;
+  pool->failed += failed;
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+static void verify_all(struct setup *s, char **files, int num_files,
+                       uint64_t *turns, uint32_t *failed) {
+  struct pool pool = {.s = s, .files = files, .num_files = num_files};
+  uint32_t workers = s->workers;
+  pthread_t *threads;
+  uint32_t started = 0;
+
+  if (workers == 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = online > 0 ? online : 1;
+#else
+    workers = 1;
+#endif
+  }
+
+  pthread_mutex_init(&pool.lock, NULL);
+  threads = malloc(sizeof(*threads) * workers);
+
+  /* This thread is a worker too */
+  while (started + 1 < workers &&
+         pthread_create(&threads[started], NULL, work, &pool) == 0) {
+    started++;
+  }
+  work(&pool);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+
+  *turns = pool.turns;
+  *failed = pool.failed;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-t turn | -k tick] [-j workers] [-v] file...\n"
+          "  -t shows the players as that turn was done\n"
+          "  -k shows the players after that step\n"
+          "  -j verifies on that many threads, 0 is one per core\n"
+          "  -v keeps the engine output, which is off by default\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  struct setup s = {.workers = 1};
+  uint64_t turns = 0;
+  uint32_t failed = 0;
+  double start;
+  double seconds;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:k:j:v")) != -1) {
+    switch (opt) {
+    case 't':
+    case 'k':
+      s.seek = true;
+      s.by_tick = opt == 'k';
+      s.at = atoi(optarg);
+      break;
+    case 'j':
+      s.workers = atoi(optarg);
+      break;
+    case 'v':
+      s.verbose = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind == argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  common_log_quiet(!s.verbose);
+
+  if (s.seek) {
+    for (int i = optind; i < argc; i++) {
+      replay_t *replay = replay_open(argv[i]);
+
+      if (replay == NULL) {
+        fprintf(stderr, "%s: not a recording\n", argv[i]);
+        failed++;
+        continue;
+      }
+      if (!seek(&s, argv[i], replay)) {
+        failed++;
+      }
+      replay_free(replay);
+    }
+  } else {
+    start = now();
+    verify_all(&s, &argv[optind], argc - optind, &turns, &failed);
+    seconds = now() - start;
+    printf("%d files, %u failed, %lu turns in %.3f s: %.1f turns/s\n",
+           argc - optind, failed, (unsigned long)turns, seconds,
+           turns / seconds);
+  }
+
+  return failed > 0 ? 1 : 0;
+}
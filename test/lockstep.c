@@ -0,0 +1,178 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "engine.h"
+#include "lockstep.h"
+#include "map.h"
+#include "message.h"
+#include "player_npc.h"
+#include "wire.h"
+
+/* NPC matches are played twice, once as usual and once in lockstep with every
+ * NPC behind its own lockstep engine. The NPCs have to get exactly the same
+ * messages both times, ticks included, no step may hash differently on the
+ * two sides and the server has to send less. The NPCs hold some replies back
+ * for a few steps, so the engines have blocked steps to agree on too. */
+
+#define PLAYERS 6
+#define TURNS 60
+
+struct seat {
+  void *npc;
+  message_t *held;
+  uint32_t calls;
+  lockstep_t *lockstep;
+  /* Of what the NPC got */
+  uint64_t hash;
+  /* Sent by the server, shared */
+  uint64_t *bytes;
+};
+
+static uint32_t failures = 0;
+
+static uint64_t hash_msg(uint64_t hash, message_t *msg) {
+  uint8_t buf[1 << 16];
+  size_t size = wire_encode(msg, buf, sizeof(buf));
+
+  for (size_t i = 0; i < size && i < sizeof(buf); i++) {
+    hash = (hash ^ buf[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void npc_send(void *data, message_t *msg) {
+  struct seat *seat = data;
+
+  seat->hash = hash_msg(seat->hash, msg);
+  player_npc_server_send(seat->npc, msg);
+}
+
+static void server_send(void *data, message_t *msg) {
+  struct seat *seat = data;
+
+  *seat->bytes += wire_encode(msg, NULL, 0);
+  if (seat->lockstep != NULL) {
+    lockstep_server_send(seat->lockstep, msg);
+  } else {
+    npc_send(seat, msg);
+  }
+}
+
+static message_t *slow_get(void *data) {
+  struct seat *seat = data;
+  message_t *msg;
+
+  if (seat->held == NULL) {
+    seat->held = player_npc_server_get(seat->npc);
+  }
+  if (seat->held == NULL || ++seat->calls % 3 != 0) {
+    return NULL;
+  }
+
+  msg = seat->held;
+  seat->held = NULL;
+  return msg;
+}
+
+/* Returns the steps any lockstep engine disagreed on, @param hashes gets a
+ * hash per NPC of what it got and @param bytes what the server sent */
+static uint32_t play(uint32_t seed, bool delta, bool lockstep,
+                     uint64_t *hashes, uint64_t *bytes) {
+  struct seat seats[PLAYERS] = {0};
+  uint32_t desyncs = 0;
+  engine_t *engine;
+  map_t *map;
+
+  *bytes = 0;
+  map = map_new(80, 40, 20, seed);
+  engine = engine_new(PLAYERS, map, NULL, false, seed);
+  if (engine == NULL) {
+    printf("Seed %u: no engine\n", seed);
+    failures++;
+    for (uint8_t i = 0; i < PLAYERS; i++) {
+      hashes[i] = 0;
+    }
+    map_free(map);
+    return 0;
+  }
+  engine_set_delta_updates(engine, delta);
+  engine_set_lockstep(engine, lockstep);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    seats[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    seats[i].calls = i;
+    seats[i].hash = 14695981039346656037ULL;
+    seats[i].bytes = bytes;
+    if (lockstep) {
+      seats[i].lockstep = lockstep_new(npc_send, &seats[i]);
+    }
+    engine_add_player(engine, server_send, &seats[i], slow_get, &seats[i]);
+  }
+
+  /* engine_run() stops at the first step that waits */
+  for (uint32_t i = 0; engine_turns(engine) < TURNS && i < TURNS * 256; i++) {
+    engine_tick(engine);
+  }
+  if (engine_turns(engine) < TURNS) {
+    printf("Seed %u%s: match got stuck after %u turns\n", seed,
+           lockstep ? " (lockstep)" : "", engine_turns(engine));
+    failures++;
+  }
+
+  engine_free(engine);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    hashes[i] = seats[i].hash;
+    if (lockstep) {
+      desyncs += lockstep_desyncs(seats[i].lockstep);
+      lockstep_free(seats[i].lockstep);
+    }
+    message_unref(seats[i].held);
+    player_npc_free(&seats[i].npc);
+  }
+  map_free(map);
+
+  return desyncs;
+}
+
+static void check(uint32_t seed, bool delta) {
+  const char *name = delta ? " (delta)" : "";
+  uint64_t usual[PLAYERS];
+  uint64_t locked[PLAYERS];
+  uint64_t usual_bytes;
+  uint64_t locked_bytes;
+  uint32_t desyncs;
+
+  play(seed, delta, false, usual, &usual_bytes);
+  desyncs = play(seed, delta, true, locked, &locked_bytes);
+
+  if (desyncs > 0) {
+    printf("Seed %u%s: %u steps out of sync\n", seed, name, desyncs);
+    failures++;
+  }
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    if (usual[i] != locked[i]) {
+      printf("Seed %u%s: player %u got other messages\n", seed, name, i);
+      failures++;
+    }
+  }
+  if (locked_bytes >= usual_bytes) {
+    printf("Seed %u%s: lockstep sent %lu bytes, %lu otherwise\n", seed, name,
+           (unsigned long)locked_bytes, (unsigned long)usual_bytes);
+    failures++;
+  }
+}
+
+int main(void) {
+  common_log_quiet(true);
+
+  for (uint32_t seed = 1; seed <= 3; seed++) {
+    check(seed, false);
+    check(seed, true);
+  }
+
+  printf("%u failures\n", failures);
+
+  return failures > 0 ? 1 : 0;
+}
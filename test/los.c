@@ -0,0 +1,146 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "map.h"
+#include "map_bits.h"
+#include "map_opts.h"
+
+/* Compares map_line_of_sight() with testing every cell of the cone through
+ * map_has_los(), which is what it used to do. The same queries are then run
+ * against a copy of the map with the line of sight table. */
+
+static bool in_cone(enum direction dir, pos_t d) {
+  switch (dir) {
+  case DIRECTION_NORTH:
+    return d.y <= 0;
+  case DIRECTION_SOUTH:
+    return d.y >= 0;
+  case DIRECTION_WEST:
+    return d.x <= 0;
+  case DIRECTION_EAST:
+    return d.x >= 0;
+  case DIRECTION_NORTH_WEST:
+    return d.x + d.y <= 0;
+  case DIRECTION_NORTH_EAST:
+    return d.x - d.y >= 0;
+  case DIRECTION_SOUTH_WEST:
+    return d.x - d.y <= 0;
+  case DIRECTION_SOUTH_EAST:
+    return d.x + d.y >= 0;
+  case DIRECTION_ANY:
+    return true;
+  }
+  return false;
+}
+
+static map_bits_t *reference(map_t *map, pos_t from, enum direction dir) {
+  map_bits_t *seen;
+
+  seen = map_bits_new(map_width(map), map_height(map));
+
+  for (coord_t x = 0; x < map_width(map); x++) {
+    for (coord_t y = 0; y < map_height(map); y++) {
+      pos_t p = {x, y};
+      pos_t d = {x - from.x, y - from.y};
+
+      if (in_cone(dir, d) && !map_is_wall(map, p) &&
+          map_has_los(map, from, p)) {
+        map_bits_add(seen, p);
+      }
+    }
+  }
+
+  return seen;
+}
+
+static bool check(map_t *map, map_t *walked, pos_t from, enum direction dir) {
+  map_bits_t *expected;
+  map_opts_t *got;
+  bool ok = true;
+
+  expected = reference(walked, from, dir);
+  got = map_line_of_sight(map, from, dir);
+
+  if (got->size != map_bits_count(expected)) {
+    ok = false;
+  }
+
+  for (uint32_t i = 0; ok && i < got->size; i++) {
+    if (!map_bits_contains(expected, got->data[i])) {
+      ok = false;
+    }
+  }
+
+  for (coord_t x = -1; ok && dir == DIRECTION_ANY && x <= map_width(map); x++) {
+    for (coord_t y = -1; ok && y <= map_height(map); y++) {
+      pos_t p = {x, y};
+
+      ok = map_has_los(map, from, p) == map_has_los(walked, from, p);
+    }
+  }
+
+  if (!ok) {
+    printf("Mismatch %dx%d from (%d,%d) facing %d: got %u, expected %u\n",
+           map_width(map), map_height(map), from.x, from.y, dir, got->size,
+           map_bits_count(expected));
+  }
+
+  map_bits_free(expected);
+  map_opts_free(got);
+  return ok;
+}
+
+int main(void) {
+  struct {
+    coord_t width;
+    coord_t height;
+    int32_t room_factor;
+  } sizes[] = {{80, 40, 20}, {80, 40, 60}, {37, 23, 10}, {120, 30, 40}};
+  uint32_t checked = 0;
+  uint32_t failed = 0;
+
+  for (uint32_t seed = 1; seed <= 40; seed++) {
+    map_t *map;
+    map_t *table;
+    map_opts_t *spaces;
+    uint8_t s = seed % (sizeof(sizes) / sizeof(*sizes));
+
+    map = map_new(sizes[s].width, sizes[s].height, sizes[s].room_factor, seed);
+    table = map_new(sizes[s].width, sizes[s].height, sizes[s].room_factor, seed);
+    map_precompute_los(table, 4, MAP_LOS_TABLE_MAX);
+    spaces = map_empty_spaces(map);
+    srand(seed);
+
+    for (uint32_t i = 0; i < 30; i++) {
+      pos_t from;
+
+      if (i % 10 == 9) {
+        /* Walls and cells off the map */
+        from.x = rand() % (sizes[s].width + 2) - 1;
+        from.y = rand() % (sizes[s].height + 2) - 1;
+      } else {
+        from = spaces->data[rand() % spaces->size];
+      }
+
+      for (enum direction dir = DIRECTION_NORTH; dir <= DIRECTION_ANY; dir++) {
+        if (!check(map, map, from, dir)) {
+          failed++;
+        }
+        if (!check(table, map, from, dir)) {
+          failed++;
+        }
+        checked += 2;
+      }
+    }
+    map_opts_free(spaces);
+    map_free(map);
+    map_free(table);
+  }
+
+  printf("%u of %u line of sight queries differ\n", failed, checked);
+
+  return failed > 0 ? 1 : 0;
+}
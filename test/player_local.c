@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "player_local.h"
+#include "player_npc.h"
+#include "wire.h"
+
+/* NPCs on threads of their own talk to the engine through player_local. The
+ * match has to play out exactly like one with the NPCs called directly, apart
+ * from the ticks, also with pipelined turns where the acks the NPCs still send
+ * are dropped. A burst far bigger than the queue has to arrive complete and in
+ * order. */
+
+#define PLAYERS 6
+#define TURNS 60
+#define BURST 100000
+
+struct client {
+  void *local;
+  void *npc;
+  pthread_t thread;
+  atomic_bool stop;
+};
+
+struct tap {
+  void *local;
+  void *npc;
+  uint64_t *hash;
+};
+
+static uint32_t failures = 0;
+
+static size_t skip_varint(const uint8_t *buf, size_t at) {
+  while (buf[at++] & 0x80) {
+  }
+  return at;
+}
+
+/* Ticks count the engine's steps, which depend on how often it found a reply
+ * missing, so they are left out */
+static uint64_t hash_msg(uint64_t hash, message_t *msg) {
+  uint8_t buf[1 << 16];
+  size_t size = wire_encode(msg, buf, sizeof(buf));
+  size_t at = skip_varint(buf, 0) + 1;
+
+  hash = (hash ^ buf[at++]) * 1099511628211ULL;
+  for (at = skip_varint(buf, at); at < size && at < sizeof(buf); at++) {
+    hash = (hash ^ buf[at]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void *run_client(void *data) {
+  struct client *c = data;
+
+  /* Quiet is per thread */
+  common_log_quiet(true);
+
+  while (!atomic_load(&c->stop)) {
+    message_t *msg = player_local_get(c->local);
+    message_t *reply;
+
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+
+    player_npc_server_send(c->npc, msg);
+    message_unref(msg);
+    while ((reply = player_npc_server_get(c->npc)) != NULL) {
+      player_local_send(c->local, reply);
+      message_unref(reply);
+    }
+  }
+
+  return NULL;
+}
+
+static void tap_send(void *data, message_t *msg) {
+  struct tap *tap = data;
+
+  *tap->hash = hash_msg(*tap->hash, msg);
+  if (tap->local != NULL) {
+    player_local_server_send(tap->local, msg);
+  } else {
+    player_npc_server_send(tap->npc, msg);
+  }
+}
+
+static message_t *tap_get(void *data) {
+  struct tap *tap = data;
+
+  if (tap->local != NULL) {
+    return player_local_server_get(tap->local);
+  }
+  return player_npc_server_get(tap->npc);
+}
+
+/* Returns a hash of what was sent to the players */
+static uint64_t play(uint32_t seed, bool threaded, bool pipelined) {
+  struct tap taps[PLAYERS];
+  struct client clients[PLAYERS];
+  uint64_t hash = 14695981039346656037ULL;
+  engine_t *engine;
+  map_t *map;
+
+  map = map_new(80, 40, 20, seed);
+  engine = engine_new(PLAYERS, map, NULL, false, seed);
+  if (engine == NULL) {
+    printf("Seed %u: no engine\n", seed);
+    failures++;
+    map_free(map);
+    return hash;
+  }
+  engine_set_pipelined(engine, pipelined);
+
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    taps[i].local = threaded ? player_local_new() : NULL;
+    taps[i].hash = &hash;
+    engine_add_player(engine, tap_send, &taps[i], tap_get, &taps[i]);
+
+    if (threaded) {
+      clients[i].local = taps[i].local;
+      clients[i].npc = taps[i].npc;
+      atomic_init(&clients[i].stop, false);
+      pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+    }
+  }
+
+  if (!threaded) {
+    engine_run(engine, TURNS);
+  }
+  /* The replies come in whenever the threads get to them */
+  while (threaded && engine_turns(engine) < TURNS) {
+    if (engine_step_until_blocked(engine) == 0) {
+      sched_yield();
+    }
+  }
+
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    if (threaded) {
+      atomic_store(&clients[i].stop, true);
+      pthread_join(clients[i].thread, NULL);
+    }
+  }
+
+  engine_free(engine);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    player_npc_free(&taps[i].npc);
+    player_local_free(&taps[i].local);
+  }
+  map_free(map);
+
+  return hash;
+}
+
+static void *read_burst(void *data) {
+  void *local = data;
+  uint32_t next = 0;
+
+  while (next < BURST) {
+    message_t *msg = player_local_get(local);
+
+    if (msg == NULL) {
+      sched_yield();
+      continue;
+    }
+    if (msg->tick != next) {
+      printf("Burst: got tick %u, expected %u\n", msg->tick, next);
+      failures++;
+      next = msg->tick;
+    }
+    next++;
+    message_unref(msg);
+  }
+
+  return NULL;
+}
+
+static void check_burst(void) {
+  void *local = player_local_new();
+  pthread_t reader;
+
+  pthread_create(&reader, NULL, read_burst, local);
+  for (uint32_t i = 0; i < BURST; i++) {
+    message_t *msg = message_ask_ready(i);
+
+    player_local_server_send(local, msg);
+    message_unref(msg);
+  }
+  pthread_join(reader, NULL);
+
+  player_local_free(&local);
+}
+
+int main(void) {
+  common_log_quiet(true);
+
+  check_burst();
+
+  for (uint32_t seed = 1; seed <= 5; seed++) {
+    uint64_t direct = play(seed, false, false);
+
+    if (direct != play(seed, true, false)) {
+      printf("Seed %u: match over player_local differs\n", seed);
+      failures++;
+    }
+    if (direct != play(seed, true, true)) {
+      printf("Seed %u: pipelined match differs\n", seed);
+      failures++;
+    }
+  }
+
+  printf("%u failures\n", failures);
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "player_npc.h"
+#include "record.h"
+#include "replay.h"
+
+/* NPC matches are recorded and replayed. Played through, the replay has to
+ * match every keyframe, and seeking to a turn between keyframes, or to the
+ * tick of it, has to give the engine exactly as it was then in the match.
+ * The NPCs hold some replies back for a few steps, as remote players would,
+ * so the engine spends steps waiting that the replay has to take too. The
+ * recording is then garbled past the first keyframe, which the replay has to
+ * refuse without reading outside the file. */
+
+#define PLAYERS 6
+#define KEYFRAME_TURNS 8
+#define HALF 29
+#define TURNS 60
+
+struct slow {
+  void *npc;
+  message_t *held;
+  uint32_t calls;
+};
+
+static uint32_t failures = 0;
+
+static message_t *slow_get(void *data) {
+  struct slow *slow = data;
+  message_t *msg;
+
+  if (slow->held == NULL) {
+    slow->held = player_npc_server_get(slow->npc);
+  }
+  if (slow->held == NULL || ++slow->calls % 3 != 0) {
+    return NULL;
+  }
+
+  msg = slow->held;
+  slow->held = NULL;
+  return msg;
+}
+
+/* engine_run() stops at the first step that waits */
+static void run(engine_t *engine, uint32_t turns) {
+  for (uint32_t i = 0; engine_turns(engine) < turns && i < turns * 256; i++) {
+    engine_tick(engine);
+  }
+}
+
+static bool same(engine_snapshot_t *a, engine_snapshot_t *b) {
+  const void *a_data;
+  const void *b_data;
+  size_t a_size;
+  size_t b_size;
+
+  a_data = engine_snapshot_data(a, &a_size);
+  b_data = engine_snapshot_data(b, &b_size);
+
+  return a_size == b_size && memcmp(a_data, b_data, a_size) == 0;
+}
+
+/* Flips every byte of the keyframe blocks after the first, false if the
+ * file can not be rewritten */
+static bool garble(const char *path) {
+  uint8_t *data;
+  size_t at = RECORD_HEADER_SIZE;
+  size_t size;
+  bool first = true;
+  bool ok;
+  FILE *file;
+
+  file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data = malloc(size);
+  ok = data != NULL && fread(data, 1, size, file) == size;
+  fclose(file);
+
+  while (ok && at + RECORD_FRAME_SIZE <= size) {
+    uint8_t kind = data[at];
+    uint32_t frame;
+
+    memcpy(&frame, data + at + 1, sizeof(frame));
+    at += RECORD_FRAME_SIZE;
+    if (frame > size - at) {
+      break;
+    }
+    if (kind == RECORD_KEYFRAME && !first) {
+      /* Turns and tick stay, the block goes */
+      for (uint32_t i = 2 * sizeof(uint32_t); i < frame; i++) {
+        data[at + i] ^= 0xa5;
+      }
+    }
+    first = first && kind != RECORD_KEYFRAME;
+    at += frame;
+  }
+
+  file = ok ? fopen(path, "wb") : NULL;
+  ok = file != NULL && fwrite(data, 1, size, file) == size;
+  if (file != NULL) {
+    ok = fclose(file) == 0 && ok;
+  }
+  free(data);
+
+  return ok;
+}
+
+static void check(uint32_t seed, bool delta) {
+  char path[] = "/tmp/respawn-test-replay-XXXXXX";
+  struct slow npcs[PLAYERS] = {0};
+  engine_snapshot_t *half;
+  engine_snapshot_t *seeked;
+  replay_t *replay;
+  engine_t *engine;
+  uint32_t tick;
+  map_t *map;
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd < 0) {
+    printf("Seed %u: no temporary file\n", seed);
+    failures++;
+    return;
+  }
+  close(fd);
+
+  map = map_new(80, 40, 20, seed);
+  engine = engine_new(PLAYERS, map, NULL, false, seed);
+  if (engine == NULL) {
+    printf("Seed %u: no engine\n", seed);
+    failures++;
+    map_free(map);
+    unlink(path);
+    return;
+  }
+  engine_set_delta_updates(engine, delta);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    npcs[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    npcs[i].calls = i;
+    engine_add_player(engine, player_npc_server_send, npcs[i].npc, slow_get,
+                      &npcs[i]);
+  }
+  if (!engine_record(engine, path, KEYFRAME_TURNS)) {
+    printf("Seed %u: can not record\n", seed);
+    failures++;
+  }
+
+  run(engine, HALF);
+  half = engine_snapshot(engine, NULL);
+  tick = engine_ticks(engine);
+  run(engine, TURNS);
+  if (!engine_record_stop(engine)) {
+    printf("Seed %u: recording incomplete\n", seed);
+    failures++;
+  }
+
+  replay = replay_open(path);
+  if (replay == NULL) {
+    printf("Seed %u: can not open the recording\n", seed);
+    failures++;
+    goto out;
+  }
+
+  if (replay_keyframes(replay) != TURNS / KEYFRAME_TURNS + 1 ||
+      replay_verify(replay) != 0) {
+    printf("Seed %u%s: replay differs from the keyframes\n", seed,
+           delta ? " (delta)" : "");
+    failures++;
+  }
+
+  seeked = NULL;
+  if (!replay_seek_turn(replay, HALF) ||
+      engine_ticks(replay_engine(replay)) != tick ||
+      !same(half, seeked = engine_snapshot(replay_engine(replay), seeked))) {
+    printf("Seed %u: seeking to turn %u differs\n", seed, HALF);
+    failures++;
+  }
+  if (!replay_seek(replay, tick) ||
+      !same(half, seeked = engine_snapshot(replay_engine(replay), seeked))) {
+    printf("Seed %u: seeking to tick %u differs\n", seed, tick);
+    failures++;
+  }
+  if (replay_seek_turn(replay, TURNS + 1000)) {
+    printf("Seed %u: seeking past the end worked\n", seed);
+    failures++;
+  }
+
+  engine_snapshot_free(seeked);
+  replay_free(replay);
+
+  replay = garble(path) ? replay_open(path) : NULL;
+  if (replay == NULL ||
+      replay_verify(replay) != replay_keyframes(replay) - 1 ||
+      replay_seek_turn(replay, HALF)) {
+    printf("Seed %u: garbled keyframes were taken\n", seed);
+    failures++;
+  }
+  replay_free(replay);
+
+out:
+  unlink(path);
+  engine_snapshot_free(half);
+  engine_free(engine);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    message_unref(npcs[i].held);
+    player_npc_free(&npcs[i].npc);
+  }
+  map_free(map);
+}
+
+int main(void) {
+  common_log_quiet(true);
+
+  for (uint32_t seed = 1; seed <= 3; seed++) {
+    check(seed, false);
+    check(seed, true);
+  }
+
+  printf("%u failures\n", failures);
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "player_npc.h"
+#include "wire.h"
+
+/* A match is snapshotted halfway and played on with NPCs, which records what
+ * they answer. Restored, and fed the same answers, the engine has to send
+ * exactly what it sent the first time, ticks included. That goes for the
+ * engine the snapshot was taken of, also with delta updates, and for a second
+ * engine restored from the bare block, which before playing on is offered
+ * that block cut short and garbled. */
+
+#define PLAYERS 6
+#define HALF 20
+#define TURNS 50
+#define GETS_MAX (1 << 16)
+
+struct tap {
+  void *npc;
+  bool replay;
+  uint64_t *hash;
+  /* Every answer to the engine asking for a message, NULL included */
+  message_t **gets;
+  uint32_t num_gets;
+  uint32_t next_get;
+};
+
+static uint32_t failures = 0;
+
+static uint64_t hash_msg(uint64_t hash, message_t *msg) {
+  uint8_t buf[1 << 16];
+  size_t size = wire_encode(msg, buf, sizeof(buf));
+
+  for (size_t i = 0; i < size && i < sizeof(buf); i++) {
+    hash = (hash ^ buf[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void tap_send(void *data, message_t *msg) {
+  struct tap *tap = data;
+
+  *tap->hash = hash_msg(*tap->hash, msg);
+  if (!tap->replay) {
+    player_npc_server_send(tap->npc, msg);
+  }
+}
+
+static message_t *tap_get(void *data) {
+  struct tap *tap = data;
+  message_t *msg;
+
+  if (tap->replay) {
+    if (tap->next_get == tap->num_gets) {
+      return NULL;
+    }
+    return message_ref(tap->gets[tap->next_get++]);
+  }
+
+  msg = player_npc_server_get(tap->npc);
+  if (tap->num_gets < GETS_MAX) {
+    tap->gets[tap->num_gets++] = message_ref(msg);
+  }
+  return msg;
+}
+
+/* NULL, with @param map freed, if there is no engine */
+static engine_t *new_engine(uint32_t seed, map_t **map, struct tap *taps,
+                            uint64_t *hash, bool delta) {
+  engine_t *engine;
+
+  *map = map_new(80, 40, 20, seed);
+  engine = engine_new(PLAYERS, *map, NULL, false, seed);
+  if (engine == NULL) {
+    printf("Seed %u: no engine\n", seed);
+    failures++;
+    map_free(*map);
+    return NULL;
+  }
+  engine_set_delta_updates(engine, delta);
+
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].hash = hash;
+    engine_add_player(engine, tap_send, &taps[i], tap_get, &taps[i]);
+  }
+  return engine;
+}
+
+static void forget(struct tap *taps) {
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    for (uint32_t j = 0; j < taps[i].num_gets; j++) {
+      message_unref(taps[i].gets[j]);
+    }
+    taps[i].num_gets = 0;
+  }
+}
+
+static void replay(struct tap *taps) {
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].replay = true;
+    taps[i].next_get = 0;
+  }
+}
+
+static bool restore_block(engine_t *engine, const uint8_t *data,
+                          size_t size) {
+  engine_snapshot_t *snap = engine_snapshot_from_data(data, size);
+  bool ok = engine_restore(engine, snap);
+
+  engine_snapshot_free(snap);
+  return ok;
+}
+
+/* Cut blocks have to be refused and refused ones may not change anything.
+ * Garbled ones may be taken if they still read back, @param engine is put
+ * back to @param data after those. */
+static void check_broken(uint32_t seed, engine_t *engine, const uint8_t *data,
+                         size_t size) {
+  uint64_t hash = engine_state_hash(engine);
+  uint8_t *garbled = malloc(size);
+
+  for (size_t cut = 0; cut < size; cut += 1 + cut / 16) {
+    if (restore_block(engine, data, cut)) {
+      printf("Seed %u: restored a block cut to %zu bytes\n", seed, cut);
+      failures++;
+    }
+    if (engine_state_hash(engine) != hash) {
+      printf("Seed %u: refused block changed the engine\n", seed);
+      failures++;
+      return;
+    }
+  }
+
+  /* Counts and sizes of all ones */
+  for (size_t at = 0; at + 4 <= size; at += 1 + at / 32) {
+    memcpy(garbled, data, size);
+    memset(garbled + at, 0xff, 4);
+    if (restore_block(engine, garbled, size)) {
+      restore_block(engine, data, size);
+    } else if (engine_state_hash(engine) != hash) {
+      printf("Seed %u: block garbled at %zu changed the engine\n", seed, at);
+      failures++;
+      break;
+    }
+  }
+  free(garbled);
+}
+
+/* Plays the second half again in a new engine restored from the block of
+ * @param snap, which has to end up at @param played */
+static void check_block(uint32_t seed, engine_snapshot_t *snap,
+                        struct tap *taps, uint64_t played) {
+  struct tap copies[PLAYERS] = {0};
+  engine_snapshot_t *bare;
+  engine_t *copy;
+  map_t *copy_map;
+  uint64_t hash = 0;
+  const void *data;
+  size_t size;
+
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    copies[i] = taps[i];
+  }
+  replay(copies);
+  copy = new_engine(seed, &copy_map, copies, &hash, false);
+  if (copy == NULL) {
+    return;
+  }
+
+  data = engine_snapshot_data(snap, &size);
+  bare = engine_snapshot_from_data(data, size);
+  hash = 14695981039346656037ULL;
+  if (!engine_restore(copy, bare)) {
+    printf("Seed %u: restore from the block failed\n", seed);
+    failures++;
+  }
+  check_broken(seed, copy, data, size);
+  engine_run(copy, TURNS);
+  if (hash != played) {
+    printf("Seed %u: match restored from the block differs\n", seed);
+    failures++;
+  }
+  engine_snapshot_free(bare);
+  engine_free(copy);
+  map_free(copy_map);
+}
+
+static void check(uint32_t seed, bool delta) {
+  struct tap taps[PLAYERS] = {0};
+  engine_snapshot_t *snap;
+  engine_t *engine;
+  map_t *map;
+  uint64_t played = 14695981039346656037ULL;
+  uint64_t hash = 0;
+
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    taps[i].gets = calloc(GETS_MAX, sizeof(*taps[i].gets));
+  }
+  engine = new_engine(seed, &map, taps, &hash, delta);
+  if (engine == NULL) {
+    for (uint8_t i = 0; i < PLAYERS; i++) {
+      free(taps[i].gets);
+      player_npc_free(&taps[i].npc);
+    }
+    return;
+  }
+  engine_run(engine, HALF);
+
+  snap = engine_snapshot(engine, NULL);
+  forget(taps);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].hash = &played;
+  }
+  engine_run(engine, TURNS);
+
+  hash = 14695981039346656037ULL;
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].hash = &hash;
+  }
+  replay(taps);
+  if (!engine_restore(engine, snap) || engine_turns(engine) != HALF) {
+    printf("Seed %u: restore failed\n", seed);
+    failures++;
+  }
+  engine_run(engine, TURNS);
+  if (hash != played) {
+    printf("Seed %u%s: restored match differs\n", seed,
+           delta ? " (delta)" : "");
+    failures++;
+  }
+
+  /* Complete updates have no base, so the bare block has to do */
+  if (!delta) {
+    check_block(seed, snap, taps, played);
+  }
+
+  engine_snapshot_free(snap);
+  engine_free(engine);
+  forget(taps);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    free(taps[i].gets);
+    player_npc_free(&taps[i].npc);
+  }
+  map_free(map);
+}
+
+int main(void) {
+  common_log_quiet(true);
+
+  for (uint32_t seed = 1; seed <= 3; seed++) {
+    check(seed, false);
+    check(seed, true);
+  }
+
+  printf("%u failures\n", failures);
+
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,586 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "engine.h"
+#include "map.h"
+#include "message.h"
+#include "player_npc.h"
+#include "wire.h"
+
+/* Every message of a few NPC matches is encoded, decoded and compared with the
+ * original. The NPCs only ever see the decoded copies, so the match has to
+ * play out exactly like one without the wire in between. The same goes for
+ * matches with delta player updates, the NPCs have to answer just like they
+ * did with complete ones. Broken and cut short frames have to be refused. */
+
+#define PLAYERS 6
+#define TURNS 60
+
+struct tap {
+  void *npc;
+  bool wire;
+  uint64_t *hash;
+  uint64_t *replies;
+};
+
+static uint32_t failures = 0;
+static uint32_t checked = 0;
+
+static void fail(message_t *msg, const char *what) {
+  printf("Message type %u, tick %u: %s\n", msg->type, msg->tick, what);
+  failures++;
+}
+
+static bool same_positions(pos_t *a, uint32_t a_size, pos_t *b,
+                           uint32_t b_size) {
+  if (a_size != b_size) {
+    return false;
+  }
+  for (uint32_t i = 0; i < a_size; i++) {
+    if (!POS_EQ(a[i], b[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool same_spells(struct msg_spell *a, struct msg_spell *b,
+                        uint8_t num) {
+  for (uint8_t i = 0; i < num; i++) {
+    if (a[i].id != b[i].id || a[i].charges != b[i].charges) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool same_effect(struct applied_effect *a, struct applied_effect *b) {
+  if (a->type != b->type || a->victim != b->victim || !POS_EQ(a->at, b->at) ||
+      a->duration != b->duration) {
+    return false;
+  }
+
+  switch (a->type) {
+  case SPELL_EFFECT_PUSH:
+  case SPELL_EFFECT_PULL:
+  case SPELL_EFFECT_PUSH_RANDOM:
+    return POS_EQ(a->data.new_pos, b->data.new_pos);
+  case SPELL_EFFECT_SPLASH:
+    return POS_EQ(a->data.area.center, b->data.area.center) &&
+           a->data.area.radius == b->data.area.radius;
+  default:
+    return a->data.dmg == b->data.dmg;
+  }
+}
+
+static bool same_events(struct incident *a, struct incident *b) {
+  if (!POS_EQ(a->from, b->from) || a->incident_type != b->incident_type ||
+      a->spell_kind != b->spell_kind || a->spell_id != b->spell_id ||
+      a->player_origin != b->player_origin ||
+      a->num_targets != b->num_targets) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < a->num_targets; i++) {
+    struct target *ta = &a->targets[i];
+    struct target *tb = &b->targets[i];
+
+    if (!POS_EQ(ta->target, tb->target) ||
+        ta->num_effects != tb->num_effects) {
+      return false;
+    }
+    for (uint8_t j = 0; j < ta->num_effects; j++) {
+      if (!same_effect(&ta->effects[j], &tb->effects[j])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool same_update(message_t *a, message_t *b) {
+  typeof(a->body.player_update) *ua = &a->body.player_update;
+  typeof(b->body.player_update) *ub = &b->body.player_update;
+
+  if (ua->player_id != ub->player_id || !POS_EQ(ua->pos, ub->pos) ||
+      ua->face != ub->face || ua->health != ub->health ||
+      ua->kills != ub->kills || ua->deaths != ub->deaths ||
+      !same_spells(ua->spells, ub->spells, PORTAL_NONE) ||
+      !same_positions(ua->los.opts, ua->los.size, ub->los.opts,
+                      ub->los.size) ||
+      ua->num_effects != ub->num_effects ||
+      !same_spells(ua->effects, ub->effects, ua->num_effects) ||
+      ua->num_others != ub->num_others || ua->num_portals != ub->num_portals ||
+      ua->num_events != ub->num_events || ua->base != ub->base ||
+      !same_positions(ua->los_gone.opts, ua->los_gone.size,
+                      ub->los_gone.opts, ub->los_gone.size) ||
+      ua->num_others_gone != ub->num_others_gone ||
+      (ua->num_others_gone > 0 &&
+       memcmp(ua->others_gone, ub->others_gone, ua->num_others_gone) != 0)) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < ua->num_others; i++) {
+    if (ua->others[i].player_id != ub->others[i].player_id ||
+        !POS_EQ(ua->others[i].pos, ub->others[i].pos) ||
+        ua->others[i].face != ub->others[i].face ||
+        ua->others[i].health != ub->others[i].health ||
+        ua->others[i].kills != ub->others[i].kills ||
+        ua->others[i].deaths != ub->others[i].deaths ||
+        !same_spells(ua->others[i].spells, ub->others[i].spells,
+                     PORTAL_NONE) ||
+        ua->others[i].num_effects != ub->others[i].num_effects ||
+        !same_spells(ua->others[i].effects, ub->others[i].effects,
+                     ua->others[i].num_effects)) {
+      return false;
+    }
+  }
+
+  for (uint8_t i = 0; i < ua->num_portals; i++) {
+    if (ua->portals[i].kind != ub->portals[i].kind ||
+        ua->portals[i].spell != ub->portals[i].spell ||
+        !POS_EQ(ua->portals[i].pos, ub->portals[i].pos)) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < ua->num_events; i++) {
+    if (!same_events(&ua->events[i], &ub->events[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool same_map(message_t *a, message_t *b) {
+  uint32_t words =
+      (a->body.map.width * a->body.map.height + 63) / 64 * MAP_PLANES;
+
+  if (a->body.map.width != b->body.map.width ||
+      a->body.map.height != b->body.map.height ||
+      a->body.map.num_players != b->body.map.num_players ||
+      a->body.map.num_portals != b->body.map.num_portals ||
+      memcmp(a->body.map.data, b->body.map.data,
+             words * sizeof(*a->body.map.data)) != 0) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < a->body.map.num_portals; i++) {
+    if (!POS_EQ(a->body.map.portals[i].pos, b->body.map.portals[i].pos) ||
+        a->body.map.portals[i].kind != b->body.map.portals[i].kind) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool same_lockstep(message_t *a, message_t *b) {
+  typeof(a->body.lockstep) *la = &a->body.lockstep;
+  typeof(b->body.lockstep) *lb = &b->body.lockstep;
+
+  if (la->flags != lb->flags || la->num_inputs != lb->num_inputs ||
+      la->state_size != lb->state_size ||
+      (la->flags & LOCKSTEP_HASHED && la->hash != lb->hash) ||
+      (la->state_size > 0 && (la->player_id != lb->player_id ||
+                              memcmp(la->state, lb->state,
+                                     la->state_size) != 0))) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < la->num_inputs; i++) {
+    struct msg_input *ia = &la->inputs[i];
+    struct msg_input *ib = &lb->inputs[i];
+
+    if (ia->player != ib->player || ia->type != ib->type ||
+        ia->tick != ib->tick || ia->reply_tick != ib->reply_tick ||
+        !POS_EQ(ia->pos, ib->pos) || ia->value != ib->value) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool same(message_t *a, message_t *b) {
+  if (a->type != b->type || a->tick != b->tick) {
+    return false;
+  }
+
+  switch (a->type) {
+  case MESSAGE_MAP:
+    return same_map(a, b);
+  case MESSAGE_ASK_SPAWN:
+    return a->body.ask_spawn.player_id == b->body.ask_spawn.player_id &&
+           same_positions(a->body.ask_spawn.opts, a->body.ask_spawn.size,
+                          b->body.ask_spawn.opts, b->body.ask_spawn.size);
+  case MESSAGE_REPLY_SPAWN:
+    return POS_EQ(a->body.reply_spawn.dst, b->body.reply_spawn.dst) &&
+           a->body.reply_spawn.face == b->body.reply_spawn.face;
+  case MESSAGE_ASK_MOVE:
+    return same_positions(a->body.ask_move.opts, a->body.ask_move.size,
+                          b->body.ask_move.opts, b->body.ask_move.size);
+  case MESSAGE_REPLY_MOVE:
+    return POS_EQ(a->body.reply_move.dst, b->body.reply_move.dst) &&
+           a->body.reply_move.face == b->body.reply_move.face;
+  case MESSAGE_ASK_FIGHT:
+    for (uint8_t i = 0; i < PORTAL_NONE; i++) {
+      if (a->body.ask_fight.spell_id[i] != b->body.ask_fight.spell_id[i] ||
+          !same_positions(a->body.ask_fight.spell_opts[i].opts,
+                          a->body.ask_fight.spell_opts[i].size,
+                          b->body.ask_fight.spell_opts[i].opts,
+                          b->body.ask_fight.spell_opts[i].size)) {
+        return false;
+      }
+    }
+    return true;
+  case MESSAGE_REPLY_FIGHT:
+    return a->body.reply_fight.spell_id == b->body.reply_fight.spell_id &&
+           POS_EQ(a->body.reply_fight.target, b->body.reply_fight.target);
+  case MESSAGE_PLAYER_UPDATE:
+    return same_update(a, b);
+  case MESSAGE_LOCKSTEP:
+    return same_lockstep(a, b);
+  default:
+    return true;
+  }
+}
+
+static uint64_t fnv(uint64_t hash, uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Encodes, decodes and checks @param msg, returns the decoded copy */
+static message_t *round_trip(message_t *msg, uint64_t *hash) {
+  uint8_t *buf;
+  uint8_t *again;
+  size_t size;
+  message_t *copy;
+
+  checked++;
+  size = wire_encode(msg, NULL, 0);
+  buf = malloc(size);
+  again = malloc(size);
+
+  if (wire_encode(msg, buf, size) != size) {
+    fail(msg, "measured and written size differ");
+  }
+  if (wire_frame_size(buf, size) != size) {
+    fail(msg, "frame size is off");
+  }
+  *hash = fnv(*hash, buf, size);
+
+  /* Every shorter prefix is an incomplete frame */
+  for (size_t cut = 0; cut < size; cut += 1 + cut / 8) {
+    message_t *partial = wire_decode(buf, cut, WIRE_FRAME_MAX);
+
+    if (partial != NULL) {
+      fail(msg, "decoded a cut short frame");
+      message_unref(partial);
+    }
+  }
+
+  /* Garbage may decode to anything, but must not crash */
+  for (size_t i = 0; i < size; i += 1 + i / 4) {
+    buf[i] ^= 0x5a;
+    message_unref(wire_decode(buf, size, WIRE_FRAME_MAX));
+    buf[i] ^= 0x5a;
+  }
+
+  copy = wire_decode(buf, size, WIRE_FRAME_MAX);
+  if (copy == NULL) {
+    fail(msg, "could not decode");
+    copy = message_ref(msg);
+  } else if (!same(msg, copy)) {
+    fail(msg, "decoded copy differs");
+  } else if (wire_encode(copy, again, size) != size ||
+             memcmp(buf, again, size) != 0) {
+    fail(msg, "copy encodes differently");
+  }
+
+  free(buf);
+  free(again);
+
+  return copy;
+}
+
+static void tap_send(void *data, message_t *msg) {
+  struct tap *tap = data;
+  message_t *copy;
+
+  if (!tap->wire) {
+    uint8_t buf[1 << 16];
+    size_t size = wire_encode(msg, buf, sizeof(buf));
+
+    *tap->hash = fnv(*tap->hash, buf, size);
+    player_npc_server_send(tap->npc, msg);
+    return;
+  }
+
+  copy = round_trip(msg, tap->hash);
+  player_npc_server_send(tap->npc, copy);
+  message_unref(copy);
+}
+
+static message_t *tap_get(void *data) {
+  struct tap *tap = data;
+  message_t *msg;
+  message_t *copy;
+
+  msg = player_npc_server_get(tap->npc);
+  if (msg == NULL) {
+    return msg;
+  }
+  if (!tap->wire) {
+    uint8_t buf[1 << 16];
+    size_t size = wire_encode(msg, buf, sizeof(buf));
+
+    *tap->replies = fnv(*tap->replies, buf, size);
+    return msg;
+  }
+
+  copy = round_trip(msg, tap->replies);
+  message_unref(msg);
+
+  return copy;
+}
+
+/* Returns a hash of what was sent to the players, @param replies gets one of
+ * what they answered */
+static uint64_t play(uint32_t seed, bool wire, bool delta, uint64_t *replies) {
+  struct tap taps[PLAYERS];
+  uint64_t hash = 14695981039346656037ULL;
+  engine_t *engine;
+  map_t *map;
+
+  *replies = hash;
+  map = map_new(80, 40, 20, seed);
+  engine = engine_new(PLAYERS, map, NULL, false, seed);
+  if (engine == NULL) {
+    printf("Seed %u: no engine\n", seed);
+    failures++;
+    map_free(map);
+    return hash;
+  }
+  engine_set_delta_updates(engine, delta);
+
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    taps[i].npc = player_npc_new(seed * UINT8_MAX + i);
+    taps[i].wire = wire;
+    taps[i].hash = &hash;
+    taps[i].replies = replies;
+    engine_add_player(engine, tap_send, &taps[i], tap_get, &taps[i]);
+  }
+
+  if (!engine_run(engine, TURNS)) {
+    printf("Seed %u: match got stuck after %u turns\n", seed,
+           engine_turns(engine));
+    failures++;
+  }
+
+  engine_free(engine);
+  for (uint8_t i = 0; i < PLAYERS; i++) {
+    player_npc_free(&taps[i].npc);
+  }
+  map_free(map);
+
+  return hash;
+}
+
+static void check_edges(void) {
+  pos_t corners[] = {{-1, -1}, {0, 0}, {70000, -3}, {-70000, 1 << 20}};
+  pos_t block[64];
+  pos_t checkers[64];
+  pos_t rows[64];
+  struct msg_input inputs[3];
+  uint8_t state[40];
+  message_t *msgs[11];
+  uint64_t ignored = 0;
+
+  /* Lists in row order that the mask and run layouts suit best */
+  for (uint8_t i = 0; i < 64; i++) {
+    block[i] = (pos_t){i % 8 - 3, i / 8 + 5};
+    checkers[i] = (pos_t){2 * (i % 8) + (i / 8) % 2, i / 8};
+    rows[i] = (pos_t){i % 32 + 1000 * (i / 32), -(1 << 19) + i / 32};
+  }
+
+  msgs[0] = message_ask_ready(0);
+  msgs[1] = message_reply_fight(1, 0, POSITION_UNKNOWN);
+  msgs[2] = message_ask_move(2, 0, corners);
+  msgs[3] = message_ask_move(3, sizeof(corners) / sizeof(*corners), corners);
+  msgs[4] = message_ask_spawn(UINT32_MAX, 7, 1, corners);
+  msgs[5] = message_ask_move(5, 64, block);
+  msgs[6] = message_ask_move(6, 64, checkers);
+  msgs[7] = message_ask_move(7, 64, rows);
+  msgs[8] = message_ask_move(8, 63, checkers + 1);
+
+  /* Lockstep inputs, made from replies as the engine takes them */
+  message_to_input(msgs[1], 2, 5, &inputs[0]);
+  message_to_input(msgs[0], 0, 9, &inputs[1]);
+  inputs[1].type = MESSAGE_REPLY_MAP;
+  message_to_input(msgs[1], 1, 9, &inputs[2]);
+  inputs[2].type = MESSAGE_REPLY_MOVE;
+  inputs[2].pos = corners[2];
+  inputs[2].value = DIRECTION_WEST;
+  for (uint8_t i = 0; i < sizeof(state); i++) {
+    state[i] = i * 37;
+  }
+  msgs[9] = message_lockstep(9, 3, LOCKSTEP_DELTA | LOCKSTEP_HASHED,
+                             0x0123456789abcdefULL, 3, inputs,
+                             sizeof(state), state);
+  msgs[10] = message_lockstep(UINT32_MAX, 0, LOCKSTEP_PIPELINED, 0, 3,
+                              inputs, 0, NULL);
+
+  for (uint8_t i = 0; i < sizeof(msgs) / sizeof(*msgs); i++) {
+    uint8_t buf[1024];
+    size_t size;
+    message_t *copy;
+
+    message_unref(round_trip(msgs[i], &ignored));
+
+    /* Other versions and trailing bytes are refused */
+    size = wire_encode(msgs[i], buf, sizeof(buf));
+    buf[1]++;
+    copy = wire_decode(buf, size, WIRE_FRAME_MAX);
+    if (copy != NULL) {
+      fail(msgs[i], "decoded another version");
+      message_unref(copy);
+    }
+    buf[1]--;
+    buf[0]++;
+    buf[size] = 0;
+    copy = wire_decode(buf, size + 1, WIRE_FRAME_MAX);
+    if (copy != NULL) {
+      fail(msgs[i], "decoded trailing bytes");
+      message_unref(copy);
+    }
+
+    message_unref(msgs[i]);
+  }
+
+  /* Spells the server does not have never reach the engine */
+  msgs[0] = message_reply_fight(1, 200, POSITION_UNKNOWN);
+  message_to_input(msgs[0], 0, 1, &inputs[0]);
+  msgs[1] = message_lockstep(1, 0, 0, 0, 1, inputs, 0, NULL);
+  for (uint8_t i = 0; i < 2; i++) {
+    uint8_t buf[64];
+    size_t size = wire_encode(msgs[i], buf, sizeof(buf));
+    message_t *copy = wire_decode(buf, size, WIRE_FRAME_MAX);
+
+    if (copy != NULL) {
+      fail(msgs[i], "decoded an unknown spell");
+      message_unref(copy);
+    }
+    message_unref(msgs[i]);
+  }
+}
+
+static size_t put_varint(uint8_t *buf, size_t at, uint64_t v) {
+  while (v >= 0x80) {
+    buf[at++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[at++] = v;
+  return at;
+}
+
+/* A frame of @param type listing @param count cells as one run, which takes
+ * a few bytes however many there are. Returns its size. */
+static size_t runs_frame(uint8_t *buf, uint8_t type, uint32_t count) {
+  uint8_t body[64];
+  size_t prefix;
+  size_t len = 0;
+
+  body[len++] = WIRE_VERSION;
+  body[len++] = type;
+  len = put_varint(body, len, 0);
+  len = put_varint(body, len, message_arena_size(count, sizeof(pos_t)));
+  if (type == MESSAGE_ASK_SPAWN) {
+    body[len++] = 0;
+  }
+  len = put_varint(body, len, count);
+  body[len++] = 2; /* Runs */
+  len = put_varint(body, len, 0);
+  len = put_varint(body, len, 0);
+  len = put_varint(body, len, 1000);
+  len = put_varint(body, len, 0);
+  len = put_varint(body, len, count);
+
+  prefix = put_varint(buf, 0, len);
+  memcpy(buf + prefix, body, len);
+  return prefix + len;
+}
+
+/* Frames claiming far more than they hold have to stay within the caller's
+ * limit and the lists their type can have */
+static void check_expansion(void) {
+  uint8_t buf[80];
+  size_t size;
+  message_t *copy;
+
+  size = runs_frame(buf, MESSAGE_ASK_SPAWN, 100);
+  copy = wire_decode(buf, size, message_arena_size(100, sizeof(pos_t)));
+  if (copy == NULL || copy->body.ask_spawn.size != 100) {
+    printf("Could not decode a run of 100 cells\n");
+    failures++;
+  }
+  message_unref(copy);
+
+  size = runs_frame(buf, MESSAGE_ASK_SPAWN, 2000000);
+  copy = wire_decode(buf, size, 65536);
+  if (copy != NULL) {
+    printf("Decoded %zu bytes into 2000000 cells past the limit\n", size);
+    failures++;
+    message_unref(copy);
+  }
+
+  size = runs_frame(buf, MESSAGE_ASK_MOVE, 2000000);
+  copy = wire_decode(buf, size, WIRE_FRAME_MAX);
+  if (copy != NULL) {
+    printf("Decoded 2000000 moves\n");
+    failures++;
+    message_unref(copy);
+  }
+
+  /* Replies have no arrays to claim an arena for */
+  size = runs_frame(buf, MESSAGE_REPLY_MOVE, 100);
+  copy = wire_decode(buf, size, WIRE_FRAME_MAX);
+  if (copy != NULL) {
+    printf("Decoded a reply claiming an arena\n");
+    failures++;
+    message_unref(copy);
+  }
+}
+
+int main(void) {
+  common_log_quiet(true);
+
+  check_edges();
+  check_expansion();
+
+  for (uint32_t seed = 1; seed <= 3; seed++) {
+    uint64_t replies[3];
+    uint64_t direct = play(seed, false, false, &replies[0]);
+    uint64_t wired = play(seed, true, false, &replies[1]);
+
+    play(seed, true, true, &replies[2]);
+
+    if (direct != wired || replies[0] != replies[1]) {
+      printf("Seed %u: match played differently over the wire\n", seed);
+      failures++;
+    }
+    if (replies[0] != replies[2]) {
+      printf("Seed %u: match played differently with delta updates\n", seed);
+      failures++;
+    }
+  }
+
+  printf("%u of %u messages failed\n", failures, checked);
+
+  return failures > 0 ? 1 : 0;
+}
@@ -10,6 +10,7 @@
 #include "engine.h"
 #include "incident.h"
 #include "map.h"
+#include "map_bits.h"
 #include "map_opts.h"
 #include "menu.h"
 #include "message.h"
@@ -89,6 +90,7 @@ typedef struct {
   message_t *waiting;
 
   map_opts_t *los_opts;
+  map_bits_t *los_set;
   map_opts_t *spawn_opts;
   map_opts_t *move_opts;
   map_opts_t *target_opts[PORTAL_NONE];
@@ -394,12 +396,14 @@ static void draw_buttons(ctx_t *ctx, button_t *buttons, uint8_t num_buttons,
   }
 }
 
-static void init_local(ctx_t *ctx) {
+/* False, with nothing set up, if the engine refuses the match */
+static bool init_local(ctx_t *ctx) {
   uint32_t width = 80;
   uint32_t height = 40;
 
   map_t *map =
       map_new(width, height, (int)ctx->local_menu.walls, ctx->local_menu.seed);
+  map_precompute_los(map, 1, MAP_LOS_TABLE_MAX);
 
   ctx->msg_ctx = player_local_new();
   ctx->send_msg = player_local_send;
@@ -407,17 +411,25 @@ static void init_local(ctx_t *ctx) {
 
   ctx->player_count = (int)ctx->local_menu.players;
 
-  ctx->engine = engine_new(ctx->player_count, map, NULL, false);
+  ctx->engine = engine_new(ctx->player_count, map, NULL, false,
+                           ctx->local_menu.seed);
+  if (ctx->engine == NULL) {
+    player_local_free(&ctx->msg_ctx);
+    map_free(map);
+    return false;
+  }
 
   engine_add_player(ctx->engine, player_local_server_send, ctx->msg_ctx,
                     player_local_server_get, ctx->msg_ctx);
 
   for (uint8_t i = 1; i < ctx->player_count; i++) {
-    void *npc = player_npc_new();
+    void *npc = player_npc_new(ctx->local_menu.seed + i);
 
     engine_add_player(ctx->engine, player_npc_server_send, npc,
                       player_npc_server_get, npc);
   }
+
+  return true;
 }
 
 static void setup_floor(ctx_t *ctx) {
@@ -547,7 +559,7 @@ static void draw_walls(ctx_t *ctx) {
 static void draw_fog_of_war(ctx_t *ctx) {
   coord_t w;
   coord_t h;
-  if (ctx->los_opts == NULL) {
+  if (ctx->los_set == NULL) {
     return;
   }
 
@@ -557,7 +569,7 @@ static void draw_fog_of_war(ctx_t *ctx) {
   for (coord_t x = 0; x < w; x++) {
     for (coord_t y = 0; y < h; y++) {
       pos_t p = {x, y};
-      if (!map_opts_contains(ctx->los_opts, p)) {
+      if (!map_bits_contains(ctx->los_set, p)) {
         DrawRectangle(map_x(ctx, p.x), map_y(ctx, p.y), ctx->w_width,
                       ctx->w_height, Fade(BLACK, .5f));
       }
@@ -813,11 +825,21 @@ static void handle_waiting_player_update(ctx_t *ctx) {
   setup_spell_buttons(ctx);
   setup_player_stats(ctx);
 
-  map_opts_free(ctx->los_opts);
-  ctx->los_opts = map_opts_import(ctx->waiting->body.player_update.los.opts,
-                                  ctx->waiting->body.player_update.los.size);
+  if (ctx->los_opts == NULL) {
+    ctx->los_opts = map_opts_new(ctx->waiting->body.player_update.los.size);
+  }
+  player_los_update(ctx->los_opts, ctx->waiting);
+  map_bits_free(ctx->los_set);
+  ctx->los_set = map_bits_from_opts(map_width(ctx->map), map_height(ctx->map),
+                                    ctx->los_opts);
 
-  ctx->skip_fight = ctx->waiting->body.player_update.num_others == 0;
+  ctx->skip_fight = true;
+  for (uint8_t i = 0; i < ctx->player_count; i++) {
+    if (i != ctx->waiting->body.player_update.player_id &&
+        !POS_IS_UNKNOWN(ctx->players[i].position)) {
+      ctx->skip_fight = false;
+    }
+  }
   if (ctx->skip_fight) {
     show_confirm(ctx);
   }
@@ -1490,9 +1512,8 @@ int main(int argc, char **argv) {
 
       if (ctx.local_menu.back) {
         ctx.state = STATE_MENU_MAIN;
-      } else if (ctx.local_menu.ready) {
+      } else if (ctx.local_menu.ready && init_local(&ctx)) {
         ctx.state = STATE_IN_GAME_WAITING;
-        init_local(&ctx);
       }
       break;
     }
@@ -1658,7 +1679,7 @@ int main(int argc, char **argv) {
 
     EndDrawing();
     if (ctx.engine != NULL) {
-      engine_tick(ctx.engine);
+      engine_step_until_blocked(ctx.engine);
     }
     frames++;
   }